@@ -17,6 +17,7 @@
  ********************************************************************/
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <limits.h>
 #include <sys/stat.h>
@@ -25,23 +26,51 @@
 #include <errno.h>
 #include <evfibers_private/fiber.h>
 
-int main()
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [pooled|unpooled|huge] [count] [size]\n",
+			name);
+	exit(-1);
+}
+
+int main(int argc, char *argv[])
 {
 	int retval;
 	struct fbr_context context;
-	fbr_init(&context, EV_DEFAULT);
-	const size_t count = 10000;
+	size_t count = 10000;
+	size_t size = 0;
 	const size_t repeats = 100;
+	const char *mode = "pooled";
 	struct fbr_buffer *buffers;
+	ev_tstamp started, elapsed;
 	size_t i, j;
 
+	if (argc > 1)
+		mode = argv[1];
+	if (argc > 2)
+		count = strtoul(argv[2], NULL, 10);
+	if (argc > 3)
+		size = strtoul(argv[3], NULL, 10);
+
+	fbr_init(&context, EV_DEFAULT);
+	if (!strcmp(mode, "unpooled"))
+		fbr_set_buffer_cache_size(&context, 0);
+	else if (!strcmp(mode, "huge"))
+		fbr_enable_buffer_huge_pages(&context, 1);
+	else if (strcmp(mode, "pooled"))
+		usage(argv[0]);
+	if (count > FBR_BUFFER_CACHE_SIZE && strcmp(mode, "unpooled"))
+		fbr_set_buffer_cache_size(&context, count);
+
 	signal(SIGPIPE, SIG_IGN);
 	buffers = calloc(count, sizeof(struct fbr_buffer));
 
 	for (j = 0; j < repeats; j++) {
 		printf("Repeat #%zd...", j);
+		ev_now_update(EV_DEFAULT);
+		started = ev_now(EV_DEFAULT);
 		for (i = 0; i < count; i++) {
-			retval = fbr_buffer_init(&context, buffers + i, 0);
+			retval = fbr_buffer_init(&context, buffers + i, size);
 			if (retval) {
 				fprintf(stderr, "error at count = %zd\n", i);
 				fprintf(stderr, "fbr_buffer_init: %s\n",
@@ -55,9 +84,12 @@ int main()
 		for (i = 0; i < count; i++) {
 			fbr_buffer_destroy(&context, buffers + i);
 		}
-		printf(" Done!\n");
+		ev_now_update(EV_DEFAULT);
+		elapsed = ev_now(EV_DEFAULT) - started;
+		printf(" %.0f buffers/s\n", count / elapsed);
 	}
 
+	free(buffers);
 	fbr_destroy(&context);
 	return 0;
 }
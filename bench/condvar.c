@@ -17,6 +17,7 @@
  ********************************************************************/
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <limits.h>
 #include <sys/stat.h>
@@ -33,6 +34,11 @@ struct fiber_arg {
 	struct fbr_cond_var cond2;
 	int cond2_set;
 	size_t count;
+	struct fbr_cond_var round_cond;
+	struct fbr_cond_var done_cond;
+	size_t woken;
+	size_t waiters;
+	int max_samples;
 };
 
 static void cond_fiber1(FBR_P_ void *_arg)
@@ -67,51 +73,116 @@ static void cond_fiber2(FBR_P_ void *_arg)
 	}
 }
 
+static void waiter_fiber(FBR_P_ void *_arg)
+{
+	struct fiber_arg *arg = _arg;
+	for (;;) {
+		fbr_cond_wait(FBR_A_ &arg->round_cond, NULL);
+		arg->count++;
+		if (++arg->woken == arg->waiters) {
+			arg->woken = 0;
+			fbr_cond_signal(FBR_A_ &arg->done_cond);
+		}
+	}
+}
+
+static void broadcaster_fiber(FBR_P_ void *_arg)
+{
+	struct fiber_arg *arg = _arg;
+	for (;;) {
+		fbr_cond_broadcast(FBR_A_ &arg->round_cond);
+		fbr_cond_wait(FBR_A_ &arg->done_cond, NULL);
+	}
+}
+
 static void stats_fiber(FBR_P_ void *_arg)
 {
 	struct fiber_arg *arg = _arg;
 	size_t last;
 	size_t diff;
 	int count = 0;
-	int max_samples = 100;
 	for (;;) {
 		last = arg->count;
 		fbr_sleep(FBR_A_ 1.0);
 		diff = arg->count - last;
-		printf("%zd\n", diff);
-		if (count++ > max_samples) {
+		printf("%zd wakeups/s\n", diff);
+		if (++count >= arg->max_samples) {
 			ev_break(fctx->__p->loop, EVBREAK_ALL);
 		}
 	}
 }
 
-int main()
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [pingpong|broadcast] [samples] [waiters]"
+			" [handoff budget]\n", name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
 {
 	struct fbr_context context;
 	fbr_id_t fiber1, fiber2, fiber_stats;
+	const char *mode = "pingpong";
+	unsigned handoff_budget = 0;
+	size_t i;
 	int retval;
 	(void)retval;
 	struct fiber_arg arg = {
-		.count = 0
+		.count = 0,
+		.waiters = 1000,
+		.max_samples = 100,
 	};
 
+	if (argc > 1)
+		mode = argv[1];
+	if (argc > 2)
+		arg.max_samples = atoi(argv[2]);
+	if (argc > 3)
+		arg.waiters = strtoul(argv[3], NULL, 10);
+	if (argc > 4)
+		handoff_budget = strtoul(argv[4], NULL, 10);
+	if (arg.max_samples <= 0 || 0 == arg.waiters)
+		usage(argv[0]);
+
 	fbr_init(&context, EV_DEFAULT);
+	fbr_set_handoff_budget(&context, handoff_budget);
 
 	fbr_mutex_init(&context, &arg.mutex1);
 	fbr_mutex_init(&context, &arg.mutex2);
 
 	fbr_cond_init(&context, &arg.cond1);
 	fbr_cond_init(&context, &arg.cond2);
+	fbr_cond_init(&context, &arg.round_cond);
+	fbr_cond_init(&context, &arg.done_cond);
+
+	if (!strcmp(mode, "pingpong")) {
+		fiber1 = fbr_create(&context, "fiber1", cond_fiber1, &arg, 0);
+		assert(!fbr_id_isnull(fiber1));
+		retval = fbr_transfer(&context, fiber1);
+		assert(0 == retval);
+
+		fiber2 = fbr_create(&context, "fiber2", cond_fiber2, &arg, 0);
+		assert(!fbr_id_isnull(fiber2));
+		retval = fbr_transfer(&context, fiber2);
+		assert(0 == retval);
+	} else if (!strcmp(mode, "broadcast")) {
+		for (i = 0; i < arg.waiters; i++) {
+			fiber1 = fbr_create(&context, "waiter", waiter_fiber,
+					&arg, 0);
+			assert(!fbr_id_isnull(fiber1));
+			retval = fbr_transfer(&context, fiber1);
+			assert(0 == retval);
+		}
 
-	fiber1 = fbr_create(&context, "fiber1", cond_fiber1, &arg, 0);
-	assert(!fbr_id_isnull(fiber1));
-	retval = fbr_transfer(&context, fiber1);
-	assert(0 == retval);
-
-	fiber2 = fbr_create(&context, "fiber2", cond_fiber2, &arg, 0);
-	assert(!fbr_id_isnull(fiber2));
-	retval = fbr_transfer(&context, fiber2);
-	assert(0 == retval);
+		fiber2 = fbr_create(&context, "broadcaster", broadcaster_fiber,
+				&arg, 0);
+		assert(!fbr_id_isnull(fiber2));
+		retval = fbr_transfer(&context, fiber2);
+		assert(0 == retval);
+	} else {
+		usage(argv[0]);
+	}
 
 	fiber_stats = fbr_create(&context, "fiber_stats", stats_fiber, &arg, 0);
 	assert(!fbr_id_isnull(fiber_stats));
@@ -122,6 +193,8 @@ int main()
 
 	fbr_cond_destroy(&context, &arg.cond1);
 	fbr_cond_destroy(&context, &arg.cond2);
+	fbr_cond_destroy(&context, &arg.round_cond);
+	fbr_cond_destroy(&context, &arg.done_cond);
 	fbr_mutex_destroy(&context, &arg.mutex1);
 	fbr_mutex_destroy(&context, &arg.mutex2);
 	fbr_destroy(&context);
@@ -0,0 +1,380 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <ev.h>
+#include <evfibers_private/fiber.h>
+#ifdef FBR_HAVE_URING_MULTISHOT
+#include <evfibers/uring.h>
+#endif
+
+/* Interposed libc functions counting the system calls made by the library
+ * and libev. Requires the binary to export its symbols (-rdynamic). */
+static size_t n_read, n_write, n_fcntl, n_epoll_ctl, n_epoll_wait,
+	      n_uring_enter;
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+	static ssize_t (*real)(int, void *, size_t);
+	if (NULL == real)
+		real = dlsym(RTLD_NEXT, "read");
+	n_read++;
+	return real(fd, buf, count);
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+	static ssize_t (*real)(int, const void *, size_t);
+	if (NULL == real)
+		real = dlsym(RTLD_NEXT, "write");
+	n_write++;
+	return real(fd, buf, count);
+}
+
+int fcntl(int fd, int cmd, ...)
+{
+	static int (*real)(int, int, ...);
+	va_list ap;
+	long arg;
+	if (NULL == real)
+		real = dlsym(RTLD_NEXT, "fcntl");
+	va_start(ap, cmd);
+	arg = va_arg(ap, long);
+	va_end(ap);
+	n_fcntl++;
+	return real(fd, cmd, arg);
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	static int (*real)(int, int, int, struct epoll_event *);
+	if (NULL == real)
+		real = dlsym(RTLD_NEXT, "epoll_ctl");
+	n_epoll_ctl++;
+	return real(epfd, op, fd, event);
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+		int timeout)
+{
+	static int (*real)(int, struct epoll_event *, int, int);
+	if (NULL == real)
+		real = dlsym(RTLD_NEXT, "epoll_wait");
+	n_epoll_wait++;
+	return real(epfd, events, maxevents, timeout);
+}
+
+#ifdef __NR_io_uring_enter
+long syscall(long number, ...)
+{
+	static long (*real)(long, ...);
+	long a[6];
+	va_list ap;
+	int i;
+	if (NULL == real)
+		real = dlsym(RTLD_NEXT, "syscall");
+	va_start(ap, number);
+	for (i = 0; i < 6; i++)
+		a[i] = va_arg(ap, long);
+	va_end(ap);
+	if (__NR_io_uring_enter == number)
+		n_uring_enter++;
+	return real(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+#endif
+
+#define MSG_SIZE 64
+
+struct echo_arg {
+	int fd;
+	struct fbr_fd *fdh;
+	int uring;
+	size_t requests;
+};
+
+static struct sockaddr_in listen_addr;
+
+#ifdef FBR_HAVE_URING_MULTISHOT
+static struct fbr_uring_buf_ring buf_ring;
+
+static void uring_server(FBR_P_ struct echo_arg *arg)
+{
+	struct fbr_ev_uring ev;
+	ssize_t retval;
+	void *buf;
+	(void)retval;
+
+	fbr_ev_uring_init(FBR_A_ &ev);
+	retval = fbr_uring_accept_multishot(FBR_A_ &ev, arg->fd);
+	assert(0 == retval);
+	retval = fbr_uring_wait(FBR_A_ &ev);
+	assert(0 <= retval);
+	fbr_uring_cancel(FBR_A_ &ev);
+	close(arg->fd);
+	arg->fd = retval;
+
+	for (;;) {
+		retval = fbr_uring_recv_buf(FBR_A_ arg->fd, &buf_ring, &buf, 0);
+		if (retval <= 0)
+			break;
+		retval = fbr_uring_send(FBR_A_ arg->fd, buf, retval, 0);
+		assert(retval > 0);
+		fbr_uring_buf_put(FBR_A_ &buf_ring, buf);
+	}
+}
+
+static void uring_client(FBR_P_ struct echo_arg *arg)
+{
+	char buf[MSG_SIZE];
+	ssize_t retval;
+	size_t i;
+	(void)retval;
+
+	retval = fbr_uring_connect(FBR_A_ arg->fd,
+			(struct sockaddr *)&listen_addr, sizeof(listen_addr));
+	assert(0 == retval);
+	memset(buf, 'x', sizeof(buf));
+	for (i = 0; i < arg->requests; i++) {
+		retval = fbr_uring_send(FBR_A_ arg->fd, buf, sizeof(buf), 0);
+		assert(sizeof(buf) == retval);
+		retval = fbr_uring_recv(FBR_A_ arg->fd, buf, sizeof(buf),
+				MSG_WAITALL);
+		assert(sizeof(buf) == retval);
+	}
+	shutdown(arg->fd, SHUT_WR);
+}
+#endif
+
+static void server_fiber(FBR_P_ void *_arg)
+{
+	struct echo_arg *arg = _arg;
+	char buf[MSG_SIZE];
+	ssize_t retval;
+	int fd;
+	(void)retval;
+
+#ifdef FBR_HAVE_URING_MULTISHOT
+	if (arg->uring) {
+		uring_server(FBR_A_ arg);
+		return;
+	}
+#endif
+	fd = fbr_accept(FBR_A_ arg->fd, NULL, NULL);
+	assert(0 <= fd);
+	close(arg->fd);
+	arg->fd = fd;
+	retval = fbr_fd_nonblock(FBR_A_ fd);
+	assert(0 == retval);
+	if (arg->fdh) {
+		retval = fbr_fd_attach(FBR_A_ arg->fdh, fd);
+		assert(0 == retval);
+	}
+
+	for (;;) {
+		if (arg->fdh)
+			retval = fbr_fd_read(FBR_A_ arg->fdh, buf, sizeof(buf));
+		else
+			retval = fbr_read(FBR_A_ arg->fd, buf, sizeof(buf));
+		if (retval <= 0)
+			break;
+		if (arg->fdh)
+			retval = fbr_fd_write(FBR_A_ arg->fdh, buf, retval);
+		else
+			retval = fbr_write(FBR_A_ arg->fd, buf, retval);
+		assert(retval > 0);
+	}
+	/* Persistent watchers keep the loop alive until detached */
+	if (arg->fdh)
+		fbr_fd_detach(FBR_A_ arg->fdh);
+}
+
+static void client_fiber(FBR_P_ void *_arg)
+{
+	struct echo_arg *arg = _arg;
+	char buf[MSG_SIZE];
+	ssize_t retval;
+	size_t i;
+	(void)retval;
+
+#ifdef FBR_HAVE_URING_MULTISHOT
+	if (arg->uring) {
+		uring_client(FBR_A_ arg);
+		return;
+	}
+#endif
+	retval = fbr_connect(FBR_A_ arg->fd, (struct sockaddr *)&listen_addr,
+			sizeof(listen_addr));
+	assert(0 == retval);
+	if (arg->fdh) {
+		retval = fbr_fd_attach(FBR_A_ arg->fdh, arg->fd);
+		assert(0 == retval);
+	}
+
+	memset(buf, 'x', sizeof(buf));
+	for (i = 0; i < arg->requests; i++) {
+		if (arg->fdh) {
+			retval = fbr_fd_write(FBR_A_ arg->fdh, buf, sizeof(buf));
+			assert(sizeof(buf) == retval);
+			retval = fbr_fd_read_all(FBR_A_ arg->fdh, buf,
+					sizeof(buf));
+			assert(sizeof(buf) == retval);
+			continue;
+		}
+		retval = fbr_write(FBR_A_ arg->fd, buf, sizeof(buf));
+		assert(sizeof(buf) == retval);
+		retval = fbr_read_all(FBR_A_ arg->fd, buf, sizeof(buf));
+		assert(sizeof(buf) == retval);
+	}
+	shutdown(arg->fd, SHUT_WR);
+	if (arg->fdh)
+		fbr_fd_detach(FBR_A_ arg->fdh);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [optimistic|waitfirst|fd"
+#ifdef FBR_HAVE_URING_MULTISHOT
+			"|uring"
+#endif
+			"] [requests]\n", name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fbr_context context;
+	struct echo_arg server_arg, client_arg;
+	struct fbr_fd handles[2];
+	const char *mode = "optimistic";
+	size_t requests = 200000;
+	fbr_id_t server, client;
+	ev_tstamp start, elapsed;
+	socklen_t addrlen = sizeof(listen_addr);
+	int one = 1;
+	int retval;
+	(void)retval;
+
+	if (argc > 1)
+		mode = argv[1];
+	if (argc > 2)
+		requests = strtoul(argv[2], NULL, 10);
+	if (strcmp(mode, "optimistic") && strcmp(mode, "waitfirst") &&
+			strcmp(mode, "fd")
+#ifdef FBR_HAVE_URING_MULTISHOT
+			&& strcmp(mode, "uring")
+#endif
+			)
+		usage(argv[0]);
+	if (0 == requests)
+		usage(argv[0]);
+
+	fbr_init(&context, EV_DEFAULT);
+	fbr_enable_optimistic_io(&context, strcmp(mode, "waitfirst"));
+	/* Every descriptor below is made non-blocking */
+	fbr_assume_nonblocking_fds(&context, strcmp(mode, "waitfirst"));
+
+	server_arg.fd = socket(AF_INET, SOCK_STREAM, 0);
+	assert(0 <= server_arg.fd);
+	memset(&listen_addr, 0x00, sizeof(listen_addr));
+	listen_addr.sin_family = AF_INET;
+	listen_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	retval = bind(server_arg.fd, (struct sockaddr *)&listen_addr,
+			sizeof(listen_addr));
+	assert(0 == retval);
+	retval = getsockname(server_arg.fd, (struct sockaddr *)&listen_addr,
+			&addrlen);
+	assert(0 == retval);
+	/* Accepted socket inherits TCP_NODELAY */
+	retval = setsockopt(server_arg.fd, IPPROTO_TCP, TCP_NODELAY, &one,
+			sizeof(one));
+	assert(0 == retval);
+	retval = listen(server_arg.fd, 1);
+	assert(0 == retval);
+	client_arg.fd = socket(AF_INET, SOCK_STREAM, 0);
+	assert(0 <= client_arg.fd);
+	retval = setsockopt(client_arg.fd, IPPROTO_TCP, TCP_NODELAY, &one,
+			sizeof(one));
+	assert(0 == retval);
+
+	server_arg.fdh = client_arg.fdh = NULL;
+	server_arg.uring = client_arg.uring = !strcmp(mode, "uring");
+	if (!strcmp(mode, "fd")) {
+		server_arg.fdh = &handles[0];
+		client_arg.fdh = &handles[1];
+	}
+	if (client_arg.uring) {
+#ifdef FBR_HAVE_URING_MULTISHOT
+		retval = fbr_uring_init(&context, 0);
+		assert(0 == retval);
+		retval = fbr_uring_buf_ring_init(&context, &buf_ring, 0, 16,
+				MSG_SIZE);
+		assert(0 == retval);
+#endif
+	} else {
+		retval = fbr_fd_nonblock(&context, server_arg.fd);
+		assert(0 == retval);
+		retval = fbr_fd_nonblock(&context, client_arg.fd);
+		assert(0 == retval);
+	}
+	client_arg.requests = requests;
+
+	server = fbr_create(&context, "server", server_fiber, &server_arg, 0);
+	assert(!fbr_id_isnull(server));
+	retval = fbr_transfer(&context, server);
+	assert(0 == retval);
+	client = fbr_create(&context, "client", client_fiber, &client_arg, 0);
+	assert(!fbr_id_isnull(client));
+
+	n_read = n_write = n_fcntl = n_epoll_ctl = n_epoll_wait = 0;
+	n_uring_enter = 0;
+	start = ev_time();
+	retval = fbr_transfer(&context, client);
+	assert(0 == retval);
+	ev_run(EV_DEFAULT, 0);
+	elapsed = ev_time() - start;
+
+	printf("%s: %zd requests/s\n", mode, (size_t)(requests / elapsed));
+	printf("per request: read %.2f, write %.2f, fcntl %.2f,"
+			" epoll_ctl %.2f, epoll_wait %.2f, io_uring_enter %.2f\n",
+			(double)n_read / requests, (double)n_write / requests,
+			(double)n_fcntl / requests,
+			(double)n_epoll_ctl / requests,
+			(double)n_epoll_wait / requests,
+			(double)n_uring_enter / requests);
+
+	close(server_arg.fd);
+	close(client_arg.fd);
+#ifdef FBR_HAVE_URING_MULTISHOT
+	if (client_arg.uring)
+		fbr_uring_buf_ring_destroy(&context, &buf_ring);
+#endif
+	fbr_destroy(&context);
+	return 0;
+}
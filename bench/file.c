@@ -0,0 +1,198 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <ev.h>
+#include <evfibers/fiber.h>
+#ifdef FBR_EIO_ENABLED
+#include <evfibers/eio.h>
+#endif
+#ifdef FBR_URING_ENABLED
+#include <evfibers/uring.h>
+#endif
+
+#define PATH "./file.bench.data"
+#define BLOCK 512
+
+enum mode {
+	MODE_SYNC,
+	MODE_EIO,
+	MODE_URING,
+};
+
+static enum mode mode;
+static size_t ops_per_fiber;
+static int fd;
+
+static void write_block(FBR_P_ const char *buf, off_t offset)
+{
+	ssize_t retval = -1;
+
+	switch (mode) {
+	case MODE_SYNC:
+		retval = pwrite(fd, buf, BLOCK, offset);
+		break;
+#ifdef FBR_EIO_ENABLED
+	case MODE_EIO:
+		retval = fbr_eio_write(FBR_A_ fd, (void *)buf, BLOCK, offset, 0);
+		break;
+#endif
+#ifdef FBR_URING_ENABLED
+	case MODE_URING:
+		retval = fbr_uring_write(FBR_A_ fd, buf, BLOCK, offset);
+		break;
+#endif
+	default:
+		abort();
+	}
+	assert(BLOCK == retval);
+	(void)retval;
+}
+
+static void stat_file(FBR_P)
+{
+	struct stat st;
+	int retval = -1;
+
+	switch (mode) {
+	case MODE_SYNC:
+		retval = stat(PATH, &st);
+		break;
+#ifdef FBR_EIO_ENABLED
+	case MODE_EIO:
+		{
+			EIO_STRUCT_STAT est;
+			retval = fbr_eio_stat(FBR_A_ PATH, &est, 0);
+		}
+		break;
+#endif
+#ifdef FBR_URING_ENABLED
+	case MODE_URING:
+		retval = fbr_uring_stat(FBR_A_ PATH, &st);
+		break;
+#endif
+	default:
+		abort();
+	}
+	assert(0 == retval);
+	(void)retval;
+}
+
+static void io_fiber(FBR_P_ void *_arg)
+{
+	size_t id = (size_t)_arg;
+	char buf[BLOCK];
+	size_t i;
+
+	memset(buf, 'a' + id % 26, sizeof(buf));
+	for (i = 0; i < ops_per_fiber; i++) {
+		write_block(FBR_A_ buf, (off_t)(id * BLOCK));
+		stat_file(FBR_A);
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [sync"
+#ifdef FBR_EIO_ENABLED
+			"|eio"
+#endif
+#ifdef FBR_URING_ENABLED
+			"|uring"
+#endif
+			"] [fibers] [ops per fiber]\n", name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fbr_context context;
+	const char *mode_name = "sync";
+	size_t fibers = 64;
+	size_t i;
+	fbr_id_t fiber;
+	ev_tstamp start, elapsed;
+	int retval;
+	(void)retval;
+
+	ops_per_fiber = 1000;
+	if (argc > 1)
+		mode_name = argv[1];
+	if (argc > 2)
+		fibers = strtoul(argv[2], NULL, 10);
+	if (argc > 3)
+		ops_per_fiber = strtoul(argv[3], NULL, 10);
+	if (!strcmp(mode_name, "sync"))
+		mode = MODE_SYNC;
+#ifdef FBR_EIO_ENABLED
+	else if (!strcmp(mode_name, "eio"))
+		mode = MODE_EIO;
+#endif
+#ifdef FBR_URING_ENABLED
+	else if (!strcmp(mode_name, "uring"))
+		mode = MODE_URING;
+#endif
+	else
+		usage(argv[0]);
+	if (0 == fibers || 0 == ops_per_fiber)
+		usage(argv[0]);
+
+	fbr_init(&context, EV_DEFAULT);
+#ifdef FBR_EIO_ENABLED
+	if (MODE_EIO == mode)
+		fbr_eio_init(&context);
+#endif
+#ifdef FBR_URING_ENABLED
+	if (MODE_URING == mode) {
+		retval = fbr_uring_init(&context, 0);
+		if (-1 == retval) {
+			fprintf(stderr, "fbr_uring_init: %s\n",
+					fbr_strerror(&context,
+						context.f_errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+#endif
+
+	fd = open(PATH, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	assert(0 <= fd);
+
+	start = ev_time();
+	for (i = 0; i < fibers; i++) {
+		fiber = fbr_create(&context, "io_fiber", io_fiber, (void *)i, 0);
+		assert(!fbr_id_isnull(fiber));
+		retval = fbr_transfer(&context, fiber);
+		assert(0 == retval);
+	}
+	ev_run(EV_DEFAULT, 0);
+	elapsed = ev_time() - start;
+
+	printf("%s: %zd ops/s\n", mode_name,
+			(size_t)(2 * fibers * ops_per_fiber / elapsed));
+
+	close(fd);
+	unlink(PATH);
+	fbr_destroy(&context);
+	return 0;
+}
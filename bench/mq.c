@@ -0,0 +1,207 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ev.h>
+#include <evfibers_private/fiber.h>
+
+/* A small telemetry record */
+struct record {
+	uint64_t timestamp;
+	uint32_t source;
+	uint32_t kind;
+	double values[6];
+};
+
+enum mode {
+	MODE_SINGLE,
+	MODE_BATCH,
+	MODE_MALLOC,
+	MODE_INLINE,
+};
+
+struct fiber_arg {
+	struct fbr_mq *mq;
+	enum mode mode;
+	size_t batch_size;
+	size_t count;
+	uint64_t sum;
+	int max_samples;
+};
+
+static void producer_fiber(_unused_ FBR_P_ void *_arg)
+{
+	struct fiber_arg *arg = _arg;
+	void **objs = calloc(arg->batch_size, sizeof(void *));
+	struct record *rec;
+	size_t i = 0;
+	ssize_t n;
+
+	assert(objs);
+	for (;;) {
+		switch (arg->mode) {
+		case MODE_SINGLE:
+			fbr_mq_push(arg->mq, (void *)i++);
+			break;
+		case MODE_BATCH:
+			n = fbr_mq_push_many(arg->mq, objs, arg->batch_size);
+			assert(n > 0);
+			(void)n;
+			break;
+		case MODE_MALLOC:
+			rec = malloc(sizeof(*rec));
+			assert(rec);
+			rec->timestamp = i++;
+			fbr_mq_push(arg->mq, rec);
+			break;
+		case MODE_INLINE:
+			rec = fbr_mq_reserve(arg->mq);
+			assert(rec);
+			rec->timestamp = i++;
+			fbr_mq_commit(arg->mq);
+			break;
+		}
+	}
+}
+
+static void consumer_fiber(_unused_ FBR_P_ void *_arg)
+{
+	struct fiber_arg *arg = _arg;
+	void **objs = calloc(arg->batch_size, sizeof(void *));
+	struct record *rec;
+	uint64_t sum = 0;
+	ssize_t n;
+
+	assert(objs);
+	for (;;) {
+		switch (arg->mode) {
+		case MODE_SINGLE:
+			fbr_mq_pop(arg->mq);
+			arg->count++;
+			break;
+		case MODE_BATCH:
+			n = fbr_mq_pop_many(arg->mq, objs, arg->batch_size);
+			assert(n > 0);
+			arg->count += n;
+			break;
+		case MODE_MALLOC:
+			rec = fbr_mq_pop(arg->mq);
+			sum += rec->timestamp;
+			free(rec);
+			arg->count++;
+			break;
+		case MODE_INLINE:
+			rec = fbr_mq_peek(arg->mq);
+			sum += rec->timestamp;
+			fbr_mq_release(arg->mq);
+			arg->count++;
+			break;
+		}
+		arg->sum = sum;
+	}
+}
+
+static void stats_fiber(FBR_P_ void *_arg)
+{
+	struct fiber_arg *arg = _arg;
+	size_t last;
+	int count = 0;
+	for (;;) {
+		last = arg->count;
+		fbr_sleep(FBR_A_ 1.0);
+		printf("%zd messages/s\n", arg->count - last);
+		if (++count >= arg->max_samples) {
+			ev_break(fctx->__p->loop, EVBREAK_ALL);
+		}
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [single|batch|malloc|inline] [samples]"
+			" [queue size] [batch size]\n", name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fbr_context context;
+	fbr_id_t fiber;
+	const char *mode = "batch";
+	size_t queue_size = 1024;
+	int retval;
+	(void)retval;
+	struct fiber_arg arg = {
+		.count = 0,
+		.batch_size = 64,
+		.max_samples = 10,
+	};
+
+	if (argc > 1)
+		mode = argv[1];
+	if (argc > 2)
+		arg.max_samples = atoi(argv[2]);
+	if (argc > 3)
+		queue_size = strtoul(argv[3], NULL, 10);
+	if (argc > 4)
+		arg.batch_size = strtoul(argv[4], NULL, 10);
+	if (!strcmp(mode, "single"))
+		arg.mode = MODE_SINGLE;
+	else if (!strcmp(mode, "batch"))
+		arg.mode = MODE_BATCH;
+	else if (!strcmp(mode, "malloc"))
+		arg.mode = MODE_MALLOC;
+	else if (!strcmp(mode, "inline"))
+		arg.mode = MODE_INLINE;
+	else
+		usage(argv[0]);
+	if (arg.max_samples <= 0 || 0 == arg.batch_size)
+		usage(argv[0]);
+
+	fbr_init(&context, EV_DEFAULT);
+	if (MODE_INLINE == arg.mode)
+		arg.mq = fbr_mq_create_inline(&context, queue_size,
+				sizeof(struct record), 0);
+	else
+		arg.mq = fbr_mq_create(&context, queue_size, 0);
+	assert(arg.mq);
+
+	fiber = fbr_create(&context, "consumer", consumer_fiber, &arg, 0);
+	assert(!fbr_id_isnull(fiber));
+	retval = fbr_transfer(&context, fiber);
+	assert(0 == retval);
+
+	fiber = fbr_create(&context, "producer", producer_fiber, &arg, 0);
+	assert(!fbr_id_isnull(fiber));
+	retval = fbr_transfer(&context, fiber);
+	assert(0 == retval);
+
+	fiber = fbr_create(&context, "fiber_stats", stats_fiber, &arg, 0);
+	assert(!fbr_id_isnull(fiber));
+	retval = fbr_transfer(&context, fiber);
+	assert(0 == retval);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fbr_destroy(&context);
+	return 0;
+}
@@ -0,0 +1,136 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ev.h>
+#include <evfibers_private/fiber.h>
+
+/* Models a job dispatcher with a large backlog of prioritized jobs, and a
+ * retry scheduler with a large number of delayed retries. */
+
+struct bench_arg {
+	size_t pending;
+	size_t ops;
+};
+
+static void pq_fiber(FBR_P_ void *_arg)
+{
+	struct bench_arg *arg = _arg;
+	struct fbr_pq *pq;
+	ev_tstamp start, elapsed;
+	size_t i;
+	int retval;
+	(void)retval;
+
+	pq = fbr_pq_create(FBR_A_ 0);
+	assert(pq);
+	start = ev_time();
+	for (i = 0; i < arg->pending; i++) {
+		retval = fbr_pq_push(pq, (void *)i, rand());
+		assert(0 == retval);
+	}
+	elapsed = ev_time() - start;
+	printf("pq: %zd pushes/s filling up to %zd items\n",
+			(size_t)(arg->pending / elapsed), arg->pending);
+
+	start = ev_time();
+	for (i = 0; i < arg->ops; i++) {
+		fbr_pq_pop(pq);
+		retval = fbr_pq_push(pq, (void *)i, rand());
+		assert(0 == retval);
+	}
+	elapsed = ev_time() - start;
+	printf("pq: %zd pop+push/s with %zd items pending\n",
+			(size_t)(arg->ops / elapsed), arg->pending);
+	fbr_pq_destroy(pq);
+}
+
+static void delayq_fiber(FBR_P_ void *_arg)
+{
+	struct bench_arg *arg = _arg;
+	struct fbr_delayq *dq;
+	ev_tstamp start, elapsed;
+	size_t i;
+	int retval;
+	(void)retval;
+
+	dq = fbr_delayq_create(FBR_A_ 0);
+	assert(dq);
+	/* Retries are spread over a second, starting a second from now */
+	start = ev_time();
+	for (i = 0; i < arg->pending; i++) {
+		retval = fbr_delayq_push(dq, (void *)i,
+				1. + (ev_tstamp)rand() / RAND_MAX);
+		assert(0 == retval);
+	}
+	elapsed = ev_time() - start;
+	printf("delayq: %zd pushes/s filling up to %zd items\n",
+			(size_t)(arg->pending / elapsed), arg->pending);
+
+	start = ev_time();
+	for (i = 0; i < arg->pending; i++)
+		fbr_delayq_pop(dq);
+	elapsed = ev_time() - start;
+	printf("delayq: drained %zd items as they became due in %.3fs\n",
+			arg->pending, elapsed);
+	fbr_delayq_destroy(dq);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [pq|delayq] [pending] [operations]\n",
+			name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fbr_context context;
+	struct bench_arg arg;
+	const char *mode = "pq";
+	fbr_id_t fiber;
+	int retval;
+	(void)retval;
+
+	arg.pending = 1000000;
+	arg.ops = 5000000;
+	if (argc > 1)
+		mode = argv[1];
+	if (argc > 2)
+		arg.pending = strtoul(argv[2], NULL, 10);
+	if (argc > 3)
+		arg.ops = strtoul(argv[3], NULL, 10);
+	if (strcmp(mode, "pq") && strcmp(mode, "delayq"))
+		usage(argv[0]);
+	if (0 == arg.pending)
+		usage(argv[0]);
+
+	fbr_init(&context, EV_DEFAULT);
+	fiber = fbr_create(&context, mode, strcmp(mode, "pq") ? delayq_fiber :
+			pq_fiber, &arg, 0);
+	assert(!fbr_id_isnull(fiber));
+	retval = fbr_transfer(&context, fiber);
+	assert(0 == retval);
+	ev_run(EV_DEFAULT, 0);
+
+	fbr_destroy(&context);
+	return 0;
+}
@@ -0,0 +1,138 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <ev.h>
+#include <evfibers/fiber.h>
+
+#define LINE "GET some-reasonably-long-key-name-for-a-cache\r\n"
+
+struct line_arg {
+	struct fbr_fd fdh;
+	size_t lines;
+	int buffered;
+};
+
+static void producer_fiber(FBR_P_ void *_arg)
+{
+	struct line_arg *arg = _arg;
+	char buf[64 * (sizeof(LINE) - 1)];
+	size_t i, n, chunk = sizeof(buf) / (sizeof(LINE) - 1);
+	ssize_t retval;
+	(void)retval;
+
+	for (i = 0; i < chunk; i++)
+		memcpy(buf + i * (sizeof(LINE) - 1), LINE, sizeof(LINE) - 1);
+	for (i = 0; i < arg->lines; i += n) {
+		n = arg->lines - i < chunk ? arg->lines - i : chunk;
+		retval = fbr_fd_write_all(FBR_A_ &arg->fdh, buf,
+				n * (sizeof(LINE) - 1));
+		assert(retval == (ssize_t)(n * (sizeof(LINE) - 1)));
+	}
+	shutdown(arg->fdh.fd, SHUT_WR);
+	fbr_fd_detach(FBR_A_ &arg->fdh);
+}
+
+static void consumer_fiber(FBR_P_ void *_arg)
+{
+	struct line_arg *arg = _arg;
+	struct fbr_reader reader;
+	char line[256];
+	void *ptr;
+	size_t lines = 0;
+	ssize_t retval;
+	(void)retval;
+
+	if (arg->buffered) {
+		retval = fbr_reader_init(FBR_A_ &reader, &arg->fdh, 0);
+		assert(0 == retval);
+		while (0 < fbr_reader_readline(FBR_A_ &reader, &ptr))
+			lines++;
+		fbr_reader_destroy(FBR_A_ &reader);
+	} else {
+		while (0 < fbr_readline(FBR_A_ arg->fdh.fd, line, sizeof(line)))
+			lines++;
+	}
+	assert(lines == arg->lines);
+	fbr_fd_detach(FBR_A_ &arg->fdh);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [buffered|bytewise] [lines]\n", name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fbr_context context;
+	struct line_arg producer_arg, consumer_arg;
+	const char *mode = "buffered";
+	size_t lines = 1000000;
+	fbr_id_t producer, consumer;
+	ev_tstamp start, elapsed;
+	int fds[2];
+	int retval;
+	(void)retval;
+
+	if (argc > 1)
+		mode = argv[1];
+	if (argc > 2)
+		lines = strtoul(argv[2], NULL, 10);
+	if (strcmp(mode, "buffered") && strcmp(mode, "bytewise"))
+		usage(argv[0]);
+	if (0 == lines)
+		usage(argv[0]);
+
+	fbr_init(&context, EV_DEFAULT);
+
+	retval = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	assert(0 == retval);
+	retval = fbr_fd_attach(&context, &consumer_arg.fdh, fds[0]);
+	assert(0 == retval);
+	retval = fbr_fd_attach(&context, &producer_arg.fdh, fds[1]);
+	assert(0 == retval);
+	producer_arg.lines = consumer_arg.lines = lines;
+	consumer_arg.buffered = !strcmp(mode, "buffered");
+
+	consumer = fbr_create(&context, "consumer", consumer_fiber,
+			&consumer_arg, 0);
+	assert(!fbr_id_isnull(consumer));
+	producer = fbr_create(&context, "producer", producer_fiber,
+			&producer_arg, 0);
+	assert(!fbr_id_isnull(producer));
+
+	start = ev_time();
+	retval = fbr_transfer(&context, consumer);
+	assert(0 == retval);
+	retval = fbr_transfer(&context, producer);
+	assert(0 == retval);
+	ev_run(EV_DEFAULT, 0);
+	elapsed = ev_time() - start;
+
+	printf("%s: %zd lines/s\n", mode, (size_t)(lines / elapsed));
+
+	close(fds[0]);
+	close(fds[1]);
+	fbr_destroy(&context);
+	return 0;
+}
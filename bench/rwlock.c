@@ -0,0 +1,148 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ev.h>
+#include <evfibers_private/fiber.h>
+
+/* Models a read-mostly cache: many readers yield while holding the lock
+ * (as if waiting on I/O), and a writer updates it periodically. */
+
+struct fiber_arg {
+	int use_rwlock;
+	struct fbr_mutex mutex;
+	struct fbr_rwlock rwlock;
+	size_t reads;
+	size_t writes;
+	int max_samples;
+};
+
+static void reader_fiber(FBR_P_ void *_arg)
+{
+	struct fiber_arg *arg = _arg;
+	for (;;) {
+		if (arg->use_rwlock)
+			fbr_rwlock_rdlock(FBR_A_ &arg->rwlock);
+		else
+			fbr_mutex_lock(FBR_A_ &arg->mutex);
+		fbr_cooperate(FBR_A);
+		arg->reads++;
+		if (arg->use_rwlock)
+			fbr_rwlock_unlock(FBR_A_ &arg->rwlock);
+		else
+			fbr_mutex_unlock(FBR_A_ &arg->mutex);
+	}
+}
+
+static void writer_fiber(FBR_P_ void *_arg)
+{
+	struct fiber_arg *arg = _arg;
+	for (;;) {
+		fbr_sleep(FBR_A_ 0.001);
+		if (arg->use_rwlock)
+			fbr_rwlock_wrlock(FBR_A_ &arg->rwlock);
+		else
+			fbr_mutex_lock(FBR_A_ &arg->mutex);
+		arg->writes++;
+		if (arg->use_rwlock)
+			fbr_rwlock_unlock(FBR_A_ &arg->rwlock);
+		else
+			fbr_mutex_unlock(FBR_A_ &arg->mutex);
+	}
+}
+
+static void stats_fiber(FBR_P_ void *_arg)
+{
+	struct fiber_arg *arg = _arg;
+	size_t last_reads, last_writes;
+	int count = 0;
+	for (;;) {
+		last_reads = arg->reads;
+		last_writes = arg->writes;
+		fbr_sleep(FBR_A_ 1.0);
+		printf("%zd reads/s, %zd writes/s\n", arg->reads - last_reads,
+				arg->writes - last_writes);
+		if (++count >= arg->max_samples) {
+			ev_break(fctx->__p->loop, EVBREAK_ALL);
+		}
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [rwlock|mutex] [samples] [readers]\n",
+			name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fbr_context context;
+	fbr_id_t fiber;
+	const char *mode = "rwlock";
+	size_t readers = 100;
+	size_t i;
+	int retval;
+	(void)retval;
+	struct fiber_arg arg = {
+		.reads = 0,
+		.writes = 0,
+		.max_samples = 10,
+	};
+
+	if (argc > 1)
+		mode = argv[1];
+	if (argc > 2)
+		arg.max_samples = atoi(argv[2]);
+	if (argc > 3)
+		readers = strtoul(argv[3], NULL, 10);
+	if (strcmp(mode, "rwlock") && strcmp(mode, "mutex"))
+		usage(argv[0]);
+	if (arg.max_samples <= 0 || 0 == readers)
+		usage(argv[0]);
+	arg.use_rwlock = !strcmp(mode, "rwlock");
+
+	fbr_init(&context, EV_DEFAULT);
+	fbr_mutex_init(&context, &arg.mutex);
+	fbr_rwlock_init(&context, &arg.rwlock);
+
+	for (i = 0; i < readers; i++) {
+		fiber = fbr_create(&context, "reader", reader_fiber, &arg, 0);
+		assert(!fbr_id_isnull(fiber));
+		retval = fbr_transfer(&context, fiber);
+		assert(0 == retval);
+	}
+
+	fiber = fbr_create(&context, "writer", writer_fiber, &arg, 0);
+	assert(!fbr_id_isnull(fiber));
+	retval = fbr_transfer(&context, fiber);
+	assert(0 == retval);
+
+	fiber = fbr_create(&context, "fiber_stats", stats_fiber, &arg, 0);
+	assert(!fbr_id_isnull(fiber));
+	retval = fbr_transfer(&context, fiber);
+	assert(0 == retval);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fbr_destroy(&context);
+	return 0;
+}
@@ -0,0 +1,193 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <ev.h>
+#include <evfibers_private/fiber.h>
+
+struct worker {
+	struct fbr_context fctx;
+	struct ev_loop *loop;
+	struct fbr_sched *sched;
+	fbr_id_t stopper;
+	size_t tasks;
+};
+
+struct task {
+	ev_tstamp spawned;
+	double latency;
+};
+
+static struct worker *workers;
+static size_t n_workers;
+static struct task *tasks;
+static size_t n_tasks;
+static double task_time;
+static size_t tasks_done;
+static pthread_barrier_t barrier;
+
+static void task_fiber(_unused_ FBR_P_ void *_arg)
+{
+	struct task *task = _arg;
+	ev_tstamp start = ev_time();
+	size_t i;
+
+	while (ev_time() - start < task_time)
+		;
+	task->latency = ev_time() - task->spawned;
+	if (n_tasks == __atomic_add_fetch(&tasks_done, 1, __ATOMIC_SEQ_CST)) {
+		for (i = 0; i < n_workers; i++)
+			fbr_wake_remote(&workers[i].fctx, workers[i].stopper);
+	}
+}
+
+static void stopper_fiber(FBR_P_ void *_arg)
+{
+	struct worker *w = _arg;
+	fbr_wait_remote(FBR_A);
+	fbr_sched_detach(FBR_A);
+	ev_break(w->loop, EVBREAK_ALL);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	size_t first = 0;
+	size_t i;
+	int retval;
+	(void)retval;
+
+	w->loop = ev_loop_new(EVFLAG_AUTO);
+	fbr_init(&w->fctx, w->loop);
+	retval = fbr_sched_attach(&w->fctx, w->sched);
+	assert(0 == retval);
+	w->stopper = fbr_create(&w->fctx, "stopper", stopper_fiber, w, 0);
+	assert(!fbr_id_isnull(w->stopper));
+	retval = fbr_transfer(&w->fctx, w->stopper);
+	assert(0 == retval);
+
+	pthread_barrier_wait(&barrier);
+
+	for (i = 0; i < (size_t)(w - workers); i++)
+		first += workers[i].tasks;
+	for (i = first; i < first + w->tasks; i++) {
+		tasks[i].spawned = ev_time();
+		retval = fbr_spawn(&w->fctx, "task", task_fiber, tasks + i, 0);
+		assert(0 == retval);
+	}
+	ev_run(w->loop, 0);
+
+	pthread_barrier_wait(&barrier);
+	fbr_destroy(&w->fctx);
+	ev_loop_destroy(w->loop);
+	return NULL;
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+	const struct task *ta = a, *tb = b;
+	if (ta->latency < tb->latency)
+		return -1;
+	return ta->latency > tb->latency;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [steal|nosteal] [workers] [tasks]"
+			" [task_us]\n", name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *mode = "steal";
+	pthread_t *threads;
+	struct fbr_sched *shared = NULL;
+	size_t i;
+	int retval;
+	(void)retval;
+
+	n_workers = 4;
+	n_tasks = 4000;
+	task_time = 100e-6;
+	if (argc > 1)
+		mode = argv[1];
+	if (argc > 2)
+		n_workers = strtoul(argv[2], NULL, 10);
+	if (argc > 3)
+		n_tasks = strtoul(argv[3], NULL, 10);
+	if (argc > 4)
+		task_time = atof(argv[4]) * 1e-6;
+	if (strcmp(mode, "steal") && strcmp(mode, "nosteal"))
+		usage(argv[0]);
+	if (0 == n_workers || 0 == n_tasks)
+		usage(argv[0]);
+
+	workers = calloc(n_workers, sizeof(struct worker));
+	tasks = calloc(n_tasks, sizeof(struct task));
+	threads = calloc(n_workers, sizeof(pthread_t));
+	assert(workers && tasks && threads);
+
+	/* Skewed distribution: the first worker gets half of the tasks, the
+	 * rest is spread evenly */
+	workers[0].tasks = n_workers > 1 ? n_tasks / 2 : n_tasks;
+	for (i = 1; i < n_workers; i++)
+		workers[i].tasks = (n_tasks - workers[0].tasks) /
+			(n_workers - 1);
+	workers[n_workers - 1].tasks += n_tasks - workers[0].tasks -
+		(n_workers > 1 ? workers[1].tasks * (n_workers - 1) : 0);
+
+	/* Without stealing every worker gets a scheduler of its own */
+	if (!strcmp(mode, "steal"))
+		shared = fbr_sched_create(n_workers);
+	for (i = 0; i < n_workers; i++) {
+		workers[i].sched = shared ? shared : fbr_sched_create(1);
+		assert(workers[i].sched);
+	}
+
+	pthread_barrier_init(&barrier, NULL, n_workers);
+	for (i = 0; i < n_workers; i++) {
+		retval = pthread_create(threads + i, NULL, worker_thread,
+				workers + i);
+		assert(0 == retval);
+	}
+	for (i = 0; i < n_workers; i++)
+		pthread_join(threads[i], NULL);
+	pthread_barrier_destroy(&barrier);
+
+	qsort(tasks, n_tasks, sizeof(struct task), compare_latency);
+	printf("%s: %zd workers, %zd tasks of %.0f us\n", mode, n_workers,
+			n_tasks, task_time * 1e6);
+	printf("latency p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+			tasks[n_tasks / 2].latency * 1e3,
+			tasks[n_tasks * 99 / 100].latency * 1e3,
+			tasks[n_tasks - 1].latency * 1e3);
+
+	if (shared)
+		fbr_sched_destroy(shared);
+	else
+		for (i = 0; i < n_workers; i++)
+			fbr_sched_destroy(workers[i].sched);
+	free(threads);
+	free(tasks);
+	free(workers);
+	return 0;
+}
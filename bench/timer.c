@@ -0,0 +1,139 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ev.h>
+#include <evfibers/fiber.h>
+
+/* Models a server with many idle connections, each holding a read timeout,
+ * while requests on busy connections keep re-arming theirs. */
+
+#define BUSY 10000
+
+struct churn_arg {
+	int wheel;
+	size_t idle;
+	size_t ops;
+	ev_tstamp elapsed;
+};
+
+static ev_tstamp timeout_for(size_t i)
+{
+	return 10. + (ev_tstamp)(i % 30000) / 1000.;
+}
+
+static void churn_fiber(FBR_P_ void *_arg)
+{
+	struct churn_arg *arg = _arg;
+	struct ev_loop *loop = EV_DEFAULT;
+	size_t n = arg->idle + BUSY;
+	ev_timer *timers = NULL;
+	struct fbr_ev_timer *ev_timers = NULL;
+	ev_tstamp start;
+	size_t i, j;
+
+	if (arg->wheel) {
+		ev_timers = malloc(n * sizeof(*ev_timers));
+		assert(ev_timers);
+		for (i = 0; i < n; i++) {
+			fbr_ev_timer_init(FBR_A_ &ev_timers[i]);
+			fbr_ev_timer_start(FBR_A_ &ev_timers[i],
+					timeout_for(i * 7919));
+		}
+	} else {
+		timers = malloc(n * sizeof(*timers));
+		assert(timers);
+		for (i = 0; i < n; i++) {
+			ev_timer_init(&timers[i], NULL,
+					timeout_for(i * 7919), 0.);
+			ev_timer_start(loop, &timers[i]);
+		}
+	}
+
+	/* Busy connections are spread over the whole set of timers */
+	start = ev_time();
+	for (i = 0; i < arg->ops; i++) {
+		j = (i % BUSY) * (n / BUSY);
+		if (arg->wheel) {
+			fbr_ev_timer_stop(FBR_A_ &ev_timers[j]);
+			fbr_ev_timer_start(FBR_A_ &ev_timers[j],
+					timeout_for(i * 7919));
+		} else {
+			ev_timer_stop(loop, &timers[j]);
+			ev_timer_set(&timers[j], timeout_for(i * 7919), 0.);
+			ev_timer_start(loop, &timers[j]);
+		}
+	}
+	arg->elapsed = ev_time() - start;
+
+	for (i = 0; i < n; i++) {
+		if (arg->wheel)
+			fbr_ev_timer_stop(FBR_A_ &ev_timers[i]);
+		else
+			ev_timer_stop(loop, &timers[i]);
+	}
+	free(ev_timers);
+	free(timers);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [wheel|heap] [idle timers] [operations]\n",
+			name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fbr_context context;
+	struct churn_arg arg;
+	const char *mode = "wheel";
+	fbr_id_t fiber;
+	int retval;
+	(void)retval;
+
+	arg.idle = 500000;
+	arg.ops = 5000000;
+	if (argc > 1)
+		mode = argv[1];
+	if (argc > 2)
+		arg.idle = strtoul(argv[2], NULL, 10);
+	if (argc > 3)
+		arg.ops = strtoul(argv[3], NULL, 10);
+	if (strcmp(mode, "wheel") && strcmp(mode, "heap"))
+		usage(argv[0]);
+	if (0 == arg.ops)
+		usage(argv[0]);
+	arg.wheel = !strcmp(mode, "wheel");
+
+	fbr_init(&context, EV_DEFAULT);
+	fiber = fbr_create(&context, "churn", churn_fiber, &arg, 0);
+	assert(!fbr_id_isnull(fiber));
+	retval = fbr_transfer(&context, fiber);
+	assert(0 == retval);
+	ev_run(EV_DEFAULT, 0);
+
+	printf("%s: %zd re-arms/s with %zd idle timers\n", mode,
+			(size_t)(arg.ops / arg.elapsed), arg.idle);
+
+	fbr_destroy(&context);
+	return 0;
+}
@@ -84,12 +84,16 @@ void fbr_ev_eio_init(FBR_P_ struct fbr_ev_eio *ev, eio_req *req);
  * This functions initializes libeio and sets up the necessary glue code to
  * interact with libev (and in turn libevfibers).
  *
- * Must be called only once, uses EV_DEFAULT event loop internally, but any
- * fiber scheduler can interact with libeio independently.
+ * Must be called only once. libeio results are polled from the event loop
+ * of the given context, and libeio frees a request as soon as its callback
+ * returns, so the wrappers may only be used by fibers of this context. Calls
+ * from other contexts fail with FBR_EINVAL; a fiber in another thread may
+ * delegate the call to a fiber of this context and use fbr_wake_remote to
+ * get notified about the completion.
  * @see fbr_ev_eio
  * @see fbr_ev_wait
  */
-void fbr_eio_init();
+void fbr_eio_init(FBR_P);
 
 int fbr_eio_open(FBR_P_ const char *path, int flags, mode_t mode, int pri);
 int fbr_eio_truncate(FBR_P_ const char *path, off_t offset, int pri);
@@ -149,6 +149,7 @@ extern "C" {
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/queue.h>
 #include <assert.h>
 #include <ev.h>
@@ -164,6 +165,18 @@ extern "C" {
  */
 #define FBR_STACK_SIZE (64 * 1024) /* 64 KB */
 
+/**
+ * Default maximum number of unused fiber stacks kept for reuse.
+ * @see fbr_set_stack_cache_size
+ */
+#define FBR_STACK_CACHE_SIZE 1024
+
+/**
+ * Default maximum number of unused buffer mappings kept for reuse.
+ * @see fbr_set_buffer_cache_size
+ */
+#define FBR_BUFFER_CACHE_SIZE 256
+
 /**
  * @def fbr_assert
  * Fiber version of classic assert.
@@ -236,6 +249,8 @@ enum fbr_error_code {
 	FBR_EPROTOBUF,
 	FBR_EBUFFERNOSPACE,
 	FBR_EEIO,
+	FBR_ETIMEDOUT,
+	FBR_ECANCELED,
 };
 
 /**
@@ -389,6 +404,13 @@ enum fbr_ev_type {
 	FBR_EV_MUTEX, /*!< fbr_mutex event */
 	FBR_EV_COND_VAR, /*!< fbr_cond_var event */
 	FBR_EV_EIO, /*!< libeio event */
+	FBR_EV_URING, /*!< io_uring completion event */
+	FBR_EV_TIMER, /*!< timing wheel timer event */
+	FBR_EV_RWLOCK, /*!< fbr_rwlock event */
+	FBR_EV_SEM, /*!< fbr_sem event */
+	FBR_EV_WAITGROUP, /*!< fbr_waitgroup event */
+	FBR_EV_MQ_POP, /*!< fbr_mq message arrival event */
+	FBR_EV_MQ_PUSH, /*!< fbr_mq free space event */
 };
 
 struct fbr_ev_base;
@@ -517,6 +539,113 @@ struct fbr_ev_cond_var {
 	struct fbr_ev_base ev_base;
 };
 
+/**
+ * Timer event.
+ *
+ * This event struct represents a one-shot timer kept in the timing wheel of
+ * the context. Unlike ev_timer wrapped into fbr_ev_watcher, starting and
+ * stopping it takes constant time and does not touch the timer heap of
+ * libev, which suits timeouts that mostly never fire. Expiration is rounded
+ * up to the wheel resolution of one millisecond.
+ *
+ * The event arrives once the timer has expired, and keeps arriving until
+ * the timer is started again or stopped.
+ * @see fbr_ev_timer_init
+ * @see fbr_ev_timer_start
+ * @see fbr_ev_upcast
+ * @see fbr_ev_wait
+ */
+struct fbr_ev_timer {
+	uint64_t expires; //Private
+	int active; //Private
+	int fired; //Private
+	int waiting; //Private
+	unsigned level; //Private
+	unsigned slot; //Private
+	TAILQ_ENTRY(fbr_ev_timer) entries; //Private
+	struct fbr_destructor dtor; //Private
+	struct fbr_ev_base ev_base;
+};
+
+/**
+ * fbr_rwlock event.
+ *
+ * This event struct can represent reader-writer lock aquisition waiting. Just
+ * like with fbr_ev_mutex, the lock is held once the event has arrived.
+ * @see fbr_ev_rwlock_init
+ * @see fbr_ev_upcast
+ * @see fbr_ev_wait
+ */
+struct fbr_ev_rwlock {
+	struct fbr_rwlock *rwlock; /*!< lock we're interested in */
+	int write; /*!< whether exclusive access is wanted */
+	struct fbr_ev_base ev_base;
+};
+
+/**
+ * fbr_sem event.
+ *
+ * This event struct can represent semaphore acquisition waiting. The
+ * requested permits are taken once the event has arrived.
+ * @see fbr_ev_sem_init
+ * @see fbr_ev_upcast
+ * @see fbr_ev_wait
+ */
+struct fbr_ev_sem {
+	struct fbr_sem *sem; /*!< semaphore we're interested in */
+	unsigned count; /*!< number of permits to acquire */
+	struct fbr_ev_base ev_base;
+};
+
+/**
+ * fbr_waitgroup event.
+ *
+ * This event struct can represent waiting for the counter of a wait group
+ * to drop to zero.
+ * @see fbr_ev_waitgroup_init
+ * @see fbr_ev_upcast
+ * @see fbr_ev_wait
+ */
+struct fbr_ev_waitgroup {
+	struct fbr_waitgroup *wg; /*!< wait group we're interested in */
+	struct fbr_ev_base ev_base;
+};
+
+struct fbr_mq;
+
+/**
+ * fbr_mq pop event.
+ *
+ * This event struct can represent waiting for a message on a queue. Once the
+ * event has arrived, the message has already been taken off the queue and is
+ * stored in obj, so it must be handled even if other events have arrived
+ * together with it.
+ * @see fbr_ev_mq_pop_init
+ * @see fbr_ev_upcast
+ * @see fbr_ev_wait
+ */
+struct fbr_ev_mq_pop {
+	struct fbr_mq *mq; /*!< queue we're interested in */
+	void *obj; /*!< message popped from the queue */
+	struct fbr_ev_base ev_base;
+};
+
+/**
+ * fbr_mq push event.
+ *
+ * This event struct can represent waiting for space on a queue. Once the
+ * event has arrived, obj has already been pushed to the queue; otherwise the
+ * queue has not taken it.
+ * @see fbr_ev_mq_push_init
+ * @see fbr_ev_upcast
+ * @see fbr_ev_wait
+ */
+struct fbr_ev_mq_push {
+	struct fbr_mq *mq; /*!< queue we're interested in */
+	void *obj; /*!< message to push to the queue */
+	struct fbr_ev_base ev_base;
+};
+
 /**
  * Mutex structure.
  *
@@ -542,6 +671,69 @@ struct fbr_cond_var {
 	struct fbr_id_tailq waiting;
 };
 
+/**
+ * Reader-writer lock structure.
+ *
+ * Any number of fibers may hold the lock for reading, or a single one for
+ * writing. Writers are preferred: once a writer is waiting, new readers
+ * queue up behind it, so a steady stream of readers can not starve writers.
+ * @see fbr_rwlock_init
+ * @see fbr_rwlock_destroy
+ */
+struct fbr_rwlock {
+	fbr_id_t writer; /*!< fiber holding the lock for writing */
+	unsigned readers; /*!< number of fibers holding it for reading */
+	unsigned pending_writers; //Private
+	struct fbr_id_tailq pending; //Private
+};
+
+/**
+ * Counting semaphore structure.
+ *
+ * Holds a number of permits, which fibers acquire and release in arbitrary
+ * counts. Waiters are served in order, and a release wakes only those of
+ * them that can be satisfied by the permits available.
+ * @see fbr_sem_init
+ * @see fbr_sem_destroy
+ */
+struct fbr_sem {
+	unsigned value; /*!< number of permits available */
+	struct fbr_id_tailq pending; //Private
+};
+
+/**
+ * Wait group structure.
+ *
+ * Counts outstanding pieces of work, typically child fibers, and lets other
+ * fibers wait for all of them to finish.
+ * @see fbr_waitgroup_init
+ * @see fbr_waitgroup_destroy
+ */
+struct fbr_waitgroup {
+	unsigned count; /*!< number of outstanding pieces of work */
+	struct fbr_id_tailq waiting; //Private
+};
+
+/**
+ * Persistent file descriptor handle.
+ *
+ * Wraps a non-blocking file descriptor together with its read and write
+ * watchers, which stay registered with the event loop between I/O calls.
+ * @see fbr_fd_attach
+ * @see fbr_fd_detach
+ */
+struct fbr_fd {
+	int fd; /*!< attached file descriptor, -1 after detaching */
+	struct fbr_context *fctx; //Private
+	ev_io r_io; //Private
+	ev_io w_io; //Private
+	struct fbr_cond_var r_cond; //Private
+	struct fbr_cond_var w_cond; //Private
+	ev_tstamp idle_timeout; //Private
+	ev_tstamp last_active; //Private
+	ev_timer idle_timer; //Private
+};
+
 /**
  * Virtual ring buffer implementation.
  *
@@ -559,6 +751,7 @@ struct fbr_vrb {
 	size_t ptr_size;
 	void *data_ptr;
 	void *space_ptr;
+	int fd;
 };
 
 /**
@@ -581,7 +774,19 @@ struct fbr_buffer {
 	struct fbr_mutex read_mutex;
 };
 
-struct fbr_mq;
+/**
+ * Buffered reader.
+ *
+ * Reads from a persistent file descriptor handle into a fbr_vrb in large
+ * chunks and hands out parsed pieces as pointers into the ring.
+ * @see fbr_reader_init
+ * @see fbr_reader_destroy
+ */
+struct fbr_reader {
+	struct fbr_fd *fdh;
+	struct fbr_vrb vrb;
+	size_t consumed; //Private
+};
 
 /**
  * Fiber-local data key.
@@ -669,12 +874,111 @@ void fbr_ev_mutex_init(FBR_P_ struct fbr_ev_mutex *ev,
 void fbr_ev_cond_var_init(FBR_P_ struct fbr_ev_cond_var *ev,
 		struct fbr_cond_var *cond, struct fbr_mutex *mutex);
 
+/**
+ * Initializer for timer event.
+ *
+ * This functions properly initializes fbr_ev_timer struct. You should not do
+ * it manually.
+ * @see fbr_ev_timer
+ * @see fbr_ev_wait
+ */
+void fbr_ev_timer_init(FBR_P_ struct fbr_ev_timer *ev);
+
+/**
+ * Starts a timer event.
+ * @param [in] ev timer event
+ * @param [in] timeout time in seconds until expiration
+ *
+ * Restarts the timer if it is already running or has expired. A running
+ * timer is stopped automatically if the calling fiber gets reclaimed.
+ * @see fbr_ev_timer_stop
+ */
+void fbr_ev_timer_start(FBR_P_ struct fbr_ev_timer *ev, ev_tstamp timeout);
+
+/**
+ * Stops a timer event.
+ * @param [in] ev timer event
+ *
+ * Must be called by the fiber that has started the timer. Waiting for a
+ * stopped timer fails with FBR_EINVAL, as it would never arrive.
+ * @see fbr_ev_timer_start
+ */
+void fbr_ev_timer_stop(FBR_P_ struct fbr_ev_timer *ev);
+
+/**
+ * Initializer for reader-writer lock event.
+ * @param [in] ev event to initialize
+ * @param [in] rwlock the lock to acquire
+ * @param [in] write non-zero to acquire it for writing, zero for reading
+ *
+ * This functions properly initializes fbr_ev_rwlock struct. You should not do
+ * it manually.
+ * @see fbr_ev_rwlock
+ * @see fbr_ev_wait
+ */
+void fbr_ev_rwlock_init(FBR_P_ struct fbr_ev_rwlock *ev,
+		struct fbr_rwlock *rwlock, int write);
+
+/**
+ * Initializer for semaphore event.
+ * @param [in] ev event to initialize
+ * @param [in] sem the semaphore to acquire
+ * @param [in] count number of permits to acquire
+ *
+ * This functions properly initializes fbr_ev_sem struct. You should not do
+ * it manually.
+ * @see fbr_ev_sem
+ * @see fbr_ev_wait
+ */
+void fbr_ev_sem_init(FBR_P_ struct fbr_ev_sem *ev, struct fbr_sem *sem,
+		unsigned count);
+
+/**
+ * Initializer for wait group event.
+ * @param [in] ev event to initialize
+ * @param [in] wg the wait group to wait for
+ *
+ * This functions properly initializes fbr_ev_waitgroup struct. You should not
+ * do it manually.
+ * @see fbr_ev_waitgroup
+ * @see fbr_ev_wait
+ */
+void fbr_ev_waitgroup_init(FBR_P_ struct fbr_ev_waitgroup *ev,
+		struct fbr_waitgroup *wg);
+
+/**
+ * Initializer for message queue pop event.
+ * @param [in] ev event to initialize
+ * @param [in] mq the queue to pop a message from
+ *
+ * This functions properly initializes fbr_ev_mq_pop struct. You should not do
+ * it manually.
+ * @see fbr_ev_mq_pop
+ * @see fbr_ev_wait
+ */
+void fbr_ev_mq_pop_init(FBR_P_ struct fbr_ev_mq_pop *ev, struct fbr_mq *mq);
+
+/**
+ * Initializer for message queue push event.
+ * @param [in] ev event to initialize
+ * @param [in] mq the queue to push a message to
+ * @param [in] obj the message to push
+ *
+ * This functions properly initializes fbr_ev_mq_push struct. You should not
+ * do it manually.
+ * @see fbr_ev_mq_push
+ * @see fbr_ev_wait
+ */
+void fbr_ev_mq_push_init(FBR_P_ struct fbr_ev_mq_push *ev, struct fbr_mq *mq,
+		void *obj);
+
 /**
  * Event awaiting function (one event only wrapper).
  * @param [in] one the event base pointer of the event to wait for
  * @returns 0 on success, -1 upon error
  *
- * This functions wraps fbr_ev_wait passing only one event to it.
+ * This functions wraps fbr_ev_wait passing only one event to it, deadline and
+ * cancellation of the fiber apply the same way.
  * @see fbr_ev_base
  * @see fbr_ev_wait
  */
@@ -688,8 +992,16 @@ int fbr_ev_wait_one(FBR_P_ struct fbr_ev_base *one);
  * This function waits until any event from events array arrives. Only one
  * event can arrive at a time. It returns a pointer to the same event that was
  * passed in events array.
+ *
+ * If none of the events has arrived yet, the wait is bounded by the deadline
+ * of the fiber and is interrupted by fbr_cancel. In this case all the events
+ * are cancelled and -1 is returned with f_errno set to FBR_ETIMEDOUT or
+ * FBR_ECANCELED respectively, errno is set to ETIMEDOUT or ECANCELED as well
+ * for the benefit of I/O wrappers.
  * @see fbr_ev_base
  * @see fbr_ev_wait_one
+ * @see fbr_set_deadline
+ * @see fbr_cancel
  */
 int fbr_ev_wait(FBR_P_ struct fbr_ev_base *events[]);
 
@@ -724,8 +1036,13 @@ int fbr_transfer(FBR_P_ fbr_id_t to);
  *
  * It's user's responsibility to allocate fbr_context structure and create and
  * run the libev event loop.
+ *
+ * A context and its fibers are bound to the thread running the loop. To use
+ * several threads, create a loop and a context per thread. The only function
+ * that may be called on a context from another thread is fbr_wake_remote.
  * @see fbr_context
  * @see fbr_destroy
+ * @see fbr_wake_remote
  */
 void fbr_init(struct fbr_context *fctx, struct ev_loop *loop);
 
@@ -846,8 +1163,13 @@ void fbr_log_d(FBR_P_ const char *format, ...)
  * The created fiber is not running in any shape or form, it's just created and
  * is ready to be launched.
  *
- * Stack is anonymously mmaped so it should not occupy all the required space
- * straight away. Adjust stack size only when you know what you are doing!
+ * Stack is anonymously mmaped with MAP_NORESERVE so it should not occupy all
+ * the required space straight away. A PROT_NONE guard page is placed below
+ * the stack, so an overflow crashes instead of silently corrupting memory.
+ * Requested size is rounded up to a power of two number of pages, and stacks
+ * of reclaimed fibers are kept in per-size free lists, so a fiber always gets
+ * a stack at least as large as it asked for. Adjust stack size only when you
+ * know what you are doing!
  *
  * Allocated stacks are registered as stacks via valgrind client request
  * mechanism, so it's generally valgrind friendly and should not cause any
@@ -927,10 +1249,11 @@ fbr_id_t fbr_parent(FBR_P);
  *
  * Fibers are never destroyed, but reclaimed. Reclamation frees some resources
  * like call lists and memory pools immediately while keeping fiber structure
- * itself and its stack as is. Reclaimed fiber is prepended to the reclaimed
- * fiber list and will be served as a new one whenever next fbr_create is
- * called. Fiber is prepended because it is warm in terms of cpu cache and its
- * use might be faster than any other fiber in the list.
+ * itself as is. Fiber stack is returned to the stack cache. Reclaimed fiber
+ * is prepended to the reclaimed fiber list and will be served as a new one
+ * whenever next fbr_create is called. Fiber is prepended because it is warm
+ * in terms of cpu cache and its use might be faster than any other fiber in
+ * the list.
  *
  * When you have some reclaimed fibers in the list, reclaiming and creating are
  * generally cheap operations.
@@ -990,6 +1313,160 @@ int fbr_want_reclaim(FBR_P_ fbr_id_t fiber);
  */
 int fbr_is_reclaimed(FBR_P_ fbr_id_t fiber);
 
+/**
+ * Sets the deadline of the current fiber.
+ * @param [in] deadline absolute time in the ev_now() timescale, 0 removes the
+ * deadline
+ *
+ * Once the deadline passes, every wait of the fiber that would block fails
+ * with FBR_ETIMEDOUT, no matter how many nested calls it goes through. This
+ * includes fbr_ev_wait and everything built on top of it: I/O wrappers, mutex
+ * and conditional variable waits, libeio and io_uring requests. A single timer
+ * per fiber is used for that, it is armed by the first wait after the
+ * deadline has been set.
+ *
+ * Fibers created with fbr_create inherit the deadline of their creator, so
+ * helpers spawned to handle parts of a request share its budget. A fiber may
+ * set its own deadline at any time, including a later one.
+ * @see fbr_get_deadline
+ * @see fbr_cancel
+ */
+void fbr_set_deadline(FBR_P_ ev_tstamp deadline);
+
+/**
+ * Returns the deadline of the current fiber.
+ * @returns absolute deadline or 0 if there is none
+ * @see fbr_set_deadline
+ */
+ev_tstamp fbr_get_deadline(FBR_P);
+
+/**
+ * Cancels a fiber.
+ * @param [in] fiber fiber pointer
+ * @returns -1 on error with f_errno set, 0 upon success
+ *
+ * Unlike fbr_reclaim, cancellation does not tear the fiber down in the middle
+ * of its stack. If the fiber is blocked in fbr_ev_wait, it is woken up and the
+ * wait fails with FBR_ECANCELED. Every later wait that would block fails the
+ * same way, so the fiber unwinds through its usual error paths and returns.
+ * Waits that can be satisfied immediately still succeed, allowing cleanup.
+ *
+ * Cancellation is inherited by fibers created by a cancelled fiber. Children
+ * created before are reclaimed when the fiber returns, as usual.
+ * @see fbr_is_cancelled
+ * @see fbr_set_deadline
+ */
+int fbr_cancel(FBR_P_ fbr_id_t fiber);
+
+/**
+ * Tests if given fiber is cancelled.
+ * @param [in] fiber fiber pointer
+ * @returns -1 on error with f_errno set, 1 if the fiber is cancelled, 0
+ * otherwise
+ * @see fbr_cancel
+ */
+int fbr_is_cancelled(FBR_P_ fbr_id_t fiber);
+
+/**
+ * Limits the number of cached fiber stacks.
+ * @param [in] max_cached maximum number of unused stacks to keep
+ *
+ * Stacks of reclaimed fibers are kept for reuse by subsequent fbr_create
+ * calls. Pages of a cached stack are handed back to the kernel with madvise,
+ * so cached stacks only cost address space. Stacks released when the cache is
+ * full are unmapped. Lowering the limit unmaps the excess straight away.
+ *
+ * Defaults to FBR_STACK_CACHE_SIZE.
+ * @see fbr_create
+ * @see fbr_reclaim
+ */
+void fbr_set_stack_cache_size(FBR_P_ unsigned max_cached);
+
+/**
+ * Limits the number of cached buffer mappings.
+ * @param [in] max_cached maximum number of unused mappings to keep
+ *
+ * Memory mappings of destroyed fbr_buffer and fbr_reader structures are kept
+ * for reuse by subsequent fbr_buffer_init and fbr_reader_init calls, sorted
+ * by size classes of a power of two pages; requested sizes are rounded up to
+ * the size class. Cached mappings keep their memory and their file
+ * descriptor, so up to max_cached descriptors may stay open in addition to
+ * those of live buffers; keep that in mind when sizing RLIMIT_NOFILE. Mappings
+ * released when the cache is full are unmapped. Lowering the limit unmaps the
+ * excess straight away.
+ *
+ * Defaults to FBR_BUFFER_CACHE_SIZE.
+ * @see fbr_buffer_init
+ * @see fbr_reader_init
+ */
+void fbr_set_buffer_cache_size(FBR_P_ unsigned max_cached);
+
+/**
+ * Enables or disables huge pages for buffers.
+ * @param [in] enabled 1 to enable, 0 to disable
+ *
+ * When enabled, fbr_buffer_init and fbr_reader_init back buffers of at least
+ * a huge page in size with huge pages (see memfd_create(2) MFD_HUGETLB). If
+ * no huge pages are available, regular ones are used instead.
+ *
+ * Disabled by default.
+ */
+void fbr_enable_buffer_huge_pages(FBR_P_ int enabled);
+
+/**
+ * Number of buckets in stack usage histogram.
+ * @see fbr_stack_stats
+ */
+#define FBR_STACK_HIST_BUCKETS 16
+
+/**
+ * Stack usage statistics of fibers sharing the same name.
+ *
+ * Bucket i of the histogram counts fibers whose stack high-water mark was
+ * within (512 << (i - 1), 512 << i] bytes, bucket 0 counts the ones that used
+ * at most 512 bytes and the last bucket counts everything above.
+ * @see fbr_get_stack_stats
+ */
+struct fbr_stack_stats {
+	char name[FBR_MAX_FIBER_NAME]; //!< name of the fibers
+	size_t max_used; //!< largest high-water mark seen, in bytes
+	unsigned long samples; //!< number of measured fibers
+	unsigned long hist[FBR_STACK_HIST_BUCKETS]; //!< high-water mark histogram
+};
+
+/**
+ * Enables/Disables stack usage profiling.
+ * @param [in] enabled is stack profiling enabled?
+ * @param [in] autotune should learned stack sizes be used?
+ *
+ * When enabled, stacks of newly created fibers are painted with a canary
+ * pattern, and the untouched part of the stack is measured when the fiber is
+ * reclaimed. Results are aggregated by fiber name and may be retrieved with
+ * fbr_get_stack_stats. Painting commits all of the stack pages, so this is
+ * meant as a diagnostic mode and is disabled by default.
+ *
+ * With autotune set, fbr_create with stack_size of 0 uses twice the largest
+ * high-water mark seen for a fiber name, capped by FBR_STACK_SIZE, once a few
+ * fibers with that name have been measured. A fiber that goes deeper than it
+ * did during the measurements will hit the guard page, so make sure the
+ * learning phase exercises all code paths.
+ * @see fbr_get_stack_stats
+ * @see fbr_create
+ */
+void fbr_enable_stack_profiling(FBR_P_ int enabled, int autotune);
+
+/**
+ * Retrieves stack usage statistics.
+ * @param [out] stats array to copy statistics into
+ * @param [in] max size of the stats array
+ * @returns total number of distinct fiber names measured
+ *
+ * Up to max entries are copied, so a call with max of 0 may be used to find
+ * out the required array size.
+ * @see fbr_enable_stack_profiling
+ */
+size_t fbr_get_stack_stats(FBR_P_ struct fbr_stack_stats *stats, size_t max);
+
 /**
  * Returns id of current fiber.
  * @return fbr_id_t of current fiber being executed.
@@ -1040,11 +1517,173 @@ void fbr_yield(FBR_P);
  *
  * Useful inside of some busy loop with lots of iterations to play nicely with
  * other fibers which might start starving on the execution time.
+ *
+ * Current fiber is put at the tail of the run queue, so all fibers that are
+ * already runnable get their turn and the event loop gets a chance to poll
+ * for events before the current fiber is resumed.
+ *
+ * If a budget was configured with fbr_set_cooperate_budget, this function
+ * returns immediately unless the fiber has exhausted its budget, which makes
+ * it cheap enough to be called on every iteration of a tight loop.
+ * @see fbr_set_cooperate_budget
  * @see fbr_yield
  * @see fbr_transfer
  */
 void fbr_cooperate(FBR_P);
 
+/**
+ * Configures the budget for fbr_cooperate.
+ * @param [in] quantum time in seconds a fiber may hold the CPU before
+ * fbr_cooperate actually yields (0 to disable)
+ * @param [in] iterations number of fbr_cooperate calls before it actually
+ * yields (0 to disable)
+ *
+ * The budget is reset each time a fiber gets the CPU. fbr_cooperate yields as
+ * soon as any of the enabled limits is reached. With both limits disabled
+ * (which is the default) fbr_cooperate yields on every call.
+ * @see fbr_cooperate
+ */
+void fbr_set_cooperate_budget(FBR_P_ ev_tstamp quantum, unsigned iterations);
+
+/**
+ * Enables direct handoff of wakeups.
+ * @param [in] budget maximum number of direct handoffs per event loop
+ * iteration (0 to disable)
+ *
+ * By default fbr_mutex_unlock and fbr_cond_signal only mark the woken fiber
+ * runnable, and it gets to run after the caller blocks and the event loop
+ * comes around to the run queue. With direct handoff enabled, a fiber calling
+ * them switches to the woken fiber straight away, and gets control back as
+ * soon as the woken one blocks or yields. A mutex or a conditional variable
+ * passed back and forth between fibers then costs two context switches per
+ * handoff instead of a pass through the event loop.
+ *
+ * The calling fiber gets suspended within these calls, so code relying on them
+ * not to switch fibers should not enable this. Wakeups from the root fiber
+ * (i.e. from libev callbacks) and by fbr_cond_broadcast are deferred as
+ * usual, and so are those exceeding the budget, which keeps a pair of fibers
+ * from starving the event loop.
+ *
+ * Disabled by default.
+ * @see fbr_mutex_unlock
+ * @see fbr_cond_signal
+ */
+void fbr_set_handoff_budget(FBR_P_ unsigned budget);
+
+/**
+ * Wakes up a fiber of a context running in another thread.
+ * @param [in] fctx context the fiber belongs to
+ * @param [in] id fiber to wake up
+ * @returns 0 on success, -1 on memory allocation failure
+ *
+ * This is the only function that is safe to call on a context from a thread
+ * other than the one running its loop. Wakeups are appended to a per-context
+ * mailbox and delivered in batches by the owning loop, which is notified via
+ * a single ev_async (an eventfd where available) no matter how many wakeups
+ * are queued. f_errno of the target context is not touched.
+ *
+ * Wakeups of a fiber are not counted: a fiber woken several times before it
+ * calls fbr_wait_remote will see just one wakeup. Wakeups of reclaimed fibers
+ * are silently dropped.
+ * @see fbr_wait_remote
+ */
+int fbr_wake_remote(FBR_P_ fbr_id_t id);
+
+/**
+ * Waits for a wakeup from another thread.
+ * @returns -1 on error with f_errno set, 0 upon success
+ *
+ * Returns immediately if the current fiber was woken up by fbr_wake_remote
+ * since the previous call, otherwise blocks until it is, the deadline passes
+ * or the fiber is cancelled. The event loop is kept referenced while the fiber
+ * is waiting.
+ * @see fbr_wake_remote
+ */
+int fbr_wait_remote(FBR_P);
+
+/**
+ * Work-stealing scheduler.
+ *
+ * Groups several contexts, each running in its own thread, into a pool of
+ * workers that share tasks spawned by fbr_spawn. Every worker has a lock-free
+ * deque of tasks. A task becomes a fiber only when some worker starts it, and
+ * idle workers steal tasks from the deques of busy ones.
+ *
+ * Running fibers never migrate: their stacks hold pointers to their context,
+ * watchers started in a loop belong to that loop, and so on. Only tasks that
+ * have not started yet move between threads, so a task must not assume which
+ * context it runs in, and any data it shares with other threads must be
+ * synchronized by the user.
+ * @see fbr_sched_create
+ * @see fbr_sched_attach
+ * @see fbr_spawn
+ */
+struct fbr_sched;
+
+/**
+ * Creates a work-stealing scheduler.
+ * @param [in] max_workers maximum number of contexts that may be attached
+ * @returns pointer to the scheduler, or NULL on memory allocation failure
+ * @see fbr_sched
+ * @see fbr_sched_destroy
+ */
+struct fbr_sched *fbr_sched_create(unsigned max_workers);
+
+/**
+ * Destroys a work-stealing scheduler.
+ * @param [in] sched scheduler to destroy
+ *
+ * Tasks that were never started are dropped. Must be called after all of
+ * the workers have detached, and before their loops are destroyed.
+ * @see fbr_sched_create
+ */
+void fbr_sched_destroy(struct fbr_sched *sched);
+
+/**
+ * Attaches a context to a work-stealing scheduler as a worker.
+ * @param [in] sched scheduler to attach to
+ * @returns -1 on error with f_errno set, 0 upon success
+ *
+ * Must be called from the thread running the context loop. The loop keeps
+ * running while the context is attached, even when there is nothing to do, so
+ * that it's ready to steal tasks spawned by other workers. Fails with
+ * FBR_EINVAL when the context is already attached somewhere or when
+ * max_workers contexts are attached at the moment. Slots of detached
+ * contexts are reused.
+ * @see fbr_sched_detach
+ */
+int fbr_sched_attach(FBR_P_ struct fbr_sched *sched);
+
+/**
+ * Detaches a context from its work-stealing scheduler.
+ *
+ * Tasks left in the deque of the context remain available to other workers,
+ * and to the next context taking over its slot. Waits for other workers that
+ * are in the middle of waking this one up, so the loop may be destroyed
+ * right after. Called automatically by fbr_destroy.
+ * @see fbr_sched_attach
+ */
+void fbr_sched_detach(FBR_P);
+
+/**
+ * Spawns a task on a work-stealing scheduler.
+ * @param [in] name fiber name
+ * @param [in] func function used as a fiber's ``main''
+ * @param [in] arg user supplied argument to a fiber
+ * @param [in] stack_size stack size (0 for default)
+ * @returns -1 on error with f_errno set, 0 upon success
+ *
+ * The task is queued in the deque of the current context, and some idle
+ * worker is woken up to steal it. The fiber is created by whichever worker
+ * gets to the task first. Its func receives that worker's context, and its
+ * parent is the root fiber of that context. Fails with FBR_EINVAL if the
+ * context is not attached to a scheduler.
+ * @see fbr_sched
+ * @see fbr_create
+ */
+int fbr_spawn(FBR_P_ const char *name, fbr_fiber_func_t func, void *arg,
+		size_t stack_size);
+
 /**
  * (DEPRECATED) Allocates memory in current fiber's pool.
  * @param [in] size size of the requested memory block
@@ -1123,6 +1762,42 @@ void fbr_free_nd(FBR_P_ void *ptr);
  */
 int fbr_fd_nonblock(FBR_P_ int fd);
 
+/**
+ * Enables/Disables optimistic I/O.
+ * @param [in] enabled is optimistic I/O enabled?
+ *
+ * With optimistic I/O (which is the default) fbr_read, fbr_write, fbr_recv,
+ * fbr_send, fbr_recvfrom, fbr_sendto, fbr_accept, fbr_read_all,
+ * fbr_write_all and the _wto variants of fbr_read and fbr_write try the
+ * system call straight away, and only wait for the file descriptor to
+ * become ready when it fails with EAGAIN. This saves a pair of epoll_ctl calls
+ * and a round trip through the event loop whenever the data (or buffer space,
+ * or a pending connection) is already there.
+ *
+ * Socket wrappers pass MSG_DONTWAIT, so they are always safe to try. The rest
+ * of them have no such flag and would block the whole thread on a blocking
+ * descriptor, so they keep waiting first unless fbr_assume_nonblocking_fds
+ * has been enabled as well.
+ * @see fbr_assume_nonblocking_fds
+ * @see fbr_fd_nonblock
+ */
+void fbr_enable_optimistic_io(FBR_P_ int enabled);
+
+/**
+ * Declares that descriptors passed to the I/O wrappers are non-blocking.
+ * @param [in] enabled whether the caller vouches for O_NONBLOCK
+ *
+ * With optimistic I/O enabled, this extends it to fbr_read, fbr_write,
+ * fbr_readv, fbr_writev, fbr_accept, fbr_read_all, fbr_write_all and the _wto
+ * variants of fbr_read and fbr_write. The descriptors are not checked, so
+ * every one of them has to have O_NONBLOCK set (see fbr_fd_nonblock): a call on
+ * a blocking descriptor stalls all fibers of the thread until it returns.
+ *
+ * Disabled by default.
+ * @see fbr_enable_optimistic_io
+ */
+void fbr_assume_nonblocking_fds(FBR_P_ int enabled);
+
 /**
  * Fiber friendly connect wrapper.
  * @param [in] sockfd - socket file descriptor
@@ -1175,6 +1850,7 @@ int fbr_connect_wto(FBR_P_ int sockfd, const struct sockaddr *addr,
  *
  * @see fbr_read_all
  * @see fbr_readline
+ * @see fbr_enable_optimistic_io
  */
 ssize_t fbr_read(FBR_P_ int fd, void *buf, size_t count);
 
@@ -1252,8 +1928,12 @@ ssize_t fbr_read_all_wto(FBR_P_ int fd, void *buf, size_t count, ev_tstamp timeo
  *
  * Possible errno values are described in read man page.
  *
+ * This function reads one byte per system call, since it can not keep any data
+ * past the newline for later. Use fbr_reader_readline for anything busy.
+ *
  * @see fbr_read
  * @see fbr_read_all
+ * @see fbr_reader_readline
  */
 ssize_t fbr_readline(FBR_P_ int fd, void *buffer, size_t n);
 
@@ -1405,23 +2085,370 @@ ssize_t fbr_send(FBR_P_ int sockfd, const void *buf, size_t len, int flags);
 int fbr_accept(FBR_P_ int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 
 /**
- * Puts current fiber to sleep.
- * @param [in] seconds maximum number of seconds to sleep
- * @return number of seconds actually being asleep
+ * Fiber friendly libc readv wrapper.
+ * @param [in] fd file descriptor to read from
+ * @param [in] iov array of buffers to scatter the data into
+ * @param [in] iovcnt number of elements in iov
+ * @return number of bytes read on success, -1 in case of error and errno set
  *
- * This function is used to put current fiber into sleep. It will wake up after
- * the desired time has passed or earlier if some other fiber has called it.
+ * Possible errno values are described in readv man page.
+ * @see fbr_read
  */
-ev_tstamp fbr_sleep(FBR_P_ ev_tstamp seconds);
+ssize_t fbr_readv(FBR_P_ int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Fiber friendly libc readv wrapper with timeout.
+ * @param [in] fd file descriptor to read from
+ * @param [in] iov array of buffers to scatter the data into
+ * @param [in] iovcnt number of elements in iov
+ * @param [in] timeout in seconds to wait for events
+ * @return number of bytes read on success, -1 in case of error and errno set
+ *
+ * Errno is set to ETIMEDOUT when timeout occurs.
+ * @see fbr_readv
+ */
+ssize_t fbr_readv_wto(FBR_P_ int fd, const struct iovec *iov, int iovcnt,
+		ev_tstamp timeout);
+
+/**
+ * Fiber friendly libc writev wrapper.
+ * @param [in] fd file descriptor to write to
+ * @param [in] iov array of buffers to gather the data from
+ * @param [in] iovcnt number of elements in iov
+ * @return number of bytes written on success, -1 in case of error and errno
+ * set
+ *
+ * Possible errno values are described in writev man page.
+ * @see fbr_writev_all
+ */
+ssize_t fbr_writev(FBR_P_ int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Fiber friendly libc writev wrapper with timeout.
+ * @param [in] fd file descriptor to write to
+ * @param [in] iov array of buffers to gather the data from
+ * @param [in] iovcnt number of elements in iov
+ * @param [in] timeout in seconds to wait for events
+ * @return number of bytes written on success, -1 in case of error and errno
+ * set
+ *
+ * Errno is set to ETIMEDOUT when timeout occurs.
+ * @see fbr_writev
+ */
+ssize_t fbr_writev_wto(FBR_P_ int fd, const struct iovec *iov, int iovcnt,
+		ev_tstamp timeout);
+
+/**
+ * Writes all the buffers of an iovec array.
+ * @param [in] fd file descriptor to write to
+ * @param [in] iov array of buffers to gather the data from
+ * @param [in] iovcnt number of elements in iov
+ * @return total number of bytes written on success, -1 in case of error and
+ * errno set
+ *
+ * Keeps calling writev until everything is written, so a header and a body
+ * go out with a single system call whenever the socket has room for them.
+ * The iov array itself is not modified. Fails with EINVAL if iovcnt is
+ * negative or exceeds IOV_MAX.
+ * @see fbr_write_all
+ */
+ssize_t fbr_writev_all(FBR_P_ int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Writes all the buffers of an iovec array with timeout.
+ * @param [in] fd file descriptor to write to
+ * @param [in] iov array of buffers to gather the data from
+ * @param [in] iovcnt number of elements in iov
+ * @param [in] timeout in seconds for the whole operation
+ * @return total number of bytes written on success, -1 in case of error and
+ * errno set
+ *
+ * Errno is set to ETIMEDOUT when timeout occurs, in which case some of the
+ * data may have been written already.
+ * @see fbr_writev_all
+ */
+ssize_t fbr_writev_all_wto(FBR_P_ int fd, const struct iovec *iov, int iovcnt,
+		ev_tstamp timeout);
+
+/**
+ * Fiber friendly libc recvmsg wrapper.
+ * @param [in] sockfd file descriptor to read from
+ * @param [in] msg message header, see man recvmsg for details
+ * @param [in] flags just flags, see man recvmsg for details
+ * @return number of bytes read on success, -1 in case of error and errno set
+ * @see fbr_recvfrom
+ */
+ssize_t fbr_recvmsg(FBR_P_ int sockfd, struct msghdr *msg, int flags);
+
+/**
+ * Fiber friendly libc recvmsg wrapper with timeout.
+ * @param [in] sockfd file descriptor to read from
+ * @param [in] msg message header, see man recvmsg for details
+ * @param [in] flags just flags, see man recvmsg for details
+ * @param [in] timeout in seconds to wait for events
+ * @return number of bytes read on success, -1 in case of error and errno set
+ *
+ * Errno is set to ETIMEDOUT when timeout occurs.
+ * @see fbr_recvmsg
+ */
+ssize_t fbr_recvmsg_wto(FBR_P_ int sockfd, struct msghdr *msg, int flags,
+		ev_tstamp timeout);
+
+/**
+ * Fiber friendly libc sendmsg wrapper.
+ * @param [in] sockfd file descriptor to write to
+ * @param [in] msg message header, see man sendmsg for details
+ * @param [in] flags just flags, see man sendmsg for details
+ * @return number of bytes written on success, -1 in case of error and errno
+ * set
+ * @see fbr_sendto
+ */
+ssize_t fbr_sendmsg(FBR_P_ int sockfd, const struct msghdr *msg, int flags);
+
+/**
+ * Fiber friendly libc sendmsg wrapper with timeout.
+ * @param [in] sockfd file descriptor to write to
+ * @param [in] msg message header, see man sendmsg for details
+ * @param [in] flags just flags, see man sendmsg for details
+ * @param [in] timeout in seconds to wait for events
+ * @return number of bytes written on success, -1 in case of error and errno
+ * set
+ *
+ * Errno is set to ETIMEDOUT when timeout occurs.
+ * @see fbr_sendmsg
+ */
+ssize_t fbr_sendmsg_wto(FBR_P_ int sockfd, const struct msghdr *msg,
+		int flags, ev_tstamp timeout);
+
+#if defined(FBR_HAVE_MMSG) && defined(_GNU_SOURCE)
+/**
+ * Fiber friendly libc recvmmsg wrapper.
+ * @param [in] sockfd file descriptor to read from
+ * @param [in] msgvec array of message headers
+ * @param [in] vlen number of elements in msgvec
+ * @param [in] flags just flags, see man recvmmsg for details
+ * @return number of messages received on success, -1 in case of error and
+ * errno set
+ *
+ * Waits until at least one datagram is there and then receives as many of
+ * them as are queued, up to vlen, with a single system call. Length of each
+ * message is stored in msg_len field of its msgvec element.
+ *
+ * Only available where the C library provides recvmmsg, and only declared
+ * when _GNU_SOURCE is defined, since struct mmsghdr is not visible otherwise.
+ * @see fbr_recvmsg
+ */
+int fbr_recvmmsg(FBR_P_ int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+		int flags);
+
+/**
+ * Fiber friendly libc recvmmsg wrapper with timeout.
+ * @param [in] sockfd file descriptor to read from
+ * @param [in] msgvec array of message headers
+ * @param [in] vlen number of elements in msgvec
+ * @param [in] flags just flags, see man recvmmsg for details
+ * @param [in] timeout in seconds to wait for the first message
+ * @return number of messages received on success, -1 in case of error and
+ * errno set
+ *
+ * Errno is set to ETIMEDOUT when timeout occurs.
+ * @see fbr_recvmmsg
+ */
+int fbr_recvmmsg_wto(FBR_P_ int sockfd, struct mmsghdr *msgvec,
+		unsigned int vlen, int flags, ev_tstamp timeout);
+
+/**
+ * Fiber friendly libc sendmmsg wrapper.
+ * @param [in] sockfd file descriptor to write to
+ * @param [in] msgvec array of message headers
+ * @param [in] vlen number of elements in msgvec
+ * @param [in] flags just flags, see man sendmmsg for details
+ * @return number of messages sent on success, -1 in case of error and errno
+ * set
+ *
+ * Sends as many messages as the socket accepts with a single system call,
+ * waiting only if it can not take any. The result may be less than vlen.
+ * @see fbr_recvmmsg
+ */
+int fbr_sendmmsg(FBR_P_ int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+		int flags);
+
+/**
+ * Fiber friendly libc sendmmsg wrapper with timeout.
+ * @param [in] sockfd file descriptor to write to
+ * @param [in] msgvec array of message headers
+ * @param [in] vlen number of elements in msgvec
+ * @param [in] flags just flags, see man sendmmsg for details
+ * @param [in] timeout in seconds to wait for events
+ * @return number of messages sent on success, -1 in case of error and errno
+ * set
+ *
+ * Errno is set to ETIMEDOUT when timeout occurs.
+ * @see fbr_sendmmsg
+ */
+int fbr_sendmmsg_wto(FBR_P_ int sockfd, struct mmsghdr *msgvec,
+		unsigned int vlen, int flags, ev_tstamp timeout);
+#endif
+
+/**
+ * Attaches a file descriptor to a persistent handle.
+ * @param [in] fdh user-allocated handle
+ * @param [in] fd file descriptor to attach
+ * @returns -1 on error with f_errno set, 0 upon success
+ *
+ * Makes fd non-blocking and prepares the handle for fbr_fd_read, fbr_fd_write
+ * and friends. Plain fbr_read and alike start and stop an ev_io watcher on
+ * every call, which costs epoll_ctl system calls each time a fiber waits.
+ * Watchers of the handle are started the first time a fiber has to wait and
+ * are left running afterwards, so a busy long-lived connection keeps its
+ * epoll registration intact. A watcher is only stopped when it fires while
+ * no fiber is waiting on it, to avoid spinning the loop on a descriptor that
+ * nobody drains.
+ *
+ * Active watchers keep the event loop running, so the handle must be
+ * detached with fbr_fd_detach once the connection is over, and in any case
+ * before it goes out of scope or fd is closed.
+ * @see fbr_fd_detach
+ */
+int fbr_fd_attach(FBR_P_ struct fbr_fd *fdh, int fd);
+
+/**
+ * Detaches a file descriptor from a persistent handle.
+ * @param [in] fdh handle initialized with fbr_fd_attach
+ *
+ * Stops the watchers and sets fd field to -1. Fibers that are waiting on the
+ * handle are woken up and fail with EBADF. The file descriptor itself is left
+ * open.
+ * @see fbr_fd_attach
+ */
+void fbr_fd_detach(FBR_P_ struct fbr_fd *fdh);
+
+/**
+ * Sets an idle timeout for a persistent handle.
+ * @param [in] fdh handle initialized with fbr_fd_attach
+ * @param [in] timeout seconds without successful I/O after which waiting on
+ * the handle fails, 0 disables the timeout
+ *
+ * Unlike fbr_read_wto and alike, which arm a timer each time they wait, the
+ * handle only records the time of its last successful I/O call. A single
+ * timer is armed when a fiber has to wait, and whenever it expires ahead of
+ * the deadline because of activity in between, it is moved to the new
+ * deadline rather than being restarted on every call. A busy connection thus
+ * costs no timer operations per request.
+ *
+ * Once the deadline passes, fibers waiting on the handle and those about to
+ * wait fail with ETIMEDOUT, until successful I/O or another call to this
+ * function resets the deadline. The timeout applies to all fbr_fd_* I/O
+ * wrappers.
+ * @see fbr_fd_attach
+ */
+void fbr_fd_set_idle_timeout(FBR_P_ struct fbr_fd *fdh, ev_tstamp timeout);
+
+/**
+ * Fiber friendly libc read wrapper for a persistent handle.
+ * @param [in] fdh handle initialized with fbr_fd_attach
+ * @param [in] buf pointer to some user-allocated buffer
+ * @param [in] count maximum number of bytes to read
+ * @return number of bytes read on success, -1 in case of error and errno set
+ *
+ * Behaves like fbr_read, but waits on the persistent watcher of the handle.
+ * Several fibers may wait on the same handle at once.
+ * @see fbr_read
+ * @see fbr_fd_attach
+ */
+ssize_t fbr_fd_read(FBR_P_ struct fbr_fd *fdh, void *buf, size_t count);
+
+/**
+ * Fiber friendly libc write wrapper for a persistent handle.
+ * @param [in] fdh handle initialized with fbr_fd_attach
+ * @param [in] buf pointer to some user-allocated buffer
+ * @param [in] count maximum number of bytes to write
+ * @return number of bytes written on success, -1 in case of error and errno
+ * set
+ * @see fbr_write
+ * @see fbr_fd_attach
+ */
+ssize_t fbr_fd_write(FBR_P_ struct fbr_fd *fdh, const void *buf,
+		size_t count);
+
+/**
+ * Reads exactly count bytes from a persistent handle.
+ * @param [in] fdh handle initialized with fbr_fd_attach
+ * @param [in] buf pointer to some user-allocated buffer
+ * @param [in] count number of bytes to read
+ * @return number of bytes read, which is less than count only on EOF, or -1 in
+ * case of error and errno set
+ * @see fbr_read_all
+ */
+ssize_t fbr_fd_read_all(FBR_P_ struct fbr_fd *fdh, void *buf, size_t count);
+
+/**
+ * Writes exactly count bytes to a persistent handle.
+ * @param [in] fdh handle initialized with fbr_fd_attach
+ * @param [in] buf pointer to some user-allocated buffer
+ * @param [in] count number of bytes to write
+ * @return number of bytes written on success, -1 in case of error and errno
+ * set
+ * @see fbr_write_all
+ */
+ssize_t fbr_fd_write_all(FBR_P_ struct fbr_fd *fdh, const void *buf,
+		size_t count);
+
+/**
+ * Fiber friendly libc recv wrapper for a persistent handle.
+ * @param [in] fdh handle of a socket initialized with fbr_fd_attach
+ * @param [in] buf pointer to some user-allocated buffer
+ * @param [in] len maximum number of bytes to read
+ * @param [in] flags just flags, see man recv for details
+ * @return number of bytes read on success, -1 in case of error and errno set
+ * @see fbr_recv
+ */
+ssize_t fbr_fd_recv(FBR_P_ struct fbr_fd *fdh, void *buf, size_t len,
+		int flags);
+
+/**
+ * Fiber friendly libc send wrapper for a persistent handle.
+ * @param [in] fdh handle of a socket initialized with fbr_fd_attach
+ * @param [in] buf pointer to some user-allocated buffer
+ * @param [in] len maximum number of bytes to write
+ * @param [in] flags just flags, see man send for details
+ * @return number of bytes written on success, -1 in case of error and errno
+ * set
+ * @see fbr_send
+ */
+ssize_t fbr_fd_send(FBR_P_ struct fbr_fd *fdh, const void *buf, size_t len,
+		int flags);
+
+/**
+ * Fiber friendly libc accept wrapper for a persistent handle.
+ * @param [in] fdh handle of a listening socket initialized with fbr_fd_attach
+ * @param [in] addr client address
+ * @param [in] addrlen size of addr
+ * @return client socket fd on success, -1 in case of error and errno set
+ * @see fbr_accept
+ */
+int fbr_fd_accept(FBR_P_ struct fbr_fd *fdh, struct sockaddr *addr,
+		socklen_t *addrlen);
+
+/**
+ * Puts current fiber to sleep.
+ * @param [in] seconds maximum number of seconds to sleep
+ * @return number of seconds actually being asleep
+ *
+ * This function is used to put current fiber into sleep. It will wake up after
+ * the desired time has passed or earlier if some other fiber has called it.
+ */
+ev_tstamp fbr_sleep(FBR_P_ ev_tstamp seconds);
 
 /**
  * Waits for an async libev event.
  * @param [in] w ev_async watcher (initialized by caller)
+ * @returns -1 on error with f_errno set, 0 upon success
  *
  * This function will cause the calling fiber to wait until an
  * ev_async_send() has been triggered on the specified ev_async watcher.
  */
-void fbr_async_wait(FBR_P_ ev_async *w);
+int fbr_async_wait(FBR_P_ ev_async *w);
 
 /**
  * Prints fiber call stack to stderr.
@@ -1448,16 +2475,18 @@ void fbr_mutex_init(FBR_P_ struct fbr_mutex *mutex);
 /**
  * Locks a mutex.
  * @param [in] mutex pointer to a mutex
+ * @returns -1 on error with f_errno set, 0 upon success
  *
  * Attempts to lock a mutex. If mutex is already locked then the calling fiber
- * is suspended until the mutex is eventually freed.
+ * is suspended until the mutex is eventually freed. Locking fails only if the
+ * wait is cut short by the deadline or cancellation of the fiber.
  *
  * @see fbr_mutex_init
  * @see fbr_mutex_trylock
  * @see fbr_mutex_unlock
  * @see fbr_mutex_destroy
  */
-void fbr_mutex_lock(FBR_P_ struct fbr_mutex *mutex);
+int fbr_mutex_lock(FBR_P_ struct fbr_mutex *mutex);
 
 /**
  * Tries to locks a mutex.
@@ -1479,7 +2508,8 @@ int fbr_mutex_trylock(FBR_P_ struct fbr_mutex *mutex);
  * @param [in] mutex pointer to a mutex
  *
  * Unlocks the given mutex. An other fiber that is waiting for it (if any) will
- * be called upon next libev loop iteration.
+ * be put into the run queue and called before the event loop polls for events
+ * next time.
  *
  * @see fbr_mutex_init
  * @see fbr_mutex_lock
@@ -1535,7 +2565,8 @@ void fbr_cond_destroy(FBR_P_ struct fbr_cond_var *cond);
  *
  * A mutex must be acquired by the calling fiber prior to waiting for a
  * condition. Internally mutex is released and reacquired again before
- * returning. Upon successful return calling fiber will hold the mutex.
+ * returning. Upon return calling fiber will hold the mutex, even if the wait
+ * failed because of the deadline or cancellation of the fiber.
  *
  * @see fbr_cond_init
  * @see fbr_cond_destroy
@@ -1548,7 +2579,8 @@ int fbr_cond_wait(FBR_P_ struct fbr_cond_var *cond, struct fbr_mutex *mutex);
  * Broadcasts a signal to all fibers waiting for condition.
  *
  * All fibers waiting for a condition will be added to run queue (and will
- * eventually be run, one per event loop iteration).
+ * be run in a single batch before the event loop polls for events next
+ * time).
  *
  * @see fbr_cond_init
  * @see fbr_cond_destroy
@@ -1561,7 +2593,7 @@ void fbr_cond_broadcast(FBR_P_ struct fbr_cond_var *cond);
  * Signals to first fiber waiting for a condition.
  *
  * Exactly one fiber (first one) waiting for a condition will be added to run
- * queue (and will eventually be run, one per event loop iteration).
+ * queue (and will be run before the event loop polls for events next time).
  *
  * @see fbr_cond_init
  * @see fbr_cond_destroy
@@ -1570,6 +2602,235 @@ void fbr_cond_broadcast(FBR_P_ struct fbr_cond_var *cond);
  */
 void fbr_cond_signal(FBR_P_ struct fbr_cond_var *cond);
 
+/**
+ * Initializes a reader-writer lock.
+ * @param [in] rwlock a lock structure to initialize
+ * @see fbr_rwlock
+ * @see fbr_rwlock_destroy
+ */
+void fbr_rwlock_init(FBR_P_ struct fbr_rwlock *rwlock);
+
+/**
+ * Locks a reader-writer lock for reading.
+ * @param [in] rwlock pointer to a lock
+ * @returns -1 on error with f_errno set, 0 upon success
+ *
+ * Shares the lock with other readers. The calling fiber is suspended while
+ * the lock is held by a writer or some writer is waiting for it. Fails only
+ * if the wait is cut short by the deadline or cancellation of the fiber.
+ * @see fbr_rwlock_unlock
+ * @see fbr_rwlock_tryrdlock
+ * @see fbr_rwlock_rdlock_wto
+ */
+int fbr_rwlock_rdlock(FBR_P_ struct fbr_rwlock *rwlock);
+
+/**
+ * Locks a reader-writer lock for writing.
+ * @param [in] rwlock pointer to a lock
+ * @returns -1 on error with f_errno set, 0 upon success
+ *
+ * The calling fiber is suspended until all the current holders release the
+ * lock and the writers that came earlier are done with it.
+ * @see fbr_rwlock_unlock
+ * @see fbr_rwlock_trywrlock
+ * @see fbr_rwlock_wrlock_wto
+ */
+int fbr_rwlock_wrlock(FBR_P_ struct fbr_rwlock *rwlock);
+
+/**
+ * Tries to lock a reader-writer lock for reading.
+ * @param [in] rwlock pointer to a lock
+ * @returns 1 if lock was successful, 0 otherwise
+ * @see fbr_rwlock_rdlock
+ */
+int fbr_rwlock_tryrdlock(FBR_P_ struct fbr_rwlock *rwlock);
+
+/**
+ * Tries to lock a reader-writer lock for writing.
+ * @param [in] rwlock pointer to a lock
+ * @returns 1 if lock was successful, 0 otherwise
+ * @see fbr_rwlock_wrlock
+ */
+int fbr_rwlock_trywrlock(FBR_P_ struct fbr_rwlock *rwlock);
+
+/**
+ * Locks a reader-writer lock for reading with a timeout.
+ * @param [in] rwlock pointer to a lock
+ * @param [in] timeout maximum number of seconds to wait
+ * @returns -1 on error with f_errno set, 0 upon success
+ *
+ * Same as fbr_rwlock_rdlock, but gives up with FBR_ETIMEDOUT (and errno set
+ * to ETIMEDOUT) once the timeout expires.
+ * @see fbr_rwlock_rdlock
+ */
+int fbr_rwlock_rdlock_wto(FBR_P_ struct fbr_rwlock *rwlock,
+		ev_tstamp timeout);
+
+/**
+ * Locks a reader-writer lock for writing with a timeout.
+ * @param [in] rwlock pointer to a lock
+ * @param [in] timeout maximum number of seconds to wait
+ * @returns -1 on error with f_errno set, 0 upon success
+ *
+ * Same as fbr_rwlock_wrlock, but gives up with FBR_ETIMEDOUT (and errno set
+ * to ETIMEDOUT) once the timeout expires. Readers that queued up behind the
+ * writer are let in if it gives up.
+ * @see fbr_rwlock_wrlock
+ */
+int fbr_rwlock_wrlock_wto(FBR_P_ struct fbr_rwlock *rwlock,
+		ev_tstamp timeout);
+
+/**
+ * Unlocks a reader-writer lock.
+ * @param [in] rwlock pointer to a lock
+ *
+ * Releases the lock held by the calling fiber either for reading or for
+ * writing. Once the last holder is gone, the lock is passed to the first
+ * waiting writer, or else to all the waiting readers at once.
+ * @see fbr_rwlock_rdlock
+ * @see fbr_rwlock_wrlock
+ */
+void fbr_rwlock_unlock(FBR_P_ struct fbr_rwlock *rwlock);
+
+/**
+ * Destroys a reader-writer lock.
+ * @param [in] rwlock pointer to a lock
+ *
+ * The lock must not be held or waited for.
+ * @see fbr_rwlock_init
+ */
+void fbr_rwlock_destroy(FBR_P_ struct fbr_rwlock *rwlock);
+
+/**
+ * Initializes a counting semaphore.
+ * @param [in] sem a semaphore structure to initialize
+ * @param [in] value initial number of permits
+ * @see fbr_sem
+ * @see fbr_sem_destroy
+ */
+void fbr_sem_init(FBR_P_ struct fbr_sem *sem, unsigned value);
+
+/**
+ * Acquires permits from a semaphore.
+ * @param [in] sem pointer to a semaphore
+ * @param [in] count number of permits to acquire
+ * @returns -1 on error with f_errno set, 0 upon success
+ *
+ * The calling fiber is suspended until count permits are available and all
+ * the fibers that came earlier have been served. Fails only if the wait is
+ * cut short by the deadline or cancellation of the fiber.
+ * @see fbr_sem_release
+ * @see fbr_sem_tryacquire
+ * @see fbr_sem_acquire_wto
+ */
+int fbr_sem_acquire(FBR_P_ struct fbr_sem *sem, unsigned count);
+
+/**
+ * Tries to acquire permits from a semaphore.
+ * @param [in] sem pointer to a semaphore
+ * @param [in] count number of permits to acquire
+ * @returns 1 if the permits were acquired, 0 otherwise
+ * @see fbr_sem_acquire
+ */
+int fbr_sem_tryacquire(FBR_P_ struct fbr_sem *sem, unsigned count);
+
+/**
+ * Acquires permits from a semaphore with a timeout.
+ * @param [in] sem pointer to a semaphore
+ * @param [in] count number of permits to acquire
+ * @param [in] timeout maximum number of seconds to wait
+ * @returns -1 on error with f_errno set, 0 upon success
+ *
+ * Same as fbr_sem_acquire, but gives up with FBR_ETIMEDOUT (and errno set to
+ * ETIMEDOUT) once the timeout expires.
+ * @see fbr_sem_acquire
+ */
+int fbr_sem_acquire_wto(FBR_P_ struct fbr_sem *sem, unsigned count,
+		ev_tstamp timeout);
+
+/**
+ * Releases permits to a semaphore.
+ * @param [in] sem pointer to a semaphore
+ * @param [in] count number of permits to release
+ *
+ * Waiting fibers are added to the run queue in order for as long as the
+ * permits available are enough for them.
+ * @see fbr_sem_acquire
+ */
+void fbr_sem_release(FBR_P_ struct fbr_sem *sem, unsigned count);
+
+/**
+ * Destroys a semaphore.
+ * @param [in] sem pointer to a semaphore
+ *
+ * The semaphore must not be waited for.
+ * @see fbr_sem_init
+ */
+void fbr_sem_destroy(FBR_P_ struct fbr_sem *sem);
+
+/**
+ * Initializes a wait group.
+ * @param [in] wg a wait group structure to initialize
+ * @see fbr_waitgroup
+ * @see fbr_waitgroup_destroy
+ */
+void fbr_waitgroup_init(FBR_P_ struct fbr_waitgroup *wg);
+
+/**
+ * Adds outstanding work to a wait group.
+ * @param [in] wg pointer to a wait group
+ * @param [in] count number of pieces of work to add
+ *
+ * Normally called before the child fibers are created.
+ * @see fbr_waitgroup_done
+ */
+void fbr_waitgroup_add(FBR_P_ struct fbr_waitgroup *wg, unsigned count);
+
+/**
+ * Marks a piece of work in a wait group as done.
+ * @param [in] wg pointer to a wait group
+ *
+ * Once the counter drops to zero, all the waiting fibers are added to the
+ * run queue.
+ * @see fbr_waitgroup_add
+ * @see fbr_waitgroup_wait
+ */
+void fbr_waitgroup_done(FBR_P_ struct fbr_waitgroup *wg);
+
+/**
+ * Waits for a wait group.
+ * @param [in] wg pointer to a wait group
+ * @returns -1 on error with f_errno set, 0 upon success
+ *
+ * Returns immediately if there's no outstanding work, otherwise suspends the
+ * calling fiber until the counter drops to zero. Fails only if the wait is
+ * cut short by the deadline or cancellation of the fiber.
+ * @see fbr_waitgroup_wait_wto
+ */
+int fbr_waitgroup_wait(FBR_P_ struct fbr_waitgroup *wg);
+
+/**
+ * Waits for a wait group with a timeout.
+ * @param [in] wg pointer to a wait group
+ * @param [in] timeout maximum number of seconds to wait
+ * @returns -1 on error with f_errno set, 0 upon success
+ *
+ * Same as fbr_waitgroup_wait, but gives up with FBR_ETIMEDOUT (and errno set
+ * to ETIMEDOUT) once the timeout expires.
+ * @see fbr_waitgroup_wait
+ */
+int fbr_waitgroup_wait_wto(FBR_P_ struct fbr_waitgroup *wg,
+		ev_tstamp timeout);
+
+/**
+ * Destroys a wait group.
+ * @param [in] wg pointer to a wait group
+ *
+ * The wait group must not be waited for.
+ * @see fbr_waitgroup_init
+ */
+void fbr_waitgroup_destroy(FBR_P_ struct fbr_waitgroup *wg);
+
 /**
  * Initializes memory mappings.
  * @param [in] vrb a pointer to fbr_vrb
@@ -1581,8 +2842,16 @@ void fbr_cond_signal(FBR_P_ struct fbr_cond_var *cond);
  * correspond to the same physical memory region. Also it adds two page-sized
  * regions on the left and on the right with PROT_NONE access as a guards.
  *
- * It does mmaps on the same file, which is unlinked and closed afterwards, so
- * it will not pollute file descriptor space of a process and the filesystem.
+ * It does mmaps on the same anonymous memory file (see memfd_create(2)), or
+ * where that is not supported, on a temporary file created after
+ * file_pattern. The temporary file is unlinked right away so it will not
+ * pollute the filesystem.
+ *
+ * Note that the descriptor stays open until fbr_vrb_destroy to allow
+ * fbr_vrb_resize to grow the file in place, so every live vrb costs one file
+ * descriptor of the process. Applications keeping many of them, directly or
+ * through fbr_buffer and fbr_reader, should account for that in
+ * RLIMIT_NOFILE.
  *
  * @see struct fbr_vrb
  * @see fbr_vrb_destroy
@@ -1723,7 +2992,8 @@ static inline void fbr_vrb_reset(struct fbr_vrb *vrb)
 	vrb->space_ptr = vrb->lower_ptr;
 }
 
-/* Private function */
+/* Private function, unlike fbr_vrb_resize also shrinks the vrb down to the
+ * length of the data it holds */
 int fbr_vrb_resize_do(struct fbr_vrb *vrb, size_t new_size,
 		const char *file_pattern);
 
@@ -1734,9 +3004,15 @@ int fbr_vrb_resize_do(struct fbr_vrb *vrb, size_t new_size,
  * @param [in] file_pattern file name patterm for underlying mmap storage
  * @returns 0 on succes, -1 on error.
  *
- * This function does new mappings and copies the data over. Old mappings will
- * be destroyed and all pointers to old data will be invalid after this
- * operation.
+ * This function grows the backing file and remaps both halves over the
+ * reserved address range. It does nothing if the vrb can already hold
+ * new_size bytes, a vrb is never shrunk by it. Growing keeps the lower half in
+ * place when the address space after the reservation is free, otherwise the
+ * mappings are moved with mremap(2). Data is copied only when it wraps around
+ * the end of the ring, and then only the shorter of the two parts.
+ *
+ * Pointers into the vrb may be invalid after this operation. If remapping
+ * fails halfway, the vrb should be destroyed.
  *
  * @see struct fbr_vrb
  * @see fbr_vrb_init
@@ -1744,21 +3020,9 @@ int fbr_vrb_resize_do(struct fbr_vrb *vrb, size_t new_size,
 static inline int fbr_vrb_resize(struct fbr_vrb *vrb, size_t new_size,
 		const char *file_pattern)
 {
-	struct fbr_vrb tmp;
-	int rv;
 	if (fbr_vrb_capacity(vrb) >= new_size)
 		return 0;
-	memcpy(&tmp, vrb, sizeof(tmp));
-	rv = fbr_vrb_init(vrb, new_size, file_pattern);
-	if (rv) {
-		memcpy(vrb, &tmp, sizeof(tmp));
-		return rv;
-	}
-	memcpy(fbr_vrb_space_ptr(vrb), fbr_vrb_data_ptr(&tmp),
-			fbr_vrb_data_len(&tmp));
-	fbr_vrb_give(vrb, fbr_vrb_data_len(&tmp));
-	fbr_vrb_destroy(&tmp);
-	return 0;
+	return fbr_vrb_resize_do(vrb, new_size, file_pattern);
 }
 
 
@@ -1772,6 +3036,10 @@ static inline int fbr_vrb_resize(struct fbr_vrb *vrb, size_t new_size,
  * read what you have written. The buffer will occupy size rounded up to page
  * size in physical memory, while occupying twice this size in virtual process
  * memory due to usage of two mirrored adjacent mmaps.
+ *
+ * The underlying fbr_vrb holds an open file descriptor for as long as the
+ * buffer lives, and afterwards while its mappings are cached, see
+ * fbr_vrb_init and fbr_set_buffer_cache_size.
  */
 int fbr_buffer_init(FBR_P_ struct fbr_buffer *buffer, size_t size);
 
@@ -1897,10 +3165,12 @@ void fbr_buffer_destroy(FBR_P_ struct fbr_buffer *buffer);
  * Prepares a chunk of memory to be committed to buffer.
  * @param [in] buffer a pointer to fbr_buffer
  * @param [in] size required size
- * @returns pointer to memory reserved for commit.
+ * @returns pointer to memory reserved for commit, NULL on error with f_errno
+ * set.
  *
  * This function reserves a chunk of memory (or waits until there is one
- * available, blocking current fiber) and returns pointer to it.
+ * available, blocking current fiber) and returns pointer to it. The wait fails
+ * if the deadline of the fiber passes or it gets cancelled.
  *
  * A fiber trying to reserve a chunk of memory after some other fiber already
  * reserved it leads to the former fiber being blocked until the latter one
@@ -1935,7 +3205,7 @@ void fbr_buffer_alloc_abort(FBR_P_ struct fbr_buffer *buffer);
  * Aborts a chunk of memory in the buffer.
  * @param [in] buffer a pointer to fbr_buffer
  * @param [in] size number of bytes required
- * @returns read address containing size bytes
+ * @returns read address containing size bytes, NULL on error with f_errno set
  *
  * This function reserves (or waits till data is available, blocking current
  * fiber) a chunk of memory for reading. While a chunk of memory is reserved
@@ -1968,17 +3238,59 @@ void fbr_buffer_read_advance(FBR_P_ struct fbr_buffer *buffer);
  */
 void fbr_buffer_read_discard(FBR_P_ struct fbr_buffer *buffer);
 
+/**
+ * Reads from a file descriptor straight into the buffer.
+ * @param [in] buffer a pointer to fbr_buffer
+ * @param [in] fd file descriptor to read from
+ * @param [in] max maximum number of bytes to read, 0 for all free space
+ * @returns number of bytes read, 0 on end of file, -1 on error with errno or
+ * f_errno set as by fbr_read.
+ *
+ * This function waits until the buffer has some free space and then does a
+ * single fbr_read into it, so no intermediate copy is needed. Thanks to the
+ * mirrored mapping the free space is always contiguous, even when it wraps
+ * around the end of the buffer.
+ *
+ * While waiting for the fd the space is reserved as with
+ * fbr_buffer_alloc_prepare, so other writers are blocked. Readers waiting on
+ * the buffer are woken up once the data is committed.
+ * @see fbr_buffer_drain_to_fd
+ * @see fbr_read
+ */
+ssize_t fbr_buffer_fill_from_fd(FBR_P_ struct fbr_buffer *buffer, int fd,
+		size_t max);
+
+/**
+ * Writes buffer contents straight to a file descriptor.
+ * @param [in] buffer a pointer to fbr_buffer
+ * @param [in] fd file descriptor to write to
+ * @param [in] max maximum number of bytes to write, 0 for all available data
+ * @returns number of bytes written, -1 on error with errno or f_errno set as
+ * by fbr_write.
+ *
+ * This function waits until the buffer has some data and then does a single
+ * fbr_write of it. Written bytes are removed from the buffer and writers
+ * waiting for free space are woken up. Like fbr_buffer_read_address, it holds
+ * the read side of the buffer while waiting for the fd.
+ * @see fbr_buffer_fill_from_fd
+ * @see fbr_write
+ */
+ssize_t fbr_buffer_drain_to_fd(FBR_P_ struct fbr_buffer *buffer, int fd,
+		size_t max);
+
 /**
  * Resizes the buffer.
  * @param [in] buffer a pointer to fbr_buffer
  * @param [in] size a new buffer length
  * @returns 0 on success, -1 on error.
  *
- * This function allocates new memory mapping of sufficient size and copies the
- * content of a buffer into it. Old mapping is destroyed.
+ * This function resizes the underlying fbr_vrb in place, see fbr_vrb_resize.
+ * Unlike fbr_vrb_resize it also shrinks: a smaller size returns memory to the
+ * system after a burst, but the buffer is never shrunk below the amount of
+ * data it holds.
  *
- * This operation is expensive and involves several syscalls, so it is
- * beneficiary to allocate a buffer of siffucuent size from the start.
+ * This operation involves several syscalls, so it is beneficiary to allocate
+ * a buffer of sufficient size from the start.
  *
  * This function acquires both read and write mutex, and may block until read
  * or write operation has finished.
@@ -2091,16 +3403,352 @@ static inline int fbr_buffer_can_write(FBR_P_ struct fbr_buffer *buffer,
 	return fbr_buffer_free_bytes(FBR_A_ buffer) >= size;
 }
 
+/**
+ * Initializes a buffered reader.
+ * @param [in] reader fbr_reader structure to initialize
+ * @param [in] fdh handle to read from, initialized with fbr_fd_attach
+ * @param [in] size size of the ring, also the maximum length of a single
+ * piece returned by the reader
+ * @returns 0 on success, -1 on error with f_errno set
+ *
+ * The reader does not own fdh, it has to be detached separately. Its ring is
+ * an fbr_vrb and holds a file descriptor of its own, see fbr_buffer_init.
+ * @see fbr_reader_destroy
+ */
+int fbr_reader_init(FBR_P_ struct fbr_reader *reader, struct fbr_fd *fdh,
+		size_t size);
+
+/**
+ * Destroys a buffered reader.
+ * @param [in] reader a pointer to fbr_reader
+ *
+ * Any data read ahead and not handed out yet is lost.
+ */
+void fbr_reader_destroy(FBR_P_ struct fbr_reader *reader);
+
+/**
+ * Reads up to and including a delimiter.
+ * @param [in] reader a pointer to fbr_reader
+ * @param [in] delim delimiter byte
+ * @param [out] ptr set to the start of the piece
+ * @returns length of the piece, 0 on EOF, -1 on error with f_errno set
+ *
+ * Calling fiber is blocked until the delimiter or EOF arrives. On EOF the
+ * rest of the data is returned without the delimiter. The piece is not
+ * copied anywhere: *ptr points into the ring and stays valid until the next
+ * call on this reader.
+ *
+ * FBR_EBUFFERNOSPACE is set if the ring fills up before the delimiter is
+ * found; FBR_ESYSTEM means read failed, see errno in this case.
+ * @see fbr_reader_readline
+ */
+ssize_t fbr_reader_read_until(FBR_P_ struct fbr_reader *reader, int delim,
+		void **ptr);
+
+/**
+ * Reads a line.
+ * @param [in] reader a pointer to fbr_reader
+ * @param [out] ptr set to the start of the line
+ * @returns length of the line including the newline, 0 on EOF, -1 on error
+ * with f_errno set
+ *
+ * Same as fbr_reader_read_until with a newline delimiter.
+ * @see fbr_reader_read_until
+ */
+ssize_t fbr_reader_readline(FBR_P_ struct fbr_reader *reader, void **ptr);
+
+/**
+ * Reads exactly n bytes.
+ * @param [in] reader a pointer to fbr_reader
+ * @param [in] n number of bytes to read
+ * @param [out] ptr set to the start of the data
+ * @returns n on success, less than n on EOF, -1 on error with f_errno set
+ *
+ * Pointer validity and error codes are the same as for fbr_reader_read_until;
+ * FBR_EINVAL is set if n exceeds the reader size.
+ * @see fbr_reader_read_until
+ */
+ssize_t fbr_reader_read_exact(FBR_P_ struct fbr_reader *reader, size_t n,
+		void **ptr);
+
 struct fbr_mq *fbr_mq_create(FBR_P_ size_t size, int flags);
-void fbr_mq_push(struct fbr_mq *mq, void *obj);
+int fbr_mq_push(struct fbr_mq *mq, void *obj);
 int fbr_mq_try_push(struct fbr_mq *mq, void *obj);
-void fbr_mq_wait_push(struct fbr_mq *mq);
+
+/**
+ * Pushes a batch of messages to a queue.
+ * @param [in] mq a pointer to fbr_mq
+ * @param [in] objs messages to push
+ * @param [in] n number of messages in objs
+ * @returns number of messages pushed, -1 on error with f_errno set
+ *
+ * Suspends the calling fiber until at least one message can be pushed, then
+ * pushes as many of them as fit without blocking any further. Waiting fibers
+ * are woken once per batch rather than once per message.
+ * @see fbr_mq_pop_many
+ */
+ssize_t fbr_mq_push_many(struct fbr_mq *mq, void **objs, size_t n);
+int fbr_mq_wait_push(struct fbr_mq *mq);
 void *fbr_mq_pop(struct fbr_mq *mq);
 int fbr_mq_try_pop(struct fbr_mq *mq, void **obj);
-void fbr_mq_wait_pop(struct fbr_mq *mq);
+
+/**
+ * Pops a batch of messages from a queue.
+ * @param [in] mq a pointer to fbr_mq
+ * @param [out] objs array to store the messages in
+ * @param [in] max size of objs
+ * @returns number of messages popped, -1 on error with f_errno set
+ *
+ * Suspends the calling fiber until at least one message is available, then
+ * pops up to max of them without blocking any further. Fibers waiting to
+ * push are let in once per batch rather than once per message.
+ * @see fbr_mq_push_many
+ */
+ssize_t fbr_mq_pop_many(struct fbr_mq *mq, void **objs, size_t max);
+int fbr_mq_wait_pop(struct fbr_mq *mq);
+
+/**
+ * Creates a message queue with inline payloads.
+ * @param [in] size maximum number of messages in the queue
+ * @param [in] elem_size size of every message in bytes
+ * @param [in] flags same as for fbr_mq_create
+ * @returns a pointer to fbr_mq, NULL on error with f_errno set
+ *
+ * Instead of pointers, messages of elem_size bytes are stored right in a
+ * contiguous cache line aligned ring, so they need no allocation of their
+ * own. Such a queue is used with fbr_mq_reserve/fbr_mq_commit and
+ * fbr_mq_peek/fbr_mq_release, or with the copying fbr_mq_push_data and
+ * fbr_mq_pop_data; pointer based push and pop functions and events are not
+ * supported for it. Both size and elem_size must be non-zero.
+ * @see fbr_mq_destroy
+ */
+struct fbr_mq *fbr_mq_create_inline(FBR_P_ size_t size, size_t elem_size,
+		int flags);
+
+/**
+ * Reserves space for a message in an inline queue.
+ * @param [in] mq a pointer to fbr_mq created by fbr_mq_create_inline
+ * @returns a pointer to elem_size bytes to fill in, NULL on error with
+ * f_errno set
+ *
+ * Suspends the calling fiber while the queue is full. The message becomes
+ * visible to consumers once fbr_mq_commit is called; there may only be one
+ * reservation per queue outstanding at a time, so the producer should not
+ * wait for anything in between.
+ * @see fbr_mq_commit
+ * @see fbr_mq_try_reserve
+ */
+void *fbr_mq_reserve(struct fbr_mq *mq);
+
+/**
+ * Reserves space for a message in an inline queue without blocking.
+ * @param [in] mq a pointer to fbr_mq created by fbr_mq_create_inline
+ * @returns a pointer to elem_size bytes to fill in, NULL if the queue is
+ * full
+ * @see fbr_mq_reserve
+ */
+void *fbr_mq_try_reserve(struct fbr_mq *mq);
+
+/**
+ * Publishes the message reserved with fbr_mq_reserve.
+ * @param [in] mq a pointer to fbr_mq created by fbr_mq_create_inline
+ * @see fbr_mq_reserve
+ */
+void fbr_mq_commit(struct fbr_mq *mq);
+
+/**
+ * Looks at the oldest message of an inline queue.
+ * @param [in] mq a pointer to fbr_mq created by fbr_mq_create_inline
+ * @returns a pointer to the message, NULL on error with f_errno set
+ *
+ * Suspends the calling fiber while the queue is empty. The message stays in
+ * the queue, and the pointer stays valid, until fbr_mq_release is called;
+ * just like with reservations, one consumer at a time is expected.
+ * @see fbr_mq_release
+ * @see fbr_mq_try_peek
+ */
+void *fbr_mq_peek(struct fbr_mq *mq);
+
+/**
+ * Looks at the oldest message of an inline queue without blocking.
+ * @param [in] mq a pointer to fbr_mq created by fbr_mq_create_inline
+ * @returns a pointer to the message, NULL if the queue is empty
+ * @see fbr_mq_peek
+ */
+void *fbr_mq_try_peek(struct fbr_mq *mq);
+
+/**
+ * Removes the message returned by fbr_mq_peek from the queue.
+ * @param [in] mq a pointer to fbr_mq created by fbr_mq_create_inline
+ * @see fbr_mq_peek
+ */
+void fbr_mq_release(struct fbr_mq *mq);
+
+/**
+ * Copies a message into an inline queue.
+ * @param [in] mq a pointer to fbr_mq created by fbr_mq_create_inline
+ * @param [in] data elem_size bytes of the message
+ * @returns 0 on success, -1 on error with f_errno set
+ * @see fbr_mq_reserve
+ */
+int fbr_mq_push_data(struct fbr_mq *mq, const void *data);
+
+/**
+ * Copies a message out of an inline queue.
+ * @param [in] mq a pointer to fbr_mq created by fbr_mq_create_inline
+ * @param [out] data buffer of elem_size bytes for the message
+ * @returns 0 on success, -1 on error with f_errno set
+ * @see fbr_mq_peek
+ */
+int fbr_mq_pop_data(struct fbr_mq *mq, void *data);
 void fbr_mq_clear(struct fbr_mq *mq, int wake_up_writers);
 void fbr_mq_destroy(struct fbr_mq *mq);
 
+struct fbr_pq;
+
+/**
+ * Creates a priority queue.
+ * @param [in] size maximum number of items in the queue, 0 for no limit
+ * @returns a pointer to fbr_pq, NULL on error with f_errno set
+ *
+ * Items are kept in a binary heap and popped lowest priority value first;
+ * items of equal priority come out in the order they were pushed. Blocking
+ * and signalling follow fbr_mq: a push wakes one fiber waiting to pop, and a
+ * pop wakes one fiber waiting to push.
+ * @see fbr_pq_destroy
+ */
+struct fbr_pq *fbr_pq_create(FBR_P_ size_t size);
+
+/**
+ * Pushes an item to a priority queue.
+ * @param [in] pq a pointer to fbr_pq
+ * @param [in] obj the item
+ * @param [in] priority the priority, lower values are popped first
+ * @returns 0 on success, -1 on error with f_errno set
+ *
+ * Suspends the calling fiber while the queue is full.
+ * @see fbr_pq_try_push
+ */
+int fbr_pq_push(struct fbr_pq *pq, void *obj, int priority);
+
+/**
+ * Pushes an item to a priority queue without blocking.
+ * @param [in] pq a pointer to fbr_pq
+ * @param [in] obj the item
+ * @param [in] priority the priority, lower values are popped first
+ * @returns 0 on success, -1 if the queue is full or on error with f_errno
+ * set
+ * @see fbr_pq_push
+ */
+int fbr_pq_try_push(struct fbr_pq *pq, void *obj, int priority);
+
+/**
+ * Pops the item with the lowest priority value from a priority queue.
+ * @param [in] pq a pointer to fbr_pq
+ * @returns the item, NULL on error with f_errno set
+ *
+ * Suspends the calling fiber while the queue is empty.
+ * @see fbr_pq_try_pop
+ */
+void *fbr_pq_pop(struct fbr_pq *pq);
+
+/**
+ * Pops an item from a priority queue without blocking.
+ * @param [in] pq a pointer to fbr_pq
+ * @param [out] obj set to the item
+ * @returns 0 on success, -1 if the queue is empty
+ * @see fbr_pq_pop
+ */
+int fbr_pq_try_pop(struct fbr_pq *pq, void **obj);
+
+/**
+ * Gets the number of items in a priority queue.
+ * @param [in] pq a pointer to fbr_pq
+ * @returns number of items
+ */
+size_t fbr_pq_count(struct fbr_pq *pq);
+
+/**
+ * Destroys a priority queue.
+ * @param [in] pq a pointer to fbr_pq
+ *
+ * Items left in the queue are not freed.
+ * @see fbr_pq_create
+ */
+void fbr_pq_destroy(struct fbr_pq *pq);
+
+struct fbr_delayq;
+
+/**
+ * Creates a delay queue.
+ * @param [in] size maximum number of items in the queue, 0 for no limit
+ * @returns a pointer to fbr_delayq, NULL on error with f_errno set
+ *
+ * Items become available for popping once their delay has passed, earliest
+ * due first. However many items are pending, the queue uses a single timer
+ * for the earliest of them. Blocking and signalling follow fbr_mq.
+ * @see fbr_delayq_destroy
+ */
+struct fbr_delayq *fbr_delayq_create(FBR_P_ size_t size);
+
+/**
+ * Pushes an item to a delay queue.
+ * @param [in] dq a pointer to fbr_delayq
+ * @param [in] obj the item
+ * @param [in] delay number of seconds from now the item becomes due in
+ * @returns 0 on success, -1 on error with f_errno set
+ *
+ * Suspends the calling fiber while the queue is full.
+ * @see fbr_delayq_try_push
+ */
+int fbr_delayq_push(struct fbr_delayq *dq, void *obj, ev_tstamp delay);
+
+/**
+ * Pushes an item to a delay queue without blocking.
+ * @param [in] dq a pointer to fbr_delayq
+ * @param [in] obj the item
+ * @param [in] delay number of seconds from now the item becomes due in
+ * @returns 0 on success, -1 if the queue is full or on error with f_errno
+ * set
+ * @see fbr_delayq_push
+ */
+int fbr_delayq_try_push(struct fbr_delayq *dq, void *obj, ev_tstamp delay);
+
+/**
+ * Pops the earliest due item from a delay queue.
+ * @param [in] dq a pointer to fbr_delayq
+ * @returns the item, NULL on error with f_errno set
+ *
+ * Suspends the calling fiber until some item is due.
+ * @see fbr_delayq_try_pop
+ */
+void *fbr_delayq_pop(struct fbr_delayq *dq);
+
+/**
+ * Pops a due item from a delay queue without blocking.
+ * @param [in] dq a pointer to fbr_delayq
+ * @param [out] obj set to the item
+ * @returns 0 on success, -1 if no item is due yet
+ * @see fbr_delayq_pop
+ */
+int fbr_delayq_try_pop(struct fbr_delayq *dq, void **obj);
+
+/**
+ * Gets the number of items in a delay queue, due or not.
+ * @param [in] dq a pointer to fbr_delayq
+ * @returns number of items
+ */
+size_t fbr_delayq_count(struct fbr_delayq *dq);
+
+/**
+ * Destroys a delay queue.
+ * @param [in] dq a pointer to fbr_delayq
+ *
+ * Items left in the queue are not freed.
+ * @see fbr_delayq_create
+ */
+void fbr_delayq_destroy(struct fbr_delayq *dq);
+
 /**
  * Gets fiber user data pointer.
  * @param [in] id fiber id
@@ -2194,7 +3842,8 @@ static inline pid_t fbr_popen0(FBR_P_ const char *filename, char *const argv[],
  * Waits for child process to finish.
  * @param [in] pid is the PID of the process to wait for
  * @returns the process exit/trace status caused by rpid (see your systems
- * waitpid and sys/wait.h documentation for details)
+ * waitpid and sys/wait.h documentation for details), -1 if the wait was cut
+ * short by the deadline or cancellation of the fiber
  *
  * This function is basically a fiber wrapper for ev_child watcher. It's worth
  * reading the libev documentation for ev_child to fully understand the
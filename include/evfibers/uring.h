@@ -0,0 +1,293 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#ifndef _FBR_URING_H_
+#define _FBR_URING_H_
+/**
+ * @file evfibers/uring.h
+ * This file contains API for io_uring based fiber wrappers.
+ *
+ * Operations are submitted to a per-context io_uring instance and the calling
+ * fiber sleeps until the completion arrives. Completions are reaped in the
+ * event loop via an eventfd registered with the ring, so unlike libeio no
+ * thread pool is involved. Submissions made by fibers during one loop
+ * iteration are passed to the kernel with a single system call before the
+ * loop blocks.
+ *
+ * Wrappers return what the corresponding system call would, or -1 with
+ * f_errno set to FBR_ESYSTEM and errno set to the error reported by the
+ * kernel. An offset of -1 for read and write means the current file
+ * position, which is advanced as with read(2) and write(2).
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <evfibers/config.h>
+#ifndef FBR_URING_ENABLED
+# error "This build of libevfibers lacks support for io_uring"
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+#include <evfibers/fiber.h>
+
+/**
+ * Default number of submission queue entries of the ring.
+ * @see fbr_uring_init
+ */
+#define FBR_URING_ENTRIES 256
+
+/**
+ * io_uring completion event.
+ *
+ * This event struct represents an operation submitted with
+ * fbr_uring_get_sqe. It arrives once the completion is there, and can be
+ * waited for with fbr_ev_wait together with other events.
+ * @see fbr_ev_uring_init
+ * @see fbr_uring_get_sqe
+ * @see fbr_ev_wait
+ */
+struct fbr_ev_uring {
+	int res; /*!< result of the operation, negated errno on failure */
+	unsigned flags; /*!< IORING_CQE_F_* flags of the completion */
+	void *req; //Private
+	struct fbr_destructor dtor; //Private
+	struct fbr_ev_base ev_base;
+};
+
+/**
+ * Initializer for io_uring event.
+ *
+ * This functions properly initializes fbr_ev_uring struct. You should not do
+ * it manually.
+ * @see fbr_ev_uring
+ * @see fbr_ev_wait
+ */
+void fbr_ev_uring_init(FBR_P_ struct fbr_ev_uring *ev);
+
+/**
+ * Initialization routine for io_uring fiber wrappers.
+ * @param [in] entries size of the submission queue, 0 means
+ * FBR_URING_ENTRIES
+ * @returns 0 on success, -1 on error with f_errno set
+ *
+ * Sets up an io_uring instance for the context and registers an eventfd for
+ * its completions with the event loop. FBR_ESYSTEM is set if the kernel
+ * refuses to create the ring (see errno), FBR_EINVAL if the context already
+ * has one. The ring is torn down by fbr_destroy.
+ */
+int fbr_uring_init(FBR_P_ unsigned entries);
+
+/**
+ * Obtains a submission queue entry for an event.
+ * @param [in] ev event initialized with fbr_ev_uring_init
+ * @returns zeroed submission queue entry, or NULL on error with f_errno set
+ *
+ * Fill in the opcode and arguments of the operation, but leave user_data
+ * alone: it ties the completion to ev. The entry is submitted to the kernel
+ * before the event loop blocks next time. ev must then be waited for until it
+ * arrives; if the fiber is reclaimed earlier, the operation is cancelled.
+ * Memory passed to the kernel must stay valid until the completion, which
+ * is not guaranteed for fiber stack after reclaim when the operation is
+ * already being executed, so use heap memory for operations that may get
+ * cancelled this way.
+ *
+ * FBR_EINVAL is set if fbr_uring_init has not been called for the context.
+ * @see fbr_ev_uring
+ */
+struct io_uring_sqe *fbr_uring_get_sqe(FBR_P_ struct fbr_ev_uring *ev);
+
+/**
+ * Waits for the next completion of an operation.
+ * @param [in] ev event with an operation submitted
+ * @returns non-negative result of the operation, or -1 with f_errno set
+ *
+ * A failed operation sets f_errno to FBR_ESYSTEM and errno to the error
+ * reported by the kernel. ev->flags holds the flags of the completion, and
+ * IORING_CQE_F_MORE among them means that the operation stays armed and ev
+ * may be waited for again. Otherwise ev may be reused for a new operation.
+ *
+ * FBR_EINVAL is set if ev has no operation submitted. If the wait fails
+ * because of the deadline or cancellation of the fiber, the operation is
+ * cancelled and waited for, without being interruptible, until the kernel is
+ * done with it, so that its buffers may be reused or freed as soon as this
+ * returns. Whatever it still completes with is thrown away, which includes
+ * closing file descriptors it has produced.
+ * @see fbr_uring_get_sqe
+ */
+int fbr_uring_wait(FBR_P_ struct fbr_ev_uring *ev);
+
+/**
+ * Cancels an operation.
+ * @param [in] ev event with an operation submitted
+ *
+ * Detaches ev from its operation and asks the kernel to cancel it, which is
+ * what happens when a fiber gets reclaimed while having operations in
+ * flight. ev may be reused right away. File descriptors and provided
+ * buffers from the completions that are not going to be consumed are
+ * released. Does nothing if ev has no operation submitted.
+ *
+ * Should be called by the fiber that has submitted the operation, typically
+ * to stop a multishot one.
+ * @see fbr_uring_accept_multishot
+ */
+void fbr_uring_cancel(FBR_P_ struct fbr_ev_uring *ev);
+
+ssize_t fbr_uring_read(FBR_P_ int fd, void *buf, size_t count, off_t offset);
+ssize_t fbr_uring_write(FBR_P_ int fd, const void *buf, size_t count,
+		off_t offset);
+int fbr_uring_fsync(FBR_P_ int fd, int datasync);
+int fbr_uring_open(FBR_P_ const char *path, int flags, mode_t mode);
+int fbr_uring_close(FBR_P_ int fd);
+int fbr_uring_stat(FBR_P_ const char *path, struct stat *buf);
+int fbr_uring_fstat(FBR_P_ int fd, struct stat *buf);
+
+ssize_t fbr_uring_recv(FBR_P_ int sockfd, void *buf, size_t len, int flags);
+ssize_t fbr_uring_send(FBR_P_ int sockfd, const void *buf, size_t len,
+		int flags);
+int fbr_uring_accept(FBR_P_ int sockfd, struct sockaddr *addr,
+		socklen_t *addrlen);
+int fbr_uring_connect(FBR_P_ int sockfd, const struct sockaddr *addr,
+		socklen_t addrlen);
+
+/**
+ * Timed out version of fbr_uring_send.
+ * @param [in] timeout in seconds to wait for the data to be sent
+ *
+ * The send is linked with a timeout in the ring, so no timer of the event
+ * loop is involved. Errno is set to ETIMEDOUT when timeout occurs, in which
+ * case nothing has been sent.
+ * @see fbr_uring_send
+ */
+ssize_t fbr_uring_send_wto(FBR_P_ int sockfd, const void *buf, size_t len,
+		int flags, ev_tstamp timeout);
+
+/**
+ * Timed out version of fbr_uring_recv.
+ * @param [in] timeout in seconds to wait for the data
+ *
+ * Errno is set to ETIMEDOUT when timeout occurs.
+ * @see fbr_uring_send_wto
+ */
+ssize_t fbr_uring_recv_wto(FBR_P_ int sockfd, void *buf, size_t len,
+		int flags, ev_tstamp timeout);
+
+/**
+ * Timed out version of fbr_uring_connect.
+ * @param [in] timeout in seconds to wait for the connection
+ *
+ * Errno is set to ETIMEDOUT when timeout occurs.
+ * @see fbr_uring_send_wto
+ */
+int fbr_uring_connect_wto(FBR_P_ int sockfd, const struct sockaddr *addr,
+		socklen_t addrlen, ev_tstamp timeout);
+
+#ifdef FBR_HAVE_URING_MULTISHOT
+
+/**
+ * Arms multishot accept on a listening socket.
+ * @param [in] ev event initialized with fbr_ev_uring_init
+ * @param [in] sockfd listening socket
+ * @returns 0 on success, -1 on error with f_errno set
+ *
+ * A single submission keeps accepting connections until cancelled or until
+ * it fails. Each connection arrives as a completion of ev, so fbr_uring_wait
+ * returns the next accepted socket. Stop accepting with fbr_uring_cancel,
+ * which also closes the sockets accepted but not yet waited for.
+ *
+ * Requires Linux 5.19, older kernels fail the first wait with EINVAL.
+ * @see fbr_uring_wait
+ * @see fbr_uring_cancel
+ */
+int fbr_uring_accept_multishot(FBR_P_ struct fbr_ev_uring *ev, int sockfd);
+
+/**
+ * Ring of buffers provided to the kernel.
+ *
+ * Receive operations selecting a buffer from the ring take one only once
+ * the data is there, so a buffer per idle connection is not needed. Buffers
+ * go back to the ring with fbr_uring_buf_put.
+ * @see fbr_uring_buf_ring_init
+ * @see fbr_uring_recv_buf
+ */
+struct fbr_uring_buf_ring {
+	void *ring; //Private
+	size_t ring_size; //Private
+	void *bufs; //Private
+	size_t buf_size; /*!< size of each buffer */
+	unsigned entries; /*!< number of buffers */
+	unsigned short tail; //Private
+	unsigned short bgid; /*!< buffer group id */
+};
+
+/**
+ * Registers a ring of provided buffers.
+ * @param [in] ring ring to initialize
+ * @param [in] bgid buffer group id, unique within the context
+ * @param [in] entries number of buffers, a power of two up to 32768
+ * @param [in] buf_size size of each buffer
+ * @returns 0 on success, -1 on error with f_errno set
+ *
+ * Sets FBR_EINVAL for invalid arguments or if fbr_uring_init has not been
+ * called, FBR_ESYSTEM if memory allocation or registration has failed
+ * (requires Linux 5.19).
+ */
+int fbr_uring_buf_ring_init(FBR_P_ struct fbr_uring_buf_ring *ring,
+		unsigned short bgid, unsigned entries, size_t buf_size);
+
+/**
+ * Unregisters and frees a ring of provided buffers.
+ * @param [in] ring ring to destroy
+ *
+ * No operation selecting from the ring may be in flight.
+ */
+void fbr_uring_buf_ring_destroy(FBR_P_ struct fbr_uring_buf_ring *ring);
+
+/**
+ * Returns a buffer to the ring.
+ * @param [in] ring ring the buffer belongs to
+ * @param [in] buf buffer obtained from fbr_uring_recv_buf
+ */
+void fbr_uring_buf_put(FBR_P_ struct fbr_uring_buf_ring *ring, void *buf);
+
+/**
+ * Receives into a buffer selected from a ring.
+ * @param [in] sockfd socket to receive from
+ * @param [in] ring ring to select the buffer from
+ * @param [out] buf buffer with the data
+ * @param [in] flags recv(2) flags
+ * @returns number of bytes received, 0 on end of file or -1 on error with
+ * f_errno set
+ *
+ * On success *buf is owned by the caller until returned with
+ * fbr_uring_buf_put. Errno is set to ENOBUFS when the ring has run out of
+ * buffers. *buf is set to NULL unless data has been received.
+ */
+ssize_t fbr_uring_recv_buf(FBR_P_ int sockfd,
+		struct fbr_uring_buf_ring *ring, void **buf, int flags);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <sys/queue.h>
 #include <evfibers/fiber.h>
 #include <evfibers_private/trace.h>
@@ -141,17 +142,43 @@ LIST_HEAD(mem_pool_list, mem_pool);
 TAILQ_HEAD(fiber_destructor_tailq, fbr_destructor);
 LIST_HEAD(fiber_list, fbr_fiber);
 
+#define FBR_STACK_CLASSES 16
+#define FBR_VRB_CLASSES 16
+
+struct fbr_stack {
+	char *ptr;
+	size_t size;
+	size_t map_size;
+	unsigned sclass;
+	unsigned valgrind_id;
+	int painted;
+	LIST_ENTRY(fbr_stack) entries;
+};
+
+LIST_HEAD(fbr_stack_list, fbr_stack);
+
+#define FBR_STACK_CANARY 0xFB
+#define FBR_STACK_AUTOTUNE_SAMPLES 4
+
+struct fbr_stack_profile {
+	struct fbr_stack_stats stats;
+	LIST_ENTRY(fbr_stack_profile) entries;
+};
+
+LIST_HEAD(fbr_stack_profile_list, fbr_stack_profile);
+
 struct fbr_fiber {
 	uint64_t id;
 	char name[FBR_MAX_FIBER_NAME];
 	fbr_fiber_func_t func;
 	void *func_arg;
 	coro_context ctx;
-	char *stack;
-	size_t stack_size;
+	struct fbr_stack *stack;
 	struct {
 		struct fbr_ev_base **waiting;
 		int arrived;
+		int interruptible;
+		int settling;
 	} ev;
 	struct trace_info reclaim_tinfo;
 	struct fiber_list children;
@@ -167,10 +194,146 @@ struct fbr_fiber {
 	int no_reclaim;
 	int want_reclaim;
 	struct fbr_cond_var reclaim_cond;
+	struct fbr_cond_var remote_cond;
+	int remote_woken;
+	struct {
+		ev_tstamp started;
+		unsigned calls;
+	} slice;
+	struct {
+		ev_tstamp at;
+		int cancelled;
+		struct fbr_ev_timer timer;
+	} deadline;
 };
 
 TAILQ_HEAD(mutex_tailq, fbr_mutex);
 
+#define FBR_SCHED_DEQUE_SIZE 64
+
+struct fbr_task {
+	char name[FBR_MAX_FIBER_NAME];
+	fbr_fiber_func_t func;
+	void *arg;
+	size_t stack_size;
+};
+
+struct fbr_deque_buf {
+	size_t mask;
+	struct fbr_deque_buf *prev;
+	struct fbr_task *tasks[];
+};
+
+struct fbr_sched_worker {
+	/* Chase-Lev deque: owner pushes and takes at the bottom, thieves
+	 * steal from the top */
+	int64_t top __attribute__((aligned(64)));
+	int64_t bottom __attribute__((aligned(64)));
+	struct fbr_deque_buf *buf;
+	struct fbr_sched *sched;
+	struct fbr_context *fctx;
+	/* Owned by an attached context */
+	int claimed;
+	int attached;
+	/* Wakers about to signal the loop of the worker */
+	int wakers;
+	int idle;
+	uint32_t seed;
+	struct ev_prepare prepare;
+	struct ev_async wakeup;
+};
+
+struct fbr_sched {
+	unsigned max_workers;
+	/* Slots ever claimed, the rest of them were never used */
+	unsigned n_workers;
+	struct fbr_sched_worker *workers;
+};
+
+#ifdef FBR_URING_ENABLED
+#include <evfibers/uring.h>
+#include <linux/stat.h>
+
+struct fbr_uring_cqe {
+	int res;
+	unsigned flags;
+};
+
+/* In-flight io_uring operation. Lives in a pool of the context rather than
+ * in the waiting event, since the kernel may complete it after the fiber
+ * which has submitted it is gone. */
+struct fbr_uring_req {
+	struct fbr_ev_uring *ev;
+	int waiting;
+	int finished;
+	uint8_t opcode;
+	/* Linked timeout, read by the kernel at submission */
+	struct __kernel_timespec ts;
+	/* Path of open or stat and the statx buffer, which the kernel may
+	 * access after the fiber is gone */
+	char *path;
+	struct statx stx;
+	/* Where the statx result goes once consumed, NULL if nobody cares */
+	struct stat *st;
+#ifdef FBR_HAVE_URING_MULTISHOT
+	/* Buffers selected by completions nobody waits for go back here */
+	struct fbr_uring_buf_ring *buf_ring;
+#endif
+	struct fbr_uring_cqe *cqes;
+	size_t head;
+	size_t n_cqes;
+	size_t capacity;
+	SLIST_ENTRY(fbr_uring_req) entries;
+};
+
+SLIST_HEAD(fbr_uring_req_slist, fbr_uring_req);
+
+struct fbr_uring {
+	int fd;
+	int event_fd;
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned local_tail;
+	unsigned to_submit;
+	unsigned in_flight;
+	struct fbr_uring_req_slist free_reqs;
+	ev_io event_io;
+	ev_prepare submit_prepare;
+};
+#endif
+
+#define FBR_WHEEL_BITS 6
+#define FBR_WHEEL_SIZE (1 << FBR_WHEEL_BITS)
+#define FBR_WHEEL_MASK (FBR_WHEEL_SIZE - 1)
+#define FBR_WHEEL_LEVELS 4
+#define FBR_WHEEL_TICK 0.001
+
+TAILQ_HEAD(fbr_ev_timer_tailq, fbr_ev_timer);
+
+/* Hierarchical timing wheel: level n slots span FBR_WHEEL_SIZE^n ticks and
+ * get cascaded into the level below as it wraps around. */
+struct fbr_timer_wheel {
+	struct fbr_ev_timer_tailq slots[FBR_WHEEL_LEVELS][FBR_WHEEL_SIZE];
+	uint64_t occupied[FBR_WHEEL_LEVELS];
+	uint64_t now; /* next tick to be processed */
+	uint64_t next; /* tick the driving timer is set for */
+	ev_tstamp base;
+	size_t count;
+	ev_timer timer;
+};
+
 struct fbr_stack_item {
 	struct fbr_fiber *fiber;
 	struct trace_info tinfo;
@@ -181,12 +344,55 @@ struct fbr_context_private {
 	struct fbr_stack_item *sp;
 	struct fbr_fiber root;
 	struct fiber_list reclaimed;
-	struct ev_async pending_async;
+	struct {
+		struct fbr_stack_list free[FBR_STACK_CLASSES];
+		unsigned cached;
+		unsigned max_cached;
+		struct fbr_stack *deferred;
+		int profiling;
+		int autotune;
+		struct fbr_stack_profile_list profiles;
+		size_t n_profiles;
+	} stacks;
+	struct {
+		struct fbr_vrb *free[FBR_VRB_CLASSES];
+		unsigned count[FBR_VRB_CLASSES];
+		unsigned alloc[FBR_VRB_CLASSES];
+		unsigned cached;
+		unsigned max_cached;
+		int huge_pages;
+	} vrbs;
+	struct ev_prepare pending_prepare;
+	struct ev_check pending_check;
+	struct ev_idle pending_idle;
 	struct fbr_id_tailq pending_fibers;
 	int backtraces_enabled;
+	int optimistic_io;
+	int nonblocking_fds;
 	uint64_t last_id;
 	uint64_t key_free_mask;
 	const char *buffer_file_pattern;
+	struct {
+		ev_tstamp quantum;
+		unsigned iterations;
+	} cooperate;
+	struct {
+		unsigned budget;
+		unsigned used;
+		unsigned iteration;
+	} handoff;
+	struct {
+		pthread_mutex_t lock;
+		fbr_id_t *items;
+		size_t size;
+		size_t capacity;
+		fbr_id_t *spare;
+		size_t spare_capacity;
+		struct ev_async async;
+	} remote;
+	struct fbr_sched_worker *sched;
+	struct fbr_uring *uring;
+	struct fbr_timer_wheel wheel;
 
 	struct ev_loop *loop;
 };
@@ -196,10 +402,48 @@ struct fbr_mq {
 	void **rb;
 	unsigned head;
 	unsigned tail;
-	unsigned max;
+	unsigned size;
+	unsigned mask;
+	char *data;
+	size_t elem_size;
+	size_t stride;
 	int flags;
 	struct fbr_cond_var bytes_available_cond;
 	struct fbr_cond_var bytes_freed_cond;
+	struct fbr_id_tailq pop_waiting;
+	struct fbr_id_tailq push_waiting;
+};
+
+struct fbr_heap_entry {
+	ev_tstamp key;
+	uint64_t seq;
+	void *obj;
+};
+
+/* Binary min-heap, entries with equal keys come out in insertion order */
+struct fbr_heap {
+	struct fbr_heap_entry *entries;
+	size_t count;
+	size_t alloc;
+	uint64_t seq;
+};
+
+struct fbr_pq {
+	struct fbr_context *fctx;
+	struct fbr_heap heap;
+	size_t size;
+	struct fbr_cond_var available_cond;
+	struct fbr_cond_var freed_cond;
+};
+
+struct fbr_delayq {
+	struct fbr_context *fctx;
+	struct fbr_heap heap;
+	size_t size;
+	ev_timer timer;
+	ev_tstamp armed_at;
+	struct fbr_cond_var available_cond;
+	struct fbr_cond_var freed_cond;
 };
 
 #endif
@@ -16,10 +16,16 @@
 
  ********************************************************************/
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* struct mmsghdr */
+#endif
 #include <evfibers/config.h>
 
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <limits.h>
+#include <sys/stat.h>
 #include <libgen.h>
 #include <assert.h>
 #include <errno.h>
@@ -31,12 +37,23 @@
 #include <valgrind/valgrind.h>
 #else
 #define RUNNING_ON_VALGRIND (0)
-#define VALGRIND_STACK_REGISTER(a,b) (void)0
+#define VALGRIND_STACK_REGISTER(a,b) (0)
+#define VALGRIND_STACK_DEREGISTER(a) (void)0
+#endif
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
 #endif
 
 #ifdef FBR_EIO_ENABLED
 #include <evfibers/eio.h>
 #endif
+#ifdef FBR_URING_ENABLED
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <evfibers/uring.h>
+#endif
 #include <evfibers_private/fiber.h>
 
 #ifndef LIST_FOREACH_SAFE
@@ -101,33 +118,74 @@ static int fbr_id_unpack(FBR_P_ struct fbr_fiber **ptr, fbr_id_t id)
 	return 0;
 }
 
-static void pending_async_cb(EV_P_ ev_async *w, _unused_ int revents)
+static void stop_pending(FBR_P)
 {
-	struct fbr_context *fctx;
+	ev_prepare_stop(fctx->__p->loop, &fctx->__p->pending_prepare);
+	ev_check_stop(fctx->__p->loop, &fctx->__p->pending_check);
+	ev_idle_stop(fctx->__p->loop, &fctx->__p->pending_idle);
+}
+
+static void start_pending(FBR_P)
+{
+	ev_prepare_start(fctx->__p->loop, &fctx->__p->pending_prepare);
+	ev_check_start(fctx->__p->loop, &fctx->__p->pending_check);
+	/* Active idle watcher prevents the loop from blocking while there are
+	 * runnable fibers left */
+	ev_idle_start(fctx->__p->loop, &fctx->__p->pending_idle);
+}
+
+static void run_pending(FBR_P)
+{
+	struct fbr_id_tailq batch;
 	struct fbr_id_tailq_i *item;
-	fctx = (struct fbr_context *)w->data;
 	int retval;
 
 	ENSURE_ROOT_FIBER;
 
-	if (TAILQ_EMPTY(&fctx->__p->pending_fibers)) {
-		ev_async_stop(EV_A_ &fctx->__p->pending_async);
-		return;
+	/* Fibers that become runnable while this batch is being executed are
+	 * left for the next batch, so that a fiber requeueing itself over and
+	 * over can not starve the event loop. */
+	TAILQ_INIT(&batch);
+	TAILQ_CONCAT(&batch, &fctx->__p->pending_fibers, entries);
+	TAILQ_FOREACH(item, &batch, entries) {
+		item->head = &batch;
 	}
 
-	item = TAILQ_FIRST(&fctx->__p->pending_fibers);
-	assert(item->head == &fctx->__p->pending_fibers);
-	/* item shall be removed from the queue by a destructor, which shall be
-	 * set by the procedure demanding delayed execution. Destructor
-	 * guarantees removal upon the reclaim of fiber. */
-	ev_async_send(EV_A_ &fctx->__p->pending_async);
-
-	retval = fbr_transfer(FBR_A_ item->id);
-	if (-1 == retval && FBR_ENOFIBER != fctx->f_errno) {
-		fbr_log_e(FBR_A_ "libevfibers: unexpected error trying to call"
-				" a fiber by id: %s",
-				fbr_strerror(FBR_A_ fctx->f_errno));
+	while (!TAILQ_EMPTY(&batch)) {
+		item = TAILQ_FIRST(&batch);
+		/* item shall normally be removed from the queue by a
+		 * destructor, which is set by the procedure demanding delayed
+		 * execution. Here we remove it ourselves right before the
+		 * transfer, so the destructor will find it detached. */
+		TAILQ_REMOVE(&batch, item, entries);
+		item->head = NULL;
+
+		retval = fbr_transfer(FBR_A_ item->id);
+		if (-1 == retval && FBR_ENOFIBER != fctx->f_errno) {
+			fbr_log_e(FBR_A_ "libevfibers: unexpected error trying"
+					" to call a fiber by id: %s",
+					fbr_strerror(FBR_A_ fctx->f_errno));
+		}
 	}
+
+	if (TAILQ_EMPTY(&fctx->__p->pending_fibers))
+		stop_pending(FBR_A);
+}
+
+static void pending_prepare_cb(_unused_ EV_P_ ev_prepare *w,
+		_unused_ int revents)
+{
+	run_pending((struct fbr_context *)w->data);
+}
+
+static void pending_check_cb(_unused_ EV_P_ ev_check *w, _unused_ int revents)
+{
+	run_pending((struct fbr_context *)w->data);
+}
+
+static void pending_idle_cb(_unused_ EV_P_ ev_idle *w, _unused_ int revents)
+{
+	run_pending((struct fbr_context *)w->data);
 }
 
 static void *allocate_in_fiber(FBR_P_ size_t size, struct fbr_fiber *in)
@@ -191,14 +249,36 @@ static void stdio_logger(FBR_P_ struct fbr_logger *logger,
 	fprintf(stream, "\n");
 }
 
+static void remote_async_cb(EV_P_ ev_async *w, int revents);
+
+static void wheel_init(FBR_P);
+
 void fbr_init(FBR_P_ struct ev_loop *loop)
 {
 	struct fbr_fiber *root;
 	struct fbr_logger *logger;
 	char *buffer_pattern;
+	unsigned i;
 
 	fctx->__p = malloc(sizeof(struct fbr_context_private));
 	LIST_INIT(&fctx->__p->reclaimed);
+	for (i = 0; i < FBR_STACK_CLASSES; i++)
+		LIST_INIT(&fctx->__p->stacks.free[i]);
+	fctx->__p->stacks.cached = 0;
+	fctx->__p->stacks.max_cached = FBR_STACK_CACHE_SIZE;
+	fctx->__p->stacks.deferred = NULL;
+	fctx->__p->stacks.profiling = 0;
+	fctx->__p->stacks.autotune = 0;
+	LIST_INIT(&fctx->__p->stacks.profiles);
+	fctx->__p->stacks.n_profiles = 0;
+	for (i = 0; i < FBR_VRB_CLASSES; i++) {
+		fctx->__p->vrbs.free[i] = NULL;
+		fctx->__p->vrbs.count[i] = 0;
+		fctx->__p->vrbs.alloc[i] = 0;
+	}
+	fctx->__p->vrbs.cached = 0;
+	fctx->__p->vrbs.max_cached = FBR_BUFFER_CACHE_SIZE;
+	fctx->__p->vrbs.huge_pages = 0;
 	LIST_INIT(&fctx->__p->root.children);
 	LIST_INIT(&fctx->__p->root.pool);
 	TAILQ_INIT(&fctx->__p->root.destructors);
@@ -209,6 +289,11 @@ void fbr_init(FBR_P_ struct ev_loop *loop)
 	fctx->__p->last_id = 0;
 	root->id = fctx->__p->last_id++;
 	coro_create(&root->ctx, NULL, NULL, NULL, 0);
+	root->deadline.at = 0.;
+	root->deadline.cancelled = 0;
+	root->deadline.timer.active = 0;
+	root->ev.interruptible = 0;
+	root->ev.settling = 0;
 
 	logger = allocate_in_fiber(FBR_A_ sizeof(struct fbr_logger), root);
 	logger->logv = stdio_logger;
@@ -220,11 +305,37 @@ void fbr_init(FBR_P_ struct ev_loop *loop)
 	fctx->__p->backtraces_enabled = 1;
 	fill_trace_info(FBR_A_ &fctx->__p->sp->tinfo);
 	fctx->__p->loop = loop;
-	fctx->__p->pending_async.data = fctx;
 	fctx->__p->backtraces_enabled = 0;
+	fctx->__p->optimistic_io = 1;
+	fctx->__p->nonblocking_fds = 0;
+	fctx->__p->cooperate.quantum = 0.;
+	fctx->__p->cooperate.iterations = 0;
+	fctx->__p->handoff.budget = 0;
+	fctx->__p->handoff.used = 0;
+	fctx->__p->handoff.iteration = 0;
 	memset(&fctx->__p->key_free_mask, 0xFF,
 			sizeof(fctx->__p->key_free_mask));
-	ev_async_init(&fctx->__p->pending_async, pending_async_cb);
+	ev_prepare_init(&fctx->__p->pending_prepare, pending_prepare_cb);
+	fctx->__p->pending_prepare.data = fctx;
+	ev_check_init(&fctx->__p->pending_check, pending_check_cb);
+	fctx->__p->pending_check.data = fctx;
+	ev_idle_init(&fctx->__p->pending_idle, pending_idle_cb);
+	fctx->__p->pending_idle.data = fctx;
+
+	pthread_mutex_init(&fctx->__p->remote.lock, NULL);
+	fctx->__p->remote.items = NULL;
+	fctx->__p->remote.size = 0;
+	fctx->__p->remote.capacity = 0;
+	fctx->__p->remote.spare = NULL;
+	fctx->__p->remote.spare_capacity = 0;
+	ev_async_init(&fctx->__p->remote.async, remote_async_cb);
+	fctx->__p->remote.async.data = fctx;
+	ev_async_start(loop, &fctx->__p->remote.async);
+	/* Only fibers waiting for remote wakeups keep the loop alive */
+	ev_unref(loop);
+	fctx->__p->sched = NULL;
+	fctx->__p->uring = NULL;
+	wheel_init(FBR_A);
 
 	buffer_pattern = getenv("FBR_BUFFER_FILE_PATTERN");
 	if (buffer_pattern)
@@ -233,6 +344,22 @@ void fbr_init(FBR_P_ struct ev_loop *loop)
 		fctx->__p->buffer_file_pattern = default_buffer_pattern;
 }
 
+void fbr_enable_optimistic_io(FBR_P_ int enabled)
+{
+	if (enabled)
+		fctx->__p->optimistic_io = 1;
+	else
+		fctx->__p->optimistic_io = 0;
+}
+
+void fbr_assume_nonblocking_fds(FBR_P_ int enabled)
+{
+	if (enabled)
+		fctx->__p->nonblocking_fds = 1;
+	else
+		fctx->__p->nonblocking_fds = 0;
+}
+
 const char *fbr_strerror(_unused_ FBR_P_ enum fbr_error_code code)
 {
 	switch (code) {
@@ -254,6 +381,10 @@ const char *fbr_strerror(_unused_ FBR_P_ enum fbr_error_code code)
 			return "Not enough space in the buffer";
 		case FBR_EEIO:
 			return "libeio request error";
+		case FBR_ETIMEDOUT:
+			return "Fiber deadline has passed";
+		case FBR_ECANCELED:
+			return "Fiber has been cancelled";
 	}
 	return "Unknown error";
 }
@@ -316,22 +447,51 @@ static void reclaim_children(FBR_P_ struct fbr_fiber *fiber)
 
 static void fbr_free_in_fiber(_unused_ FBR_P_ _unused_ struct fbr_fiber *fiber,
 		void *ptr, int destructor);
+static void stack_release(FBR_P_ struct fbr_stack *stack);
+static void stack_measure(FBR_P_ struct fbr_fiber *fiber);
+static void flush_deferred_stack(FBR_P);
+#ifdef FBR_URING_ENABLED
+static void uring_destroy(FBR_P);
+static enum ev_action_hint uring_prepare_ev(FBR_P_ struct fbr_ev_uring *ev);
+static void uring_finish_ev(FBR_P_ struct fbr_ev_uring *ev);
+#endif
 
 void fbr_destroy(FBR_P)
 {
 	struct fbr_fiber *fiber, *x;
 	struct mem_pool *p, *x2;
+	struct fbr_stack_profile *profile, *x3;
+	unsigned i;
 
+	fbr_sched_detach(FBR_A);
 	reclaim_children(FBR_A_ &fctx->__p->root);
+	stop_pending(FBR_A);
+#ifdef FBR_URING_ENABLED
+	/* Reclaimed fibers may have cancelled their operations just now */
+	uring_destroy(FBR_A);
+#endif
+	ev_timer_stop(fctx->__p->loop, &fctx->__p->wheel.timer);
+	ev_ref(fctx->__p->loop);
+	ev_async_stop(fctx->__p->loop, &fctx->__p->remote.async);
+	pthread_mutex_destroy(&fctx->__p->remote.lock);
+	free(fctx->__p->remote.items);
+	free(fctx->__p->remote.spare);
 
 	LIST_FOREACH_SAFE(p, &fctx->__p->root.pool, entries, x2) {
 		fbr_free_in_fiber(FBR_A_ &fctx->__p->root, p + 1, 1);
 	}
 
+	flush_deferred_stack(FBR_A);
 	LIST_FOREACH_SAFE(fiber, &fctx->__p->reclaimed, entries.reclaimed, x) {
-		free(fiber->stack);
 		free(fiber);
 	}
+	fbr_set_stack_cache_size(FBR_A_ 0);
+	fbr_set_buffer_cache_size(FBR_A_ 0);
+	for (i = 0; i < FBR_VRB_CLASSES; i++)
+		free(fctx->__p->vrbs.free[i]);
+	LIST_FOREACH_SAFE(profile, &fctx->__p->stacks.profiles, entries, x3) {
+		free(profile);
+	}
 
 	free(fctx->__p);
 }
@@ -348,6 +508,12 @@ void fbr_enable_backtraces(FBR_P_ int enabled)
 static void cancel_ev(_unused_ FBR_P_ struct fbr_ev_base *ev)
 {
 	fbr_destructor_remove(FBR_A_ &ev->item.dtor, 1 /* call it */);
+#ifdef FBR_URING_ENABLED
+	if (FBR_EV_URING == ev->type)
+		uring_finish_ev(FBR_A_ fbr_ev_upcast(ev, fbr_ev_uring));
+#endif
+	if (FBR_EV_TIMER == ev->type)
+		fbr_ev_upcast(ev, fbr_ev_timer)->waiting = 0;
 }
 
 static void post_ev(_unused_ FBR_P_ struct fbr_fiber *fiber,
@@ -394,6 +560,217 @@ static void ev_watcher_cb(_unused_ EV_P_ ev_watcher *w, _unused_ int event)
 }
 
 
+static uint64_t wheel_current_tick(FBR_P)
+{
+	struct fbr_timer_wheel *wheel = &fctx->__p->wheel;
+	ev_tstamp elapsed = ev_now(fctx->__p->loop) - wheel->base;
+
+	if (elapsed < 0.)
+		return 0;
+	return (uint64_t)(elapsed / FBR_WHEEL_TICK);
+}
+
+static void wheel_link(struct fbr_timer_wheel *wheel, struct fbr_ev_timer *ev)
+{
+	uint64_t expires = ev->expires;
+	uint64_t delta;
+	unsigned level;
+
+	if (expires < wheel->now)
+		expires = wheel->now;
+	delta = expires - wheel->now;
+	for (level = 0; level < FBR_WHEEL_LEVELS - 1; level++)
+		if (delta < 1ULL << (FBR_WHEEL_BITS * (level + 1)))
+			break;
+	/* Beyond the wheel range: park in the farthest slot, the timer gets
+	 * relinked with its real expiration when that slot is cascaded */
+	if (delta >= 1ULL << (FBR_WHEEL_BITS * FBR_WHEEL_LEVELS))
+		expires = wheel->now +
+			(1ULL << (FBR_WHEEL_BITS * FBR_WHEEL_LEVELS)) - 1;
+	ev->level = level;
+	ev->slot = (expires >> (FBR_WHEEL_BITS * level)) & FBR_WHEEL_MASK;
+	TAILQ_INSERT_TAIL(&wheel->slots[level][ev->slot], ev, entries);
+	wheel->occupied[level] |= 1ULL << ev->slot;
+}
+
+static void wheel_unlink(struct fbr_timer_wheel *wheel,
+		struct fbr_ev_timer *ev)
+{
+	struct fbr_ev_timer_tailq *head = &wheel->slots[ev->level][ev->slot];
+
+	TAILQ_REMOVE(head, ev, entries);
+	if (TAILQ_EMPTY(head))
+		wheel->occupied[ev->level] &= ~(1ULL << ev->slot);
+}
+
+static void wheel_cascade(struct fbr_timer_wheel *wheel, unsigned level,
+		unsigned slot)
+{
+	struct fbr_ev_timer_tailq moved;
+	struct fbr_ev_timer *ev;
+
+	if (0 == (wheel->occupied[level] & (1ULL << slot)))
+		return;
+	TAILQ_INIT(&moved);
+	TAILQ_CONCAT(&moved, &wheel->slots[level][slot], entries);
+	wheel->occupied[level] &= ~(1ULL << slot);
+	while (!TAILQ_EMPTY(&moved)) {
+		ev = TAILQ_FIRST(&moved);
+		TAILQ_REMOVE(&moved, ev, entries);
+		wheel_link(wheel, ev);
+	}
+}
+
+/* Sets the driving timer for the next tick that has anything to do: an
+ * occupied slot of the lowest level or the cascade at its wrap around */
+static void wheel_schedule(FBR_P)
+{
+	struct fbr_timer_wheel *wheel = &fctx->__p->wheel;
+	uint64_t next, bits;
+	ev_tstamp after;
+
+	if (0 == wheel->count) {
+		ev_timer_stop(fctx->__p->loop, &wheel->timer);
+		return;
+	}
+	next = (wheel->now + FBR_WHEEL_MASK) & ~(uint64_t)FBR_WHEEL_MASK;
+	bits = wheel->occupied[0] >> (wheel->now & FBR_WHEEL_MASK);
+	if (bits && wheel->now + __builtin_ctzll(bits) < next)
+		next = wheel->now + __builtin_ctzll(bits);
+	if (ev_is_active(&wheel->timer) && next == wheel->next)
+		return;
+	wheel->next = next;
+	after = wheel->base + next * FBR_WHEEL_TICK -
+		ev_now(fctx->__p->loop);
+	ev_timer_stop(fctx->__p->loop, &wheel->timer);
+	ev_timer_set(&wheel->timer, max(0., after), 0.);
+	ev_timer_start(fctx->__p->loop, &wheel->timer);
+}
+
+static void wheel_fire(FBR_P_ struct fbr_ev_timer *ev)
+{
+	struct fbr_fiber *fiber;
+	int retval;
+
+	ev->fired = 1;
+	if (!ev->waiting)
+		return;
+	retval = fbr_id_unpack(FBR_A_ &fiber, ev->ev_base.id);
+	if (-1 == retval) {
+		fbr_log_e(FBR_A_ "libevfibers: fiber is about to be called by"
+			" the timer, but it's id is not valid: %s",
+			fbr_strerror(FBR_A_ fctx->f_errno));
+		abort();
+	}
+	post_ev(FBR_A_ fiber, &ev->ev_base);
+	retval = fbr_transfer(FBR_A_ fbr_id_pack(fiber));
+	assert(0 == retval);
+}
+
+static void wheel_timer_cb(_unused_ EV_P_ ev_timer *w, _unused_ int revents)
+{
+	struct fbr_context *fctx = w->data;
+	struct fbr_timer_wheel *wheel = &fctx->__p->wheel;
+	struct fbr_ev_timer_tailq *head;
+	struct fbr_ev_timer *ev;
+	uint64_t current = wheel_current_tick(FBR_A);
+	uint64_t tick;
+	unsigned level, slot, idx;
+
+	ENSURE_ROOT_FIBER;
+
+	while (wheel->count && wheel->now <= current) {
+		tick = wheel->now;
+		idx = tick & FBR_WHEEL_MASK;
+		for (level = 1; 0 == idx && level < FBR_WHEEL_LEVELS; level++) {
+			slot = (tick >> (FBR_WHEEL_BITS * level)) &
+				FBR_WHEEL_MASK;
+			wheel_cascade(wheel, level, slot);
+			if (slot)
+				break;
+		}
+		wheel->now++;
+		/* Fibers woken up may link timers for tick + FBR_WHEEL_SIZE into
+		 * the same slot, those go to the tail */
+		head = &wheel->slots[0][idx];
+		while (!TAILQ_EMPTY(head)) {
+			ev = TAILQ_FIRST(head);
+			if (ev->expires > tick)
+				break;
+			wheel_unlink(wheel, ev);
+			wheel->count--;
+			wheel_fire(FBR_A_ ev);
+		}
+	}
+	wheel_schedule(FBR_A);
+}
+
+static void wheel_init(FBR_P)
+{
+	struct fbr_timer_wheel *wheel = &fctx->__p->wheel;
+	unsigned level, slot;
+
+	for (level = 0; level < FBR_WHEEL_LEVELS; level++) {
+		for (slot = 0; slot < FBR_WHEEL_SIZE; slot++)
+			TAILQ_INIT(&wheel->slots[level][slot]);
+		wheel->occupied[level] = 0;
+	}
+	wheel->now = 0;
+	wheel->next = 0;
+	wheel->base = ev_now(fctx->__p->loop);
+	wheel->count = 0;
+	ev_timer_init(&wheel->timer, wheel_timer_cb, 0., 0.);
+	wheel->timer.data = fctx;
+}
+
+static void wheel_timer_dtor(FBR_P_ void *arg)
+{
+	struct fbr_ev_timer *ev = arg;
+
+	struct fbr_timer_wheel *wheel = &fctx->__p->wheel;
+	int linked = ev->active && !ev->fired;
+
+	ev->active = 0;
+	ev->fired = 0;
+	if (!linked)
+		return;
+	wheel_unlink(wheel, ev);
+	/* The driving timer is left alone unless it has nothing to wait for,
+	 * since a spurious wake up is cheaper than rescheduling */
+	if (0 == --wheel->count)
+		ev_timer_stop(fctx->__p->loop, &wheel->timer);
+}
+
+void fbr_ev_timer_start(FBR_P_ struct fbr_ev_timer *ev, ev_tstamp timeout)
+{
+	struct fbr_timer_wheel *wheel = &fctx->__p->wheel;
+	ev_tstamp at;
+
+	wheel_timer_dtor(FBR_A_ ev);
+	if (0 == wheel->count)
+		/* Nothing to catch up with */
+		wheel->now = wheel_current_tick(FBR_A);
+	at = (ev_now(fctx->__p->loop) + timeout - wheel->base) /
+		FBR_WHEEL_TICK;
+	if (at < 0.)
+		at = 0.;
+	ev->expires = (uint64_t)at;
+	if (ev->expires < at)
+		ev->expires++;
+	wheel_link(wheel, ev);
+	wheel->count++;
+	ev->active = 1;
+	if (!ev->dtor.active)
+		fbr_destructor_add(FBR_A_ &ev->dtor);
+	wheel_schedule(FBR_A);
+}
+
+void fbr_ev_timer_stop(FBR_P_ struct fbr_ev_timer *ev)
+{
+	fbr_destructor_remove(FBR_A_ &ev->dtor, 0 /* call it */);
+	wheel_timer_dtor(FBR_A_ ev);
+}
+
 static void fbr_free_in_fiber(_unused_ FBR_P_ _unused_ struct fbr_fiber *fiber,
 		void *ptr, int destructor)
 {
@@ -444,6 +821,7 @@ static int do_reclaim(FBR_P_ struct fbr_fiber *fiber)
 	struct fbr_fiber *f;
 #endif
 
+	flush_deferred_stack(FBR_A);
 	fill_trace_info(FBR_A_ &fiber->reclaim_tinfo);
 	reclaim_children(FBR_A_ fiber);
 	fiber_cleanup(FBR_A_ fiber);
@@ -455,6 +833,17 @@ static int do_reclaim(FBR_P_ struct fbr_fiber *fiber)
 #endif
 	LIST_INSERT_HEAD(&fctx->__p->reclaimed, fiber, entries.reclaimed);
 
+	if (fiber->stack->painted)
+		stack_measure(FBR_A_ fiber);
+
+	/* A fiber reclaiming itself is still running on its own stack, it can
+	 * only be released once we have switched away from it */
+	if (CURRENT_FIBER == fiber)
+		fctx->__p->stacks.deferred = fiber->stack;
+	else
+		stack_release(FBR_A_ fiber->stack);
+	fiber->stack = NULL;
+
 	filter_fiber_stack(FBR_A_ fiber);
 
 	if (CURRENT_FIBER == fiber)
@@ -481,8 +870,11 @@ int fbr_reclaim(FBR_P_ fbr_id_t id)
 				FBR_ENOFIBER == fctx->f_errno)
 			return_success(0);
 		retval = fbr_cond_wait(FBR_A_ &fiber->reclaim_cond, &mutex);
-		assert(0 == retval);
-		(void)retval;
+		if (-1 == retval) {
+			fbr_mutex_unlock(FBR_A_ &mutex);
+			fbr_mutex_destroy(FBR_A_ &mutex);
+			return -1;
+		}
 	}
 	fbr_mutex_unlock(FBR_A_ &mutex);
 	fbr_mutex_destroy(FBR_A_ &mutex);
@@ -532,6 +924,42 @@ int fbr_is_reclaimed(_unused_ FBR_P_ fbr_id_t id)
 	return 1;
 }
 
+void fbr_set_deadline(FBR_P_ ev_tstamp deadline)
+{
+	struct fbr_fiber *fiber = CURRENT_FIBER;
+
+	if (fiber->deadline.timer.active)
+		/* Armed again by the next wait */
+		fbr_ev_timer_stop(FBR_A_ &fiber->deadline.timer);
+	fiber->deadline.at = deadline;
+}
+
+ev_tstamp fbr_get_deadline(FBR_P)
+{
+	return CURRENT_FIBER->deadline.at;
+}
+
+int fbr_cancel(FBR_P_ fbr_id_t id)
+{
+	struct fbr_fiber *fiber;
+
+	unpack_transfer_errno(-1, &fiber, id);
+	fiber->deadline.cancelled = 1;
+	if (!fiber->ev.interruptible)
+		/* Not blocked, the next wait will fail */
+		return_success(0);
+	fiber->ev.arrived = 1;
+	return fbr_transfer(FBR_A_ id);
+}
+
+int fbr_is_cancelled(FBR_P_ fbr_id_t id)
+{
+	struct fbr_fiber *fiber;
+
+	unpack_transfer_errno(-1, &fiber, id);
+	return_success(fiber->deadline.cancelled);
+}
+
 fbr_id_t fbr_self(FBR_P)
 {
 	return CURRENT_FIBER_ID;
@@ -568,11 +996,85 @@ static void item_dtor(_unused_ FBR_P_ void *arg)
 	}
 }
 
+static int rwlock_try(FBR_P_ struct fbr_rwlock *rwlock, int write)
+{
+	if (!fbr_id_isnull(rwlock->writer))
+		return 0;
+	if (write) {
+		if (rwlock->readers > 0)
+			return 0;
+		rwlock->writer = CURRENT_FIBER_ID;
+		return 1;
+	}
+	/* Writers are preferred */
+	if (rwlock->pending_writers > 0)
+		return 0;
+	rwlock->readers++;
+	return 1;
+}
+
+static void rwlock_grant(FBR_P_ struct fbr_rwlock *rwlock);
+
+static void rwlock_item_dtor(FBR_P_ void *arg)
+{
+	struct fbr_id_tailq_i *item = arg;
+	struct fbr_ev_rwlock *ev = fbr_ev_upcast(item->ev, fbr_ev_rwlock);
+	struct fbr_rwlock *rwlock = ev->rwlock;
+
+	if (item->head != &rwlock->pending) {
+		/* Already granted and possibly queued for transfer */
+		item_dtor(FBR_A_ arg);
+		return;
+	}
+	TAILQ_REMOVE(&rwlock->pending, item, entries);
+	item->head = NULL;
+	if (ev->write && 0 == --rwlock->pending_writers)
+		/* Readers queued up behind a writer giving up may proceed */
+		rwlock_grant(FBR_A_ rwlock);
+}
+
+static int sem_try(_unused_ FBR_P_ struct fbr_sem *sem, unsigned count)
+{
+	/* Waiters are served in order, even if a smaller request fits */
+	if (!TAILQ_EMPTY(&sem->pending) || sem->value < count)
+		return 0;
+	sem->value -= count;
+	return 1;
+}
+
+static void sem_grant(FBR_P_ struct fbr_sem *sem);
+
+static void sem_item_dtor(FBR_P_ void *arg)
+{
+	struct fbr_id_tailq_i *item = arg;
+	struct fbr_ev_sem *ev = fbr_ev_upcast(item->ev, fbr_ev_sem);
+	struct fbr_sem *sem = ev->sem;
+
+	if (item->head != &sem->pending) {
+		/* Already granted and possibly queued for transfer */
+		item_dtor(FBR_A_ arg);
+		return;
+	}
+	TAILQ_REMOVE(&sem->pending, item, entries);
+	item->head = NULL;
+	/* Smaller requests queued up behind this one may fit now */
+	sem_grant(FBR_A_ sem);
+}
+
+static int mq_take(struct fbr_mq *mq, void **obj);
+static int mq_put(struct fbr_mq *mq, void *obj);
+
 static enum ev_action_hint prepare_ev(FBR_P_ struct fbr_ev_base *ev)
 {
 	struct fbr_ev_watcher *e_watcher;
 	struct fbr_ev_mutex *e_mutex;
 	struct fbr_ev_cond_var *e_cond;
+	struct fbr_ev_timer *e_timer;
+	struct fbr_ev_rwlock *e_rwlock;
+	struct fbr_ev_sem *e_sem;
+	struct fbr_ev_waitgroup *e_wg;
+	struct fbr_ev_mq_pop *e_mq_pop;
+	struct fbr_ev_mq_push *e_mq_push;
 	struct fbr_id_tailq_i *item = &ev->item;
 
 	ev->arrived = 0;
@@ -624,12 +1126,88 @@ static enum ev_action_hint prepare_ev(FBR_P_ struct fbr_ev_base *ev)
 #else
 		fbr_log_e(FBR_A_ "libevfibers: libeio support is not compiled");
 		abort();
+#endif
+		break;
+	case FBR_EV_TIMER:
+		e_timer = fbr_ev_upcast(ev, fbr_ev_timer);
+		if (!e_timer->active) {
+			fbr_destructor_remove(FBR_A_ &ev->item.dtor,
+					0 /* call it */);
+			return EV_AH_EINVAL;
+		}
+		if (e_timer->fired)
+			return EV_AH_ARRIVED;
+		e_timer->waiting = 1;
+		break;
+	case FBR_EV_RWLOCK:
+		e_rwlock = fbr_ev_upcast(ev, fbr_ev_rwlock);
+		if (rwlock_try(FBR_A_ e_rwlock->rwlock, e_rwlock->write))
+			return EV_AH_ARRIVED;
+		ev->item.dtor.func = rwlock_item_dtor;
+		id_tailq_i_set(FBR_A_ item, CURRENT_FIBER);
+		item->ev = ev;
+		ev->data = item;
+		TAILQ_INSERT_TAIL(&e_rwlock->rwlock->pending, item, entries);
+		item->head = &e_rwlock->rwlock->pending;
+		if (e_rwlock->write)
+			e_rwlock->rwlock->pending_writers++;
+		break;
+	case FBR_EV_SEM:
+		e_sem = fbr_ev_upcast(ev, fbr_ev_sem);
+		if (sem_try(FBR_A_ e_sem->sem, e_sem->count))
+			return EV_AH_ARRIVED;
+		ev->item.dtor.func = sem_item_dtor;
+		id_tailq_i_set(FBR_A_ item, CURRENT_FIBER);
+		item->ev = ev;
+		ev->data = item;
+		TAILQ_INSERT_TAIL(&e_sem->sem->pending, item, entries);
+		item->head = &e_sem->sem->pending;
+		break;
+	case FBR_EV_WAITGROUP:
+		e_wg = fbr_ev_upcast(ev, fbr_ev_waitgroup);
+		if (0 == e_wg->wg->count)
+			return EV_AH_ARRIVED;
+		id_tailq_i_set(FBR_A_ item, CURRENT_FIBER);
+		item->ev = ev;
+		ev->data = item;
+		TAILQ_INSERT_TAIL(&e_wg->wg->waiting, item, entries);
+		item->head = &e_wg->wg->waiting;
+		break;
+	case FBR_EV_MQ_POP:
+		e_mq_pop = fbr_ev_upcast(ev, fbr_ev_mq_pop);
+		if (mq_take(e_mq_pop->mq, &e_mq_pop->obj))
+			return EV_AH_ARRIVED;
+		id_tailq_i_set(FBR_A_ item, CURRENT_FIBER);
+		item->ev = ev;
+		ev->data = item;
+		TAILQ_INSERT_TAIL(&e_mq_pop->mq->pop_waiting, item, entries);
+		item->head = &e_mq_pop->mq->pop_waiting;
+		break;
+	case FBR_EV_MQ_PUSH:
+		e_mq_push = fbr_ev_upcast(ev, fbr_ev_mq_push);
+		if (mq_put(e_mq_push->mq, e_mq_push->obj))
+			return EV_AH_ARRIVED;
+		id_tailq_i_set(FBR_A_ item, CURRENT_FIBER);
+		item->ev = ev;
+		ev->data = item;
+		TAILQ_INSERT_TAIL(&e_mq_push->mq->push_waiting, item, entries);
+		item->head = &e_mq_push->mq->push_waiting;
+		break;
+	case FBR_EV_URING:
+#ifdef FBR_URING_ENABLED
+		return uring_prepare_ev(FBR_A_ fbr_ev_upcast(ev, fbr_ev_uring));
+#else
+		fbr_log_e(FBR_A_ "libevfibers: io_uring support is not"
+				" compiled");
+		abort();
 #endif
 		break;
 	}
 	return EV_AH_OK;
 }
 
+static int mutex_lock(FBR_P_ struct fbr_mutex *mutex, int interruptible);
+
 static void finish_ev(FBR_P_ struct fbr_ev_base *ev)
 {
 	struct fbr_ev_cond_var *e_cond;
@@ -639,7 +1217,7 @@ static void finish_ev(FBR_P_ struct fbr_ev_base *ev)
 	case FBR_EV_COND_VAR:
 		e_cond = fbr_ev_upcast(ev, fbr_ev_cond_var);
 		if (e_cond->mutex)
-			fbr_mutex_lock(FBR_A_ e_cond->mutex);
+			mutex_lock(FBR_A_ e_cond->mutex, 0);
 		break;
 	case FBR_EV_WATCHER:
 		e_watcher = fbr_ev_upcast(ev, fbr_ev_watcher);
@@ -648,57 +1226,63 @@ static void finish_ev(FBR_P_ struct fbr_ev_base *ev)
 	case FBR_EV_MUTEX:
 		/* NOP */
 		break;
+	case FBR_EV_TIMER:
+		fbr_ev_upcast(ev, fbr_ev_timer)->waiting = 0;
+		break;
+	case FBR_EV_RWLOCK:
+	case FBR_EV_SEM:
+	case FBR_EV_WAITGROUP:
+	case FBR_EV_MQ_POP:
+	case FBR_EV_MQ_PUSH:
+		/* NOP */
+		break;
 	case FBR_EV_EIO:
 #ifdef FBR_EIO_ENABLED
 		/* NOP */
 #else
 		fbr_log_e(FBR_A_ "libevfibers: libeio support is not compiled");
 		abort();
+#endif
+		break;
+	case FBR_EV_URING:
+#ifdef FBR_URING_ENABLED
+		uring_finish_ev(FBR_A_ fbr_ev_upcast(ev, fbr_ev_uring));
+#else
+		fbr_log_e(FBR_A_ "libevfibers: io_uring support is not"
+				" compiled");
+		abort();
 #endif
 		break;
 	}
 }
 
-static void watcher_timer_dtor(_unused_ FBR_P_ void *_arg)
-{
-	struct ev_timer *w = _arg;
-	ev_timer_stop(fctx->__p->loop, w);
-}
-
 int fbr_ev_wait_to(FBR_P_ struct fbr_ev_base *events[], ev_tstamp timeout)
 {
 	size_t size;
-	ev_timer timer;
-	struct fbr_ev_watcher watcher;
-	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
+	struct fbr_ev_timer timer;
 	struct fbr_ev_base **new_events;
 	struct fbr_ev_base **ev_pptr;
 	int n_events;
 
-	ev_timer_init(&timer, NULL, timeout, 0.);
-	ev_timer_start(fctx->__p->loop, &timer);
-	fbr_ev_watcher_init(FBR_A_ &watcher,
-			(struct ev_watcher *)&timer);
-	dtor.func = watcher_timer_dtor;
-	dtor.arg = &timer;
-	fbr_destructor_add(FBR_A_ &dtor);
+	fbr_ev_timer_init(FBR_A_ &timer);
+	fbr_ev_timer_start(FBR_A_ &timer, timeout);
 	size = 0;
 	for (ev_pptr = events; NULL != *ev_pptr; ev_pptr++)
 		size++;
 	new_events = alloca((size + 2) * sizeof(void *));
 	memcpy(new_events, events, size * sizeof(void *));
-	new_events[size] = &watcher.ev_base;
+	new_events[size] = &timer.ev_base;
 	new_events[size + 1] = NULL;
 	n_events = fbr_ev_wait(FBR_A_ new_events);
-	fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
+	fbr_ev_timer_stop(FBR_A_ &timer);
 	if (n_events < 0)
 		return n_events;
-	if (watcher.ev_base.arrived)
+	if (timer.ev_base.arrived)
 		n_events--;
 	return n_events;
 }
 
-int fbr_ev_wait(FBR_P_ struct fbr_ev_base *events[])
+static int ev_wait(FBR_P_ struct fbr_ev_base *events[], int interruptible)
 {
 	struct fbr_fiber *fiber = CURRENT_FIBER;
 	enum ev_action_hint hint;
@@ -707,6 +1291,7 @@ int fbr_ev_wait(FBR_P_ struct fbr_ev_base *events[])
 
 	fiber->ev.arrived = 0;
 	fiber->ev.waiting = events;
+	fiber->ev.settling = 1;
 
 	for (i = 0; NULL != events[i]; i++) {
 		hint = prepare_ev(FBR_A_ events[i]);
@@ -718,12 +1303,21 @@ int fbr_ev_wait(FBR_P_ struct fbr_ev_base *events[])
 			events[i]->arrived = 1;
 			break;
 		case EV_AH_EINVAL:
+			fiber->ev.settling = 0;
 			return_error(-1, FBR_EINVAL);
 		}
 	}
 
+	if (interruptible && fiber->deadline.cancelled)
+		/* Would block, but nothing is going to be waited for */
+		fiber->ev.arrived = 1;
+
+	fiber->ev.settling = 0;
+	fiber->ev.interruptible = interruptible;
 	while (0 == fiber->ev.arrived)
 		fbr_yield(FBR_A);
+	fiber->ev.interruptible = 0;
+	fiber->ev.settling = 1;
 
 	for (i = 0; NULL != events[i]; i++) {
 		if (events[i]->arrived) {
@@ -732,10 +1326,52 @@ int fbr_ev_wait(FBR_P_ struct fbr_ev_base *events[])
 		} else
 			cancel_ev(FBR_A_ events[i]);
 	}
+	fiber->ev.settling = 0;
+	if (0 == num) {
+		/* Woken up by fbr_cancel */
+		errno = ECANCELED;
+		return_error(-1, FBR_ECANCELED);
+	}
 	return_success(num);
 }
 
-int fbr_ev_wait_one(FBR_P_ struct fbr_ev_base *one)
+static int ev_wait_deadline(FBR_P_ struct fbr_ev_base *events[])
+{
+	struct fbr_fiber *fiber = CURRENT_FIBER;
+	struct fbr_ev_timer *timer = &fiber->deadline.timer;
+	struct fbr_ev_base **new_events;
+	size_t size;
+	int n_events;
+
+	if (!timer->active)
+		fbr_ev_timer_start(FBR_A_ timer, max(0., fiber->deadline.at -
+					ev_now(fctx->__p->loop)));
+	for (size = 0; NULL != events[size]; size++)
+		;
+	new_events = alloca((size + 2) * sizeof(void *));
+	memcpy(new_events, events, size * sizeof(void *));
+	new_events[size] = &timer->ev_base;
+	new_events[size + 1] = NULL;
+	n_events = ev_wait(FBR_A_ new_events, 1);
+	if (n_events < 0 || !timer->ev_base.arrived)
+		return n_events;
+	/* The timer stays fired until the deadline is changed, so that any
+	 * further wait fails straight away */
+	if (0 == --n_events) {
+		errno = ETIMEDOUT;
+		return_error(-1, FBR_ETIMEDOUT);
+	}
+	return_success(n_events);
+}
+
+int fbr_ev_wait(FBR_P_ struct fbr_ev_base *events[])
+{
+	if (CURRENT_FIBER->deadline.at > 0.)
+		return ev_wait_deadline(FBR_A_ events);
+	return ev_wait(FBR_A_ events, 1);
+}
+
+static int ev_wait_one(FBR_P_ struct fbr_ev_base *one, int interruptible)
 {
 	struct fbr_fiber *fiber = CURRENT_FIBER;
 	enum ev_action_hint hint;
@@ -743,6 +1379,7 @@ int fbr_ev_wait_one(FBR_P_ struct fbr_ev_base *one)
 
 	fiber->ev.arrived = 0;
 	fiber->ev.waiting = events;
+	fiber->ev.settling = 1;
 
 	hint = prepare_ev(FBR_A_ one);
 	switch (hint) {
@@ -751,39 +1388,59 @@ int fbr_ev_wait_one(FBR_P_ struct fbr_ev_base *one)
 	case EV_AH_ARRIVED:
 		goto finish;
 	case EV_AH_EINVAL:
+		fiber->ev.settling = 0;
 		return_error(-1, FBR_EINVAL);
 	}
 
+	fiber->ev.settling = 0;
+	fiber->ev.interruptible = interruptible;
 	while (0 == fiber->ev.arrived)
 		fbr_yield(FBR_A);
-
+	fiber->ev.interruptible = 0;
+	fiber->ev.settling = 1;
+
+	if (!one->arrived) {
+		/* Woken up by fbr_cancel */
+		cancel_ev(FBR_A_ one);
+		fiber->ev.settling = 0;
+		errno = ECANCELED;
+		return_error(-1, FBR_ECANCELED);
+	}
 finish:
 	finish_ev(FBR_A_ one);
+	fiber->ev.settling = 0;
 	return 0;
 }
 
+int fbr_ev_wait_one(FBR_P_ struct fbr_ev_base *one)
+{
+	struct fbr_fiber *fiber = CURRENT_FIBER;
+	struct fbr_ev_base *events[] = {one, NULL};
+
+	if (fiber->deadline.at > 0. || fiber->deadline.cancelled) {
+		if (-1 == fbr_ev_wait(FBR_A_ events))
+			return -1;
+		return 0;
+	}
+	return ev_wait_one(FBR_A_ one, 1);
+}
+
 int fbr_ev_wait_one_wto(FBR_P_ struct fbr_ev_base *one, ev_tstamp timeout)
 {
 	int n_events;
 	struct fbr_ev_base *events[] = {one, NULL, NULL};
-	ev_timer timer;
-	struct fbr_ev_watcher twatcher;
-	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
+	struct fbr_ev_timer timer;
 
-	ev_timer_init(&timer, NULL, timeout, 0.);
-	ev_timer_start(fctx->__p->loop, &timer);
-
-	fbr_ev_watcher_init(FBR_A_ &twatcher,
-			(struct ev_watcher *)&timer);
-	dtor.func = watcher_timer_dtor;
-	dtor.arg = &timer;
-	fbr_destructor_add(FBR_A_ &dtor);
-	events[1] = &twatcher.ev_base;
+	fbr_ev_timer_init(FBR_A_ &timer);
+	fbr_ev_timer_start(FBR_A_ &timer, timeout);
+	events[1] = &timer.ev_base;
 
 	n_events = fbr_ev_wait(FBR_A_ events);
-	fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
+	fbr_ev_timer_stop(FBR_A_ &timer);
 
-	if (n_events > 0 && events[0]->arrived)
+	if (n_events < 0)
+		return -1;
+	if (events[0]->arrived)
 		return 0;
 	errno = ETIMEDOUT;
 	return -1;
@@ -802,6 +1459,8 @@ int fbr_transfer(FBR_P_ fbr_id_t to)
 	fctx->__p->sp->fiber = callee;
 	fill_trace_info(FBR_A_ &fctx->__p->sp->tinfo);
 
+	callee->slice.started = 0.;
+	callee->slice.calls = 0;
 	coro_transfer(&caller->ctx, &callee->ctx);
 
 	return_success(0);
@@ -815,6 +1474,8 @@ void fbr_yield(FBR_P)
 			fctx->__p->sp->fiber != &fctx->__p->root);
 	callee = fctx->__p->sp->fiber;
 	caller = (--fctx->__p->sp)->fiber;
+	caller->slice.started = 0.;
+	caller->slice.calls = 0;
 	coro_transfer(&callee->ctx, &caller->ctx);
 }
 
@@ -872,7 +1533,10 @@ int fbr_connect(FBR_P_ int sockfd, const struct sockaddr *addr,
 	dtor.arg = &io;
 	fbr_destructor_add(FBR_A_ &dtor);
 	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
-	fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
+	if (-1 == fbr_ev_wait_one(FBR_A_ &watcher.ev_base)) {
+		fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
+		return -1;
+	}
 
 	len = sizeof(r);
 	if (-1 == getsockopt(sockfd, SOL_SOCKET, SO_ERROR, (void *)&r, &len)) {
@@ -924,6 +1588,14 @@ int fbr_connect_wto(FBR_P_ int sockfd, const struct sockaddr *addr,
 }
 
 
+/* Only a non-blocking fd may be tried before waiting for it, as the call
+ * would block the whole thread otherwise. Asking the kernel would cost a
+ * syscall per call, so the user has to vouch for the descriptors. */
+static int io_optimistic(FBR_P)
+{
+	return fctx->__p->optimistic_io && fctx->__p->nonblocking_fds;
+}
+
 ssize_t fbr_read(FBR_P_ int fd, void *buf, size_t count)
 {
 	ssize_t r;
@@ -931,6 +1603,15 @@ ssize_t fbr_read(FBR_P_ int fd, void *buf, size_t count)
 	struct fbr_ev_watcher watcher;
 	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
 
+	/* Data is likely to be there already, go waiting only if it's not */
+	if (io_optimistic(FBR_A)) {
+		do {
+			r = read(fd, buf, count);
+		} while (-1 == r && EINTR == errno);
+		if (-1 != r || EAGAIN != errno)
+			return r;
+	}
+
 	ev_io_init(&io, NULL, fd, EV_READ);
 	ev_io_start(fctx->__p->loop, &io);
 	dtor.func = watcher_io_dtor;
@@ -938,7 +1619,10 @@ ssize_t fbr_read(FBR_P_ int fd, void *buf, size_t count)
 	fbr_destructor_add(FBR_A_ &dtor);
 
 	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
-	fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
+	if (-1 == fbr_ev_wait_one(FBR_A_ &watcher.ev_base)) {
+		fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
+		return -1;
+	}
 
 	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
 	do {
@@ -958,6 +1642,14 @@ ssize_t fbr_read_wto(FBR_P_ int fd, void *buf, size_t count, ev_tstamp timeout)
 	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
 	int rc = 0;
 
+	if (io_optimistic(FBR_A)) {
+		do {
+			r = read(fd, buf, count);
+		} while (-1 == r && EINTR == errno);
+		if (-1 != r || EAGAIN != errno)
+			return r;
+	}
+
 	ev_io_init(&io, NULL, fd, EV_READ);
 	ev_io_start(fctx->__p->loop, &io);
 	dtor.func = watcher_io_dtor;
@@ -986,6 +1678,23 @@ ssize_t fbr_read_all(FBR_P_ int fd, void *buf, size_t count)
 	ev_io io;
 	struct fbr_ev_watcher watcher;
 	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
+	int optimistic = io_optimistic(FBR_A);
+
+	while (optimistic && count != done) {
+		r = read(fd, buf + done, count - done);
+		if (-1 == r) {
+			if (EINTR == errno)
+				continue;
+			if (EAGAIN == errno)
+				break;
+			return -1;
+		}
+		if (0 == r)
+			return (ssize_t)done;
+		done += r;
+	}
+	if (count == done)
+		return (ssize_t)done;
 
 	ev_io_init(&io, NULL, fd, EV_READ);
 	ev_io_start(fctx->__p->loop, &io);
@@ -997,7 +1706,8 @@ ssize_t fbr_read_all(FBR_P_ int fd, void *buf, size_t count)
 
 	while (count != done) {
 next:
-		fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
+		if (-1 == fbr_ev_wait_one(FBR_A_ &watcher.ev_base))
+			goto error;
 		for (;;) {
 			r = read(fd, buf + done, count - done);
 			if (-1 == r) {
@@ -1031,11 +1741,10 @@ ssize_t fbr_read_all_wto(FBR_P_ int fd, void *buf, size_t count, ev_tstamp timeo
 	ssize_t r;
 	size_t done = 0;
 	ev_io io;
-	struct fbr_ev_watcher watcher, twatcher;
+	struct fbr_ev_watcher watcher;
+	struct fbr_ev_timer timer;
 	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
-	struct fbr_destructor dtor2 = FBR_DESTRUCTOR_INITIALIZER;
 	struct fbr_ev_base *events[] = {NULL, NULL, NULL};
-	ev_timer timer;
 
 	ev_io_init(&io, NULL, fd, EV_READ);
 	ev_io_start(fctx->__p->loop, &io);
@@ -1046,19 +1755,14 @@ ssize_t fbr_read_all_wto(FBR_P_ int fd, void *buf, size_t count, ev_tstamp timeo
 	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
 	events[0] = &watcher.ev_base;
 
-	ev_timer_init(&timer, NULL, timeout, 0.);
-	ev_timer_start(fctx->__p->loop, &timer);
-
-	fbr_ev_watcher_init(FBR_A_ &twatcher,
-			(struct ev_watcher *)&timer);
-	dtor2.func = watcher_timer_dtor;
-	dtor2.arg = &timer;
-	fbr_destructor_add(FBR_A_ &dtor2);
-	events[1] = &twatcher.ev_base;
+	fbr_ev_timer_init(FBR_A_ &timer);
+	fbr_ev_timer_start(FBR_A_ &timer, timeout);
+	events[1] = &timer.ev_base;
 
 	while (count != done) {
 next:
-		fbr_ev_wait(FBR_A_ events);
+		if (-1 == fbr_ev_wait(FBR_A_ events))
+			goto error;
 		if (events[1]->arrived)
 			goto error;
 
@@ -1081,15 +1785,13 @@ next:
 		done += r;
 	}
 	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	fbr_destructor_remove(FBR_A_ &dtor2, 0 /* Call it? */);
-	ev_timer_stop(fctx->__p->loop, &timer);
+	fbr_ev_timer_stop(FBR_A_ &timer);
 	ev_io_stop(fctx->__p->loop, &io);
 	return (ssize_t)done;
 
 error:
 	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	fbr_destructor_remove(FBR_A_ &dtor2, 0 /* Call it? */);
-	ev_timer_stop(fctx->__p->loop, &timer);
+	fbr_ev_timer_stop(FBR_A_ &timer);
 	ev_io_stop(fctx->__p->loop, &io);
 	return -1;
 }
@@ -1147,6 +1849,14 @@ ssize_t fbr_write(FBR_P_ int fd, const void *buf, size_t count)
 	struct fbr_ev_watcher watcher;
 	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
 
+	if (io_optimistic(FBR_A)) {
+		do {
+			r = write(fd, buf, count);
+		} while (-1 == r && EINTR == errno);
+		if (-1 != r || EAGAIN != errno)
+			return r;
+	}
+
 	ev_io_init(&io, NULL, fd, EV_WRITE);
 	ev_io_start(fctx->__p->loop, &io);
 	dtor.func = watcher_io_dtor;
@@ -1154,7 +1864,10 @@ ssize_t fbr_write(FBR_P_ int fd, const void *buf, size_t count)
 	fbr_destructor_add(FBR_A_ &dtor);
 
 	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
-	fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
+	if (-1 == fbr_ev_wait_one(FBR_A_ &watcher.ev_base)) {
+		fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
+		return -1;
+	}
 
 	do {
 		r = write(fd, buf, count);
@@ -1173,6 +1886,14 @@ ssize_t fbr_write_wto(FBR_P_ int fd, const void *buf, size_t count, ev_tstamp ti
 	struct fbr_ev_watcher watcher;
 	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
 
+	if (io_optimistic(FBR_A)) {
+		do {
+			r = write(fd, buf, count);
+		} while (-1 == r && EINTR == errno);
+		if (-1 != r || EAGAIN != errno)
+			return r;
+	}
+
 	ev_io_init(&io, NULL, fd, EV_WRITE);
 	ev_io_start(fctx->__p->loop, &io);
 	dtor.func = watcher_io_dtor;
@@ -1199,6 +1920,21 @@ ssize_t fbr_write_all(FBR_P_ int fd, const void *buf, size_t count)
 	ev_io io;
 	struct fbr_ev_watcher watcher;
 	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
+	int optimistic = io_optimistic(FBR_A);
+
+	while (optimistic && count != done) {
+		r = write(fd, buf + done, count - done);
+		if (-1 == r) {
+			if (EINTR == errno)
+				continue;
+			if (EAGAIN == errno)
+				break;
+			return -1;
+		}
+		done += r;
+	}
+	if (count == done)
+		return (ssize_t)done;
 
 	ev_io_init(&io, NULL, fd, EV_WRITE);
 	ev_io_start(fctx->__p->loop, &io);
@@ -1210,7 +1946,8 @@ ssize_t fbr_write_all(FBR_P_ int fd, const void *buf, size_t count)
 
 	while (count != done) {
 next:
-		fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
+		if (-1 == fbr_ev_wait_one(FBR_A_ &watcher.ev_base))
+			goto error;
 		for (;;) {
 			r = write(fd, buf + done, count - done);
 			if (-1 == r) {
@@ -1242,11 +1979,10 @@ ssize_t fbr_write_all_wto(FBR_P_ int fd, const void *buf, size_t count, ev_tstam
 	ssize_t r;
 	size_t done = 0;
 	ev_io io;
-	struct fbr_ev_watcher watcher, twatcher;
+	struct fbr_ev_watcher watcher;
+	struct fbr_ev_timer timer;
 	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
-	struct fbr_destructor dtor2 = FBR_DESTRUCTOR_INITIALIZER;
 	struct fbr_ev_base *events[] = {NULL, NULL, NULL};
-	ev_timer timer;
 
 	ev_io_init(&io, NULL, fd, EV_WRITE);
 	ev_io_start(fctx->__p->loop, &io);
@@ -1257,19 +1993,14 @@ ssize_t fbr_write_all_wto(FBR_P_ int fd, const void *buf, size_t count, ev_tstam
 	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
 	events[0] = &watcher.ev_base;
 
-	ev_timer_init(&timer, NULL, timeout, 0.);
-	ev_timer_start(fctx->__p->loop, &timer);
-
-	fbr_ev_watcher_init(FBR_A_ &twatcher,
-			(struct ev_watcher *)&timer);
-	dtor2.func = watcher_timer_dtor;
-	dtor2.arg = &timer;
-	fbr_destructor_add(FBR_A_ &dtor2);
-	events[1] = &twatcher.ev_base;
+	fbr_ev_timer_init(FBR_A_ &timer);
+	fbr_ev_timer_start(FBR_A_ &timer, timeout);
+	events[1] = &timer.ev_base;
 
 	while (count != done) {
 next:
-		fbr_ev_wait(FBR_A_ events);
+		if (-1 == fbr_ev_wait(FBR_A_ events))
+			goto error;
 		if (events[1]->arrived) {
 			errno = ETIMEDOUT;
 			goto error;
@@ -1292,15 +2023,13 @@ next:
 		done += r;
 	}
 	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	fbr_destructor_remove(FBR_A_ &dtor2, 0 /* Call it? */);
-	ev_timer_stop(fctx->__p->loop, &timer);
+	fbr_ev_timer_stop(FBR_A_ &timer);
 	ev_io_stop(fctx->__p->loop, &io);
 	return (ssize_t)done;
 
 error:
 	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	fbr_destructor_remove(FBR_A_ &dtor2, 0 /* Call it? */);
-	ev_timer_stop(fctx->__p->loop, &timer);
+	fbr_ev_timer_stop(FBR_A_ &timer);
 	ev_io_stop(fctx->__p->loop, &io);
 	return -1;
 }
@@ -1309,10 +2038,20 @@ error:
 ssize_t fbr_recvfrom(FBR_P_ int sockfd, void *buf, size_t len, int flags,
 		struct sockaddr *src_addr, socklen_t *addrlen)
 {
+	ssize_t r;
 	ev_io io;
 	struct fbr_ev_watcher watcher;
 	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
 
+	if (fctx->__p->optimistic_io) {
+		do {
+			r = recvfrom(sockfd, buf, len, flags | MSG_DONTWAIT,
+					src_addr, addrlen);
+		} while (-1 == r && EINTR == errno);
+		if (-1 != r || EAGAIN != errno)
+			return r;
+	}
+
 	ev_io_init(&io, NULL, sockfd, EV_READ);
 	ev_io_start(fctx->__p->loop, &io);
 	dtor.func = watcher_io_dtor;
@@ -1320,7 +2059,10 @@ ssize_t fbr_recvfrom(FBR_P_ int sockfd, void *buf, size_t len, int flags,
 	fbr_destructor_add(FBR_A_ &dtor);
 
 	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
-	fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
+	if (-1 == fbr_ev_wait_one(FBR_A_ &watcher.ev_base)) {
+		fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
+		return -1;
+	}
 
 	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
 	ev_io_stop(fctx->__p->loop, &io);
@@ -1330,10 +2072,19 @@ ssize_t fbr_recvfrom(FBR_P_ int sockfd, void *buf, size_t len, int flags,
 
 ssize_t fbr_recv(FBR_P_ int sockfd, void *buf, size_t len, int flags)
 {
+	ssize_t r;
 	ev_io io;
 	struct fbr_ev_watcher watcher;
 	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
 
+	if (fctx->__p->optimistic_io) {
+		do {
+			r = recv(sockfd, buf, len, flags | MSG_DONTWAIT);
+		} while (-1 == r && EINTR == errno);
+		if (-1 != r || EAGAIN != errno)
+			return r;
+	}
+
 	ev_io_init(&io, NULL, sockfd, EV_READ);
 	ev_io_start(fctx->__p->loop, &io);
 	dtor.func = watcher_io_dtor;
@@ -1341,7 +2092,10 @@ ssize_t fbr_recv(FBR_P_ int sockfd, void *buf, size_t len, int flags)
 	fbr_destructor_add(FBR_A_ &dtor);
 
 	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
-	fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
+	if (-1 == fbr_ev_wait_one(FBR_A_ &watcher.ev_base)) {
+		fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
+		return -1;
+	}
 
 	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
 	ev_io_stop(fctx->__p->loop, &io);
@@ -1352,10 +2106,20 @@ ssize_t fbr_recv(FBR_P_ int sockfd, void *buf, size_t len, int flags)
 ssize_t fbr_sendto(FBR_P_ int sockfd, const void *buf, size_t len, int flags,
 		const struct sockaddr *dest_addr, socklen_t addrlen)
 {
+	ssize_t r;
 	ev_io io;
 	struct fbr_ev_watcher watcher;
 	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
 
+	if (fctx->__p->optimistic_io) {
+		do {
+			r = sendto(sockfd, buf, len, flags | MSG_DONTWAIT,
+					dest_addr, addrlen);
+		} while (-1 == r && EINTR == errno);
+		if (-1 != r || EAGAIN != errno)
+			return r;
+	}
+
 	ev_io_init(&io, NULL, sockfd, EV_WRITE);
 	ev_io_start(fctx->__p->loop, &io);
 	dtor.func = watcher_io_dtor;
@@ -1363,7 +2127,10 @@ ssize_t fbr_sendto(FBR_P_ int sockfd, const void *buf, size_t len, int flags,
 	fbr_destructor_add(FBR_A_ &dtor);
 
 	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
-	fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
+	if (-1 == fbr_ev_wait_one(FBR_A_ &watcher.ev_base)) {
+		fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
+		return -1;
+	}
 
 	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
 	ev_io_stop(fctx->__p->loop, &io);
@@ -1373,10 +2140,19 @@ ssize_t fbr_sendto(FBR_P_ int sockfd, const void *buf, size_t len, int flags,
 
 ssize_t fbr_send(FBR_P_ int sockfd, const void *buf, size_t len, int flags)
 {
+	ssize_t r;
 	ev_io io;
 	struct fbr_ev_watcher watcher;
 	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
 
+	if (fctx->__p->optimistic_io) {
+		do {
+			r = send(sockfd, buf, len, flags | MSG_DONTWAIT);
+		} while (-1 == r && EINTR == errno);
+		if (-1 != r || EAGAIN != errno)
+			return r;
+	}
+
 	ev_io_init(&io, NULL, sockfd, EV_WRITE);
 	ev_io_start(fctx->__p->loop, &io);
 	dtor.func = watcher_io_dtor;
@@ -1384,7 +2160,10 @@ ssize_t fbr_send(FBR_P_ int sockfd, const void *buf, size_t len, int flags)
 	fbr_destructor_add(FBR_A_ &dtor);
 
 	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
-	fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
+	if (-1 == fbr_ev_wait_one(FBR_A_ &watcher.ev_base)) {
+		fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
+		return -1;
+	}
 
 	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
 	ev_io_stop(fctx->__p->loop, &io);
@@ -1399,6 +2178,14 @@ int fbr_accept(FBR_P_ int sockfd, struct sockaddr *addr, socklen_t *addrlen)
 	struct fbr_ev_watcher watcher;
 	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
 
+	if (io_optimistic(FBR_A)) {
+		do {
+			r = accept(sockfd, addr, addrlen);
+		} while (-1 == r && EINTR == errno);
+		if (-1 != r || EAGAIN != errno)
+			return r;
+	}
+
 	ev_io_init(&io, NULL, sockfd, EV_READ);
 	ev_io_start(fctx->__p->loop, &io);
 	dtor.func = watcher_io_dtor;
@@ -1406,7 +2193,10 @@ int fbr_accept(FBR_P_ int sockfd, struct sockaddr *addr, socklen_t *addrlen)
 	fbr_destructor_add(FBR_A_ &dtor);
 
 	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
-	fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
+	if (-1 == fbr_ev_wait_one(FBR_A_ &watcher.ev_base)) {
+		fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
+		return -1;
+	}
 
 	do {
 		r = accept(sockfd, addr, addrlen);
@@ -1418,914 +2208,3491 @@ int fbr_accept(FBR_P_ int sockfd, struct sockaddr *addr, socklen_t *addrlen)
 	return r;
 }
 
-ev_tstamp fbr_sleep(FBR_P_ ev_tstamp seconds)
+/* Waits until fd is ready for events or deadline passes, negative deadline
+ * means no deadline. Returns -1 with errno set to ETIMEDOUT on timeout. */
+static int wait_fd(FBR_P_ int fd, int events, ev_tstamp deadline)
 {
-	ev_timer timer;
+	ev_io io;
 	struct fbr_ev_watcher watcher;
 	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
-	ev_tstamp expected = ev_now(fctx->__p->loop) + seconds;
+	int rc;
 
-	ev_timer_init(&timer, NULL, seconds, 0.);
-	ev_timer_start(fctx->__p->loop, &timer);
-	dtor.func = watcher_timer_dtor;
-	dtor.arg = &timer;
+	ev_io_init(&io, NULL, fd, events);
+	ev_io_start(fctx->__p->loop, &io);
+	dtor.func = watcher_io_dtor;
+	dtor.arg = &io;
 	fbr_destructor_add(FBR_A_ &dtor);
 
-	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&timer);
-	fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
+	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&io);
+	if (deadline < 0.)
+		rc = fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
+	else
+		rc = fbr_ev_wait_one_wto(FBR_A_ &watcher.ev_base,
+				max(0., deadline - ev_now(fctx->__p->loop)));
 
 	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	ev_timer_stop(fctx->__p->loop, &timer);
-
-	return max(0., expected - ev_now(fctx->__p->loop));
+	ev_io_stop(fctx->__p->loop, &io);
+	return rc;
 }
 
-static void watcher_async_dtor(FBR_P_ void *_arg)
+static ev_tstamp deadline_after(FBR_P_ ev_tstamp timeout)
 {
-	struct ev_async *w = _arg;
-	ev_async_stop(fctx->__p->loop, w);
+	return ev_now(fctx->__p->loop) + timeout;
 }
 
-void fbr_async_wait(FBR_P_ ev_async *w)
+static ssize_t do_readv(FBR_P_ int fd, const struct iovec *iov, int iovcnt,
+		ev_tstamp deadline)
 {
-	struct fbr_ev_watcher watcher;
-	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
-
-	dtor.func = watcher_async_dtor;
-	dtor.arg = w;
-	fbr_destructor_add(FBR_A_ &dtor);
-
-	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)w);
-	fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
-
-	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	ev_async_stop(fctx->__p->loop, w);
+	ssize_t r;
+	int wait = !io_optimistic(FBR_A);
 
-	return;
+	for (;;) {
+		if (wait && -1 == wait_fd(FBR_A_ fd, EV_READ, deadline))
+			return -1;
+		r = readv(fd, iov, iovcnt);
+		if (-1 != r)
+			return r;
+		if (EAGAIN != errno && EINTR != errno)
+			return -1;
+		wait = (EAGAIN == errno);
+	}
 }
 
-static unsigned get_page_size()
+ssize_t fbr_readv(FBR_P_ int fd, const struct iovec *iov, int iovcnt)
 {
-	static unsigned sz;
-	long retval;
-	if (sz > 0)
-		return sz;
-	retval = sysconf(_SC_PAGESIZE);
-	if (0 > retval) {
-		fprintf(stderr, "libevfibers: sysconf(_SC_PAGESIZE): %s",
-				strerror(errno));
-		abort();
-	}
-	sz = retval;
-	return sz;
+	return do_readv(FBR_A_ fd, iov, iovcnt, -1.);
 }
 
-static size_t round_up_to_page_size(size_t size)
+ssize_t fbr_readv_wto(FBR_P_ int fd, const struct iovec *iov, int iovcnt,
+		ev_tstamp timeout)
 {
-	unsigned sz = get_page_size();
-	size_t remainder;
-	remainder = size % sz;
-	if (remainder == 0)
-		return size;
-	return size + sz - remainder;
+	return do_readv(FBR_A_ fd, iov, iovcnt, deadline_after(FBR_A_ timeout));
 }
 
-fbr_id_t fbr_create(FBR_P_ const char *name, fbr_fiber_func_t func, void *arg,
-		size_t stack_size)
+static ssize_t do_writev(FBR_P_ int fd, const struct iovec *iov, int iovcnt,
+		ev_tstamp deadline)
 {
-	struct fbr_fiber *fiber;
-	if (!LIST_EMPTY(&fctx->__p->reclaimed)) {
-		fiber = LIST_FIRST(&fctx->__p->reclaimed);
-		LIST_REMOVE(fiber, entries.reclaimed);
-	} else {
-		fiber = malloc(sizeof(struct fbr_fiber));
-		memset(fiber, 0x00, sizeof(struct fbr_fiber));
-		if (0 == stack_size)
-			stack_size = FBR_STACK_SIZE;
-		stack_size = round_up_to_page_size(stack_size);
-		fiber->stack = malloc(stack_size);
-		if (NULL == fiber->stack)
-			err(EXIT_FAILURE, "malloc failed");
-		fiber->stack_size = stack_size;
-		(void)VALGRIND_STACK_REGISTER(fiber->stack, fiber->stack +
-				stack_size);
-		fbr_cond_init(FBR_A_ &fiber->reclaim_cond);
-		fiber->id = fctx->__p->last_id++;
+	ssize_t r;
+	int wait = !io_optimistic(FBR_A);
+
+	for (;;) {
+		if (wait && -1 == wait_fd(FBR_A_ fd, EV_WRITE, deadline))
+			return -1;
+		r = writev(fd, iov, iovcnt);
+		if (-1 != r)
+			return r;
+		if (EAGAIN != errno && EINTR != errno)
+			return -1;
+		wait = (EAGAIN == errno);
 	}
-	coro_create(&fiber->ctx, (coro_func)call_wrapper, FBR_A, fiber->stack,
-			fiber->stack_size);
-	LIST_INIT(&fiber->children);
-	LIST_INIT(&fiber->pool);
-	TAILQ_INIT(&fiber->destructors);
-	strncpy(fiber->name, name, FBR_MAX_FIBER_NAME - 1);
-	fiber->func = func;
-	fiber->func_arg = arg;
-	LIST_INSERT_HEAD(&CURRENT_FIBER->children, fiber, entries.children);
-	fiber->parent = CURRENT_FIBER;
-	fiber->no_reclaim = 0;
-	fiber->want_reclaim = 0;
-	return fbr_id_pack(fiber);
 }
 
-int fbr_disown(FBR_P_ fbr_id_t parent_id)
+ssize_t fbr_writev(FBR_P_ int fd, const struct iovec *iov, int iovcnt)
 {
-	struct fbr_fiber *fiber, *parent;
-	if (!fbr_id_isnull(parent_id))
-		unpack_transfer_errno(-1, &parent, parent_id);
-	else
-		parent = &fctx->__p->root;
-	fiber = CURRENT_FIBER;
-	LIST_REMOVE(fiber, entries.children);
-	LIST_INSERT_HEAD(&parent->children, fiber, entries.children);
-	fiber->parent = parent;
-	return_success(0);
+	return do_writev(FBR_A_ fd, iov, iovcnt, -1.);
 }
 
-fbr_id_t fbr_parent(FBR_P)
+ssize_t fbr_writev_wto(FBR_P_ int fd, const struct iovec *iov, int iovcnt,
+		ev_tstamp timeout)
 {
-	struct fbr_fiber *fiber = CURRENT_FIBER;
-	if (fiber->parent == &fctx->__p->root)
-		return FBR_ID_NULL;
-	return fbr_id_pack(fiber->parent);
+	return do_writev(FBR_A_ fd, iov, iovcnt,
+			deadline_after(FBR_A_ timeout));
 }
 
-void *fbr_calloc(FBR_P_ unsigned int nmemb, size_t size)
+static ssize_t do_writev_all(FBR_P_ int fd, const struct iovec *iov,
+		int iovcnt, ev_tstamp deadline)
 {
-	void *ptr;
-	fprintf(stderr, "libevfibers: fbr_calloc is deprecated\n");
-	ptr = allocate_in_fiber(FBR_A_ nmemb * size, CURRENT_FIBER);
-	memset(ptr, 0x00, nmemb * size);
-	return ptr;
+	struct iovec head;
+	size_t done = 0;
+	size_t skip = 0;
+	ssize_t r;
+
+	if (iovcnt < 0 || iovcnt > IOV_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	while (iovcnt > 0) {
+		if (skip > 0) {
+			/* Finish the partially written buffer on its own, the
+			 * caller's array is left untouched */
+			head.iov_base = (char *)iov->iov_base + skip;
+			head.iov_len = iov->iov_len - skip;
+			r = do_writev(FBR_A_ fd, &head, 1, deadline);
+		} else
+			r = do_writev(FBR_A_ fd, iov, iovcnt, deadline);
+		if (-1 == r)
+			return -1;
+		done += r;
+		r += skip;
+		skip = 0;
+		/* Skip what has been written, zero-length buffers included */
+		while (iovcnt > 0 && (size_t)r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0)
+			skip = r;
+	}
+	return (ssize_t)done;
 }
 
-void *fbr_alloc(FBR_P_ size_t size)
+ssize_t fbr_writev_all(FBR_P_ int fd, const struct iovec *iov, int iovcnt)
 {
-	fprintf(stderr, "libevfibers: fbr_alloc is deprecated\n");
-	return allocate_in_fiber(FBR_A_ size, CURRENT_FIBER);
+	return do_writev_all(FBR_A_ fd, iov, iovcnt, -1.);
 }
 
-void fbr_alloc_set_destructor(_unused_ FBR_P_ void *ptr,
-		fbr_alloc_destructor_func_t func, void *context)
+ssize_t fbr_writev_all_wto(FBR_P_ int fd, const struct iovec *iov, int iovcnt,
+		ev_tstamp timeout)
 {
-	struct mem_pool *pool_entry;
-	fprintf(stderr, "libevfibers:"
-		       " fbr_alloc_set_destructor is deprecated\n");
-	pool_entry = (struct mem_pool *)ptr - 1;
-	pool_entry->destructor = func;
-	pool_entry->destructor_context = context;
+	return do_writev_all(FBR_A_ fd, iov, iovcnt,
+			deadline_after(FBR_A_ timeout));
 }
 
-void fbr_free(FBR_P_ void *ptr)
+static ssize_t do_recvmsg(FBR_P_ int sockfd, struct msghdr *msg, int flags,
+		ev_tstamp deadline)
 {
-	fprintf(stderr, "libevfibers: fbr_free is deprecated\n");
-	fbr_free_in_fiber(FBR_A_ CURRENT_FIBER, ptr, 1);
+	ssize_t r;
+	int wait = !fctx->__p->optimistic_io;
+
+	for (;;) {
+		if (wait && -1 == wait_fd(FBR_A_ sockfd, EV_READ, deadline))
+			return -1;
+		r = recvmsg(sockfd, msg, flags | MSG_DONTWAIT);
+		if (-1 != r)
+			return r;
+		if (EAGAIN != errno && EINTR != errno)
+			return -1;
+		wait = (EAGAIN == errno);
+	}
 }
 
-void fbr_free_nd(FBR_P_ void *ptr)
+ssize_t fbr_recvmsg(FBR_P_ int sockfd, struct msghdr *msg, int flags)
 {
-	fprintf(stderr, "libevfibers: fbr_free_nd is deprecated\n");
-	fbr_free_in_fiber(FBR_A_ CURRENT_FIBER, ptr, 0);
+	return do_recvmsg(FBR_A_ sockfd, msg, flags, -1.);
 }
 
-void fbr_dump_stack(FBR_P_ fbr_logutil_func_t log)
+ssize_t fbr_recvmsg_wto(FBR_P_ int sockfd, struct msghdr *msg, int flags,
+		ev_tstamp timeout)
 {
-	struct fbr_stack_item *ptr = fctx->__p->sp;
-	(*log)(FBR_A_ "%s", "Fiber call stack:");
-	(*log)(FBR_A_ "%s", "-------------------------------");
-	while (ptr >= fctx->__p->stack) {
-		(*log)(FBR_A_ "fiber_call: %p\t%s",
-				ptr->fiber,
-				ptr->fiber->name);
-		print_trace_info(FBR_A_ &ptr->tinfo, log);
-		(*log)(FBR_A_ "%s", "-------------------------------");
-		ptr--;
-	}
+	return do_recvmsg(FBR_A_ sockfd, msg, flags,
+			deadline_after(FBR_A_ timeout));
 }
 
-static void transfer_later(FBR_P_ struct fbr_id_tailq_i *item)
+static ssize_t do_sendmsg(FBR_P_ int sockfd, const struct msghdr *msg,
+		int flags, ev_tstamp deadline)
 {
-	int was_empty;
-	was_empty = TAILQ_EMPTY(&fctx->__p->pending_fibers);
-	TAILQ_INSERT_TAIL(&fctx->__p->pending_fibers, item, entries);
-	item->head = &fctx->__p->pending_fibers;
-	if (was_empty && !TAILQ_EMPTY(&fctx->__p->pending_fibers)) {
-		ev_async_start(fctx->__p->loop, &fctx->__p->pending_async);
+	ssize_t r;
+	int wait = !fctx->__p->optimistic_io;
+
+	for (;;) {
+		if (wait && -1 == wait_fd(FBR_A_ sockfd, EV_WRITE, deadline))
+			return -1;
+		r = sendmsg(sockfd, msg, flags | MSG_DONTWAIT);
+		if (-1 != r)
+			return r;
+		if (EAGAIN != errno && EINTR != errno)
+			return -1;
+		wait = (EAGAIN == errno);
 	}
-	ev_async_send(fctx->__p->loop, &fctx->__p->pending_async);
 }
 
-static void transfer_later_tailq(FBR_P_ struct fbr_id_tailq *tailq)
+ssize_t fbr_sendmsg(FBR_P_ int sockfd, const struct msghdr *msg, int flags)
 {
-	int was_empty;
-	struct fbr_id_tailq_i *item;
-	TAILQ_FOREACH(item, tailq, entries) {
-		item->head = &fctx->__p->pending_fibers;
-	}
-	was_empty = TAILQ_EMPTY(&fctx->__p->pending_fibers);
-	TAILQ_CONCAT(&fctx->__p->pending_fibers, tailq, entries);
-	if (was_empty && !TAILQ_EMPTY(&fctx->__p->pending_fibers)) {
-		ev_async_start(fctx->__p->loop, &fctx->__p->pending_async);
-	}
-	ev_async_send(fctx->__p->loop, &fctx->__p->pending_async);
+	return do_sendmsg(FBR_A_ sockfd, msg, flags, -1.);
 }
 
-void fbr_ev_mutex_init(FBR_P_ struct fbr_ev_mutex *ev,
-		struct fbr_mutex *mutex)
+ssize_t fbr_sendmsg_wto(FBR_P_ int sockfd, const struct msghdr *msg,
+		int flags, ev_tstamp timeout)
 {
-	ev_base_init(FBR_A_ &ev->ev_base, FBR_EV_MUTEX);
-	ev->mutex = mutex;
+	return do_sendmsg(FBR_A_ sockfd, msg, flags,
+			deadline_after(FBR_A_ timeout));
 }
 
-void fbr_mutex_init(_unused_ FBR_P_ struct fbr_mutex *mutex)
+#ifdef FBR_HAVE_MMSG
+static int do_recvmmsg(FBR_P_ int sockfd, struct mmsghdr *msgvec,
+		unsigned int vlen, int flags, ev_tstamp deadline)
 {
-	mutex->locked_by = FBR_ID_NULL;
-	TAILQ_INIT(&mutex->pending);
+	int r;
+	int wait = !fctx->__p->optimistic_io;
+
+	for (;;) {
+		if (wait && -1 == wait_fd(FBR_A_ sockfd, EV_READ, deadline))
+			return -1;
+		r = recvmmsg(sockfd, msgvec, vlen, flags | MSG_DONTWAIT, NULL);
+		if (-1 != r)
+			return r;
+		if (EAGAIN != errno && EINTR != errno)
+			return -1;
+		wait = (EAGAIN == errno);
+	}
 }
 
-void fbr_mutex_lock(FBR_P_ struct fbr_mutex *mutex)
+int fbr_recvmmsg(FBR_P_ int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+		int flags)
 {
-	struct fbr_ev_mutex ev;
-
-	assert(!fbr_id_eq(mutex->locked_by, CURRENT_FIBER_ID) &&
-			"Mutex is already locked by current fiber");
-	fbr_ev_mutex_init(FBR_A_ &ev, mutex);
-	fbr_ev_wait_one(FBR_A_ &ev.ev_base);
-	assert(fbr_id_eq(mutex->locked_by, CURRENT_FIBER_ID));
+	return do_recvmmsg(FBR_A_ sockfd, msgvec, vlen, flags, -1.);
 }
 
-int fbr_mutex_trylock(FBR_P_ struct fbr_mutex *mutex)
+int fbr_recvmmsg_wto(FBR_P_ int sockfd, struct mmsghdr *msgvec,
+		unsigned int vlen, int flags, ev_tstamp timeout)
 {
-	if (fbr_id_isnull(mutex->locked_by)) {
-		mutex->locked_by = CURRENT_FIBER_ID;
-		return 1;
-	}
-	return 0;
+	return do_recvmmsg(FBR_A_ sockfd, msgvec, vlen, flags,
+			deadline_after(FBR_A_ timeout));
 }
 
-void fbr_mutex_unlock(FBR_P_ struct fbr_mutex *mutex)
+static int do_sendmmsg(FBR_P_ int sockfd, struct mmsghdr *msgvec,
+		unsigned int vlen, int flags, ev_tstamp deadline)
 {
-	struct fbr_id_tailq_i *item, *x;
-	struct fbr_fiber *fiber = NULL;
-	assert(fbr_id_eq(mutex->locked_by, CURRENT_FIBER_ID) &&
-			"Can't unlock the mutex, locked by another fiber");
-
-	if (TAILQ_EMPTY(&mutex->pending)) {
-		mutex->locked_by = FBR_ID_NULL;
-		return;
-	}
+	int r;
+	int wait = !fctx->__p->optimistic_io;
 
-	TAILQ_FOREACH_SAFE(item, &mutex->pending, entries, x) {
-		assert(item->head == &mutex->pending);
-		TAILQ_REMOVE(&mutex->pending, item, entries);
-		if (-1 == fbr_id_unpack(FBR_A_ &fiber, item->id)) {
-			fbr_log_e(FBR_A_ "libevfibers: unexpected error trying"
-					" to find a fiber by id: %s",
-					fbr_strerror(FBR_A_ fctx->f_errno));
-			continue;
-		}
-		break;
+	for (;;) {
+		if (wait && -1 == wait_fd(FBR_A_ sockfd, EV_WRITE, deadline))
+			return -1;
+		r = sendmmsg(sockfd, msgvec, vlen, flags | MSG_DONTWAIT);
+		if (-1 != r)
+			return r;
+		if (EAGAIN != errno && EINTR != errno)
+			return -1;
+		wait = (EAGAIN == errno);
 	}
-
-	mutex->locked_by = item->id;
-	assert(!fbr_id_isnull(mutex->locked_by));
-	post_ev(FBR_A_ fiber, item->ev);
-
-	transfer_later(FBR_A_ item);
 }
 
-void fbr_mutex_destroy(_unused_ FBR_P_ _unused_ struct fbr_mutex *mutex)
+int fbr_sendmmsg(FBR_P_ int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+		int flags)
 {
-	/* Since mutex is stack allocated now, this efffeectively turns into
-	 * NOOP. But we might consider adding some cleanup in the future.
-	 */
+	return do_sendmmsg(FBR_A_ sockfd, msgvec, vlen, flags, -1.);
 }
 
-void fbr_ev_cond_var_init(FBR_P_ struct fbr_ev_cond_var *ev,
-		struct fbr_cond_var *cond, struct fbr_mutex *mutex)
+int fbr_sendmmsg_wto(FBR_P_ int sockfd, struct mmsghdr *msgvec,
+		unsigned int vlen, int flags, ev_tstamp timeout)
 {
-	ev_base_init(FBR_A_ &ev->ev_base, FBR_EV_COND_VAR);
-	ev->cond = cond;
-	ev->mutex = mutex;
+	return do_sendmmsg(FBR_A_ sockfd, msgvec, vlen, flags,
+			deadline_after(FBR_A_ timeout));
 }
+#endif
 
-void fbr_cond_init(_unused_ FBR_P_ struct fbr_cond_var *cond)
+static void fd_io_cb(_unused_ EV_P_ ev_io *w, _unused_ int revents)
 {
-	cond->mutex = NULL;
-	TAILQ_INIT(&cond->waiting);
-}
+	struct fbr_fd *fdh = w->data;
+	struct fbr_context *fctx = fdh->fctx;
+	struct fbr_cond_var *cond;
 
-void fbr_cond_destroy(_unused_ FBR_P_ _unused_ struct fbr_cond_var *cond)
-{
-	/* Since condvar is stack allocated now, this efffeectively turns into
-	 * NOOP. But we might consider adding some cleanup in the future.
-	 */
+	cond = (w == &fdh->r_io) ? &fdh->r_cond : &fdh->w_cond;
+	/* Nobody drains the descriptor at the moment, level-triggered watcher
+	 * would fire on every loop iteration until somebody does */
+	if (TAILQ_EMPTY(&cond->waiting)) {
+		ev_io_stop(fctx->__p->loop, w);
+		return;
+	}
+	fbr_cond_broadcast(FBR_A_ cond);
 }
 
-int fbr_cond_wait(FBR_P_ struct fbr_cond_var *cond, struct fbr_mutex *mutex)
+static void fd_idle_cb(_unused_ EV_P_ ev_timer *w, _unused_ int revents)
 {
-	struct fbr_ev_cond_var ev;
-
-	if (mutex && fbr_id_isnull(mutex->locked_by))
-		return_error(-1, FBR_EINVAL);
+	struct fbr_fd *fdh = w->data;
+	struct fbr_context *fctx = fdh->fctx;
+	ev_tstamp remaining;
 
-	fbr_ev_cond_var_init(FBR_A_ &ev, cond, mutex);
-	fbr_ev_wait_one(FBR_A_ &ev.ev_base);
-	return_success(0);
-}
-
-void fbr_cond_broadcast(FBR_P_ struct fbr_cond_var *cond)
-{
-	struct fbr_id_tailq_i *item;
-	struct fbr_fiber *fiber;
-	if (TAILQ_EMPTY(&cond->waiting))
+	remaining = fdh->last_active + fdh->idle_timeout -
+		ev_now(fctx->__p->loop);
+	if (remaining > 0.) {
+		/* There was some activity meanwhile, nobody to bother unless
+		 * somebody is still waiting */
+		if (TAILQ_EMPTY(&fdh->r_cond.waiting) &&
+				TAILQ_EMPTY(&fdh->w_cond.waiting))
+			return;
+		ev_timer_set(w, remaining, 0.);
+		ev_timer_start(fctx->__p->loop, w);
 		return;
-	TAILQ_FOREACH(item, &cond->waiting, entries) {
-		if(-1 == fbr_id_unpack(FBR_A_ &fiber, item->id)) {
-			assert(FBR_ENOFIBER == fctx->f_errno);
-			continue;
-		}
-		post_ev(FBR_A_ fiber, item->ev);
 	}
-	transfer_later_tailq(FBR_A_ &cond->waiting);
+	fbr_cond_broadcast(FBR_A_ &fdh->r_cond);
+	fbr_cond_broadcast(FBR_A_ &fdh->w_cond);
 }
 
-void fbr_cond_signal(FBR_P_ struct fbr_cond_var *cond)
+static int fd_wait(FBR_P_ struct fbr_fd *fdh, ev_io *w,
+		struct fbr_cond_var *cond)
 {
-	struct fbr_id_tailq_i *item;
-	struct fbr_fiber *fiber;
-	if (TAILQ_EMPTY(&cond->waiting))
-		return;
-	item = TAILQ_FIRST(&cond->waiting);
-	if(-1 == fbr_id_unpack(FBR_A_ &fiber, item->id)) {
-		assert(FBR_ENOFIBER == fctx->f_errno);
-		return;
-	}
-	post_ev(FBR_A_ fiber, item->ev);
+	ev_tstamp remaining;
 
-	assert(item->head == &cond->waiting);
-	TAILQ_REMOVE(&cond->waiting, item, entries);
-	transfer_later(FBR_A_ item);
+	if (fdh->idle_timeout > 0.) {
+		remaining = fdh->last_active + fdh->idle_timeout -
+			ev_now(fctx->__p->loop);
+		if (remaining <= 0.) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		if (!ev_is_active(&fdh->idle_timer)) {
+			ev_timer_set(&fdh->idle_timer, remaining, 0.);
+			ev_timer_start(fctx->__p->loop, &fdh->idle_timer);
+		}
+	}
+	if (!ev_is_active(w))
+		ev_io_start(fctx->__p->loop, w);
+	return fbr_cond_wait(FBR_A_ cond, NULL);
 }
 
-int fbr_vrb_init(struct fbr_vrb *vrb, size_t size, const char *file_pattern)
+int fbr_fd_attach(FBR_P_ struct fbr_fd *fdh, int fd)
 {
-	int fd = -1;
-	size_t sz = get_page_size();
-	size = (size ? round_up_to_page_size(size) : sz);
-	void *ptr = MAP_FAILED;
-	char *temp_name = NULL;
-	mode_t old_umask;
-	const mode_t secure_umask = 077;
-
-	temp_name = strdup(file_pattern);
-	if (!temp_name)
+	if (-1 == fbr_fd_nonblock(FBR_A_ fd))
 		return -1;
-	//fctx->__p->vrb_file_pattern);
-	vrb->mem_ptr_size = size * 2 + sz * 2;
-	vrb->mem_ptr = mmap(NULL, vrb->mem_ptr_size, PROT_NONE,
-			FBR_MAP_ANON_FLAG | MAP_PRIVATE, -1, 0);
-	if (MAP_FAILED == vrb->mem_ptr)
-		goto error;
-	vrb->lower_ptr = vrb->mem_ptr + sz;
-	vrb->upper_ptr = vrb->lower_ptr + size;
-	vrb->ptr_size = size;
-	vrb->data_ptr = vrb->lower_ptr;
-	vrb->space_ptr = vrb->lower_ptr;
-
-	old_umask = umask(0);
-	umask(secure_umask);
-	fd = mkstemp(temp_name);
-	umask(old_umask);
-	if (0 >= fd)
-		goto error;
 
-	if (0 > unlink(temp_name))
-		goto error;
-	free(temp_name);
-	temp_name = NULL;
+	fdh->fd = fd;
+	fdh->fctx = fctx;
+	ev_io_init(&fdh->r_io, fd_io_cb, fd, EV_READ);
+	fdh->r_io.data = fdh;
+	ev_io_init(&fdh->w_io, fd_io_cb, fd, EV_WRITE);
+	fdh->w_io.data = fdh;
+	fbr_cond_init(FBR_A_ &fdh->r_cond);
+	fbr_cond_init(FBR_A_ &fdh->w_cond);
+	fdh->idle_timeout = 0.;
+	fdh->last_active = ev_now(fctx->__p->loop);
+	ev_timer_init(&fdh->idle_timer, fd_idle_cb, 0., 0.);
+	fdh->idle_timer.data = fdh;
+	return_success(0);
+}
 
-	if (0 > ftruncate(fd, size))
-		goto error;
+void fbr_fd_detach(FBR_P_ struct fbr_fd *fdh)
+{
+	ev_io_stop(fctx->__p->loop, &fdh->r_io);
+	ev_io_stop(fctx->__p->loop, &fdh->w_io);
+	ev_timer_stop(fctx->__p->loop, &fdh->idle_timer);
+	fdh->fd = -1;
+	fbr_cond_broadcast(FBR_A_ &fdh->r_cond);
+	fbr_cond_broadcast(FBR_A_ &fdh->w_cond);
+}
 
-	ptr = mmap(vrb->lower_ptr, vrb->ptr_size, PROT_READ | PROT_WRITE,
-			MAP_FIXED | MAP_SHARED, fd, 0);
-	if (MAP_FAILED == ptr)
-		goto error;
-	if (ptr != vrb->lower_ptr)
-		goto error;
+void fbr_fd_set_idle_timeout(FBR_P_ struct fbr_fd *fdh, ev_tstamp timeout)
+{
+	struct ev_loop *loop = fctx->__p->loop;
 
-	ptr = mmap(vrb->upper_ptr, vrb->ptr_size, PROT_READ | PROT_WRITE,
-			MAP_FIXED | MAP_SHARED, fd, 0);
-	if (MAP_FAILED == ptr)
-		goto error;
-	if (ptr != vrb->upper_ptr)
-		goto error;
+	fdh->idle_timeout = timeout;
+	fdh->last_active = ev_now(loop);
+	if (timeout <= 0.) {
+		ev_timer_stop(loop, &fdh->idle_timer);
+		return;
+	}
+	/* A running timer finds out a later deadline when it fires, but an
+	 * earlier one needs the timer re-armed */
+	if (ev_is_active(&fdh->idle_timer) &&
+			ev_timer_remaining(loop, &fdh->idle_timer) > timeout) {
+		ev_timer_stop(loop, &fdh->idle_timer);
+		ev_timer_set(&fdh->idle_timer, timeout, 0.);
+		ev_timer_start(loop, &fdh->idle_timer);
+	}
+}
 
-	close(fd);
-	return 0;
+ssize_t fbr_fd_read(FBR_P_ struct fbr_fd *fdh, void *buf, size_t count)
+{
+	ssize_t r;
 
-error:
-	if (MAP_FAILED != ptr)
-		munmap(ptr, size);
-	if (0 < fd)
-		close(fd);
-	if (vrb->mem_ptr)
-		munmap(vrb->mem_ptr, vrb->mem_ptr_size);
-	if (temp_name)
-		free(temp_name);
-	return -1;
+	for (;;) {
+		r = read(fdh->fd, buf, count);
+		if (-1 != r) {
+			fdh->last_active = ev_now(fctx->__p->loop);
+			return r;
+		}
+		if (EAGAIN == errno) {
+			if (-1 == fd_wait(FBR_A_ fdh, &fdh->r_io,
+						&fdh->r_cond))
+				return -1;
+		} else if (EINTR != errno)
+			return -1;
+	}
 }
 
-int fbr_buffer_init(FBR_P_ struct fbr_buffer *buffer, size_t size)
+ssize_t fbr_fd_write(FBR_P_ struct fbr_fd *fdh, const void *buf, size_t count)
 {
-	int rv;
-	rv = fbr_vrb_init(&buffer->vrb, size, fctx->__p->buffer_file_pattern);
-	if (rv)
-		return_error(-1, FBR_EBUFFERMMAP);
+	ssize_t r;
 
-	buffer->prepared_bytes = 0;
-	buffer->waiting_bytes = 0;
-	fbr_cond_init(FBR_A_ &buffer->committed_cond);
-	fbr_cond_init(FBR_A_ &buffer->bytes_freed_cond);
-	fbr_mutex_init(FBR_A_ &buffer->write_mutex);
-	fbr_mutex_init(FBR_A_ &buffer->read_mutex);
-	return_success(0);
+	for (;;) {
+		r = write(fdh->fd, buf, count);
+		if (-1 != r) {
+			fdh->last_active = ev_now(fctx->__p->loop);
+			return r;
+		}
+		if (EAGAIN == errno) {
+			if (-1 == fd_wait(FBR_A_ fdh, &fdh->w_io,
+						&fdh->w_cond))
+				return -1;
+		} else if (EINTR != errno)
+			return -1;
+	}
 }
 
-void fbr_vrb_destroy(struct fbr_vrb *vrb)
+ssize_t fbr_fd_read_all(FBR_P_ struct fbr_fd *fdh, void *buf, size_t count)
 {
-	munmap(vrb->upper_ptr, vrb->ptr_size);
-	munmap(vrb->lower_ptr, vrb->ptr_size);
-	munmap(vrb->mem_ptr, vrb->mem_ptr_size);
+	ssize_t r;
+	size_t done = 0;
+
+	while (count != done) {
+		r = fbr_fd_read(FBR_A_ fdh, buf + done, count - done);
+		if (-1 == r)
+			return -1;
+		if (0 == r)
+			break;
+		done += r;
+	}
+	return (ssize_t)done;
 }
 
-void fbr_buffer_destroy(FBR_P_ struct fbr_buffer *buffer)
+ssize_t fbr_fd_write_all(FBR_P_ struct fbr_fd *fdh, const void *buf,
+		size_t count)
 {
-	fbr_vrb_destroy(&buffer->vrb);
+	ssize_t r;
+	size_t done = 0;
 
-	fbr_mutex_destroy(FBR_A_ &buffer->read_mutex);
-	fbr_mutex_destroy(FBR_A_ &buffer->write_mutex);
-	fbr_cond_destroy(FBR_A_ &buffer->committed_cond);
-	fbr_cond_destroy(FBR_A_ &buffer->bytes_freed_cond);
+	while (count != done) {
+		r = fbr_fd_write(FBR_A_ fdh, buf + done, count - done);
+		if (-1 == r)
+			return -1;
+		done += r;
+	}
+	return (ssize_t)done;
 }
 
-void *fbr_buffer_alloc_prepare(FBR_P_ struct fbr_buffer *buffer, size_t size)
+ssize_t fbr_fd_recv(FBR_P_ struct fbr_fd *fdh, void *buf, size_t len,
+		int flags)
 {
-	if (size > fbr_buffer_size(FBR_A_ buffer))
-		return_error(NULL, FBR_EINVAL);
-
-	fbr_mutex_lock(FBR_A_ &buffer->write_mutex);
+	ssize_t r;
 
-	while (buffer->prepared_bytes > 0)
-		fbr_cond_wait(FBR_A_ &buffer->committed_cond,
-				&buffer->write_mutex);
+	for (;;) {
+		r = recv(fdh->fd, buf, len, flags | MSG_DONTWAIT);
+		if (-1 != r) {
+			fdh->last_active = ev_now(fctx->__p->loop);
+			return r;
+		}
+		if (EAGAIN == errno) {
+			if (-1 == fd_wait(FBR_A_ fdh, &fdh->r_io,
+						&fdh->r_cond))
+				return -1;
+		} else if (EINTR != errno)
+			return -1;
+	}
+}
 
-	assert(0 == buffer->prepared_bytes);
+ssize_t fbr_fd_send(FBR_P_ struct fbr_fd *fdh, const void *buf, size_t len,
+		int flags)
+{
+	ssize_t r;
 
-	buffer->prepared_bytes = size;
+	for (;;) {
+		r = send(fdh->fd, buf, len, flags | MSG_DONTWAIT);
+		if (-1 != r) {
+			fdh->last_active = ev_now(fctx->__p->loop);
+			return r;
+		}
+		if (EAGAIN == errno) {
+			if (-1 == fd_wait(FBR_A_ fdh, &fdh->w_io,
+						&fdh->w_cond))
+				return -1;
+		} else if (EINTR != errno)
+			return -1;
+	}
+}
 
-	while (fbr_buffer_free_bytes(FBR_A_ buffer) < size)
-		fbr_cond_wait(FBR_A_ &buffer->bytes_freed_cond,
-				&buffer->write_mutex);
+int fbr_fd_accept(FBR_P_ struct fbr_fd *fdh, struct sockaddr *addr,
+		socklen_t *addrlen)
+{
+	int r;
 
-	return fbr_buffer_space_ptr(FBR_A_ buffer);
+	for (;;) {
+		r = accept(fdh->fd, addr, addrlen);
+		if (-1 != r) {
+			fdh->last_active = ev_now(fctx->__p->loop);
+			return r;
+		}
+		if (EAGAIN == errno) {
+			if (-1 == fd_wait(FBR_A_ fdh, &fdh->r_io,
+						&fdh->r_cond))
+				return -1;
+		} else if (EINTR != errno)
+			return -1;
+	}
 }
 
-void fbr_buffer_alloc_commit(FBR_P_ struct fbr_buffer *buffer)
+ev_tstamp fbr_sleep(FBR_P_ ev_tstamp seconds)
 {
-	fbr_vrb_give(&buffer->vrb, buffer->prepared_bytes);
-	buffer->prepared_bytes = 0;
-	fbr_cond_signal(FBR_A_ &buffer->committed_cond);
-	fbr_mutex_unlock(FBR_A_ &buffer->write_mutex);
+	struct fbr_ev_timer timer;
+	ev_tstamp expected = ev_now(fctx->__p->loop) + seconds;
+
+	fbr_ev_timer_init(FBR_A_ &timer);
+	fbr_ev_timer_start(FBR_A_ &timer, seconds);
+	fbr_ev_wait_one(FBR_A_ &timer.ev_base);
+	fbr_ev_timer_stop(FBR_A_ &timer);
+
+	return max(0., expected - ev_now(fctx->__p->loop));
 }
 
-void fbr_buffer_alloc_abort(FBR_P_ struct fbr_buffer *buffer)
+static void watcher_async_dtor(FBR_P_ void *_arg)
 {
-	buffer->prepared_bytes = 0;
-	fbr_cond_signal(FBR_A_ &buffer->committed_cond);
-	fbr_mutex_unlock(FBR_A_ &buffer->write_mutex);
+	struct ev_async *w = _arg;
+	ev_async_stop(fctx->__p->loop, w);
 }
 
-void *fbr_buffer_read_address(FBR_P_ struct fbr_buffer *buffer, size_t size)
+int fbr_async_wait(FBR_P_ ev_async *w)
 {
+	struct fbr_ev_watcher watcher;
+	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
 	int retval;
-	if (size > fbr_buffer_size(FBR_A_ buffer))
-		return_error(NULL, FBR_EINVAL);
 
-	fbr_mutex_lock(FBR_A_ &buffer->read_mutex);
+	dtor.func = watcher_async_dtor;
+	dtor.arg = w;
+	fbr_destructor_add(FBR_A_ &dtor);
 
-	while (fbr_buffer_bytes(FBR_A_ buffer) < size) {
-		retval = fbr_cond_wait(FBR_A_ &buffer->committed_cond,
-				&buffer->read_mutex);
-		assert(0 == retval);
-		(void)retval;
-	}
+	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)w);
+	retval = fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
 
-	buffer->waiting_bytes = size;
+	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
+	ev_async_stop(fctx->__p->loop, w);
 
-	return_success(fbr_buffer_data_ptr(FBR_A_ buffer));
+	return retval;
 }
 
-void fbr_buffer_read_advance(FBR_P_ struct fbr_buffer *buffer)
+static unsigned get_page_size()
 {
-	fbr_vrb_take(&buffer->vrb, buffer->waiting_bytes);
-
-	fbr_cond_signal(FBR_A_ &buffer->bytes_freed_cond);
-	fbr_mutex_unlock(FBR_A_ &buffer->read_mutex);
+	static unsigned sz;
+	long retval;
+	if (sz > 0)
+		return sz;
+	retval = sysconf(_SC_PAGESIZE);
+	if (0 > retval) {
+		fprintf(stderr, "libevfibers: sysconf(_SC_PAGESIZE): %s",
+				strerror(errno));
+		abort();
+	}
+	sz = retval;
+	return sz;
 }
 
-void fbr_buffer_read_discard(FBR_P_ struct fbr_buffer *buffer)
+static size_t round_up_to_page_size(size_t size)
 {
-	fbr_mutex_unlock(FBR_A_ &buffer->read_mutex);
+	unsigned sz = get_page_size();
+	size_t remainder;
+	remainder = size % sz;
+	if (remainder == 0)
+		return size;
+	return size + sz - remainder;
 }
 
-int fbr_buffer_resize(FBR_P_ struct fbr_buffer *buffer, size_t size)
+static unsigned stack_class(size_t size)
 {
-	int rv;
-	fbr_mutex_lock(FBR_A_ &buffer->read_mutex);
-	fbr_mutex_lock(FBR_A_ &buffer->write_mutex);
-	rv = fbr_vrb_resize(&buffer->vrb, size, fctx->__p->buffer_file_pattern);
-	fbr_mutex_unlock(FBR_A_ &buffer->write_mutex);
-	fbr_mutex_unlock(FBR_A_ &buffer->read_mutex);
-	if (rv)
-		return_error(-1, FBR_EBUFFERMMAP);
-	return_success(0);
+	size_t class_size = get_page_size();
+	unsigned sclass = 0;
+	while (class_size < size) {
+		class_size <<= 1;
+		sclass++;
+	}
+	return sclass;
 }
 
-struct fbr_mq *fbr_mq_create(FBR_P_ size_t size, int flags)
+static struct fbr_stack *stack_acquire(FBR_P_ size_t size)
 {
-	struct fbr_mq *mq;
-
-	mq = calloc(1, sizeof(*mq));
-	mq->fctx = fctx;
-	mq->max = size + 1; /* One element is always unused */
-	mq->rb = calloc(mq->max, sizeof(void *));
-	mq->flags = flags;
+	struct fbr_stack *stack;
+	size_t page_size = get_page_size();
+	unsigned sclass;
+	char *map;
 
-	fbr_cond_init(FBR_A_ &mq->bytes_available_cond);
-	fbr_cond_init(FBR_A_ &mq->bytes_freed_cond);
+	if (0 == size)
+		size = FBR_STACK_SIZE;
+	sclass = stack_class(size);
+	if (sclass < FBR_STACK_CLASSES) {
+		stack = LIST_FIRST(&fctx->__p->stacks.free[sclass]);
+		if (stack) {
+			LIST_REMOVE(stack, entries);
+			fctx->__p->stacks.cached--;
+			goto out;
+		}
+		size = page_size << sclass;
+	} else {
+		size = round_up_to_page_size(size);
+	}
 
-	return mq;
+	stack = malloc(sizeof(struct fbr_stack));
+	if (NULL == stack)
+		err(EXIT_FAILURE, "malloc failed");
+	stack->size = size;
+	stack->map_size = size + page_size;
+	stack->sclass = sclass;
+	map = mmap(NULL, stack->map_size, PROT_READ | PROT_WRITE,
+			FBR_MAP_ANON_FLAG | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+	if (MAP_FAILED == map)
+		err(EXIT_FAILURE, "mmap failed");
+	/* Stack grows down, so the guard page goes below it */
+	if (-1 == mprotect(map, page_size, PROT_NONE))
+		err(EXIT_FAILURE, "mprotect failed");
+	stack->ptr = map + page_size;
+	stack->valgrind_id = VALGRIND_STACK_REGISTER(stack->ptr,
+			stack->ptr + size);
+out:
+	stack->painted = fctx->__p->stacks.profiling;
+	if (stack->painted)
+		memset(stack->ptr, FBR_STACK_CANARY, stack->size);
+	return stack;
+}
+
+static void stack_unmap(struct fbr_stack *stack)
+{
+	VALGRIND_STACK_DEREGISTER(stack->valgrind_id);
+	munmap(stack->ptr - (stack->map_size - stack->size), stack->map_size);
+	free(stack);
+}
+
+static void stack_discard_pages(struct fbr_stack *stack)
+{
+#ifdef MADV_FREE
+	static int madv_free_unsupported;
+	if (!madv_free_unsupported) {
+		if (0 == madvise(stack->ptr, stack->size, MADV_FREE) ||
+				EINVAL != errno)
+			return;
+		/* Kernels prior to 4.5 do not know MADV_FREE */
+		madv_free_unsupported = 1;
+	}
+#endif
+	madvise(stack->ptr, stack->size, MADV_DONTNEED);
 }
 
-void fbr_mq_clear(struct fbr_mq *mq, int wake_up_writers)
+static void stack_release(FBR_P_ struct fbr_stack *stack)
 {
-	memset(mq->rb, 0x00, mq->max * sizeof(void *));
-	mq->head = 0;
-	mq->tail = 0;
-
-	if (wake_up_writers)
-		fbr_cond_signal(mq->fctx, &mq->bytes_available_cond);
+	if (stack->sclass >= FBR_STACK_CLASSES || fctx->__p->stacks.cached >=
+			fctx->__p->stacks.max_cached) {
+		stack_unmap(stack);
+		return;
+	}
+	stack_discard_pages(stack);
+	LIST_INSERT_HEAD(&fctx->__p->stacks.free[stack->sclass], stack,
+			entries);
+	fctx->__p->stacks.cached++;
 }
 
-void fbr_mq_push(struct fbr_mq *mq, void *obj)
+static void flush_deferred_stack(FBR_P)
 {
-	unsigned next;
-
-	while ((next = ((mq->head + 1) % mq->max )) == mq->tail)
-		fbr_cond_wait(mq->fctx, &mq->bytes_freed_cond, NULL);
-
-	mq->rb[mq->head] = obj;
-	mq->head = next;
-
-	fbr_cond_signal(mq->fctx, &mq->bytes_available_cond);
+	struct fbr_stack *stack = fctx->__p->stacks.deferred;
+	if (NULL == stack)
+		return;
+	fctx->__p->stacks.deferred = NULL;
+	stack_release(FBR_A_ stack);
 }
 
-int fbr_mq_try_push(struct fbr_mq *mq, void *obj)
+void fbr_set_stack_cache_size(FBR_P_ unsigned max_cached)
 {
-	unsigned next = mq->head + 1;
-	if (next >= mq->max)
-		next = 0;
-
-	/* Circular buffer is full */
-	if (next == mq->tail)
-		return -1;
+	struct fbr_stack *stack;
+	unsigned i = FBR_STACK_CLASSES;
 
-	mq->rb[mq->head] = obj;
-	mq->head = next;
-
-	fbr_cond_signal(mq->fctx, &mq->bytes_available_cond);
-	return 0;
+	fctx->__p->stacks.max_cached = max_cached;
+	/* Larger stacks go first as they hold more address space */
+	while (i-- > 0 && fctx->__p->stacks.cached > max_cached) {
+		while (fctx->__p->stacks.cached > max_cached) {
+			stack = LIST_FIRST(&fctx->__p->stacks.free[i]);
+			if (NULL == stack)
+				break;
+			LIST_REMOVE(stack, entries);
+			fctx->__p->stacks.cached--;
+			stack_unmap(stack);
+		}
+	}
 }
 
-void fbr_mq_wait_push(struct fbr_mq *mq)
+void fbr_enable_stack_profiling(FBR_P_ int enabled, int autotune)
 {
-	while (((mq->head + 1) % mq->max) == mq->tail)
-		fbr_cond_wait(mq->fctx, &mq->bytes_freed_cond, NULL);
+	fctx->__p->stacks.profiling = enabled || autotune;
+	fctx->__p->stacks.autotune = autotune;
 }
 
-static void *mq_do_pop(struct fbr_mq *mq)
+static struct fbr_stack_profile *find_stack_profile(FBR_P_ const char *name)
 {
-	void *obj;
-	unsigned next;
-
-	obj = mq->rb[mq->tail];
-	mq->rb[mq->tail] = NULL;
-
-	next = mq->tail + 1;
-	if (next >= mq->max)
-		next = 0;
-
-	mq->tail = next;
-
-	fbr_cond_signal(mq->fctx, &mq->bytes_freed_cond);
-	return obj;
+	struct fbr_stack_profile *profile;
+	LIST_FOREACH(profile, &fctx->__p->stacks.profiles, entries) {
+		if (0 == strncmp(profile->stats.name, name,
+					FBR_MAX_FIBER_NAME - 1))
+			return profile;
+	}
+	return NULL;
+}
+
+static void stack_measure(FBR_P_ struct fbr_fiber *fiber)
+{
+	struct fbr_stack *stack = fiber->stack;
+	struct fbr_stack_profile *profile;
+	size_t untouched = 0;
+	size_t used;
+	unsigned bucket = 0;
+
+	/* Stack grows down, so the untouched part is at the low end */
+	while (untouched < stack->size && FBR_STACK_CANARY ==
+			(unsigned char)stack->ptr[untouched])
+		untouched++;
+	used = stack->size - untouched;
+
+	profile = find_stack_profile(FBR_A_ fiber->name);
+	if (NULL == profile) {
+		profile = calloc(1, sizeof(struct fbr_stack_profile));
+		if (NULL == profile)
+			return;
+		memcpy(profile->stats.name, fiber->name, FBR_MAX_FIBER_NAME);
+		LIST_INSERT_HEAD(&fctx->__p->stacks.profiles, profile,
+				entries);
+		fctx->__p->stacks.n_profiles++;
+	}
+	while (bucket < FBR_STACK_HIST_BUCKETS - 1 &&
+			used > (size_t)512 << bucket)
+		bucket++;
+	profile->stats.hist[bucket]++;
+	profile->stats.samples++;
+	if (used > profile->stats.max_used)
+		profile->stats.max_used = used;
 }
 
-void *fbr_mq_pop(struct fbr_mq *mq)
+size_t fbr_get_stack_stats(FBR_P_ struct fbr_stack_stats *stats, size_t max)
 {
+	struct fbr_stack_profile *profile;
+	size_t i = 0;
+	LIST_FOREACH(profile, &fctx->__p->stacks.profiles, entries) {
+		if (i >= max)
+			break;
+		stats[i++] = profile->stats;
+	}
+	return fctx->__p->stacks.n_profiles;
+}
 
-	/* if the head isn't ahead of the tail, we don't have any elements */
-	while (mq->head == mq->tail)
-		fbr_cond_wait(mq->fctx, &mq->bytes_available_cond, NULL);
+static size_t learned_stack_size(FBR_P_ const char *name)
+{
+	struct fbr_stack_profile *profile;
+	size_t size;
 
-	return mq_do_pop(mq);
+	profile = find_stack_profile(FBR_A_ name);
+	if (NULL == profile ||
+			profile->stats.samples < FBR_STACK_AUTOTUNE_SAMPLES)
+		return 0;
+	size = 2 * profile->stats.max_used;
+	if (size > FBR_STACK_SIZE)
+		size = FBR_STACK_SIZE;
+	return size;
 }
 
-int fbr_mq_try_pop(struct fbr_mq *mq, void **obj)
+fbr_id_t fbr_create(FBR_P_ const char *name, fbr_fiber_func_t func, void *arg,
+		size_t stack_size)
 {
-	/* if the head isn't ahead of the tail, we don't have any elements */
-	if (mq->head == mq->tail)
-		return -1;
+	struct fbr_fiber *fiber;
 
-	*obj = mq_do_pop(mq);
-	return 0;
+	flush_deferred_stack(FBR_A);
+	if (!LIST_EMPTY(&fctx->__p->reclaimed)) {
+		fiber = LIST_FIRST(&fctx->__p->reclaimed);
+		LIST_REMOVE(fiber, entries.reclaimed);
+	} else {
+		fiber = malloc(sizeof(struct fbr_fiber));
+		memset(fiber, 0x00, sizeof(struct fbr_fiber));
+		fbr_cond_init(FBR_A_ &fiber->reclaim_cond);
+		fbr_cond_init(FBR_A_ &fiber->remote_cond);
+		fiber->id = fctx->__p->last_id++;
+	}
+	if (0 == stack_size && fctx->__p->stacks.autotune)
+		stack_size = learned_stack_size(FBR_A_ name);
+	fiber->stack = stack_acquire(FBR_A_ stack_size);
+	coro_create(&fiber->ctx, (coro_func)call_wrapper, FBR_A,
+			fiber->stack->ptr, fiber->stack->size);
+	LIST_INIT(&fiber->children);
+	LIST_INIT(&fiber->pool);
+	TAILQ_INIT(&fiber->destructors);
+	strncpy(fiber->name, name, FBR_MAX_FIBER_NAME - 1);
+	fiber->func = func;
+	fiber->func_arg = arg;
+	LIST_INSERT_HEAD(&CURRENT_FIBER->children, fiber, entries.children);
+	fiber->parent = CURRENT_FIBER;
+	fiber->no_reclaim = 0;
+	fiber->want_reclaim = 0;
+	fiber->remote_woken = 0;
+	fiber->ev.interruptible = 0;
+	fiber->ev.settling = 0;
+	fiber->deadline.at = CURRENT_FIBER->deadline.at;
+	fiber->deadline.cancelled = CURRENT_FIBER->deadline.cancelled;
+	fbr_ev_timer_init(FBR_A_ &fiber->deadline.timer);
+	/* The timer is armed by the fiber itself and has to wake it up */
+	fiber->deadline.timer.ev_base.id = fbr_id_pack(fiber);
+	return fbr_id_pack(fiber);
 }
 
-void fbr_mq_wait_pop(struct fbr_mq *mq)
+int fbr_disown(FBR_P_ fbr_id_t parent_id)
 {
-	/* if the head isn't ahead of the tail, we don't have any elements */
-	while (mq->head == mq->tail)
-		fbr_cond_wait(mq->fctx, &mq->bytes_available_cond, NULL);
+	struct fbr_fiber *fiber, *parent;
+	if (!fbr_id_isnull(parent_id))
+		unpack_transfer_errno(-1, &parent, parent_id);
+	else
+		parent = &fctx->__p->root;
+	fiber = CURRENT_FIBER;
+	LIST_REMOVE(fiber, entries.children);
+	LIST_INSERT_HEAD(&parent->children, fiber, entries.children);
+	fiber->parent = parent;
+	return_success(0);
 }
 
-void fbr_mq_destroy(struct fbr_mq *mq)
+fbr_id_t fbr_parent(FBR_P)
 {
-	fbr_cond_destroy(mq->fctx, &mq->bytes_freed_cond);
-	fbr_cond_destroy(mq->fctx, &mq->bytes_available_cond);
-	free(mq->rb);
-	free(mq);
+	struct fbr_fiber *fiber = CURRENT_FIBER;
+	if (fiber->parent == &fctx->__p->root)
+		return FBR_ID_NULL;
+	return fbr_id_pack(fiber->parent);
 }
 
-void *fbr_get_user_data(FBR_P_ fbr_id_t id)
+void *fbr_calloc(FBR_P_ unsigned int nmemb, size_t size)
 {
-	struct fbr_fiber *fiber;
-	unpack_transfer_errno(NULL, &fiber, id);
-	return_success(fiber->user_data);
+	void *ptr;
+	fprintf(stderr, "libevfibers: fbr_calloc is deprecated\n");
+	ptr = allocate_in_fiber(FBR_A_ nmemb * size, CURRENT_FIBER);
+	memset(ptr, 0x00, nmemb * size);
+	return ptr;
 }
 
-int fbr_set_user_data(FBR_P_ fbr_id_t id, void *data)
+void *fbr_alloc(FBR_P_ size_t size)
 {
-	struct fbr_fiber *fiber;
-	unpack_transfer_errno(-1, &fiber, id);
-	fiber->user_data = data;
-	return_success(0);
+	fprintf(stderr, "libevfibers: fbr_alloc is deprecated\n");
+	return allocate_in_fiber(FBR_A_ size, CURRENT_FIBER);
 }
 
-void fbr_destructor_add(FBR_P_ struct fbr_destructor *dtor)
+void fbr_alloc_set_destructor(_unused_ FBR_P_ void *ptr,
+		fbr_alloc_destructor_func_t func, void *context)
 {
-	struct fbr_fiber *fiber = CURRENT_FIBER;
-	TAILQ_INSERT_TAIL(&fiber->destructors, dtor, entries);
-	dtor->active = 1;
+	struct mem_pool *pool_entry;
+	fprintf(stderr, "libevfibers:"
+		       " fbr_alloc_set_destructor is deprecated\n");
+	pool_entry = (struct mem_pool *)ptr - 1;
+	pool_entry->destructor = func;
+	pool_entry->destructor_context = context;
 }
 
-void fbr_destructor_remove(FBR_P_ struct fbr_destructor *dtor,
-		int call)
+void fbr_free(FBR_P_ void *ptr)
 {
-	struct fbr_fiber *fiber = CURRENT_FIBER;
-
-	if (0 == dtor->active)
-		return;
+	fprintf(stderr, "libevfibers: fbr_free is deprecated\n");
+	fbr_free_in_fiber(FBR_A_ CURRENT_FIBER, ptr, 1);
+}
 
-	TAILQ_REMOVE(&fiber->destructors, dtor, entries);
-	if (call)
-		dtor->func(FBR_A_ dtor->arg);
-	dtor->active = 0;
+void fbr_free_nd(FBR_P_ void *ptr)
+{
+	fprintf(stderr, "libevfibers: fbr_free_nd is deprecated\n");
+	fbr_free_in_fiber(FBR_A_ CURRENT_FIBER, ptr, 0);
 }
 
-static inline int wrap_ffsll(uint64_t val)
+void fbr_dump_stack(FBR_P_ fbr_logutil_func_t log)
 {
-	/* TODO: Add some check for the existance of this builtin */
-	return __builtin_ffsll(val);
+	struct fbr_stack_item *ptr = fctx->__p->sp;
+	(*log)(FBR_A_ "%s", "Fiber call stack:");
+	(*log)(FBR_A_ "%s", "-------------------------------");
+	while (ptr >= fctx->__p->stack) {
+		(*log)(FBR_A_ "fiber_call: %p\t%s",
+				ptr->fiber,
+				ptr->fiber->name);
+		print_trace_info(FBR_A_ &ptr->tinfo, log);
+		(*log)(FBR_A_ "%s", "-------------------------------");
+		ptr--;
+	}
 }
 
-static inline int is_key_registered(FBR_P_ fbr_key_t key)
+static void transfer_later(FBR_P_ struct fbr_id_tailq_i *item)
 {
-	return 0 == (fctx->__p->key_free_mask & (1 << key));
+	if (TAILQ_EMPTY(&fctx->__p->pending_fibers))
+		start_pending(FBR_A);
+	TAILQ_INSERT_TAIL(&fctx->__p->pending_fibers, item, entries);
+	item->head = &fctx->__p->pending_fibers;
 }
 
-static inline void register_key(FBR_P_ fbr_key_t key)
+static void transfer_handoff(FBR_P_ struct fbr_id_tailq_i *item)
 {
+	struct fbr_context_private *p = fctx->__p;
+	unsigned iteration;
+	int retval;
 
-	fctx->__p->key_free_mask &= ~(1ULL << key);
+	/* Switching from the root would just run the fiber earlier within
+	 * the same callback, and a deep call stack is better not grown any
+	 * further. Neither can a fiber be left while it is preparing or
+	 * finishing its own events: they may arrive in the meantime and have
+	 * it transferred to while it is still on the call stack */
+	if (0 == p->handoff.budget || CURRENT_FIBER == &p->root ||
+			CURRENT_FIBER->ev.settling ||
+			p->sp - p->stack >= FBR_CALL_STACK_SIZE / 2) {
+		transfer_later(FBR_A_ item);
+		return;
+	}
+	/* Fibers handing a wakeup back and forth would never let the loop
+	 * run otherwise */
+	iteration = ev_iteration(p->loop);
+	if (iteration != p->handoff.iteration) {
+		p->handoff.iteration = iteration;
+		p->handoff.used = 0;
+	}
+	if (p->handoff.used >= p->handoff.budget) {
+		transfer_later(FBR_A_ item);
+		return;
+	}
+	p->handoff.used++;
+	item->head = NULL;
+	retval = fbr_transfer(FBR_A_ item->id);
+	assert(0 == retval);
+	(void)retval;
 }
 
-static inline void unregister_key(FBR_P_ fbr_key_t key)
+static void transfer_later_tailq(FBR_P_ struct fbr_id_tailq *tailq)
 {
-	fctx->__p->key_free_mask |= (1 << key);
+	struct fbr_id_tailq_i *item;
+	if (TAILQ_EMPTY(tailq))
+		return;
+	TAILQ_FOREACH(item, tailq, entries) {
+		item->head = &fctx->__p->pending_fibers;
+	}
+	if (TAILQ_EMPTY(&fctx->__p->pending_fibers))
+		start_pending(FBR_A);
+	TAILQ_CONCAT(&fctx->__p->pending_fibers, tailq, entries);
 }
 
-int fbr_key_create(FBR_P_ fbr_key_t *key_ptr)
+void fbr_set_cooperate_budget(FBR_P_ ev_tstamp quantum, unsigned iterations)
 {
-	fbr_key_t key = wrap_ffsll(fctx->__p->key_free_mask) - 1;
-	assert(key < FBR_MAX_KEY);
-	register_key(FBR_A_ key);
-	*key_ptr = key;
-	return_success(0);
+	fctx->__p->cooperate.quantum = quantum;
+	fctx->__p->cooperate.iterations = iterations;
 }
 
-int fbr_key_delete(FBR_P_ fbr_key_t key)
+void fbr_set_handoff_budget(FBR_P_ unsigned budget)
 {
-	if (!is_key_registered(FBR_A_ key))
-		return_error(-1, FBR_ENOKEY);
+	fctx->__p->handoff.budget = budget;
+	fctx->__p->handoff.used = 0;
+}
 
-	unregister_key(FBR_A_ key);
+static int cooperate_due(FBR_P_ struct fbr_fiber *fiber)
+{
+	ev_tstamp now;
+	int budgeted = 0;
 
-	return_success(0);
+	if (fctx->__p->cooperate.iterations > 0) {
+		budgeted = 1;
+		if (++fiber->slice.calls >= fctx->__p->cooperate.iterations)
+			return 1;
+	}
+	if (fctx->__p->cooperate.quantum > 0.) {
+		budgeted = 1;
+		/* The slice is timed from the first fbr_cooperate call after
+		 * the fiber got the CPU, so that context switches don't have
+		 * to query the clock. */
+		now = ev_time();
+		if (0. == fiber->slice.started)
+			fiber->slice.started = now;
+		else if (now - fiber->slice.started >=
+				fctx->__p->cooperate.quantum)
+			return 1;
+	}
+	return !budgeted;
 }
 
-int fbr_key_set(FBR_P_ fbr_id_t id, fbr_key_t key, void *value)
+void fbr_cooperate(FBR_P)
 {
-	struct fbr_fiber *fiber;
+	struct fbr_fiber *fiber = CURRENT_FIBER;
+	struct fbr_id_tailq_i item;
 
-	unpack_transfer_errno(-1, &fiber, id);
+	assert("Attempt to cooperate in a root fiber" &&
+			fiber != &fctx->__p->root);
 
-	if (!is_key_registered(FBR_A_ key))
-		return_error(-1, FBR_ENOKEY);
+	if (!cooperate_due(FBR_A_ fiber))
+		return;
 
-	fiber->key_data[key] = value;
-	return_success(0);
+	id_tailq_i_set(FBR_A_ &item, fiber);
+	fbr_destructor_init(&item.dtor);
+	item.dtor.func = item_dtor;
+	item.dtor.arg = &item;
+	fbr_destructor_add(FBR_A_ &item.dtor);
+	transfer_later(FBR_A_ &item);
+
+	fbr_yield(FBR_A);
+
+	fbr_destructor_remove(FBR_A_ &item.dtor, 1 /* Call it? */);
 }
 
-void *fbr_key_get(FBR_P_ fbr_id_t id, fbr_key_t key)
+int fbr_wake_remote(FBR_P_ fbr_id_t id)
 {
-	struct fbr_fiber *fiber;
+	fbr_id_t *items;
+	size_t capacity;
 
-	unpack_transfer_errno(NULL, &fiber, id);
-
-	if (!is_key_registered(FBR_A_ key))
-		return_error(NULL, FBR_ENOKEY);
+	pthread_mutex_lock(&fctx->__p->remote.lock);
+	if (fctx->__p->remote.size == fctx->__p->remote.capacity) {
+		capacity = fctx->__p->remote.capacity ?
+			2 * fctx->__p->remote.capacity : 16;
+		items = realloc(fctx->__p->remote.items,
+				capacity * sizeof(fbr_id_t));
+		if (NULL == items) {
+			pthread_mutex_unlock(&fctx->__p->remote.lock);
+			return -1;
+		}
+		fctx->__p->remote.items = items;
+		fctx->__p->remote.capacity = capacity;
+	}
+	fctx->__p->remote.items[fctx->__p->remote.size++] = id;
+	pthread_mutex_unlock(&fctx->__p->remote.lock);
 
-	return fiber->key_data[key];
+	/* libev coalesces the sends that happen before the loop gets to
+	 * process the first one, so a burst costs a single eventfd write */
+	ev_async_send(fctx->__p->loop, &fctx->__p->remote.async);
+	return 0;
 }
 
-const char *fbr_get_name(FBR_P_ fbr_id_t id)
+static void remote_async_cb(_unused_ EV_P_ ev_async *w, _unused_ int revents)
 {
+	struct fbr_context *fctx = w->data;
+	fbr_id_t *items;
 	struct fbr_fiber *fiber;
-	unpack_transfer_errno(NULL, &fiber, id);
-	return_success(fiber->name);
+	size_t size, capacity, i;
+
+	ENSURE_ROOT_FIBER;
+
+	/* Swap the mailbox with the spare one, so that the lock is not held
+	 * while the batch is being processed */
+	pthread_mutex_lock(&fctx->__p->remote.lock);
+	items = fctx->__p->remote.items;
+	size = fctx->__p->remote.size;
+	capacity = fctx->__p->remote.capacity;
+	fctx->__p->remote.items = fctx->__p->remote.spare;
+	fctx->__p->remote.capacity = fctx->__p->remote.spare_capacity;
+	fctx->__p->remote.size = 0;
+	pthread_mutex_unlock(&fctx->__p->remote.lock);
+
+	for (i = 0; i < size; i++) {
+		/* Target fiber might have been reclaimed meanwhile */
+		if (-1 == fbr_id_unpack(FBR_A_ &fiber, items[i]))
+			continue;
+		fiber->remote_woken = 1;
+		fbr_cond_broadcast(FBR_A_ &fiber->remote_cond);
+	}
+
+	fctx->__p->remote.spare = items;
+	fctx->__p->remote.spare_capacity = capacity;
 }
 
-int fbr_set_name(FBR_P_ fbr_id_t id, const char *name)
+static void remote_wait_dtor(FBR_P_ _unused_ void *arg)
 {
-	struct fbr_fiber *fiber;
-	unpack_transfer_errno(-1, &fiber, id);
-	strncpy(fiber->name, name, FBR_MAX_FIBER_NAME - 1);
-	return_success(0);
+	ev_unref(fctx->__p->loop);
 }
 
-static int make_pipe(FBR_P_ int *r, int*w)
+int fbr_wait_remote(FBR_P)
 {
-	int fds[2];
-	int retval;
-	retval = pipe(fds);
-	if (-1 == retval)
-		return_error(-1, FBR_ESYSTEM);
-	*r = fds[0];
-	*w = fds[1];
+	struct fbr_fiber *fiber = CURRENT_FIBER;
+	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
+	int retval = 0;
+
+	if (!fiber->remote_woken) {
+		/* Keep the loop running while we're waiting for the other
+		 * thread, otherwise nothing else might be holding it */
+		ev_ref(fctx->__p->loop);
+		dtor.func = remote_wait_dtor;
+		fbr_destructor_add(FBR_A_ &dtor);
+		while (!fiber->remote_woken && 0 == retval)
+			retval = fbr_cond_wait(FBR_A_ &fiber->remote_cond,
+					NULL);
+		fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
+		if (retval)
+			return -1;
+	}
+	fiber->remote_woken = 0;
 	return_success(0);
 }
 
-pid_t fbr_popen3(FBR_P_ const char *filename, char *const argv[],
-		char *const envp[], const char *working_dir,
-		int *stdin_w_ptr, int *stdout_r_ptr, int *stderr_r_ptr)
+static struct fbr_deque_buf *deque_buf_new(size_t size,
+		struct fbr_deque_buf *prev)
+{
+	struct fbr_deque_buf *buf;
+	buf = malloc(sizeof(struct fbr_deque_buf) +
+			size * sizeof(struct fbr_task *));
+	if (NULL == buf)
+		return NULL;
+	buf->mask = size - 1;
+	buf->prev = prev;
+	return buf;
+}
+
+static int deque_push(struct fbr_sched_worker *w, struct fbr_task *task)
+{
+	struct fbr_deque_buf *buf, *grown;
+	int64_t b, t, i;
+
+	b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+	t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+	buf = __atomic_load_n(&w->buf, __ATOMIC_RELAXED);
+	if (b - t > (int64_t)buf->mask) {
+		/* Thieves may still be reading the old buffer, so it is only
+		 * freed along with the scheduler */
+		grown = deque_buf_new(2 * (buf->mask + 1), buf);
+		if (NULL == grown)
+			return -1;
+		for (i = t; i < b; i++)
+			grown->tasks[i & grown->mask] = __atomic_load_n(
+					&buf->tasks[i & buf->mask],
+					__ATOMIC_RELAXED);
+		__atomic_store_n(&w->buf, grown, __ATOMIC_RELEASE);
+		buf = grown;
+	}
+	__atomic_store_n(&buf->tasks[b & buf->mask], task, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static struct fbr_task *deque_take(struct fbr_sched_worker *w)
+{
+	struct fbr_deque_buf *buf;
+	struct fbr_task *task = NULL;
+	int64_t b, t;
+
+	b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+	buf = __atomic_load_n(&w->buf, __ATOMIC_RELAXED);
+	__atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+	if (t <= b) {
+		task = __atomic_load_n(&buf->tasks[b & buf->mask],
+				__ATOMIC_RELAXED);
+		if (t == b) {
+			/* Last task, race against the thieves for it */
+			if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, 0,
+						__ATOMIC_SEQ_CST,
+						__ATOMIC_RELAXED))
+				task = NULL;
+			__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+		}
+	} else {
+		__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return task;
+}
+
+static struct fbr_task *deque_steal(struct fbr_sched_worker *w)
+{
+	struct fbr_deque_buf *buf;
+	struct fbr_task *task;
+	int64_t b, t;
+
+	t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b)
+		return NULL;
+	buf = __atomic_load_n(&w->buf, __ATOMIC_ACQUIRE);
+	task = __atomic_load_n(&buf->tasks[t & buf->mask], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		/* Lost the race to the owner or another thief */
+		return NULL;
+	return task;
+}
+
+static struct fbr_task *sched_next_task(struct fbr_sched_worker *self)
+{
+	struct fbr_sched *sched = self->sched;
+	struct fbr_task *task;
+	unsigned n, start, i;
+
+	task = deque_take(self);
+	if (task)
+		return task;
+
+	n = __atomic_load_n(&sched->n_workers, __ATOMIC_ACQUIRE);
+	/* xorshift32, picks a random victim to start with */
+	self->seed ^= self->seed << 13;
+	self->seed ^= self->seed >> 17;
+	self->seed ^= self->seed << 5;
+	start = self->seed % n;
+	for (i = 0; i < n; i++) {
+		if (&sched->workers[(start + i) % n] == self)
+			continue;
+		task = deque_steal(&sched->workers[(start + i) % n]);
+		if (task)
+			return task;
+	}
+	return NULL;
+}
+
+static void run_task(FBR_P_ struct fbr_task *task)
 {
-	pid_t pid;
-	int stdin_r = -1, stdin_w = -1;
-	int stdout_r = -1, stdout_w = -1;
-	int stderr_r = -1, stderr_w = -1;
-	int devnull = -1;
+	fbr_id_t id;
 	int retval;
 
-	retval = (stdin_w_ptr ? make_pipe(FBR_A_ &stdin_r, &stdin_w) : 0);
-	if (retval)
-		goto error;
-	retval = (stdout_r_ptr ? make_pipe(FBR_A_ &stdout_r, &stdout_w) : 0);
-	if (retval)
-		goto error;
-	retval = (stderr_r_ptr ? make_pipe(FBR_A_ &stderr_r, &stderr_w) : 0);
-	if (retval)
-		goto error;
+	id = fbr_create(FBR_A_ task->name, task->func, task->arg,
+			task->stack_size);
+	free(task);
+	retval = fbr_transfer(FBR_A_ id);
+	assert(0 == retval);
+	(void)retval;
+}
 
-	pid = fork();
-	if (-1 == pid)
-		goto error;
-	if (0 == pid) {
-		/* Child */
-		ev_break(EV_DEFAULT, EVBREAK_ALL);
-		if (stdin_w_ptr) {
-			retval = close(stdin_w);
-			if (-1 == retval)
-				goto error;
-			retval = dup2(stdin_r, STDIN_FILENO);
-			if (-1 == retval)
-				goto error;
-		} else {
-			devnull = open("/dev/null", O_RDONLY);
-			if (-1 == retval)
-				goto error;
-			retval = dup2(devnull, STDIN_FILENO);
-			if (-1 == retval)
-				goto error;
-			retval = close(devnull);
-			if (-1 == retval)
-				goto error;
+static void sched_prepare_cb(_unused_ EV_P_ ev_prepare *w,
+		_unused_ int revents)
+{
+	struct fbr_context *fctx = w->data;
+	struct fbr_sched_worker *self = fctx->__p->sched;
+	struct fbr_task *task;
+
+	ENSURE_ROOT_FIBER;
+
+	__atomic_store_n(&self->idle, 0, __ATOMIC_RELAXED);
+	/* Tasks are started one per loop iteration while there are runnable
+	 * fibers around, and as many as possible otherwise. This way tasks
+	 * queued behind a busy worker stay available for stealing. */
+	do {
+		task = sched_next_task(self);
+		if (NULL == task) {
+			/* Announce being idle and look once again, so that a
+			 * task pushed meanwhile is not missed */
+			__atomic_store_n(&self->idle, 1, __ATOMIC_SEQ_CST);
+			task = sched_next_task(self);
+			if (NULL == task)
+				return;
+			__atomic_store_n(&self->idle, 0, __ATOMIC_RELAXED);
 		}
-		if (stdout_r_ptr) {
-			retval = close(stdout_r);
-			if (-1 == retval)
-				goto error;
-			retval = dup2(stdout_w, STDOUT_FILENO);
-			if (-1 == retval)
-				goto error;
-		} else {
-			devnull = open("/dev/null", O_WRONLY);
-			if (-1 == retval)
-				goto error;
-			retval = dup2(devnull, STDOUT_FILENO);
-			if (-1 == retval)
-				goto error;
-			retval = close(devnull);
-			if (-1 == retval)
-				goto error;
+		run_task(FBR_A_ task);
+		if (fctx->__p->sched != self)
+			/* Task has detached us */
+			return;
+	} while (TAILQ_EMPTY(&fctx->__p->pending_fibers));
+}
+
+static void sched_wakeup_cb(_unused_ EV_P_ _unused_ ev_async *w,
+		_unused_ int revents)
+{
+	/* Nothing to do here, the prepare watcher picks up the tasks on the
+	 * next loop iteration */
+}
+
+static void sched_wake_idle(struct fbr_sched_worker *self)
+{
+	struct fbr_sched *sched = self->sched;
+	struct fbr_sched_worker *w;
+	unsigned n, i;
+	int sent;
+
+	n = __atomic_load_n(&sched->n_workers, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n; i++) {
+		w = &sched->workers[i];
+		if (w == self || !__atomic_load_n(&w->idle, __ATOMIC_SEQ_CST))
+			continue;
+		/* Registering first keeps the worker from detaching and
+		 * having its loop destroyed under the send, see
+		 * fbr_sched_detach */
+		__atomic_fetch_add(&w->wakers, 1, __ATOMIC_SEQ_CST);
+		sent = 0;
+		if (__atomic_load_n(&w->attached, __ATOMIC_SEQ_CST) &&
+				__atomic_exchange_n(&w->idle, 0,
+					__ATOMIC_SEQ_CST)) {
+			ev_async_send(w->fctx->__p->loop, &w->wakeup);
+			sent = 1;
 		}
-		if (stderr_r_ptr) {
-			retval = close(stderr_r);
-			if (-1 == retval)
-				goto error;
-			retval = dup2(stderr_w, STDERR_FILENO);
-			if (-1 == retval)
-				goto error;
-		} else {
-			devnull = open("/dev/null", O_WRONLY);
-			if (-1 == retval)
-				goto error;
-			retval = dup2(devnull, STDERR_FILENO);
-			if (-1 == retval)
-				goto error;
-			retval = close(devnull);
-			if (-1 == retval)
-				goto error;
+		__atomic_fetch_sub(&w->wakers, 1, __ATOMIC_RELEASE);
+		if (sent)
+			return;
+	}
+}
+
+struct fbr_sched *fbr_sched_create(unsigned max_workers)
+{
+	struct fbr_sched *sched;
+	unsigned i;
+
+	sched = malloc(sizeof(struct fbr_sched));
+	if (NULL == sched)
+		return NULL;
+	sched->max_workers = max_workers;
+	sched->n_workers = 0;
+	if (posix_memalign((void **)&sched->workers, 64,
+				max_workers * sizeof(struct fbr_sched_worker))) {
+		free(sched);
+		return NULL;
+	}
+	memset(sched->workers, 0x00,
+			max_workers * sizeof(struct fbr_sched_worker));
+	for (i = 0; i < max_workers; i++) {
+		sched->workers[i].sched = sched;
+		sched->workers[i].seed = 2654435761u * (i + 1);
+		sched->workers[i].buf = deque_buf_new(FBR_SCHED_DEQUE_SIZE,
+				NULL);
+		if (NULL == sched->workers[i].buf) {
+			sched->max_workers = i;
+			fbr_sched_destroy(sched);
+			return NULL;
 		}
+	}
+	return sched;
+}
 
-		if (working_dir) {
-			retval = chdir(working_dir);
-			if (-1 == retval)
-				goto error;
+void fbr_sched_destroy(struct fbr_sched *sched)
+{
+	struct fbr_sched_worker *w;
+	struct fbr_deque_buf *buf, *prev;
+	struct fbr_task *task;
+	unsigned i;
+
+	for (i = 0; i < sched->max_workers; i++) {
+		w = &sched->workers[i];
+		while ((task = deque_take(w)))
+			free(task);
+		for (buf = w->buf; buf; buf = prev) {
+			prev = buf->prev;
+			free(buf);
 		}
+	}
+	free(sched->workers);
+	free(sched);
+}
 
-		retval = execve(filename, argv, envp);
-		if (-1 == retval)
-			goto error;
+int fbr_sched_attach(FBR_P_ struct fbr_sched *sched)
+{
+	struct fbr_sched_worker *w = NULL;
+	unsigned index, n;
+	int expected;
 
-		errx(EXIT_FAILURE, "execve failed without error code");
+	if (NULL != fctx->__p->sched)
+		return_error(-1, FBR_EINVAL);
+	/* Slots of detached workers are reused */
+	for (index = 0; index < sched->max_workers; index++) {
+		expected = 0;
+		if (__atomic_compare_exchange_n(&sched->workers[index].claimed,
+					&expected, 1, 0, __ATOMIC_ACQUIRE,
+					__ATOMIC_RELAXED)) {
+			w = &sched->workers[index];
+			break;
+		}
 	}
-	/* Parent */
-	if (stdin_w_ptr) {
-		retval = close(stdin_r);
-		if (-1 == retval)
-			goto error;
-		retval = fbr_fd_nonblock(FBR_A_ stdin_w);
-		if (retval)
-			goto error;
+	if (NULL == w)
+		return_error(-1, FBR_EINVAL);
+	n = __atomic_load_n(&sched->n_workers, __ATOMIC_RELAXED);
+	while (n < index + 1 && !__atomic_compare_exchange_n(
+				&sched->n_workers, &n, index + 1, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	w->fctx = fctx;
+	w->idle = 0;
+	ev_prepare_init(&w->prepare, sched_prepare_cb);
+	w->prepare.data = fctx;
+	ev_prepare_start(fctx->__p->loop, &w->prepare);
+	ev_async_init(&w->wakeup, sched_wakeup_cb);
+	ev_async_start(fctx->__p->loop, &w->wakeup);
+	fctx->__p->sched = w;
+	__atomic_store_n(&w->attached, 1, __ATOMIC_RELEASE);
+	return_success(0);
+}
+
+void fbr_sched_detach(FBR_P)
+{
+	struct fbr_sched_worker *w = fctx->__p->sched;
+
+	if (NULL == w)
+		return;
+	__atomic_store_n(&w->attached, 0, __ATOMIC_SEQ_CST);
+	/* A waker that saw us attached may still be sending to the loop,
+	 * which is about to be destroyed by the caller */
+	while (__atomic_load_n(&w->wakers, __ATOMIC_SEQ_CST))
+		sched_yield();
+	ev_prepare_stop(fctx->__p->loop, &w->prepare);
+	ev_async_stop(fctx->__p->loop, &w->wakeup);
+	fctx->__p->sched = NULL;
+	w->fctx = NULL;
+	__atomic_store_n(&w->claimed, 0, __ATOMIC_RELEASE);
+}
+
+int fbr_spawn(FBR_P_ const char *name, fbr_fiber_func_t func, void *arg,
+		size_t stack_size)
+{
+	struct fbr_sched_worker *self = fctx->__p->sched;
+	struct fbr_task *task;
+
+	if (NULL == self)
+		return_error(-1, FBR_EINVAL);
+
+	task = malloc(sizeof(struct fbr_task));
+	if (NULL == task)
+		return_error(-1, FBR_ESYSTEM);
+	strncpy(task->name, name, FBR_MAX_FIBER_NAME - 1);
+	task->name[FBR_MAX_FIBER_NAME - 1] = '\0';
+	task->func = func;
+	task->arg = arg;
+	task->stack_size = stack_size;
+	if (-1 == deque_push(self, task)) {
+		free(task);
+		return_error(-1, FBR_ESYSTEM);
 	}
-	if (stdout_r_ptr) {
-		retval = close(stdout_w);
-		if (-1 == retval)
-			goto error;
-		retval = fbr_fd_nonblock(FBR_A_ stdout_r);
-		if (retval)
-			goto error;
+
+	/* Pairs with the idle announcement in sched_prepare_cb */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	sched_wake_idle(self);
+	return_success(0);
+}
+
+void fbr_ev_mutex_init(FBR_P_ struct fbr_ev_mutex *ev,
+		struct fbr_mutex *mutex)
+{
+	ev_base_init(FBR_A_ &ev->ev_base, FBR_EV_MUTEX);
+	ev->mutex = mutex;
+}
+
+void fbr_mutex_init(_unused_ FBR_P_ struct fbr_mutex *mutex)
+{
+	mutex->locked_by = FBR_ID_NULL;
+	TAILQ_INIT(&mutex->pending);
+}
+
+static int mutex_lock(FBR_P_ struct fbr_mutex *mutex, int interruptible)
+{
+	struct fbr_ev_mutex ev;
+	int retval;
+
+	assert(!fbr_id_eq(mutex->locked_by, CURRENT_FIBER_ID) &&
+			"Mutex is already locked by current fiber");
+	fbr_ev_mutex_init(FBR_A_ &ev, mutex);
+	if (interruptible)
+		retval = fbr_ev_wait_one(FBR_A_ &ev.ev_base);
+	else
+		retval = ev_wait_one(FBR_A_ &ev.ev_base, 0);
+	if (retval)
+		return -1;
+	assert(fbr_id_eq(mutex->locked_by, CURRENT_FIBER_ID));
+	return 0;
+}
+
+int fbr_mutex_lock(FBR_P_ struct fbr_mutex *mutex)
+{
+	return mutex_lock(FBR_A_ mutex, 1);
+}
+
+int fbr_mutex_trylock(FBR_P_ struct fbr_mutex *mutex)
+{
+	if (fbr_id_isnull(mutex->locked_by)) {
+		mutex->locked_by = CURRENT_FIBER_ID;
+		return 1;
 	}
-	if (stderr_r_ptr) {
-		retval = close(stderr_w);
-		if (-1 == retval)
-			goto error;
-		retval = fbr_fd_nonblock(FBR_A_ stderr_r);
-		if (retval)
-			goto error;
+	return 0;
+}
+
+void fbr_mutex_unlock(FBR_P_ struct fbr_mutex *mutex)
+{
+	struct fbr_id_tailq_i *item, *x;
+	struct fbr_fiber *fiber = NULL;
+	assert(fbr_id_eq(mutex->locked_by, CURRENT_FIBER_ID) &&
+			"Can't unlock the mutex, locked by another fiber");
+
+	if (TAILQ_EMPTY(&mutex->pending)) {
+		mutex->locked_by = FBR_ID_NULL;
+		return;
 	}
 
-	fbr_log_d(FBR_A_ "child pid %d has been launched", pid);
-	if (stdin_w_ptr)
-		*stdin_w_ptr = stdin_w;
-	if (stdout_r_ptr)
-		*stdout_r_ptr = stdout_r;
-	if (stderr_r_ptr)
-		*stderr_r_ptr = stderr_r;
-	return pid;
-error:
-	if (0 <= devnull)
+	TAILQ_FOREACH_SAFE(item, &mutex->pending, entries, x) {
+		assert(item->head == &mutex->pending);
+		TAILQ_REMOVE(&mutex->pending, item, entries);
+		if (-1 == fbr_id_unpack(FBR_A_ &fiber, item->id)) {
+			fbr_log_e(FBR_A_ "libevfibers: unexpected error trying"
+					" to find a fiber by id: %s",
+					fbr_strerror(FBR_A_ fctx->f_errno));
+			continue;
+		}
+		break;
+	}
+
+	mutex->locked_by = item->id;
+	assert(!fbr_id_isnull(mutex->locked_by));
+	post_ev(FBR_A_ fiber, item->ev);
+
+	transfer_handoff(FBR_A_ item);
+}
+
+void fbr_mutex_destroy(_unused_ FBR_P_ _unused_ struct fbr_mutex *mutex)
+{
+	/* Since mutex is stack allocated now, this efffeectively turns into
+	 * NOOP. But we might consider adding some cleanup in the future.
+	 */
+}
+
+void fbr_ev_cond_var_init(FBR_P_ struct fbr_ev_cond_var *ev,
+		struct fbr_cond_var *cond, struct fbr_mutex *mutex)
+{
+	ev_base_init(FBR_A_ &ev->ev_base, FBR_EV_COND_VAR);
+	ev->cond = cond;
+	ev->mutex = mutex;
+}
+
+void fbr_ev_timer_init(FBR_P_ struct fbr_ev_timer *ev)
+{
+	ev_base_init(FBR_A_ &ev->ev_base, FBR_EV_TIMER);
+	ev->expires = 0;
+	ev->active = 0;
+	ev->fired = 0;
+	ev->waiting = 0;
+	fbr_destructor_init(&ev->dtor);
+	ev->dtor.func = wheel_timer_dtor;
+	ev->dtor.arg = ev;
+}
+
+void fbr_ev_rwlock_init(FBR_P_ struct fbr_ev_rwlock *ev,
+		struct fbr_rwlock *rwlock, int write)
+{
+	ev_base_init(FBR_A_ &ev->ev_base, FBR_EV_RWLOCK);
+	ev->rwlock = rwlock;
+	ev->write = write;
+}
+
+void fbr_ev_sem_init(FBR_P_ struct fbr_ev_sem *ev, struct fbr_sem *sem,
+		unsigned count)
+{
+	ev_base_init(FBR_A_ &ev->ev_base, FBR_EV_SEM);
+	ev->sem = sem;
+	ev->count = count;
+}
+
+void fbr_ev_waitgroup_init(FBR_P_ struct fbr_ev_waitgroup *ev,
+		struct fbr_waitgroup *wg)
+{
+	ev_base_init(FBR_A_ &ev->ev_base, FBR_EV_WAITGROUP);
+	ev->wg = wg;
+}
+
+void fbr_ev_mq_pop_init(FBR_P_ struct fbr_ev_mq_pop *ev, struct fbr_mq *mq)
+{
+	ev_base_init(FBR_A_ &ev->ev_base, FBR_EV_MQ_POP);
+	ev->mq = mq;
+	ev->obj = NULL;
+}
+
+void fbr_ev_mq_push_init(FBR_P_ struct fbr_ev_mq_push *ev, struct fbr_mq *mq,
+		void *obj)
+{
+	ev_base_init(FBR_A_ &ev->ev_base, FBR_EV_MQ_PUSH);
+	ev->mq = mq;
+	ev->obj = obj;
+}
+
+void fbr_cond_init(_unused_ FBR_P_ struct fbr_cond_var *cond)
+{
+	cond->mutex = NULL;
+	TAILQ_INIT(&cond->waiting);
+}
+
+void fbr_cond_destroy(_unused_ FBR_P_ _unused_ struct fbr_cond_var *cond)
+{
+	/* Since condvar is stack allocated now, this efffeectively turns into
+	 * NOOP. But we might consider adding some cleanup in the future.
+	 */
+}
+
+int fbr_cond_wait(FBR_P_ struct fbr_cond_var *cond, struct fbr_mutex *mutex)
+{
+	struct fbr_ev_cond_var ev;
+
+	if (mutex && fbr_id_isnull(mutex->locked_by))
+		return_error(-1, FBR_EINVAL);
+
+	fbr_ev_cond_var_init(FBR_A_ &ev, cond, mutex);
+	if (-1 == fbr_ev_wait_one(FBR_A_ &ev.ev_base)) {
+		/* The caller expects to hold the mutex either way */
+		if (mutex)
+			mutex_lock(FBR_A_ mutex, 0);
+		return -1;
+	}
+	return_success(0);
+}
+
+void fbr_cond_broadcast(FBR_P_ struct fbr_cond_var *cond)
+{
+	struct fbr_id_tailq_i *item;
+	struct fbr_fiber *fiber;
+	if (TAILQ_EMPTY(&cond->waiting))
+		return;
+	TAILQ_FOREACH(item, &cond->waiting, entries) {
+		if(-1 == fbr_id_unpack(FBR_A_ &fiber, item->id)) {
+			assert(FBR_ENOFIBER == fctx->f_errno);
+			continue;
+		}
+		post_ev(FBR_A_ fiber, item->ev);
+	}
+	transfer_later_tailq(FBR_A_ &cond->waiting);
+}
+
+void fbr_cond_signal(FBR_P_ struct fbr_cond_var *cond)
+{
+	struct fbr_id_tailq_i *item;
+	struct fbr_fiber *fiber;
+	if (TAILQ_EMPTY(&cond->waiting))
+		return;
+	item = TAILQ_FIRST(&cond->waiting);
+	if(-1 == fbr_id_unpack(FBR_A_ &fiber, item->id)) {
+		assert(FBR_ENOFIBER == fctx->f_errno);
+		return;
+	}
+	post_ev(FBR_A_ fiber, item->ev);
+
+	assert(item->head == &cond->waiting);
+	TAILQ_REMOVE(&cond->waiting, item, entries);
+	transfer_handoff(FBR_A_ item);
+}
+
+void fbr_rwlock_init(_unused_ FBR_P_ struct fbr_rwlock *rwlock)
+{
+	rwlock->writer = FBR_ID_NULL;
+	rwlock->readers = 0;
+	rwlock->pending_writers = 0;
+	TAILQ_INIT(&rwlock->pending);
+}
+
+static void rwlock_grant(FBR_P_ struct fbr_rwlock *rwlock)
+{
+	struct fbr_id_tailq_i *item, *x;
+	struct fbr_id_tailq granted;
+	struct fbr_ev_rwlock *ev;
+	struct fbr_fiber *fiber;
+
+	if (!fbr_id_isnull(rwlock->writer))
+		return;
+	if (rwlock->pending_writers > 0) {
+		if (rwlock->readers > 0)
+			return;
+		TAILQ_FOREACH_SAFE(item, &rwlock->pending, entries, x) {
+			ev = fbr_ev_upcast(item->ev, fbr_ev_rwlock);
+			if (!ev->write)
+				continue;
+			TAILQ_REMOVE(&rwlock->pending, item, entries);
+			item->head = NULL;
+			rwlock->pending_writers--;
+			if (-1 == fbr_id_unpack(FBR_A_ &fiber, item->id)) {
+				fbr_log_e(FBR_A_ "libevfibers: unexpected error"
+						" trying to find a fiber by id:"
+						" %s", fbr_strerror(FBR_A_
+							fctx->f_errno));
+				continue;
+			}
+			rwlock->writer = item->id;
+			post_ev(FBR_A_ fiber, item->ev);
+			transfer_handoff(FBR_A_ item);
+			return;
+		}
+	}
+	/* No writers left, all the readers go together */
+	TAILQ_INIT(&granted);
+	TAILQ_FOREACH_SAFE(item, &rwlock->pending, entries, x) {
+		TAILQ_REMOVE(&rwlock->pending, item, entries);
+		item->head = NULL;
+		if (-1 == fbr_id_unpack(FBR_A_ &fiber, item->id)) {
+			assert(FBR_ENOFIBER == fctx->f_errno);
+			continue;
+		}
+		rwlock->readers++;
+		post_ev(FBR_A_ fiber, item->ev);
+		TAILQ_INSERT_TAIL(&granted, item, entries);
+	}
+	transfer_later_tailq(FBR_A_ &granted);
+}
+
+static int rwlock_lock(FBR_P_ struct fbr_rwlock *rwlock, int write)
+{
+	struct fbr_ev_rwlock ev;
+
+	assert(!fbr_id_eq(rwlock->writer, CURRENT_FIBER_ID) &&
+			"Rwlock is already locked by current fiber");
+	if (rwlock_try(FBR_A_ rwlock, write))
+		return_success(0);
+	fbr_ev_rwlock_init(FBR_A_ &ev, rwlock, write);
+	return fbr_ev_wait_one(FBR_A_ &ev.ev_base);
+}
+
+int fbr_rwlock_rdlock(FBR_P_ struct fbr_rwlock *rwlock)
+{
+	return rwlock_lock(FBR_A_ rwlock, 0);
+}
+
+int fbr_rwlock_wrlock(FBR_P_ struct fbr_rwlock *rwlock)
+{
+	return rwlock_lock(FBR_A_ rwlock, 1);
+}
+
+int fbr_rwlock_tryrdlock(FBR_P_ struct fbr_rwlock *rwlock)
+{
+	return rwlock_try(FBR_A_ rwlock, 0);
+}
+
+int fbr_rwlock_trywrlock(FBR_P_ struct fbr_rwlock *rwlock)
+{
+	return rwlock_try(FBR_A_ rwlock, 1);
+}
+
+static int wait_one_wto(FBR_P_ struct fbr_ev_base *one, ev_tstamp timeout)
+{
+	struct fbr_ev_base *events[] = {one, NULL};
+	int n_events;
+
+	n_events = fbr_ev_wait_to(FBR_A_ events, timeout);
+	if (n_events < 0)
+		return -1;
+	if (0 == n_events) {
+		errno = ETIMEDOUT;
+		return_error(-1, FBR_ETIMEDOUT);
+	}
+	return_success(0);
+}
+
+static int rwlock_lock_wto(FBR_P_ struct fbr_rwlock *rwlock, int write,
+		ev_tstamp timeout)
+{
+	struct fbr_ev_rwlock ev;
+
+	assert(!fbr_id_eq(rwlock->writer, CURRENT_FIBER_ID) &&
+			"Rwlock is already locked by current fiber");
+	if (rwlock_try(FBR_A_ rwlock, write))
+		return_success(0);
+	fbr_ev_rwlock_init(FBR_A_ &ev, rwlock, write);
+	return wait_one_wto(FBR_A_ &ev.ev_base, timeout);
+}
+
+int fbr_rwlock_rdlock_wto(FBR_P_ struct fbr_rwlock *rwlock, ev_tstamp timeout)
+{
+	return rwlock_lock_wto(FBR_A_ rwlock, 0, timeout);
+}
+
+int fbr_rwlock_wrlock_wto(FBR_P_ struct fbr_rwlock *rwlock, ev_tstamp timeout)
+{
+	return rwlock_lock_wto(FBR_A_ rwlock, 1, timeout);
+}
+
+void fbr_rwlock_unlock(FBR_P_ struct fbr_rwlock *rwlock)
+{
+	if (fbr_id_eq(rwlock->writer, CURRENT_FIBER_ID)) {
+		rwlock->writer = FBR_ID_NULL;
+	} else {
+		assert(rwlock->readers > 0 &&
+				"Can't unlock the rwlock, it is not locked");
+		if (--rwlock->readers > 0)
+			return;
+	}
+	rwlock_grant(FBR_A_ rwlock);
+}
+
+void fbr_rwlock_destroy(_unused_ FBR_P_ struct fbr_rwlock *rwlock)
+{
+	assert(TAILQ_EMPTY(&rwlock->pending) &&
+			"Can't destroy the rwlock, it is waited for");
+	(void)rwlock;
+}
+
+void fbr_sem_init(_unused_ FBR_P_ struct fbr_sem *sem, unsigned value)
+{
+	sem->value = value;
+	TAILQ_INIT(&sem->pending);
+}
+
+static void sem_grant(FBR_P_ struct fbr_sem *sem)
+{
+	struct fbr_id_tailq_i *item;
+	struct fbr_id_tailq granted;
+	struct fbr_ev_sem *ev;
+	struct fbr_fiber *fiber;
+
+	TAILQ_INIT(&granted);
+	while ((item = TAILQ_FIRST(&sem->pending))) {
+		ev = fbr_ev_upcast(item->ev, fbr_ev_sem);
+		if (sem->value < ev->count)
+			break;
+		TAILQ_REMOVE(&sem->pending, item, entries);
+		item->head = NULL;
+		if (-1 == fbr_id_unpack(FBR_A_ &fiber, item->id)) {
+			assert(FBR_ENOFIBER == fctx->f_errno);
+			continue;
+		}
+		sem->value -= ev->count;
+		post_ev(FBR_A_ fiber, item->ev);
+		TAILQ_INSERT_TAIL(&granted, item, entries);
+	}
+	transfer_later_tailq(FBR_A_ &granted);
+}
+
+int fbr_sem_acquire(FBR_P_ struct fbr_sem *sem, unsigned count)
+{
+	struct fbr_ev_sem ev;
+
+	if (sem_try(FBR_A_ sem, count))
+		return_success(0);
+	fbr_ev_sem_init(FBR_A_ &ev, sem, count);
+	return fbr_ev_wait_one(FBR_A_ &ev.ev_base);
+}
+
+int fbr_sem_tryacquire(FBR_P_ struct fbr_sem *sem, unsigned count)
+{
+	return sem_try(FBR_A_ sem, count);
+}
+
+int fbr_sem_acquire_wto(FBR_P_ struct fbr_sem *sem, unsigned count,
+		ev_tstamp timeout)
+{
+	struct fbr_ev_sem ev;
+
+	if (sem_try(FBR_A_ sem, count))
+		return_success(0);
+	fbr_ev_sem_init(FBR_A_ &ev, sem, count);
+	return wait_one_wto(FBR_A_ &ev.ev_base, timeout);
+}
+
+void fbr_sem_release(FBR_P_ struct fbr_sem *sem, unsigned count)
+{
+	sem->value += count;
+	sem_grant(FBR_A_ sem);
+}
+
+void fbr_sem_destroy(_unused_ FBR_P_ struct fbr_sem *sem)
+{
+	assert(TAILQ_EMPTY(&sem->pending) &&
+			"Can't destroy the semaphore, it is waited for");
+	(void)sem;
+}
+
+void fbr_waitgroup_init(_unused_ FBR_P_ struct fbr_waitgroup *wg)
+{
+	wg->count = 0;
+	TAILQ_INIT(&wg->waiting);
+}
+
+void fbr_waitgroup_add(_unused_ FBR_P_ struct fbr_waitgroup *wg,
+		unsigned count)
+{
+	wg->count += count;
+}
+
+void fbr_waitgroup_done(FBR_P_ struct fbr_waitgroup *wg)
+{
+	struct fbr_id_tailq_i *item, *x;
+	struct fbr_id_tailq woken;
+	struct fbr_fiber *fiber;
+
+	assert(wg->count > 0 && "Wait group has no outstanding work");
+	if (--wg->count > 0)
+		return;
+	TAILQ_INIT(&woken);
+	TAILQ_FOREACH_SAFE(item, &wg->waiting, entries, x) {
+		TAILQ_REMOVE(&wg->waiting, item, entries);
+		item->head = NULL;
+		if (-1 == fbr_id_unpack(FBR_A_ &fiber, item->id)) {
+			assert(FBR_ENOFIBER == fctx->f_errno);
+			continue;
+		}
+		post_ev(FBR_A_ fiber, item->ev);
+		TAILQ_INSERT_TAIL(&woken, item, entries);
+	}
+	transfer_later_tailq(FBR_A_ &woken);
+}
+
+int fbr_waitgroup_wait(FBR_P_ struct fbr_waitgroup *wg)
+{
+	struct fbr_ev_waitgroup ev;
+
+	if (0 == wg->count)
+		return_success(0);
+	fbr_ev_waitgroup_init(FBR_A_ &ev, wg);
+	return fbr_ev_wait_one(FBR_A_ &ev.ev_base);
+}
+
+int fbr_waitgroup_wait_wto(FBR_P_ struct fbr_waitgroup *wg,
+		ev_tstamp timeout)
+{
+	struct fbr_ev_waitgroup ev;
+
+	if (0 == wg->count)
+		return_success(0);
+	fbr_ev_waitgroup_init(FBR_A_ &ev, wg);
+	return wait_one_wto(FBR_A_ &ev.ev_base, timeout);
+}
+
+void fbr_waitgroup_destroy(_unused_ FBR_P_ struct fbr_waitgroup *wg)
+{
+	assert(TAILQ_EMPTY(&wg->waiting) &&
+			"Can't destroy the wait group, it is waited for");
+	(void)wg;
+}
+
+static size_t get_huge_page_size()
+{
+	static size_t sz;
+	char line[128];
+	unsigned long kb;
+	FILE *f;
+
+	if (sz > 0)
+		return sz;
+	sz = 2 * 1024 * 1024;
+	f = fopen("/proc/meminfo", "r");
+	if (NULL == f)
+		return sz;
+	while (fgets(line, sizeof(line), f)) {
+		if (1 == sscanf(line, "Hugepagesize: %lu kB", &kb)) {
+			sz = kb * 1024;
+			break;
+		}
+	}
+	fclose(f);
+	return sz;
+}
+
+/* Returns a file of the given size to map the ring on */
+static int vrb_open(size_t size, const char *file_pattern, int huge)
+{
+	int fd = -1;
+	char *temp_name = NULL;
+	mode_t old_umask;
+	const mode_t secure_umask = 077;
+
+#ifdef FBR_HAVE_MEMFD
+	unsigned flags = MFD_CLOEXEC;
+#ifdef MFD_HUGETLB
+	if (huge)
+		flags |= MFD_HUGETLB;
+#endif
+	fd = memfd_create("fbr_vrb", flags);
+	if (0 <= fd)
+		goto truncate;
+	/* Only kernels prior to 3.17 have no memfd_create */
+	if (huge || ENOSYS != errno)
+		return -1;
+#endif
+	if (huge)
+		return -1;
+
+	temp_name = strdup(file_pattern);
+	if (!temp_name)
+		return -1;
+	old_umask = umask(0);
+	umask(secure_umask);
+	fd = mkstemp(temp_name);
+	umask(old_umask);
+	if (0 > fd)
+		goto error;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	if (0 > unlink(temp_name))
+		goto error;
+	free(temp_name);
+	temp_name = NULL;
+
+#ifdef FBR_HAVE_MEMFD
+truncate:
+#endif
+	if (0 > ftruncate(fd, size))
+		goto error;
+	return fd;
+
+error:
+	if (0 <= fd)
+		close(fd);
+	if (temp_name)
+		free(temp_name);
+	return -1;
+}
+
+static int vrb_map(struct fbr_vrb *vrb, size_t size, const char *file_pattern,
+		int huge)
+{
+	int fd = -1;
+	size_t sz = get_page_size();
+	size_t align = huge ? get_huge_page_size() : sz;
+	void *ptr = MAP_FAILED;
+
+	size = (size + align - 1) / align * align;
+	if (0 == size)
+		size = align;
+	vrb->mem_ptr_size = size * 2 + sz * 2;
+	if (huge)
+		/* Room to align the rings to a huge page */
+		vrb->mem_ptr_size += align;
+	vrb->mem_ptr = mmap(NULL, vrb->mem_ptr_size, PROT_NONE,
+			FBR_MAP_ANON_FLAG | MAP_PRIVATE, -1, 0);
+	if (MAP_FAILED == vrb->mem_ptr) {
+		vrb->mem_ptr = NULL;
+		goto error;
+	}
+	vrb->lower_ptr = vrb->mem_ptr + sz;
+	if (huge)
+		vrb->lower_ptr = (void *)(((uintptr_t)vrb->lower_ptr +
+					align - 1) & ~(uintptr_t)(align - 1));
+	vrb->upper_ptr = vrb->lower_ptr + size;
+	vrb->ptr_size = size;
+	vrb->data_ptr = vrb->lower_ptr;
+	vrb->space_ptr = vrb->lower_ptr;
+	vrb->fd = -1;
+
+	fd = vrb_open(size, file_pattern, huge);
+	if (0 > fd)
+		goto error;
+
+	ptr = mmap(vrb->lower_ptr, vrb->ptr_size, PROT_READ | PROT_WRITE,
+			MAP_FIXED | MAP_SHARED, fd, 0);
+	if (MAP_FAILED == ptr)
+		goto error;
+	if (ptr != vrb->lower_ptr)
+		goto error;
+
+	ptr = mmap(vrb->upper_ptr, vrb->ptr_size, PROT_READ | PROT_WRITE,
+			MAP_FIXED | MAP_SHARED, fd, 0);
+	if (MAP_FAILED == ptr)
+		goto error;
+	if (ptr != vrb->upper_ptr)
+		goto error;
+
+	/* Kept open to resize the ring later */
+	vrb->fd = fd;
+	return 0;
+
+error:
+	if (0 <= fd)
+		close(fd);
+	/* Unmapping the reservation drops the fixed mappings within it */
+	if (vrb->mem_ptr)
+		munmap(vrb->mem_ptr, vrb->mem_ptr_size);
+	return -1;
+}
+
+int fbr_vrb_init(struct fbr_vrb *vrb, size_t size, const char *file_pattern)
+{
+	return vrb_map(vrb, size, file_pattern, 0);
+}
+
+static int vrb_acquire(FBR_P_ struct fbr_vrb *vrb, size_t size)
+{
+	struct fbr_context_private *p = fctx->__p;
+	size_t huge_size = get_huge_page_size();
+	unsigned sclass;
+
+	sclass = stack_class(size);
+	if (sclass < FBR_VRB_CLASSES) {
+		if (p->vrbs.count[sclass] > 0) {
+			*vrb = p->vrbs.free[sclass][--p->vrbs.count[sclass]];
+			p->vrbs.cached--;
+			fbr_vrb_reset(vrb);
+			return 0;
+		}
+		size = (size_t)get_page_size() << sclass;
+	}
+	if (p->vrbs.huge_pages && size >= huge_size && 0 == size % huge_size &&
+			0 == vrb_map(vrb, size, p->buffer_file_pattern, 1))
+		return 0;
+	return vrb_map(vrb, size, p->buffer_file_pattern, 0);
+}
+
+static void vrb_release(FBR_P_ struct fbr_vrb *vrb)
+{
+	struct fbr_context_private *p = fctx->__p;
+	struct fbr_vrb *items;
+	unsigned sclass;
+	unsigned alloc;
+
+	sclass = stack_class(vrb->ptr_size);
+	/* Resized ones may be of any size */
+	if (sclass >= FBR_VRB_CLASSES || vrb->ptr_size !=
+			(size_t)get_page_size() << sclass ||
+			p->vrbs.cached >= p->vrbs.max_cached)
+		goto unmap;
+	if (p->vrbs.count[sclass] == p->vrbs.alloc[sclass]) {
+		alloc = p->vrbs.alloc[sclass] ? p->vrbs.alloc[sclass] * 2 : 16;
+		items = realloc(p->vrbs.free[sclass], alloc * sizeof(*items));
+		if (NULL == items)
+			goto unmap;
+		p->vrbs.free[sclass] = items;
+		p->vrbs.alloc[sclass] = alloc;
+	}
+	p->vrbs.free[sclass][p->vrbs.count[sclass]++] = *vrb;
+	p->vrbs.cached++;
+	return;
+
+unmap:
+	fbr_vrb_destroy(vrb);
+}
+
+void fbr_set_buffer_cache_size(FBR_P_ unsigned max_cached)
+{
+	struct fbr_context_private *p = fctx->__p;
+	unsigned i = FBR_VRB_CLASSES;
+
+	p->vrbs.max_cached = max_cached;
+	/* Larger mappings go first as they hold more memory */
+	while (i-- > 0 && p->vrbs.cached > max_cached) {
+		while (p->vrbs.cached > max_cached && p->vrbs.count[i] > 0) {
+			fbr_vrb_destroy(&p->vrbs.free[i][--p->vrbs.count[i]]);
+			p->vrbs.cached--;
+		}
+	}
+}
+
+void fbr_enable_buffer_huge_pages(FBR_P_ int enabled)
+{
+	fctx->__p->vrbs.huge_pages = enabled;
+}
+
+int fbr_buffer_init(FBR_P_ struct fbr_buffer *buffer, size_t size)
+{
+	int rv;
+	rv = vrb_acquire(FBR_A_ &buffer->vrb, size);
+	if (rv)
+		return_error(-1, FBR_EBUFFERMMAP);
+
+	buffer->prepared_bytes = 0;
+	buffer->waiting_bytes = 0;
+	fbr_cond_init(FBR_A_ &buffer->committed_cond);
+	fbr_cond_init(FBR_A_ &buffer->bytes_freed_cond);
+	fbr_mutex_init(FBR_A_ &buffer->write_mutex);
+	fbr_mutex_init(FBR_A_ &buffer->read_mutex);
+	return_success(0);
+}
+
+void fbr_vrb_destroy(struct fbr_vrb *vrb)
+{
+	munmap(vrb->upper_ptr, vrb->ptr_size);
+	munmap(vrb->lower_ptr, vrb->ptr_size);
+	munmap(vrb->mem_ptr, vrb->mem_ptr_size);
+	if (0 <= vrb->fd)
+		close(vrb->fd);
+}
+
+/* Maps both halves of a ring of the given size at lower */
+static int vrb_map_halves(struct fbr_vrb *vrb, void *lower, size_t size)
+{
+	void *ptr;
+
+	ptr = mmap(lower, size, PROT_READ | PROT_WRITE,
+			MAP_FIXED | MAP_SHARED, vrb->fd, 0);
+	if (MAP_FAILED == ptr)
+		return -1;
+	ptr = mmap(lower + size, size, PROT_READ | PROT_WRITE,
+			MAP_FIXED | MAP_SHARED, vrb->fd, 0);
+	if (MAP_FAILED == ptr)
+		return -1;
+	return 0;
+}
+
+/*
+ * Grows the mappings to new_size. The lower half stays where it is when the
+ * address range past the reservation is free, otherwise both halves move to
+ * a new reservation. Ring contents live in the file, so nothing is copied.
+ */
+static int vrb_grow(struct fbr_vrb *vrb, size_t new_size, size_t align)
+{
+	size_t sz = get_page_size();
+	size_t extra = (new_size - vrb->ptr_size) * 2;
+	void *end = vrb->mem_ptr + vrb->mem_ptr_size;
+	void *mem_ptr, *lower;
+	size_t mem_ptr_size;
+	int flags = FBR_MAP_ANON_FLAG | MAP_PRIVATE;
+
+	if (0 > ftruncate(vrb->fd, new_size))
+		return -1;
+
+#ifdef MAP_FIXED_NOREPLACE
+	flags |= MAP_FIXED_NOREPLACE;
+#endif
+	mem_ptr = mmap(end, extra, PROT_NONE, flags, -1, 0);
+	if (end == mem_ptr) {
+		if (0 > vrb_map_halves(vrb, vrb->lower_ptr, new_size)) {
+			munmap(end, extra);
+			goto restore;
+		}
+		vrb->mem_ptr_size += extra;
+		vrb->upper_ptr = vrb->lower_ptr + new_size;
+		vrb->ptr_size = new_size;
+		return 0;
+	}
+	if (MAP_FAILED != mem_ptr)
+		munmap(mem_ptr, extra);
+
+	mem_ptr_size = new_size * 2 + sz * 2;
+	if (align > sz)
+		mem_ptr_size += align;
+	mem_ptr = mmap(NULL, mem_ptr_size, PROT_NONE,
+			FBR_MAP_ANON_FLAG | MAP_PRIVATE, -1, 0);
+	if (MAP_FAILED == mem_ptr)
+		return -1;
+	lower = (void *)(((uintptr_t)mem_ptr + sz + align - 1) &
+			~(uintptr_t)(align - 1));
+#ifdef MREMAP_FIXED
+	/* Moves page tables of the populated half along */
+	if (MAP_FAILED != mremap(vrb->lower_ptr, vrb->ptr_size, new_size,
+				MREMAP_MAYMOVE | MREMAP_FIXED, lower)) {
+		if (MAP_FAILED == mmap(lower + new_size, new_size,
+					PROT_READ | PROT_WRITE,
+					MAP_FIXED | MAP_SHARED, vrb->fd, 0)) {
+			munmap(mem_ptr, mem_ptr_size);
+			goto restore;
+		}
+	} else
+#endif
+	if (0 > vrb_map_halves(vrb, lower, new_size)) {
+		munmap(mem_ptr, mem_ptr_size);
+		return -1;
+	}
+	munmap(vrb->mem_ptr, vrb->mem_ptr_size);
+	vrb->data_ptr = lower + (vrb->data_ptr - vrb->lower_ptr);
+	vrb->space_ptr = lower + (vrb->space_ptr - vrb->lower_ptr);
+	vrb->mem_ptr = mem_ptr;
+	vrb->mem_ptr_size = mem_ptr_size;
+	vrb->lower_ptr = lower;
+	vrb->upper_ptr = lower + new_size;
+	vrb->ptr_size = new_size;
+	return 0;
+
+restore:
+	vrb_map_halves(vrb, vrb->lower_ptr, vrb->ptr_size);
+	return -1;
+}
+
+/* Shrinks the mappings to new_size in place and returns memory to the OS */
+static int vrb_shrink(struct fbr_vrb *vrb, size_t new_size, size_t align)
+{
+	/* Hugetlb mappings can only be split on a huge page boundary */
+	size_t sz = align;
+	void *guard = vrb->lower_ptr + new_size * 2;
+	void *end = vrb->mem_ptr + vrb->mem_ptr_size;
+	void *ptr;
+
+	ptr = mmap(vrb->lower_ptr + new_size, new_size, PROT_READ | PROT_WRITE,
+			MAP_FIXED | MAP_SHARED, vrb->fd, 0);
+	if (MAP_FAILED == ptr)
+		return -1;
+	ptr = mmap(guard, sz, PROT_NONE, FBR_MAP_ANON_FLAG | MAP_PRIVATE |
+			MAP_FIXED, -1, 0);
+	if (MAP_FAILED == ptr)
+		return -1;
+	if (end > guard + sz)
+		munmap(guard + sz, end - (guard + sz));
+	vrb->mem_ptr_size = guard + sz - vrb->mem_ptr;
+	vrb->upper_ptr = vrb->lower_ptr + new_size;
+	vrb->ptr_size = new_size;
+	/* Mappings are already consistent, a failure only keeps the pages */
+	ftruncate(vrb->fd, new_size);
+	return 0;
+}
+
+int fbr_vrb_resize_do(struct fbr_vrb *vrb, size_t new_size,
+		_unused_ const char *file_pattern)
+{
+	size_t len = fbr_vrb_data_len(vrb);
+	size_t old_size = vrb->ptr_size;
+	size_t head, wrap, align;
+	size_t offset = vrb->data_ptr - vrb->lower_ptr;
+	struct stat st;
+
+	if (0 > fstat(vrb->fd, &st))
+		return -1;
+	/* Huge page backed files report the huge page size */
+	align = get_page_size();
+	if ((size_t)st.st_blksize > align && 0 == st.st_blksize % align)
+		align = st.st_blksize;
+	if (new_size < len)
+		new_size = len;
+	new_size = (new_size + align - 1) / align * align;
+	if (0 == new_size)
+		new_size = align;
+	if (new_size == old_size)
+		return 0;
+
+	head = len;
+	wrap = 0;
+	if (offset + len > old_size) {
+		head = old_size - offset;
+		wrap = len - head;
+	}
+
+	if (new_size < old_size) {
+		if (wrap > 0) {
+			/* Head goes to the end of the new ring, wrap stays */
+			memmove(vrb->lower_ptr + new_size - head,
+					vrb->data_ptr, head);
+			offset = new_size - head;
+		} else if (offset + len > new_size) {
+			memmove(vrb->lower_ptr, vrb->data_ptr, len);
+			offset = 0;
+		}
+		if (vrb_shrink(vrb, new_size, align))
+			return -1;
+	} else {
+		if (vrb_grow(vrb, new_size, align))
+			return -1;
+		if (wrap > 0 && wrap <= new_size - old_size && wrap <= head) {
+			/* Wrapped part goes after the old end of the ring */
+			memcpy(vrb->lower_ptr + old_size, vrb->lower_ptr, wrap);
+		} else if (wrap > 0) {
+			memmove(vrb->lower_ptr + new_size - head,
+					vrb->lower_ptr + offset, head);
+			offset = new_size - head;
+		}
+	}
+	vrb->data_ptr = vrb->lower_ptr + offset;
+	vrb->space_ptr = vrb->data_ptr + len;
+	return 0;
+}
+
+void fbr_buffer_destroy(FBR_P_ struct fbr_buffer *buffer)
+{
+	vrb_release(FBR_A_ &buffer->vrb);
+
+	fbr_mutex_destroy(FBR_A_ &buffer->read_mutex);
+	fbr_mutex_destroy(FBR_A_ &buffer->write_mutex);
+	fbr_cond_destroy(FBR_A_ &buffer->committed_cond);
+	fbr_cond_destroy(FBR_A_ &buffer->bytes_freed_cond);
+}
+
+void *fbr_buffer_alloc_prepare(FBR_P_ struct fbr_buffer *buffer, size_t size)
+{
+	if (size > fbr_buffer_size(FBR_A_ buffer))
+		return_error(NULL, FBR_EINVAL);
+
+	if (-1 == fbr_mutex_lock(FBR_A_ &buffer->write_mutex))
+		return NULL;
+
+	while (buffer->prepared_bytes > 0)
+		if (-1 == fbr_cond_wait(FBR_A_ &buffer->committed_cond,
+					&buffer->write_mutex))
+			goto error;
+
+	assert(0 == buffer->prepared_bytes);
+
+	buffer->prepared_bytes = size;
+
+	while (fbr_buffer_free_bytes(FBR_A_ buffer) < size)
+		if (-1 == fbr_cond_wait(FBR_A_ &buffer->bytes_freed_cond,
+					&buffer->write_mutex)) {
+			buffer->prepared_bytes = 0;
+			fbr_cond_signal(FBR_A_ &buffer->committed_cond);
+			goto error;
+		}
+
+	return fbr_buffer_space_ptr(FBR_A_ buffer);
+
+error:
+	fbr_mutex_unlock(FBR_A_ &buffer->write_mutex);
+	return NULL;
+}
+
+void fbr_buffer_alloc_commit(FBR_P_ struct fbr_buffer *buffer)
+{
+	fbr_vrb_give(&buffer->vrb, buffer->prepared_bytes);
+	buffer->prepared_bytes = 0;
+	fbr_cond_signal(FBR_A_ &buffer->committed_cond);
+	fbr_mutex_unlock(FBR_A_ &buffer->write_mutex);
+}
+
+void fbr_buffer_alloc_abort(FBR_P_ struct fbr_buffer *buffer)
+{
+	buffer->prepared_bytes = 0;
+	fbr_cond_signal(FBR_A_ &buffer->committed_cond);
+	fbr_mutex_unlock(FBR_A_ &buffer->write_mutex);
+}
+
+void *fbr_buffer_read_address(FBR_P_ struct fbr_buffer *buffer, size_t size)
+{
+	int retval;
+	if (size > fbr_buffer_size(FBR_A_ buffer))
+		return_error(NULL, FBR_EINVAL);
+
+	if (-1 == fbr_mutex_lock(FBR_A_ &buffer->read_mutex))
+		return NULL;
+
+	while (fbr_buffer_bytes(FBR_A_ buffer) < size) {
+		retval = fbr_cond_wait(FBR_A_ &buffer->committed_cond,
+				&buffer->read_mutex);
+		if (-1 == retval) {
+			fbr_mutex_unlock(FBR_A_ &buffer->read_mutex);
+			return NULL;
+		}
+	}
+
+	buffer->waiting_bytes = size;
+
+	return_success(fbr_buffer_data_ptr(FBR_A_ buffer));
+}
+
+void fbr_buffer_read_advance(FBR_P_ struct fbr_buffer *buffer)
+{
+	fbr_vrb_take(&buffer->vrb, buffer->waiting_bytes);
+
+	fbr_cond_signal(FBR_A_ &buffer->bytes_freed_cond);
+	fbr_mutex_unlock(FBR_A_ &buffer->read_mutex);
+}
+
+void fbr_buffer_read_discard(FBR_P_ struct fbr_buffer *buffer)
+{
+	fbr_mutex_unlock(FBR_A_ &buffer->read_mutex);
+}
+
+ssize_t fbr_buffer_fill_from_fd(FBR_P_ struct fbr_buffer *buffer, int fd,
+		size_t max)
+{
+	ssize_t r;
+	size_t size;
+
+	if (-1 == fbr_mutex_lock(FBR_A_ &buffer->write_mutex))
+		return -1;
+
+	while (buffer->prepared_bytes > 0)
+		if (-1 == fbr_cond_wait(FBR_A_ &buffer->committed_cond,
+					&buffer->write_mutex))
+			goto error;
+
+	while (0 == fbr_buffer_free_bytes(FBR_A_ buffer))
+		if (-1 == fbr_cond_wait(FBR_A_ &buffer->bytes_freed_cond,
+					&buffer->write_mutex))
+			goto error;
+
+	size = fbr_buffer_free_bytes(FBR_A_ buffer);
+	if (max > 0 && max < size)
+		size = max;
+	/* Keeps other writers off the space while we wait for the fd */
+	buffer->prepared_bytes = size;
+
+	/* Mirrored mapping makes the whole space contiguous */
+	r = fbr_read(FBR_A_ fd, fbr_buffer_space_ptr(FBR_A_ buffer), size);
+	if (r > 0)
+		fbr_vrb_give(&buffer->vrb, r);
+	buffer->prepared_bytes = 0;
+	fbr_cond_signal(FBR_A_ &buffer->committed_cond);
+	fbr_mutex_unlock(FBR_A_ &buffer->write_mutex);
+	return r;
+
+error:
+	fbr_mutex_unlock(FBR_A_ &buffer->write_mutex);
+	return -1;
+}
+
+ssize_t fbr_buffer_drain_to_fd(FBR_P_ struct fbr_buffer *buffer, int fd,
+		size_t max)
+{
+	ssize_t r;
+	size_t size;
+
+	if (-1 == fbr_mutex_lock(FBR_A_ &buffer->read_mutex))
+		return -1;
+
+	while (0 == fbr_buffer_bytes(FBR_A_ buffer)) {
+		if (-1 == fbr_cond_wait(FBR_A_ &buffer->committed_cond,
+					&buffer->read_mutex)) {
+			fbr_mutex_unlock(FBR_A_ &buffer->read_mutex);
+			return -1;
+		}
+	}
+
+	size = fbr_buffer_bytes(FBR_A_ buffer);
+	if (max > 0 && max < size)
+		size = max;
+
+	/* Mirrored mapping makes the whole data contiguous */
+	r = fbr_write(FBR_A_ fd, fbr_buffer_data_ptr(FBR_A_ buffer), size);
+	if (r > 0) {
+		fbr_vrb_take(&buffer->vrb, r);
+		fbr_cond_signal(FBR_A_ &buffer->bytes_freed_cond);
+	}
+	fbr_mutex_unlock(FBR_A_ &buffer->read_mutex);
+	return r;
+}
+
+int fbr_buffer_resize(FBR_P_ struct fbr_buffer *buffer, size_t size)
+{
+	int rv;
+	if (-1 == fbr_mutex_lock(FBR_A_ &buffer->read_mutex))
+		return -1;
+	if (-1 == fbr_mutex_lock(FBR_A_ &buffer->write_mutex)) {
+		fbr_mutex_unlock(FBR_A_ &buffer->read_mutex);
+		return -1;
+	}
+	rv = fbr_vrb_resize_do(&buffer->vrb, size,
+			fctx->__p->buffer_file_pattern);
+	fbr_mutex_unlock(FBR_A_ &buffer->write_mutex);
+	fbr_mutex_unlock(FBR_A_ &buffer->read_mutex);
+	if (rv)
+		return_error(-1, FBR_EBUFFERMMAP);
+	return_success(0);
+}
+
+int fbr_reader_init(FBR_P_ struct fbr_reader *reader, struct fbr_fd *fdh,
+		size_t size)
+{
+	int rv;
+	rv = vrb_acquire(FBR_A_ &reader->vrb, size);
+	if (rv)
+		return_error(-1, FBR_EBUFFERMMAP);
+	reader->fdh = fdh;
+	reader->consumed = 0;
+	return_success(0);
+}
+
+void fbr_reader_destroy(FBR_P_ struct fbr_reader *reader)
+{
+	vrb_release(FBR_A_ &reader->vrb);
+}
+
+/* Releases the piece handed out by the previous call */
+static void reader_consume(struct fbr_reader *reader)
+{
+	fbr_vrb_take(&reader->vrb, reader->consumed);
+	reader->consumed = 0;
+}
+
+static ssize_t reader_fill(FBR_P_ struct fbr_reader *reader)
+{
+	ssize_t r;
+	size_t space = fbr_vrb_space_len(&reader->vrb);
+
+	if (0 == space)
+		return_error(-1, FBR_EBUFFERNOSPACE);
+	r = fbr_fd_read(FBR_A_ reader->fdh, fbr_vrb_space_ptr(&reader->vrb),
+			space);
+	if (-1 == r)
+		return_error(-1, FBR_ESYSTEM);
+	fbr_vrb_give(&reader->vrb, r);
+	return_success(r);
+}
+
+ssize_t fbr_reader_read_until(FBR_P_ struct fbr_reader *reader, int delim,
+		void **ptr)
+{
+	char *data;
+	char *found;
+	size_t len;
+	size_t scanned = 0;
+	ssize_t r;
+
+	reader_consume(reader);
+	/* Filling only moves the space pointer, data stays where it is */
+	data = fbr_vrb_data_ptr(&reader->vrb);
+	for (;;) {
+		len = fbr_vrb_data_len(&reader->vrb);
+		found = memchr(data + scanned, delim, len - scanned);
+		if (found) {
+			len = found - data + 1;
+			break;
+		}
+		scanned = len;
+		r = reader_fill(FBR_A_ reader);
+		if (-1 == r)
+			return -1;
+		if (0 == r)
+			break;
+	}
+	reader->consumed = len;
+	*ptr = data;
+	return_success(len);
+}
+
+ssize_t fbr_reader_readline(FBR_P_ struct fbr_reader *reader, void **ptr)
+{
+	return fbr_reader_read_until(FBR_A_ reader, '\n', ptr);
+}
+
+ssize_t fbr_reader_read_exact(FBR_P_ struct fbr_reader *reader, size_t n,
+		void **ptr)
+{
+	size_t len;
+	ssize_t r;
+
+	if (n > fbr_vrb_capacity(&reader->vrb))
+		return_error(-1, FBR_EINVAL);
+
+	reader_consume(reader);
+	while ((len = fbr_vrb_data_len(&reader->vrb)) < n) {
+		r = reader_fill(FBR_A_ reader);
+		if (-1 == r)
+			return -1;
+		if (0 == r)
+			break;
+	}
+	if (len > n)
+		len = n;
+	reader->consumed = len;
+	*ptr = fbr_vrb_data_ptr(&reader->vrb);
+	return_success(len);
+}
+
+struct fbr_mq *fbr_mq_create(FBR_P_ size_t size, int flags)
+{
+	struct fbr_mq *mq;
+	unsigned capacity = 1;
+
+	/* Head and tail run freely and are masked into the ring */
+	while (capacity < size)
+		capacity <<= 1;
+
+	mq = calloc(1, sizeof(*mq));
+	mq->fctx = fctx;
+	mq->size = size;
+	mq->mask = capacity - 1;
+	mq->rb = calloc(capacity, sizeof(void *));
+	mq->flags = flags;
+
+	fbr_cond_init(FBR_A_ &mq->bytes_available_cond);
+	fbr_cond_init(FBR_A_ &mq->bytes_freed_cond);
+	TAILQ_INIT(&mq->pop_waiting);
+	TAILQ_INIT(&mq->push_waiting);
+
+	return mq;
+}
+
+struct fbr_mq *fbr_mq_create_inline(FBR_P_ size_t size, size_t elem_size,
+		int flags)
+{
+	struct fbr_mq *mq;
+	unsigned capacity = 1;
+	size_t stride;
+	int retval;
+
+	if (0 == size || 0 == elem_size)
+		return_error(NULL, FBR_EINVAL);
+	while (capacity < size)
+		capacity <<= 1;
+	/* Keeps every message suitably aligned for any type */
+	stride = (elem_size + 15) & ~(size_t)15;
+
+	mq = calloc(1, sizeof(*mq));
+	if (NULL == mq)
+		return_error(NULL, FBR_ESYSTEM);
+	retval = posix_memalign((void **)&mq->data, 64, capacity * stride);
+	if (retval) {
+		free(mq);
+		errno = retval;
+		return_error(NULL, FBR_ESYSTEM);
+	}
+	mq->fctx = fctx;
+	mq->size = size;
+	mq->mask = capacity - 1;
+	mq->elem_size = elem_size;
+	mq->stride = stride;
+	mq->flags = flags;
+
+	fbr_cond_init(FBR_A_ &mq->bytes_available_cond);
+	fbr_cond_init(FBR_A_ &mq->bytes_freed_cond);
+	TAILQ_INIT(&mq->pop_waiting);
+	TAILQ_INIT(&mq->push_waiting);
+
+	return_success(mq);
+}
+
+static inline unsigned mq_count(struct fbr_mq *mq)
+{
+	return mq->head - mq->tail;
+}
+
+static inline int mq_full(struct fbr_mq *mq)
+{
+	return mq_count(mq) >= mq->size;
+}
+
+/* Takes the first waiter off the list whose fiber is still around */
+static struct fbr_id_tailq_i *mq_next_waiter(struct fbr_mq *mq,
+		struct fbr_id_tailq *waiting, struct fbr_fiber **fiber)
+{
+	struct fbr_context *fctx = mq->fctx;
+	struct fbr_id_tailq_i *item;
+
+	while ((item = TAILQ_FIRST(waiting))) {
+		TAILQ_REMOVE(waiting, item, entries);
+		item->head = NULL;
+		if (0 == fbr_id_unpack(FBR_A_ fiber, item->id))
+			return item;
+		assert(FBR_ENOFIBER == fctx->f_errno);
+	}
+	return NULL;
+}
+
+/* Moves the messages of the waiting pushers into the free space. Waiters of
+ * fbr_mq_wait_push are only woken once the queue stops being full, not on
+ * every slot freed. */
+static void mq_admit_pushers(struct fbr_mq *mq, int was_full)
+{
+	struct fbr_context *fctx = mq->fctx;
+	struct fbr_id_tailq_i *item;
+	struct fbr_fiber *fiber;
+	void *obj;
+
+	while (!mq_full(mq)) {
+		item = mq_next_waiter(mq, &mq->push_waiting, &fiber);
+		if (NULL == item) {
+			if (was_full)
+				fbr_cond_broadcast(FBR_A_
+						&mq->bytes_freed_cond);
+			return;
+		}
+		obj = fbr_ev_upcast(item->ev, fbr_ev_mq_push)->obj;
+		mq->rb[mq->head++ & mq->mask] = obj;
+		post_ev(FBR_A_ fiber, item->ev);
+		transfer_handoff(FBR_A_ item);
+	}
+}
+
+static size_t mq_put_many(struct fbr_mq *mq, void **objs, size_t n)
+{
+	struct fbr_context *fctx = mq->fctx;
+	struct fbr_id_tailq_i *item;
+	struct fbr_fiber *fiber;
+	size_t i = 0;
+	int was_empty;
+
+	assert(NULL == mq->data && "Inline queue takes no pointers");
+	/* Waiting poppers imply an empty queue, the messages go straight to
+	 * them, one each */
+	while (i < n) {
+		item = mq_next_waiter(mq, &mq->pop_waiting, &fiber);
+		if (NULL == item)
+			break;
+		fbr_ev_upcast(item->ev, fbr_ev_mq_pop)->obj = objs[i++];
+		post_ev(FBR_A_ fiber, item->ev);
+		if (1 == n)
+			transfer_handoff(FBR_A_ item);
+		else
+			transfer_later(FBR_A_ item);
+	}
+
+	was_empty = (0 == mq_count(mq));
+	while (i < n && !mq_full(mq))
+		mq->rb[mq->head++ & mq->mask] = objs[i++];
+	/* Waiters of fbr_mq_wait_pop only care about the queue becoming non
+	 * empty, one wakeup per batch is enough */
+	if (was_empty && mq_count(mq) > 0)
+		fbr_cond_broadcast(FBR_A_ &mq->bytes_available_cond);
+	return i;
+}
+
+static int mq_put(struct fbr_mq *mq, void *obj)
+{
+	return mq_put_many(mq, &obj, 1);
+}
+
+static size_t mq_take_many(struct fbr_mq *mq, void **objs, size_t n)
+{
+	struct fbr_context *fctx = mq->fctx;
+	struct fbr_id_tailq_i *item;
+	struct fbr_fiber *fiber;
+	size_t i = 0;
+	int was_full;
+
+	assert(NULL == mq->data && "Inline queue gives no pointers");
+	if (mq_count(mq) > 0) {
+		was_full = mq_full(mq);
+		while (i < n && mq_count(mq) > 0) {
+			objs[i++] = mq->rb[mq->tail & mq->mask];
+			mq->rb[mq->tail++ & mq->mask] = NULL;
+		}
+		mq_admit_pushers(mq, was_full);
+		return i;
+	}
+	/* Queue of zero size: take the messages right from waiting pushers */
+	while (i < n) {
+		item = mq_next_waiter(mq, &mq->push_waiting, &fiber);
+		if (NULL == item)
+			break;
+		objs[i++] = fbr_ev_upcast(item->ev, fbr_ev_mq_push)->obj;
+		post_ev(FBR_A_ fiber, item->ev);
+		if (1 == n)
+			transfer_handoff(FBR_A_ item);
+		else
+			transfer_later(FBR_A_ item);
+	}
+	return i;
+}
+
+static int mq_take(struct fbr_mq *mq, void **obj)
+{
+	return mq_take_many(mq, obj, 1);
+}
+
+void fbr_mq_clear(struct fbr_mq *mq, int wake_up_writers)
+{
+	int was_full = mq_full(mq);
+
+	if (mq->data)
+		memset(mq->data, 0x00, (mq->mask + 1) * mq->stride);
+	else
+		memset(mq->rb, 0x00, (mq->mask + 1) * sizeof(void *));
+	mq->head = 0;
+	mq->tail = 0;
+
+	if (wake_up_writers)
+		mq_admit_pushers(mq, was_full);
+}
+
+int fbr_mq_push(struct fbr_mq *mq, void *obj)
+{
+	struct fbr_ev_mq_push ev;
+
+	if (mq_put(mq, obj))
+		return 0;
+	fbr_ev_mq_push_init(mq->fctx, &ev, mq, obj);
+	return fbr_ev_wait_one(mq->fctx, &ev.ev_base);
+}
+
+int fbr_mq_try_push(struct fbr_mq *mq, void *obj)
+{
+	if (mq_put(mq, obj))
+		return 0;
+	return -1;
+}
+
+ssize_t fbr_mq_push_many(struct fbr_mq *mq, void **objs, size_t n)
+{
+	struct fbr_ev_mq_push ev;
+	size_t pushed;
+
+	if (0 == n)
+		return 0;
+	pushed = mq_put_many(mq, objs, n);
+	if (pushed > 0)
+		return pushed;
+	fbr_ev_mq_push_init(mq->fctx, &ev, mq, objs[0]);
+	if (-1 == fbr_ev_wait_one(mq->fctx, &ev.ev_base))
+		return -1;
+	return 1 + mq_put_many(mq, objs + 1, n - 1);
+}
+
+int fbr_mq_wait_push(struct fbr_mq *mq)
+{
+	while (mq_full(mq))
+		if (-1 == fbr_cond_wait(mq->fctx, &mq->bytes_freed_cond, NULL))
+			return -1;
+	return 0;
+}
+
+void *fbr_mq_pop(struct fbr_mq *mq)
+{
+	struct fbr_ev_mq_pop ev;
+	void *obj;
+
+	if (mq_take(mq, &obj))
+		return obj;
+	fbr_ev_mq_pop_init(mq->fctx, &ev, mq);
+	if (-1 == fbr_ev_wait_one(mq->fctx, &ev.ev_base))
+		return NULL;
+	return ev.obj;
+}
+
+int fbr_mq_try_pop(struct fbr_mq *mq, void **obj)
+{
+	if (mq_take(mq, obj))
+		return 0;
+	return -1;
+}
+
+ssize_t fbr_mq_pop_many(struct fbr_mq *mq, void **objs, size_t max)
+{
+	struct fbr_ev_mq_pop ev;
+	size_t popped;
+
+	if (0 == max)
+		return 0;
+	popped = mq_take_many(mq, objs, max);
+	if (popped > 0)
+		return popped;
+	fbr_ev_mq_pop_init(mq->fctx, &ev, mq);
+	if (-1 == fbr_ev_wait_one(mq->fctx, &ev.ev_base))
+		return -1;
+	objs[0] = ev.obj;
+	return 1 + mq_take_many(mq, objs + 1, max - 1);
+}
+
+int fbr_mq_wait_pop(struct fbr_mq *mq)
+{
+	while (0 == mq_count(mq))
+		if (-1 == fbr_cond_wait(mq->fctx, &mq->bytes_available_cond,
+					NULL))
+			return -1;
+	return 0;
+}
+
+void *fbr_mq_try_reserve(struct fbr_mq *mq)
+{
+	assert(mq->data && "Only inline queues take reservations");
+	if (mq_full(mq))
+		return NULL;
+	return mq->data + (mq->head & mq->mask) * mq->stride;
+}
+
+void *fbr_mq_reserve(struct fbr_mq *mq)
+{
+	while (mq_full(mq))
+		if (-1 == fbr_cond_wait(mq->fctx, &mq->bytes_freed_cond, NULL))
+			return NULL;
+	return fbr_mq_try_reserve(mq);
+}
+
+void fbr_mq_commit(struct fbr_mq *mq)
+{
+	assert(!mq_full(mq) && "Nothing has been reserved");
+	if (0 == mq_count(mq)) {
+		mq->head++;
+		fbr_cond_broadcast(mq->fctx, &mq->bytes_available_cond);
+		return;
+	}
+	mq->head++;
+}
+
+void *fbr_mq_try_peek(struct fbr_mq *mq)
+{
+	assert(mq->data && "Only inline queues can be peeked");
+	if (0 == mq_count(mq))
+		return NULL;
+	return mq->data + (mq->tail & mq->mask) * mq->stride;
+}
+
+void *fbr_mq_peek(struct fbr_mq *mq)
+{
+	while (0 == mq_count(mq))
+		if (-1 == fbr_cond_wait(mq->fctx, &mq->bytes_available_cond,
+					NULL))
+			return NULL;
+	return fbr_mq_try_peek(mq);
+}
+
+void fbr_mq_release(struct fbr_mq *mq)
+{
+	assert(mq_count(mq) > 0 && "Nothing to release");
+	if (mq_full(mq)) {
+		mq->tail++;
+		fbr_cond_broadcast(mq->fctx, &mq->bytes_freed_cond);
+		return;
+	}
+	mq->tail++;
+}
+
+int fbr_mq_push_data(struct fbr_mq *mq, const void *data)
+{
+	void *ptr;
+
+	ptr = fbr_mq_reserve(mq);
+	if (NULL == ptr)
+		return -1;
+	memcpy(ptr, data, mq->elem_size);
+	fbr_mq_commit(mq);
+	return 0;
+}
+
+int fbr_mq_pop_data(struct fbr_mq *mq, void *data)
+{
+	void *ptr;
+
+	ptr = fbr_mq_peek(mq);
+	if (NULL == ptr)
+		return -1;
+	memcpy(data, ptr, mq->elem_size);
+	fbr_mq_release(mq);
+	return 0;
+}
+
+void fbr_mq_destroy(struct fbr_mq *mq)
+{
+	assert(TAILQ_EMPTY(&mq->pop_waiting) &&
+			TAILQ_EMPTY(&mq->push_waiting) &&
+			"Can't destroy the queue, it is waited for");
+	fbr_cond_destroy(mq->fctx, &mq->bytes_freed_cond);
+	fbr_cond_destroy(mq->fctx, &mq->bytes_available_cond);
+	free(mq->data);
+	free(mq->rb);
+	free(mq);
+}
+
+static inline int heap_less(struct fbr_heap_entry *a, struct fbr_heap_entry *b)
+{
+	return a->key < b->key || (a->key == b->key && a->seq < b->seq);
+}
+
+static int heap_push(struct fbr_heap *heap, ev_tstamp key, void *obj)
+{
+	struct fbr_heap_entry *entries;
+	struct fbr_heap_entry entry;
+	size_t i, parent;
+	size_t alloc;
+
+	if (heap->count == heap->alloc) {
+		alloc = heap->alloc ? heap->alloc * 2 : 64;
+		entries = realloc(heap->entries, alloc * sizeof(*entries));
+		if (NULL == entries)
+			return -1;
+		heap->entries = entries;
+		heap->alloc = alloc;
+	}
+	entry.key = key;
+	entry.seq = heap->seq++;
+	entry.obj = obj;
+	for (i = heap->count++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (!heap_less(&entry, &heap->entries[parent]))
+			break;
+		heap->entries[i] = heap->entries[parent];
+	}
+	heap->entries[i] = entry;
+	return 0;
+}
+
+static void *heap_pop(struct fbr_heap *heap)
+{
+	struct fbr_heap_entry *entries = heap->entries;
+	struct fbr_heap_entry last;
+	void *obj;
+	size_t i, child;
+
+	assert(heap->count > 0);
+	obj = entries[0].obj;
+	last = entries[--heap->count];
+	for (i = 0; (child = 2 * i + 1) < heap->count; i = child) {
+		if (child + 1 < heap->count &&
+				heap_less(&entries[child + 1], &entries[child]))
+			child++;
+		if (!heap_less(&entries[child], &last))
+			break;
+		entries[i] = entries[child];
+	}
+	entries[i] = last;
+	return obj;
+}
+
+struct fbr_pq *fbr_pq_create(FBR_P_ size_t size)
+{
+	struct fbr_pq *pq;
+
+	pq = calloc(1, sizeof(*pq));
+	if (NULL == pq)
+		return_error(NULL, FBR_ESYSTEM);
+	pq->fctx = fctx;
+	pq->size = size;
+	fbr_cond_init(FBR_A_ &pq->available_cond);
+	fbr_cond_init(FBR_A_ &pq->freed_cond);
+	return_success(pq);
+}
+
+static inline int pq_full(struct fbr_pq *pq)
+{
+	return pq->size > 0 && pq->heap.count >= pq->size;
+}
+
+int fbr_pq_try_push(struct fbr_pq *pq, void *obj, int priority)
+{
+	struct fbr_context *fctx = pq->fctx;
+
+	if (pq_full(pq))
+		return -1;
+	if (-1 == heap_push(&pq->heap, priority, obj))
+		return_error(-1, FBR_ESYSTEM);
+	fbr_cond_signal(FBR_A_ &pq->available_cond);
+	return_success(0);
+}
+
+int fbr_pq_push(struct fbr_pq *pq, void *obj, int priority)
+{
+	while (pq_full(pq))
+		if (-1 == fbr_cond_wait(pq->fctx, &pq->freed_cond, NULL))
+			return -1;
+	return fbr_pq_try_push(pq, obj, priority);
+}
+
+int fbr_pq_try_pop(struct fbr_pq *pq, void **obj)
+{
+	if (0 == pq->heap.count)
+		return -1;
+	*obj = heap_pop(&pq->heap);
+	if (pq->size > 0)
+		fbr_cond_signal(pq->fctx, &pq->freed_cond);
+	return 0;
+}
+
+void *fbr_pq_pop(struct fbr_pq *pq)
+{
+	void *obj;
+
+	while (0 == pq->heap.count)
+		if (-1 == fbr_cond_wait(pq->fctx, &pq->available_cond, NULL))
+			return NULL;
+	fbr_pq_try_pop(pq, &obj);
+	return obj;
+}
+
+size_t fbr_pq_count(struct fbr_pq *pq)
+{
+	return pq->heap.count;
+}
+
+void fbr_pq_destroy(struct fbr_pq *pq)
+{
+	fbr_cond_destroy(pq->fctx, &pq->available_cond);
+	fbr_cond_destroy(pq->fctx, &pq->freed_cond);
+	free(pq->heap.entries);
+	free(pq);
+}
+
+static void delayq_timer_cb(_unused_ EV_P_ ev_timer *w, _unused_ int event)
+{
+	struct fbr_delayq *dq = w->data;
+
+	dq->armed_at = 0.;
+	fbr_cond_signal(dq->fctx, &dq->available_cond);
+}
+
+struct fbr_delayq *fbr_delayq_create(FBR_P_ size_t size)
+{
+	struct fbr_delayq *dq;
+
+	dq = calloc(1, sizeof(*dq));
+	if (NULL == dq)
+		return_error(NULL, FBR_ESYSTEM);
+	dq->fctx = fctx;
+	dq->size = size;
+	ev_timer_init(&dq->timer, delayq_timer_cb, 0., 0.);
+	dq->timer.data = dq;
+	fbr_cond_init(FBR_A_ &dq->available_cond);
+	fbr_cond_init(FBR_A_ &dq->freed_cond);
+	return_success(dq);
+}
+
+static inline int delayq_due(struct fbr_delayq *dq)
+{
+	return dq->heap.count > 0 &&
+		dq->heap.entries[0].key <= ev_now(dq->fctx->__p->loop);
+}
+
+/* The only timer of the queue follows its earliest item */
+static void delayq_arm(struct fbr_delayq *dq)
+{
+	struct ev_loop *loop = dq->fctx->__p->loop;
+	ev_tstamp at;
+
+	if (0 == dq->heap.count) {
+		ev_timer_stop(loop, &dq->timer);
+		dq->armed_at = 0.;
+		return;
+	}
+	at = dq->heap.entries[0].key;
+	if (ev_is_active(&dq->timer) && at == dq->armed_at)
+		return;
+	ev_timer_stop(loop, &dq->timer);
+	ev_timer_set(&dq->timer, max(0., at - ev_now(loop)), 0.);
+	ev_timer_start(loop, &dq->timer);
+	dq->armed_at = at;
+}
+
+static inline int delayq_full(struct fbr_delayq *dq)
+{
+	return dq->size > 0 && dq->heap.count >= dq->size;
+}
+
+int fbr_delayq_try_push(struct fbr_delayq *dq, void *obj, ev_tstamp delay)
+{
+	struct fbr_context *fctx = dq->fctx;
+	ev_tstamp at = ev_now(fctx->__p->loop) + delay;
+
+	if (delayq_full(dq))
+		return -1;
+	if (-1 == heap_push(&dq->heap, at, obj))
+		return_error(-1, FBR_ESYSTEM);
+	if (delayq_due(dq))
+		fbr_cond_signal(FBR_A_ &dq->available_cond);
+	else
+		delayq_arm(dq);
+	return_success(0);
+}
+
+int fbr_delayq_push(struct fbr_delayq *dq, void *obj, ev_tstamp delay)
+{
+	while (delayq_full(dq))
+		if (-1 == fbr_cond_wait(dq->fctx, &dq->freed_cond, NULL))
+			return -1;
+	return fbr_delayq_try_push(dq, obj, delay);
+}
+
+int fbr_delayq_try_pop(struct fbr_delayq *dq, void **obj)
+{
+	if (!delayq_due(dq))
+		return -1;
+	*obj = heap_pop(&dq->heap);
+	/* Pass the wakeup on if more items are due already */
+	if (delayq_due(dq))
+		fbr_cond_signal(dq->fctx, &dq->available_cond);
+	else
+		delayq_arm(dq);
+	if (dq->size > 0)
+		fbr_cond_signal(dq->fctx, &dq->freed_cond);
+	return 0;
+}
+
+void *fbr_delayq_pop(struct fbr_delayq *dq)
+{
+	void *obj;
+
+	while (-1 == fbr_delayq_try_pop(dq, &obj)) {
+		delayq_arm(dq);
+		if (-1 == fbr_cond_wait(dq->fctx, &dq->available_cond, NULL))
+			return NULL;
+	}
+	return obj;
+}
+
+size_t fbr_delayq_count(struct fbr_delayq *dq)
+{
+	return dq->heap.count;
+}
+
+void fbr_delayq_destroy(struct fbr_delayq *dq)
+{
+	ev_timer_stop(dq->fctx->__p->loop, &dq->timer);
+	fbr_cond_destroy(dq->fctx, &dq->available_cond);
+	fbr_cond_destroy(dq->fctx, &dq->freed_cond);
+	free(dq->heap.entries);
+	free(dq);
+}
+
+void *fbr_get_user_data(FBR_P_ fbr_id_t id)
+{
+	struct fbr_fiber *fiber;
+	unpack_transfer_errno(NULL, &fiber, id);
+	return_success(fiber->user_data);
+}
+
+int fbr_set_user_data(FBR_P_ fbr_id_t id, void *data)
+{
+	struct fbr_fiber *fiber;
+	unpack_transfer_errno(-1, &fiber, id);
+	fiber->user_data = data;
+	return_success(0);
+}
+
+void fbr_destructor_add(FBR_P_ struct fbr_destructor *dtor)
+{
+	struct fbr_fiber *fiber = CURRENT_FIBER;
+	TAILQ_INSERT_TAIL(&fiber->destructors, dtor, entries);
+	dtor->active = 1;
+}
+
+void fbr_destructor_remove(FBR_P_ struct fbr_destructor *dtor,
+		int call)
+{
+	struct fbr_fiber *fiber = CURRENT_FIBER;
+
+	if (0 == dtor->active)
+		return;
+
+	TAILQ_REMOVE(&fiber->destructors, dtor, entries);
+	if (call)
+		dtor->func(FBR_A_ dtor->arg);
+	dtor->active = 0;
+}
+
+static inline int wrap_ffsll(uint64_t val)
+{
+	/* TODO: Add some check for the existance of this builtin */
+	return __builtin_ffsll(val);
+}
+
+static inline int is_key_registered(FBR_P_ fbr_key_t key)
+{
+	return 0 == (fctx->__p->key_free_mask & (1 << key));
+}
+
+static inline void register_key(FBR_P_ fbr_key_t key)
+{
+
+	fctx->__p->key_free_mask &= ~(1ULL << key);
+}
+
+static inline void unregister_key(FBR_P_ fbr_key_t key)
+{
+	fctx->__p->key_free_mask |= (1 << key);
+}
+
+int fbr_key_create(FBR_P_ fbr_key_t *key_ptr)
+{
+	fbr_key_t key = wrap_ffsll(fctx->__p->key_free_mask) - 1;
+	assert(key < FBR_MAX_KEY);
+	register_key(FBR_A_ key);
+	*key_ptr = key;
+	return_success(0);
+}
+
+int fbr_key_delete(FBR_P_ fbr_key_t key)
+{
+	if (!is_key_registered(FBR_A_ key))
+		return_error(-1, FBR_ENOKEY);
+
+	unregister_key(FBR_A_ key);
+
+	return_success(0);
+}
+
+int fbr_key_set(FBR_P_ fbr_id_t id, fbr_key_t key, void *value)
+{
+	struct fbr_fiber *fiber;
+
+	unpack_transfer_errno(-1, &fiber, id);
+
+	if (!is_key_registered(FBR_A_ key))
+		return_error(-1, FBR_ENOKEY);
+
+	fiber->key_data[key] = value;
+	return_success(0);
+}
+
+void *fbr_key_get(FBR_P_ fbr_id_t id, fbr_key_t key)
+{
+	struct fbr_fiber *fiber;
+
+	unpack_transfer_errno(NULL, &fiber, id);
+
+	if (!is_key_registered(FBR_A_ key))
+		return_error(NULL, FBR_ENOKEY);
+
+	return fiber->key_data[key];
+}
+
+const char *fbr_get_name(FBR_P_ fbr_id_t id)
+{
+	struct fbr_fiber *fiber;
+	unpack_transfer_errno(NULL, &fiber, id);
+	return_success(fiber->name);
+}
+
+int fbr_set_name(FBR_P_ fbr_id_t id, const char *name)
+{
+	struct fbr_fiber *fiber;
+	unpack_transfer_errno(-1, &fiber, id);
+	strncpy(fiber->name, name, FBR_MAX_FIBER_NAME - 1);
+	return_success(0);
+}
+
+static int make_pipe(FBR_P_ int *r, int*w)
+{
+	int fds[2];
+	int retval;
+	retval = pipe(fds);
+	if (-1 == retval)
+		return_error(-1, FBR_ESYSTEM);
+	*r = fds[0];
+	*w = fds[1];
+	return_success(0);
+}
+
+pid_t fbr_popen3(FBR_P_ const char *filename, char *const argv[],
+		char *const envp[], const char *working_dir,
+		int *stdin_w_ptr, int *stdout_r_ptr, int *stderr_r_ptr)
+{
+	pid_t pid;
+	int stdin_r = -1, stdin_w = -1;
+	int stdout_r = -1, stdout_w = -1;
+	int stderr_r = -1, stderr_w = -1;
+	int devnull = -1;
+	int retval;
+
+	retval = (stdin_w_ptr ? make_pipe(FBR_A_ &stdin_r, &stdin_w) : 0);
+	if (retval)
+		goto error;
+	retval = (stdout_r_ptr ? make_pipe(FBR_A_ &stdout_r, &stdout_w) : 0);
+	if (retval)
+		goto error;
+	retval = (stderr_r_ptr ? make_pipe(FBR_A_ &stderr_r, &stderr_w) : 0);
+	if (retval)
+		goto error;
+
+	pid = fork();
+	if (-1 == pid)
+		goto error;
+	if (0 == pid) {
+		/* Child */
+		ev_break(fctx->__p->loop, EVBREAK_ALL);
+		if (stdin_w_ptr) {
+			retval = close(stdin_w);
+			if (-1 == retval)
+				goto error;
+			retval = dup2(stdin_r, STDIN_FILENO);
+			if (-1 == retval)
+				goto error;
+		} else {
+			devnull = open("/dev/null", O_RDONLY);
+			if (-1 == retval)
+				goto error;
+			retval = dup2(devnull, STDIN_FILENO);
+			if (-1 == retval)
+				goto error;
+			retval = close(devnull);
+			if (-1 == retval)
+				goto error;
+		}
+		if (stdout_r_ptr) {
+			retval = close(stdout_r);
+			if (-1 == retval)
+				goto error;
+			retval = dup2(stdout_w, STDOUT_FILENO);
+			if (-1 == retval)
+				goto error;
+		} else {
+			devnull = open("/dev/null", O_WRONLY);
+			if (-1 == retval)
+				goto error;
+			retval = dup2(devnull, STDOUT_FILENO);
+			if (-1 == retval)
+				goto error;
+			retval = close(devnull);
+			if (-1 == retval)
+				goto error;
+		}
+		if (stderr_r_ptr) {
+			retval = close(stderr_r);
+			if (-1 == retval)
+				goto error;
+			retval = dup2(stderr_w, STDERR_FILENO);
+			if (-1 == retval)
+				goto error;
+		} else {
+			devnull = open("/dev/null", O_WRONLY);
+			if (-1 == retval)
+				goto error;
+			retval = dup2(devnull, STDERR_FILENO);
+			if (-1 == retval)
+				goto error;
+			retval = close(devnull);
+			if (-1 == retval)
+				goto error;
+		}
+
+		if (working_dir) {
+			retval = chdir(working_dir);
+			if (-1 == retval)
+				goto error;
+		}
+
+		retval = execve(filename, argv, envp);
+		if (-1 == retval)
+			goto error;
+
+		errx(EXIT_FAILURE, "execve failed without error code");
+	}
+	/* Parent */
+	if (stdin_w_ptr) {
+		retval = close(stdin_r);
+		if (-1 == retval)
+			goto error;
+		retval = fbr_fd_nonblock(FBR_A_ stdin_w);
+		if (retval)
+			goto error;
+	}
+	if (stdout_r_ptr) {
+		retval = close(stdout_w);
+		if (-1 == retval)
+			goto error;
+		retval = fbr_fd_nonblock(FBR_A_ stdout_r);
+		if (retval)
+			goto error;
+	}
+	if (stderr_r_ptr) {
+		retval = close(stderr_w);
+		if (-1 == retval)
+			goto error;
+		retval = fbr_fd_nonblock(FBR_A_ stderr_r);
+		if (retval)
+			goto error;
+	}
+
+	fbr_log_d(FBR_A_ "child pid %d has been launched", pid);
+	if (stdin_w_ptr)
+		*stdin_w_ptr = stdin_w;
+	if (stdout_r_ptr)
+		*stdout_r_ptr = stdout_r;
+	if (stderr_r_ptr)
+		*stderr_r_ptr = stderr_r;
+	return pid;
+error:
+	if (0 <= devnull)
 		close(devnull);
 	if (0 <= stdin_r)
 	       close(stdin_r);
@@ -2342,542 +5709,1484 @@ error:
 	return_error(-1, FBR_ESYSTEM);
 }
 
-static void watcher_child_dtor(_unused_ FBR_P_ void *_arg)
+static void watcher_child_dtor(_unused_ FBR_P_ void *_arg)
+{
+	struct ev_child *w = _arg;
+	ev_child_stop(fctx->__p->loop, w);
+}
+
+int fbr_waitpid(FBR_P_ pid_t pid)
+{
+	struct ev_child child;
+	struct fbr_ev_watcher watcher;
+	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
+	ev_child_init(&child, NULL, pid, 0.);
+	ev_child_start(fctx->__p->loop, &child);
+	dtor.func = watcher_child_dtor;
+	dtor.arg = &child;
+	fbr_destructor_add(FBR_A_ &dtor);
+
+	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&child);
+	if (-1 == fbr_ev_wait_one(FBR_A_ &watcher.ev_base)) {
+		fbr_destructor_remove(FBR_A_ &dtor, 1 /* Call it? */);
+		return -1;
+	}
+
+	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
+	ev_child_stop(fctx->__p->loop, &child);
+	return_success(child.rstatus);
+}
+
+int fbr_system(FBR_P_ const char *filename, char *const argv[],
+		char *const envp[], const char *working_dir)
+{
+	pid_t pid;
+	int retval;
+
+	pid = fork();
+	if (-1 == pid)
+		return_error(-1, FBR_ESYSTEM);
+	if (0 == pid) {
+		/* Child */
+		ev_break(fctx->__p->loop, EVBREAK_ALL);
+
+		if (working_dir) {
+			retval = chdir(working_dir);
+			if (-1 == retval)
+				err(EXIT_FAILURE, "chdir");
+		}
+
+		retval = execve(filename, argv, envp);
+		if (-1 == retval)
+			err(EXIT_FAILURE, "execve");
+
+		errx(EXIT_FAILURE, "execve failed without error code");
+	}
+	/* Parent */
+
+	fbr_log_d(FBR_A_ "child pid %d has been launched", pid);
+	return fbr_waitpid(FBR_A_ pid);
+}
+
+#ifdef FBR_EIO_ENABLED
+
+static struct fbr_context *eio_fctx;
+static ev_idle repeat_watcher;
+static ev_async ready_watcher;
+
+/* idle watcher callback, only used when eio_poll */
+/* didn't handle all results in one call */
+static void repeat(EV_P_ ev_idle *w, _unused_ int revents)
+{
+	if (eio_poll () != -1)
+		ev_idle_stop(EV_A_ w);
+}
+
+/* eio has some results, process them */
+static void ready(EV_P_ _unused_ ev_async *w, _unused_ int revents)
+{
+	if (eio_poll() == -1)
+		ev_idle_start(EV_A_ &repeat_watcher);
+}
+
+/* wake up the event loop */
+static void want_poll()
+{
+	ev_async_send(eio_fctx->__p->loop, &ready_watcher);
+}
+
+void fbr_eio_init(FBR_P)
+{
+	if (NULL != eio_fctx) {
+		fprintf(stderr, "libevfibers: fbr_eio_init called twice");
+		abort();
+	}
+	eio_fctx = fctx;
+	ev_idle_init(&repeat_watcher, repeat);
+	ev_async_init(&ready_watcher, ready);
+	ev_async_start(fctx->__p->loop, &ready_watcher);
+	ev_unref(fctx->__p->loop);
+	eio_init(want_poll, 0);
+}
+
+void fbr_ev_eio_init(FBR_P_ struct fbr_ev_eio *ev, eio_req *req)
+{
+	ev_base_init(FBR_A_ &ev->ev_base, FBR_EV_EIO);
+	ev->req = req;
+}
+
+static void eio_req_dtor(FBR_P_ void *_arg)
+{
+	eio_req *req = _arg;
+	eio_cancel(req);
+	ev_unref(fctx->__p->loop);
+}
+
+static int fiber_eio_cb(eio_req *req)
+{
+	struct fbr_fiber *fiber;
+	struct fbr_ev_eio *ev;
+	struct fbr_context *fctx;
+	int retval;
+
+	/* Cancelled request belongs to a reclaimed fiber, the event lived on
+	 * its stack and must not be touched */
+	if (EIO_CANCELLED(req))
+		return 0;
+
+	ev = req->data;
+	fctx = ev->ev_base.fctx;
+
+	ENSURE_ROOT_FIBER;
+
+	retval = fbr_id_unpack(FBR_A_ &fiber, ev->ev_base.id);
+	if (-1 == retval) {
+		fbr_log_e(FBR_A_ "libevfibers: fiber is about to be called by"
+			" the eio callback, but it's id is not valid: %s",
+			fbr_strerror(FBR_A_ fctx->f_errno));
+		abort();
+	}
+
+	post_ev(FBR_A_ fiber, &ev->ev_base);
+
+	retval = fbr_transfer(FBR_A_ fbr_id_pack(fiber));
+	assert(0 == retval);
+	return 0;
+}
+
+#define FBR_EIO_PREP \
+	eio_req *req; \
+	struct fbr_ev_eio e_eio; \
+	int retval; \
+	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER; \
+	if (fctx != eio_fctx) \
+		return_error(-1, FBR_EINVAL); \
+	ev_ref(fctx->__p->loop);
+
+#define FBR_EIO_WAIT \
+	if (NULL == req) { \
+		ev_unref(fctx->__p->loop); \
+		return_error(-1, FBR_EEIO); \
+	} \
+	dtor.func = eio_req_dtor; \
+	dtor.arg = req; \
+	fbr_destructor_add(FBR_A_ &dtor); \
+	fbr_ev_eio_init(FBR_A_ &e_eio, req); \
+	retval = fbr_ev_wait_one(FBR_A_ &e_eio.ev_base); \
+	/* The request is cancelled if the wait has been cut short */ \
+	fbr_destructor_remove(FBR_A_ &dtor, retval /* Call it? */); \
+	if (retval) \
+		return retval; \
+	ev_unref(fctx->__p->loop);
+
+#define FBR_EIO_RESULT_CHECK \
+	if (0 > req->result) { \
+		errno = req->errorno; \
+		return_error(-1, FBR_ESYSTEM); \
+	}
+
+#define FBR_EIO_RESULT_RET \
+	FBR_EIO_RESULT_CHECK \
+	return req->result;
+
+int fbr_eio_open(FBR_P_ const char *path, int flags, mode_t mode, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_open(path, flags, mode, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_truncate(FBR_P_ const char *path, off_t offset, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_truncate(path, offset, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_chown(FBR_P_ const char *path, uid_t uid, gid_t gid, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_chown(path, uid, gid, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_chmod(FBR_P_ const char *path, mode_t mode, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_chmod(path, mode, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_mkdir(FBR_P_ const char *path, mode_t mode, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_mkdir(path, mode, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_rmdir(FBR_P_ const char *path, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_rmdir(path, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_unlink(FBR_P_ const char *path, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_unlink(path, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_utime(FBR_P_ const char *path, eio_tstamp atime, eio_tstamp mtime,
+		int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_utime(path, atime, mtime, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_mknod(FBR_P_ const char *path, mode_t mode, dev_t dev, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_mknod(path, mode, dev, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_link(FBR_P_ const char *path, const char *new_path, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_link(path, new_path, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_symlink(FBR_P_ const char *path, const char *new_path, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_symlink(path, new_path, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_rename(FBR_P_ const char *path, const char *new_path, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_rename(path, new_path, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_mlock(FBR_P_ void *addr, size_t length, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_mlock(addr, length, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_close(FBR_P_ int fd, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_close(fd, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_sync(FBR_P_ int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_sync(pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_fsync(FBR_P_ int fd, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_fsync(fd, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_fdatasync(FBR_P_ int fd, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_fdatasync(fd, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_futime(FBR_P_ int fd, eio_tstamp atime, eio_tstamp mtime, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_futime(fd, atime, mtime, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_ftruncate(FBR_P_ int fd, off_t offset, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_ftruncate(fd, offset, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_fchmod(FBR_P_ int fd, mode_t mode, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_fchmod(fd, mode, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_fchown(FBR_P_ int fd, uid_t uid, gid_t gid, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_fchown(fd, uid, gid, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_dup2(FBR_P_ int fd, int fd2, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_dup2(fd, fd2, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+ssize_t fbr_eio_seek(FBR_P_ int fd, off_t offset, int whence, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_seek(fd, offset, whence, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_CHECK;
+	return req->offs;
+}
+
+ssize_t fbr_eio_read(FBR_P_ int fd, void *buf, size_t length, off_t offset,
+		int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_read(fd, buf, length, offset, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+ssize_t fbr_eio_write(FBR_P_ int fd, void *buf, size_t length, off_t offset,
+		int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_write(fd, buf, length, offset, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_mlockall(FBR_P_ int flags, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_mlockall(flags, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_msync(FBR_P_ void *addr, size_t length, int flags, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_msync(addr, length, flags, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_readlink(FBR_P_ const char *path, char *buf, size_t size, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_readlink(path, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_CHECK;
+	strncpy(buf, req->ptr2, min(size, (size_t)req->result));
+	return req->result;
+}
+
+int fbr_eio_realpath(FBR_P_ const char *path, char *buf, size_t size, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_realpath(path, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_CHECK;
+	strncpy(buf, req->ptr2, min(size, (size_t)req->result));
+	return req->result;
+}
+
+int fbr_eio_stat(FBR_P_ const char *path, EIO_STRUCT_STAT *statdata, int pri)
+{
+	EIO_STRUCT_STAT *st;
+	FBR_EIO_PREP;
+	req = eio_stat(path, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_CHECK;
+	st = (EIO_STRUCT_STAT *)req->ptr2;
+	memcpy(statdata, st, sizeof(*st));
+	return req->result;
+}
+
+int fbr_eio_lstat(FBR_P_ const char *path, EIO_STRUCT_STAT *statdata, int pri)
+{
+	EIO_STRUCT_STAT *st;
+	FBR_EIO_PREP;
+	req = eio_lstat(path, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_CHECK;
+	st = (EIO_STRUCT_STAT *)req->ptr2;
+	memcpy(statdata, st, sizeof(*st));
+	return req->result;
+}
+
+int fbr_eio_fstat(FBR_P_ int fd, EIO_STRUCT_STAT *statdata, int pri)
+{
+	EIO_STRUCT_STAT *st;
+	FBR_EIO_PREP;
+	req = eio_fstat(fd, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_CHECK;
+	st = (EIO_STRUCT_STAT *)req->ptr2;
+	memcpy(statdata, st, sizeof(*st));
+	return req->result;
+}
+
+int fbr_eio_statvfs(FBR_P_ const char *path, EIO_STRUCT_STATVFS *statdata,
+		int pri)
+{
+	EIO_STRUCT_STATVFS *st;
+	FBR_EIO_PREP;
+	req = eio_statvfs(path, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_CHECK;
+	st = (EIO_STRUCT_STATVFS *)req->ptr2;
+	memcpy(statdata, st, sizeof(*st));
+	return req->result;
+}
+
+int fbr_eio_fstatvfs(FBR_P_ int fd, EIO_STRUCT_STATVFS *statdata, int pri)
+{
+	EIO_STRUCT_STATVFS *st;
+	FBR_EIO_PREP;
+	req = eio_fstatvfs(fd, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_CHECK;
+	st = (EIO_STRUCT_STATVFS *)req->ptr2;
+	memcpy(statdata, st, sizeof(*st));
+	return req->result;
+}
+
+int fbr_eio_sendfile(FBR_P_ int out_fd, int in_fd, off_t in_offset,
+		size_t length, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_sendfile(out_fd, in_fd, in_offset, length, pri, fiber_eio_cb,
+			&e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_readahead(FBR_P_ int fd, off_t offset, size_t length, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_readahead(fd, offset, length, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_syncfs(FBR_P_ int fd, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_syncfs(fd, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_sync_file_range(FBR_P_ int fd, off_t offset, size_t nbytes,
+			unsigned int flags, int pri)
+{
+	FBR_EIO_PREP;
+	req = eio_sync_file_range(fd, offset, nbytes, flags, pri, fiber_eio_cb,
+			&e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
+
+int fbr_eio_fallocate(FBR_P_ int fd, int mode, off_t offset, off_t len, int pri)
 {
-	struct ev_child *w = _arg;
-	ev_child_stop(fctx->__p->loop, w);
+	FBR_EIO_PREP;
+	req = eio_fallocate(fd, mode, offset, len, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
 }
 
-int fbr_waitpid(FBR_P_ pid_t pid)
+static void custom_execute_cb(eio_req *req)
 {
-	struct ev_child child;
-	struct fbr_ev_watcher watcher;
-	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER;
-	ev_child_init(&child, NULL, pid, 0.);
-	ev_child_start(fctx->__p->loop, &child);
-	dtor.func = watcher_child_dtor;
-	dtor.arg = &child;
-	fbr_destructor_add(FBR_A_ &dtor);
+	struct fbr_ev_eio *ev = req->data;
+	req->result = ev->custom_func(ev->custom_arg);
+}
 
-	fbr_ev_watcher_init(FBR_A_ &watcher, (ev_watcher *)&child);
-	fbr_ev_wait_one(FBR_A_ &watcher.ev_base);
+eio_ssize_t fbr_eio_custom(FBR_P_ fbr_eio_custom_func_t func, void *data,
+		int pri)
+{
+	FBR_EIO_PREP;
+	e_eio.custom_func = func;
+	e_eio.custom_arg = data;
+	req = eio_custom(custom_execute_cb, pri, fiber_eio_cb, &e_eio);
+	FBR_EIO_WAIT;
+	FBR_EIO_RESULT_RET;
+}
 
-	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */);
-	ev_child_stop(fctx->__p->loop, &child);
-	return_success(child.rstatus);
+#else
+
+void fbr_eio_init(FBR_PU)
+{
+	fbr_log_e(FBR_A_ "libevfibers: libeio support is not compiled");
+	abort();
 }
 
-int fbr_system(FBR_P_ const char *filename, char *const argv[],
-		char *const envp[], const char *working_dir)
+#endif
+
+#ifdef FBR_URING_ENABLED
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
 {
-	pid_t pid;
-	int retval;
+	return syscall(__NR_io_uring_setup, entries, p);
+}
 
-	pid = fork();
-	if (-1 == pid)
-		return_error(-1, FBR_ESYSTEM);
-	if (0 == pid) {
-		/* Child */
-		ev_break(EV_DEFAULT, EVBREAK_ALL);
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+		unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+			NULL, 0);
+}
 
-		if (working_dir) {
-			retval = chdir(working_dir);
-			if (-1 == retval)
-				err(EXIT_FAILURE, "chdir");
-		}
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+		unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
 
-		retval = execve(filename, argv, envp);
-		if (-1 == retval)
-			err(EXIT_FAILURE, "execve");
+static void uring_flush(FBR_P)
+{
+	struct fbr_uring *ring = fctx->__p->uring;
+	struct io_uring_sqe *sqe;
+	struct fbr_uring_req *req;
+	unsigned tail;
+	int retval;
 
-		errx(EXIT_FAILURE, "execve failed without error code");
+	if (0 == ring->to_submit)
+		return;
+	/* Remember opcodes for cleaning up after orphaned requests */
+	for (tail = ring->local_tail - ring->to_submit;
+			tail != ring->local_tail; tail++) {
+		sqe = &ring->sqes[tail & ring->sq_mask];
+		req = (struct fbr_uring_req *)(uintptr_t)sqe->user_data;
+		if (req)
+			req->opcode = sqe->opcode;
 	}
-	/* Parent */
+	__atomic_store_n(ring->sq_tail, ring->local_tail, __ATOMIC_RELEASE);
+	do {
+		retval = sys_io_uring_enter(ring->fd, ring->to_submit, 0, 0);
+	} while (-1 == retval && EINTR == errno);
+	if (-1 == retval) {
+		/* EAGAIN/EBUSY: kernel is short of resources or completions,
+		 * entries stay in the ring until the next attempt */
+		if (EAGAIN != errno && EBUSY != errno) {
+			fbr_log_e(FBR_A_ "libevfibers: io_uring_enter failed:"
+					" %s", strerror(errno));
+			abort();
+		}
+		return;
+	}
+	ring->to_submit -= retval;
+}
 
-	fbr_log_d(FBR_A_ "child pid %d has been launched", pid);
-	return fbr_waitpid(FBR_A_ pid);
+static void uring_submit_prepare_cb(_unused_ EV_P_ ev_prepare *w,
+		_unused_ int revents)
+{
+	uring_flush((struct fbr_context *)w->data);
 }
 
-#ifdef FBR_EIO_ENABLED
+/* Makes sure the next n entries end up in the same submission, as a link
+ * chain is broken at the end of it */
+static int uring_sq_room(FBR_P_ unsigned n)
+{
+	struct fbr_uring *ring = fctx->__p->uring;
+	unsigned head;
 
-static struct ev_loop *eio_loop;
-static ev_idle repeat_watcher;
-static ev_async ready_watcher;
+	if (NULL == ring)
+		return_error(-1, FBR_EINVAL);
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->local_tail - head + n <= ring->sq_entries)
+		return_success(0);
+	uring_flush(FBR_A);
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->local_tail - head + n <= ring->sq_entries)
+		return_success(0);
+	errno = EBUSY;
+	return_error(-1, FBR_ESYSTEM);
+}
 
-/* idle watcher callback, only used when eio_poll */
-/* didn't handle all results in one call */
-static void repeat(EV_P_ ev_idle *w, _unused_ int revents)
+static struct io_uring_sqe *uring_next_sqe(FBR_P)
 {
-	if (eio_poll () != -1)
-		ev_idle_stop(EV_A_ w);
+	struct fbr_uring *ring = fctx->__p->uring;
+	struct io_uring_sqe *sqe;
+	unsigned head;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->local_tail - head == ring->sq_entries) {
+		uring_flush(FBR_A);
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (ring->local_tail - head == ring->sq_entries)
+			return NULL;
+	}
+	sqe = &ring->sqes[ring->local_tail & ring->sq_mask];
+	ring->local_tail++;
+	ring->to_submit++;
+	memset(sqe, 0x00, sizeof(*sqe));
+	return sqe;
 }
 
-/* eio has some results, process them */
-static void ready(EV_P_ _unused_ ev_async *w, _unused_ int revents)
+static struct fbr_uring_req *uring_req_alloc(FBR_P)
 {
-	if (eio_poll() == -1)
-		ev_idle_start(EV_A_ &repeat_watcher);
+	struct fbr_uring *ring = fctx->__p->uring;
+	struct fbr_uring_req *req;
+
+	req = SLIST_FIRST(&ring->free_reqs);
+	if (req) {
+		SLIST_REMOVE_HEAD(&ring->free_reqs, entries);
+	} else {
+		req = calloc(1, sizeof(*req));
+		if (NULL == req)
+			return NULL;
+	}
+	req->ev = NULL;
+	req->waiting = 0;
+	req->finished = 0;
+	req->opcode = IORING_OP_NOP;
+#ifdef FBR_HAVE_URING_MULTISHOT
+	req->buf_ring = NULL;
+#endif
+	req->head = 0;
+	req->n_cqes = 0;
+	req->path = NULL;
+	req->st = NULL;
+	if (0 == ring->in_flight++)
+		ev_ref(fctx->__p->loop);
+	return req;
 }
 
-/* wake up the event loop */
-static void want_poll()
+static void uring_req_free(FBR_P_ struct fbr_uring_req *req)
 {
-	ev_async_send(eio_loop, &ready_watcher);
+	free(req->path);
+	req->path = NULL;
+	SLIST_INSERT_HEAD(&fctx->__p->uring->free_reqs, req, entries);
 }
 
-void fbr_eio_init()
+/* Completion nobody is going to consume: release what it has brought */
+static void uring_drop_cqe(FBR_P_ struct fbr_uring_req *req,
+		struct fbr_uring_cqe *cqe)
 {
-	if (NULL != eio_loop) {
-		fprintf(stderr, "libevfibers: fbr_eio_init called twice");
-		abort();
+#ifdef FBR_HAVE_URING_MULTISHOT
+	struct fbr_uring_buf_ring *ring = req->buf_ring;
+
+	if (ring && (cqe->flags & IORING_CQE_F_BUFFER))
+		fbr_uring_buf_put(FBR_A_ ring, (char *)ring->bufs +
+				(cqe->flags >> IORING_CQE_BUFFER_SHIFT) *
+				ring->buf_size);
+#endif
+	switch (req->opcode) {
+	case IORING_OP_OPENAT:
+	case IORING_OP_ACCEPT:
+		if (cqe->res >= 0)
+			close(cqe->res);
+		break;
 	}
-	eio_loop = EV_DEFAULT;
-	ev_idle_init(&repeat_watcher, repeat);
-	ev_async_init(&ready_watcher, ready);
-	ev_async_start(eio_loop, &ready_watcher);
-	ev_unref(eio_loop);
-	eio_init(want_poll, 0);
 }
 
-void fbr_ev_eio_init(FBR_P_ struct fbr_ev_eio *ev, eio_req *req)
+static void uring_cancel_req(FBR_P_ struct fbr_uring_req *req)
 {
-	ev_base_init(FBR_A_ &ev->ev_base, FBR_EV_EIO);
-	ev->req = req;
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_next_sqe(FBR_A);
+	if (NULL == sqe)
+		return;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)req;
 }
 
-static void eio_req_dtor(_unused_ FBR_P_ void *_arg)
+static void uring_ev_dtor(FBR_P_ void *arg)
 {
-	eio_req *req = _arg;
-	eio_cancel(req);
+	struct fbr_ev_uring *ev = arg;
+	struct fbr_uring_req *req = ev->req;
+
+	ev->req = NULL;
+	req->ev = NULL;
+	req->waiting = 0;
+	req->st = NULL;
+	for (; req->head < req->n_cqes; req->head++)
+		uring_drop_cqe(FBR_A_ req, req->cqes + req->head);
+	if (req->finished) {
+		uring_req_free(FBR_A_ req);
+		return;
+	}
+	/* The request is released once its last completion arrives */
+	uring_cancel_req(FBR_A_ req);
 }
 
-static int fiber_eio_cb(eio_req *req)
+static void uring_complete(FBR_P_ struct fbr_uring_req *req,
+		struct fbr_uring_cqe *cqe)
 {
+	struct fbr_uring_cqe *cqes;
 	struct fbr_fiber *fiber;
-	struct fbr_ev_eio *ev = req->data;
-	struct fbr_context *fctx = ev->ev_base.fctx;
+	size_t capacity;
 	int retval;
 
-	ENSURE_ROOT_FIBER;
+	if (0 == (cqe->flags & IORING_CQE_F_MORE)) {
+		req->finished = 1;
+		if (0 == --fctx->__p->uring->in_flight)
+			ev_unref(fctx->__p->loop);
+	}
+	if (NULL == req->ev) {
+		uring_drop_cqe(FBR_A_ req, cqe);
+		if (req->finished)
+			uring_req_free(FBR_A_ req);
+		return;
+	}
 
-	ev_unref(eio_loop);
-	if (EIO_CANCELLED(req))
-		return 0;
+	if (req->head == req->n_cqes)
+		req->head = req->n_cqes = 0;
+	if (req->n_cqes == req->capacity) {
+		capacity = req->capacity ? 2 * req->capacity : 1;
+		cqes = realloc(req->cqes, capacity * sizeof(*cqes));
+		if (NULL == cqes) {
+			fbr_log_e(FBR_A_ "libevfibers: unable to queue an"
+					" io_uring completion");
+			abort();
+		}
+		req->cqes = cqes;
+		req->capacity = capacity;
+	}
+	req->cqes[req->n_cqes++] = *cqe;
 
-	retval = fbr_id_unpack(FBR_A_ &fiber, ev->ev_base.id);
+	if (!req->waiting)
+		return;
+	retval = fbr_id_unpack(FBR_A_ &fiber, req->ev->ev_base.id);
 	if (-1 == retval) {
 		fbr_log_e(FBR_A_ "libevfibers: fiber is about to be called by"
-			" the eio callback, but it's id is not valid: %s",
-			fbr_strerror(FBR_A_ fctx->f_errno));
+			" the io_uring completion, but it's id is not valid:"
+			" %s", fbr_strerror(FBR_A_ fctx->f_errno));
 		abort();
 	}
-
-	post_ev(FBR_A_ fiber, &ev->ev_base);
-
+	post_ev(FBR_A_ fiber, &req->ev->ev_base);
 	retval = fbr_transfer(FBR_A_ fbr_id_pack(fiber));
 	assert(0 == retval);
-	return 0;
 }
 
-#define FBR_EIO_PREP \
-	eio_req *req; \
-	struct fbr_ev_eio e_eio; \
-	int retval; \
-	struct fbr_destructor dtor = FBR_DESTRUCTOR_INITIALIZER; \
-	ev_ref(eio_loop);
-
-#define FBR_EIO_WAIT \
-	if (NULL == req) { \
-		ev_unref(eio_loop); \
-		return_error(-1, FBR_EEIO); \
-	} \
-	dtor.func = eio_req_dtor; \
-	dtor.arg = req; \
-	fbr_destructor_add(FBR_A_ &dtor); \
-	fbr_ev_eio_init(FBR_A_ &e_eio, req); \
-	retval = fbr_ev_wait_one(FBR_A_ &e_eio.ev_base); \
-	fbr_destructor_remove(FBR_A_ &dtor, 0 /* Call it? */); \
-	if (retval) \
-		return retval;
+static void uring_reap(FBR_P)
+{
+	struct fbr_uring *ring = fctx->__p->uring;
+	struct io_uring_cqe *cqe;
+	struct fbr_uring_req *req;
+	struct fbr_uring_cqe copy;
+	unsigned head, tail;
 
-#define FBR_EIO_RESULT_CHECK \
-	if (0 > req->result) { \
-		errno = req->errorno; \
-		return_error(-1, FBR_ESYSTEM); \
+	head = *ring->cq_head;
+	for (;;) {
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail)
+			break;
+		cqe = &ring->cqes[head & ring->cq_mask];
+		req = (struct fbr_uring_req *)(uintptr_t)cqe->user_data;
+		copy.res = cqe->res;
+		copy.flags = cqe->flags;
+		/* Hand the slot back before waking anybody up */
+		__atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+		/* Completions of cancellation requests carry no user_data */
+		if (req)
+			uring_complete(FBR_A_ req, &copy);
 	}
-
-#define FBR_EIO_RESULT_RET \
-	FBR_EIO_RESULT_CHECK \
-	return req->result;
-
-int fbr_eio_open(FBR_P_ const char *path, int flags, mode_t mode, int pri)
-{
-	FBR_EIO_PREP;
-	req = eio_open(path, flags, mode, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
 }
 
-int fbr_eio_truncate(FBR_P_ const char *path, off_t offset, int pri)
+static void uring_event_cb(_unused_ EV_P_ ev_io *w, _unused_ int revents)
 {
-	FBR_EIO_PREP;
-	req = eio_truncate(path, offset, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
-}
+	struct fbr_context *fctx = w->data;
+	eventfd_t value;
 
-int fbr_eio_chown(FBR_P_ const char *path, uid_t uid, gid_t gid, int pri)
-{
-	FBR_EIO_PREP;
-	req = eio_chown(path, uid, gid, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
-}
+	ENSURE_ROOT_FIBER;
 
-int fbr_eio_chmod(FBR_P_ const char *path, mode_t mode, int pri)
-{
-	FBR_EIO_PREP;
-	req = eio_chmod(path, mode, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
+	eventfd_read(fctx->__p->uring->event_fd, &value);
+	uring_reap(FBR_A);
 }
 
-int fbr_eio_mkdir(FBR_P_ const char *path, mode_t mode, int pri)
+int fbr_uring_init(FBR_P_ unsigned entries)
 {
-	FBR_EIO_PREP;
-	req = eio_mkdir(path, mode, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
-}
+	struct fbr_uring *ring;
+	struct io_uring_params p;
+	unsigned i;
+	unsigned *sq_array;
 
-int fbr_eio_rmdir(FBR_P_ const char *path, int pri)
-{
-	FBR_EIO_PREP;
-	req = eio_rmdir(path, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
-}
+	if (fctx->__p->uring)
+		return_error(-1, FBR_EINVAL);
 
-int fbr_eio_unlink(FBR_P_ const char *path, int pri)
-{
-	FBR_EIO_PREP;
-	req = eio_unlink(path, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
-}
+	ring = calloc(1, sizeof(*ring));
+	if (NULL == ring)
+		return_error(-1, FBR_ESYSTEM);
+	ring->sq_ptr = ring->cq_ptr = ring->sqes = MAP_FAILED;
+	ring->event_fd = -1;
 
-int fbr_eio_utime(FBR_P_ const char *path, eio_tstamp atime, eio_tstamp mtime,
-		int pri)
-{
-	FBR_EIO_PREP;
-	req = eio_utime(path, atime, mtime, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
-}
+	memset(&p, 0x00, sizeof(p));
+	ring->fd = sys_io_uring_setup(entries ? entries : FBR_URING_ENTRIES,
+			&p);
+	if (-1 == ring->fd)
+		goto error;
 
-int fbr_eio_mknod(FBR_P_ const char *path, mode_t mode, dev_t dev, int pri)
-{
-	FBR_EIO_PREP;
-	req = eio_mknod(path, mode, dev, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_size = ring->cq_size = max(ring->sq_size,
+				ring->cq_size);
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_SQ_RING);
+	if (MAP_FAILED == ring->sq_ptr)
+		goto error;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap(NULL, ring->cq_size,
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd,
+				IORING_OFF_CQ_RING);
+		if (MAP_FAILED == ring->cq_ptr)
+			goto error;
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (MAP_FAILED == ring->sqes)
+		goto error;
+
+	ring->sq_head = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+	ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+	ring->sq_mask = *(unsigned *)((char *)ring->sq_ptr +
+			p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	/* Entries are always submitted in order, so the indirection array is
+	 * an identity mapping set up once */
+	sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		sq_array[i] = i;
+	ring->local_tail = *ring->sq_tail;
+	ring->cq_head = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+	ring->cq_mask = *(unsigned *)((char *)ring->cq_ptr +
+			p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr +
+			p.cq_off.cqes);
+
+	ring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (-1 == ring->event_fd)
+		goto error;
+	if (-1 == sys_io_uring_register(ring->fd, IORING_REGISTER_EVENTFD,
+				&ring->event_fd, 1))
+		goto error;
+
+	SLIST_INIT(&ring->free_reqs);
+	ev_io_init(&ring->event_io, uring_event_cb, ring->event_fd, EV_READ);
+	ring->event_io.data = fctx;
+	ev_io_start(fctx->__p->loop, &ring->event_io);
+	/* Only operations in flight keep the loop alive */
+	ev_unref(fctx->__p->loop);
+	ev_prepare_init(&ring->submit_prepare, uring_submit_prepare_cb);
+	ring->submit_prepare.data = fctx;
+	/* Runs after the pending fibers have had their chance to submit */
+	ev_set_priority(&ring->submit_prepare, EV_MINPRI);
+	ev_prepare_start(fctx->__p->loop, &ring->submit_prepare);
+	ev_unref(fctx->__p->loop);
+
+	fctx->__p->uring = ring;
+	return_success(0);
+
+error:
+	if (-1 != ring->event_fd)
+		close(ring->event_fd);
+	if (MAP_FAILED != ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (MAP_FAILED != ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	if (MAP_FAILED != ring->sq_ptr)
+		munmap(ring->sq_ptr, ring->sq_size);
+	if (-1 != ring->fd)
+		close(ring->fd);
+	free(ring);
+	return_error(-1, FBR_ESYSTEM);
 }
 
-int fbr_eio_link(FBR_P_ const char *path, const char *new_path, int pri)
+static void uring_destroy(FBR_P)
 {
-	FBR_EIO_PREP;
-	req = eio_link(path, new_path, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
+	struct fbr_uring *ring = fctx->__p->uring;
+	struct fbr_uring_req *req;
+
+	if (NULL == ring)
+		return;
+
+	if (ring->in_flight)
+		ev_unref(fctx->__p->loop);
+	ev_ref(fctx->__p->loop);
+	ev_io_stop(fctx->__p->loop, &ring->event_io);
+	ev_ref(fctx->__p->loop);
+	ev_prepare_stop(fctx->__p->loop, &ring->submit_prepare);
+
+	/* Closing the ring cancels whatever is still in flight; requests of
+	 * those operations are not reachable any more and leak with it */
+	close(ring->fd);
+	close(ring->event_fd);
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	munmap(ring->sq_ptr, ring->sq_size);
+	while (!SLIST_EMPTY(&ring->free_reqs)) {
+		req = SLIST_FIRST(&ring->free_reqs);
+		SLIST_REMOVE_HEAD(&ring->free_reqs, entries);
+		free(req->cqes);
+		free(req);
+	}
+	free(ring);
+	fctx->__p->uring = NULL;
 }
 
-int fbr_eio_symlink(FBR_P_ const char *path, const char *new_path, int pri)
+void fbr_ev_uring_init(FBR_P_ struct fbr_ev_uring *ev)
 {
-	FBR_EIO_PREP;
-	req = eio_symlink(path, new_path, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
+	ev_base_init(FBR_A_ &ev->ev_base, FBR_EV_URING);
+	ev->res = 0;
+	ev->flags = 0;
+	ev->req = NULL;
+	fbr_destructor_init(&ev->dtor);
 }
 
-int fbr_eio_rename(FBR_P_ const char *path, const char *new_path, int pri)
+struct io_uring_sqe *fbr_uring_get_sqe(FBR_P_ struct fbr_ev_uring *ev)
 {
-	FBR_EIO_PREP;
-	req = eio_rename(path, new_path, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
+	struct fbr_uring_req *req;
+	struct io_uring_sqe *sqe;
+
+	if (NULL == fctx->__p->uring || NULL != ev->req)
+		return_error(NULL, FBR_EINVAL);
+
+	req = uring_req_alloc(FBR_A);
+	if (NULL == req)
+		return_error(NULL, FBR_ESYSTEM);
+	sqe = uring_next_sqe(FBR_A);
+	if (NULL == sqe) {
+		req->finished = 1;
+		if (0 == --fctx->__p->uring->in_flight)
+			ev_unref(fctx->__p->loop);
+		uring_req_free(FBR_A_ req);
+		errno = EBUSY;
+		return_error(NULL, FBR_ESYSTEM);
+	}
+	sqe->user_data = (uintptr_t)req;
+
+	req->ev = ev;
+	ev->req = req;
+	ev->dtor.func = uring_ev_dtor;
+	ev->dtor.arg = ev;
+	fbr_destructor_add(FBR_A_ &ev->dtor);
+	return_success(sqe);
 }
 
-int fbr_eio_mlock(FBR_P_ void *addr, size_t length, int pri)
+static enum ev_action_hint uring_prepare_ev(FBR_P_ struct fbr_ev_uring *ev)
 {
-	FBR_EIO_PREP;
-	req = eio_mlock(addr, length, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
+	struct fbr_uring_req *req = ev->req;
+
+	if (NULL == req) {
+		fbr_destructor_remove(FBR_A_ &ev->ev_base.item.dtor,
+				0 /* call it */);
+		return EV_AH_EINVAL;
+	}
+	if (req->head < req->n_cqes)
+		return EV_AH_ARRIVED;
+	req->waiting = 1;
+	return EV_AH_OK;
 }
 
-int fbr_eio_close(FBR_P_ int fd, int pri)
+static void statx_to_stat(const struct statx *stx, struct stat *st)
 {
-	FBR_EIO_PREP;
-	req = eio_close(fd, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
+	memset(st, 0x00, sizeof(*st));
+	st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_ino = stx->stx_ino;
+	st->st_mode = stx->stx_mode;
+	st->st_nlink = stx->stx_nlink;
+	st->st_uid = stx->stx_uid;
+	st->st_gid = stx->stx_gid;
+	st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	st->st_size = stx->stx_size;
+	st->st_blksize = stx->stx_blksize;
+	st->st_blocks = stx->stx_blocks;
+	st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
 }
 
-int fbr_eio_sync(FBR_P_ int pri)
+static void uring_finish_ev(FBR_P_ struct fbr_ev_uring *ev)
 {
-	FBR_EIO_PREP;
-	req = eio_sync(pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
+	struct fbr_uring_req *req = ev->req;
+
+	req->waiting = 0;
+	if (!ev->ev_base.arrived)
+		return;
+	ev->res = req->cqes[req->head].res;
+	ev->flags = req->cqes[req->head].flags;
+	req->head++;
+	if (req->st && 0 == ev->res)
+		statx_to_stat(&req->stx, req->st);
+	if (req->head < req->n_cqes || !req->finished)
+		return;
+	/* That was the last completion of the operation */
+	fbr_destructor_remove(FBR_A_ &ev->dtor, 0 /* call it */);
+	ev->req = NULL;
+	uring_req_free(FBR_A_ req);
+}
+
+/* Cancels the operation of ev and waits it out without being interruptible,
+ * throwing away whatever it completes with */
+static void uring_drain(FBR_P_ struct fbr_ev_uring *ev)
+{
+	struct fbr_uring_req *req = ev->req;
+	struct fbr_uring_cqe cqe;
+
+	/* Result of a stat is not to be delivered either */
+	req->st = NULL;
+	uring_cancel_req(FBR_A_ req);
+	while (NULL != ev->req) {
+		for (; req->head < req->n_cqes; req->head++)
+			uring_drop_cqe(FBR_A_ req, req->cqes + req->head);
+		if (-1 == ev_wait_one(FBR_A_ &ev->ev_base, 0))
+			continue;
+		/* Last completion releases req, which stays intact in the
+		 * pool until the next allocation */
+		cqe.res = ev->res;
+		cqe.flags = ev->flags;
+		uring_drop_cqe(FBR_A_ req, &cqe);
+	}
+	/* Nothing dropped is to be seen by the caller, a provided buffer
+	 * would otherwise get released twice */
+	ev->res = 0;
+	ev->flags = 0;
+}
+
+int fbr_uring_wait(FBR_P_ struct fbr_ev_uring *ev)
+{
+	enum fbr_error_code f_errno;
+	int saved_errno;
+
+	if (-1 == fbr_ev_wait_one(FBR_A_ &ev->ev_base)) {
+		if (NULL == ev->req)
+			return -1;
+		/* Cut short by the deadline or cancellation. Buffers of the
+		 * operation may well be on the stack of the caller, so the
+		 * kernel has to be done with them before returning */
+		f_errno = fctx->f_errno;
+		saved_errno = errno;
+		uring_drain(FBR_A_ ev);
+		errno = saved_errno;
+		return_error(-1, f_errno);
+	}
+	if (ev->res < 0) {
+		errno = -ev->res;
+		return_error(-1, FBR_ESYSTEM);
+	}
+	return_success(ev->res);
 }
 
-int fbr_eio_fsync(FBR_P_ int fd, int pri)
+void fbr_uring_cancel(FBR_P_ struct fbr_ev_uring *ev)
 {
-	FBR_EIO_PREP;
-	req = eio_fsync(fd, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
+	if (NULL == ev->req)
+		return;
+	fbr_destructor_remove(FBR_A_ &ev->dtor, 1 /* call it */);
 }
 
-int fbr_eio_fdatasync(FBR_P_ int fd, int pri)
+#define FBR_URING_PREP \
+	struct fbr_ev_uring ev; \
+	struct io_uring_sqe *sqe; \
+	fbr_ev_uring_init(FBR_A_ &ev); \
+	sqe = fbr_uring_get_sqe(FBR_A_ &ev); \
+	if (NULL == sqe) \
+		return -1;
+
+ssize_t fbr_uring_read(FBR_P_ int fd, void *buf, size_t count, off_t offset)
 {
-	FBR_EIO_PREP;
-	req = eio_fdatasync(fd, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
+	FBR_URING_PREP;
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = count;
+	sqe->off = offset;
+	return fbr_uring_wait(FBR_A_ &ev);
 }
 
-int fbr_eio_futime(FBR_P_ int fd, eio_tstamp atime, eio_tstamp mtime, int pri)
+ssize_t fbr_uring_write(FBR_P_ int fd, const void *buf, size_t count,
+		off_t offset)
 {
-	FBR_EIO_PREP;
-	req = eio_futime(fd, atime, mtime, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
+	FBR_URING_PREP;
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = count;
+	sqe->off = offset;
+	return fbr_uring_wait(FBR_A_ &ev);
 }
 
-int fbr_eio_ftruncate(FBR_P_ int fd, off_t offset, int pri)
+int fbr_uring_fsync(FBR_P_ int fd, int datasync)
 {
-	FBR_EIO_PREP;
-	req = eio_ftruncate(fd, offset, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
+	FBR_URING_PREP;
+	sqe->opcode = IORING_OP_FSYNC;
+	sqe->fd = fd;
+	if (datasync)
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+	return fbr_uring_wait(FBR_A_ &ev);
 }
 
-int fbr_eio_fchmod(FBR_P_ int fd, mode_t mode, int pri)
+/* Gets an entry for an operation on path. The kernel may read the path after
+ * the fiber is gone, so a copy of it is kept with the request. */
+static struct io_uring_sqe *uring_get_sqe_path(FBR_P_ struct fbr_ev_uring *ev,
+		const char *path)
 {
-	FBR_EIO_PREP;
-	req = eio_fchmod(fd, mode, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
+	struct fbr_uring_req *req;
+	struct io_uring_sqe *sqe;
+	char *copy;
+
+	copy = strdup(path);
+	if (NULL == copy)
+		return_error(NULL, FBR_ESYSTEM);
+	sqe = fbr_uring_get_sqe(FBR_A_ ev);
+	if (NULL == sqe) {
+		free(copy);
+		return NULL;
+	}
+	req = ev->req;
+	req->path = copy;
+	sqe->addr = (uintptr_t)copy;
+	return_success(sqe);
 }
 
-int fbr_eio_fchown(FBR_P_ int fd, uid_t uid, gid_t gid, int pri)
+int fbr_uring_open(FBR_P_ const char *path, int flags, mode_t mode)
 {
-	FBR_EIO_PREP;
-	req = eio_fchown(fd, uid, gid, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
+	struct fbr_ev_uring ev;
+	struct io_uring_sqe *sqe;
+
+	fbr_ev_uring_init(FBR_A_ &ev);
+	sqe = uring_get_sqe_path(FBR_A_ &ev, path);
+	if (NULL == sqe)
+		return -1;
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->len = mode;
+	sqe->open_flags = flags;
+	return fbr_uring_wait(FBR_A_ &ev);
 }
 
-int fbr_eio_dup2(FBR_P_ int fd, int fd2, int pri)
+int fbr_uring_close(FBR_P_ int fd)
 {
-	FBR_EIO_PREP;
-	req = eio_dup2(fd, fd2, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
+	FBR_URING_PREP;
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = fd;
+	return fbr_uring_wait(FBR_A_ &ev);
 }
 
-ssize_t fbr_eio_seek(FBR_P_ int fd, off_t offset, int whence, int pri)
+/* The statx buffer lives in the request as well, the result gets converted
+ * into buf when the completion is consumed */
+static int uring_statx(FBR_P_ int dirfd, const char *path, int flags,
+		struct stat *buf)
 {
-	FBR_EIO_PREP;
-	req = eio_seek(fd, offset, whence, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_CHECK;
-	return req->offs;
+	struct fbr_uring_req *req;
+	struct fbr_ev_uring ev;
+	struct io_uring_sqe *sqe;
+
+	fbr_ev_uring_init(FBR_A_ &ev);
+	sqe = uring_get_sqe_path(FBR_A_ &ev, path);
+	if (NULL == sqe)
+		return -1;
+	req = ev.req;
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = dirfd;
+	sqe->len = STATX_BASIC_STATS;
+	sqe->off = (uintptr_t)&req->stx;
+	sqe->statx_flags = flags;
+	req->st = buf;
+	return fbr_uring_wait(FBR_A_ &ev);
 }
 
-ssize_t fbr_eio_read(FBR_P_ int fd, void *buf, size_t length, off_t offset,
-		int pri)
+int fbr_uring_stat(FBR_P_ const char *path, struct stat *buf)
 {
-	FBR_EIO_PREP;
-	req = eio_read(fd, buf, length, offset, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
+	return uring_statx(FBR_A_ AT_FDCWD, path, 0, buf);
 }
 
-ssize_t fbr_eio_write(FBR_P_ int fd, void *buf, size_t length, off_t offset,
-		int pri)
+int fbr_uring_fstat(FBR_P_ int fd, struct stat *buf)
 {
-	FBR_EIO_PREP;
-	req = eio_write(fd, buf, length, offset, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
+	return uring_statx(FBR_A_ fd, "", AT_EMPTY_PATH, buf);
 }
 
-int fbr_eio_mlockall(FBR_P_ int flags, int pri)
+
+/* Links a timeout to the operation of ev, which takes the next entry of the
+ * ring. The room for both entries is to be reserved with uring_sq_room. */
+static void uring_link_timeout(FBR_P_ struct fbr_ev_uring *ev,
+		struct io_uring_sqe *sqe, ev_tstamp timeout)
 {
-	FBR_EIO_PREP;
-	req = eio_mlockall(flags, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
+	struct fbr_uring_req *req = ev->req;
+	struct io_uring_sqe *tsqe;
+
+	req->ts.tv_sec = (long long)timeout;
+	req->ts.tv_nsec = (long long)((timeout - req->ts.tv_sec) * 1e9);
+	sqe->flags |= IOSQE_IO_LINK;
+	tsqe = uring_next_sqe(FBR_A);
+	assert(tsqe);
+	tsqe->opcode = IORING_OP_LINK_TIMEOUT;
+	tsqe->fd = -1;
+	tsqe->addr = (uintptr_t)&req->ts;
+	tsqe->len = 1;
 }
 
-int fbr_eio_msync(FBR_P_ void *addr, size_t length, int flags, int pri)
+/* Operation cancelled by its linked timeout completes with ECANCELED */
+static int uring_wait_wto(FBR_P_ struct fbr_ev_uring *ev)
 {
-	FBR_EIO_PREP;
-	req = eio_msync(addr, length, flags, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
+	int retval;
+
+	retval = fbr_uring_wait(FBR_A_ ev);
+	if (-1 == retval && FBR_ESYSTEM == fctx->f_errno &&
+			ECANCELED == errno)
+		errno = ETIMEDOUT;
+	return retval;
 }
 
-int fbr_eio_readlink(FBR_P_ const char *path, char *buf, size_t size, int pri)
+#define FBR_URING_PREP_WTO \
+	struct fbr_ev_uring ev; \
+	struct io_uring_sqe *sqe; \
+	if (-1 == uring_sq_room(FBR_A_ 2)) \
+		return -1; \
+	fbr_ev_uring_init(FBR_A_ &ev); \
+	sqe = fbr_uring_get_sqe(FBR_A_ &ev); \
+	if (NULL == sqe) \
+		return -1;
+
+static void uring_prep_recv(struct io_uring_sqe *sqe, int sockfd, void *buf,
+		size_t len, int flags)
 {
-	FBR_EIO_PREP;
-	req = eio_readlink(path, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_CHECK;
-	strncpy(buf, req->ptr2, min(size, (size_t)req->result));
-	return req->result;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = sockfd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->msg_flags = flags;
 }
 
-int fbr_eio_realpath(FBR_P_ const char *path, char *buf, size_t size, int pri)
+static void uring_prep_send(struct io_uring_sqe *sqe, int sockfd,
+		const void *buf, size_t len, int flags)
 {
-	FBR_EIO_PREP;
-	req = eio_realpath(path, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_CHECK;
-	strncpy(buf, req->ptr2, min(size, (size_t)req->result));
-	return req->result;
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = sockfd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->msg_flags = flags;
 }
 
-int fbr_eio_stat(FBR_P_ const char *path, EIO_STRUCT_STAT *statdata, int pri)
+static void uring_prep_connect(struct io_uring_sqe *sqe, int sockfd,
+		const struct sockaddr *addr, socklen_t addrlen)
 {
-	EIO_STRUCT_STAT *st;
-	FBR_EIO_PREP;
-	req = eio_stat(path, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_CHECK;
-	st = (EIO_STRUCT_STAT *)req->ptr2;
-	memcpy(statdata, st, sizeof(*st));
-	return req->result;
+	sqe->opcode = IORING_OP_CONNECT;
+	sqe->fd = sockfd;
+	sqe->addr = (uintptr_t)addr;
+	sqe->off = addrlen;
 }
 
-int fbr_eio_lstat(FBR_P_ const char *path, EIO_STRUCT_STAT *statdata, int pri)
+ssize_t fbr_uring_recv(FBR_P_ int sockfd, void *buf, size_t len, int flags)
 {
-	EIO_STRUCT_STAT *st;
-	FBR_EIO_PREP;
-	req = eio_lstat(path, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_CHECK;
-	st = (EIO_STRUCT_STAT *)req->ptr2;
-	memcpy(statdata, st, sizeof(*st));
-	return req->result;
+	FBR_URING_PREP;
+	uring_prep_recv(sqe, sockfd, buf, len, flags);
+	return fbr_uring_wait(FBR_A_ &ev);
 }
 
-int fbr_eio_fstat(FBR_P_ int fd, EIO_STRUCT_STAT *statdata, int pri)
+ssize_t fbr_uring_send(FBR_P_ int sockfd, const void *buf, size_t len,
+		int flags)
 {
-	EIO_STRUCT_STAT *st;
-	FBR_EIO_PREP;
-	req = eio_fstat(fd, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_CHECK;
-	st = (EIO_STRUCT_STAT *)req->ptr2;
-	memcpy(statdata, st, sizeof(*st));
-	return req->result;
+	FBR_URING_PREP;
+	uring_prep_send(sqe, sockfd, buf, len, flags);
+	return fbr_uring_wait(FBR_A_ &ev);
 }
 
-int fbr_eio_statvfs(FBR_P_ const char *path, EIO_STRUCT_STATVFS *statdata,
-		int pri)
+int fbr_uring_accept(FBR_P_ int sockfd, struct sockaddr *addr,
+		socklen_t *addrlen)
 {
-	EIO_STRUCT_STATVFS *st;
-	FBR_EIO_PREP;
-	req = eio_statvfs(path, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_CHECK;
-	st = (EIO_STRUCT_STATVFS *)req->ptr2;
-	memcpy(statdata, st, sizeof(*st));
-	return req->result;
+	FBR_URING_PREP;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = sockfd;
+	sqe->addr = (uintptr_t)addr;
+	sqe->addr2 = (uintptr_t)addrlen;
+	return fbr_uring_wait(FBR_A_ &ev);
 }
 
-int fbr_eio_fstatvfs(FBR_P_ int fd, EIO_STRUCT_STATVFS *statdata, int pri)
+int fbr_uring_connect(FBR_P_ int sockfd, const struct sockaddr *addr,
+		socklen_t addrlen)
 {
-	EIO_STRUCT_STATVFS *st;
-	FBR_EIO_PREP;
-	req = eio_fstatvfs(fd, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_CHECK;
-	st = (EIO_STRUCT_STATVFS *)req->ptr2;
-	memcpy(statdata, st, sizeof(*st));
-	return req->result;
+	FBR_URING_PREP;
+	uring_prep_connect(sqe, sockfd, addr, addrlen);
+	return fbr_uring_wait(FBR_A_ &ev);
 }
 
-int fbr_eio_sendfile(FBR_P_ int out_fd, int in_fd, off_t in_offset,
-		size_t length, int pri)
+ssize_t fbr_uring_recv_wto(FBR_P_ int sockfd, void *buf, size_t len,
+		int flags, ev_tstamp timeout)
 {
-	FBR_EIO_PREP;
-	req = eio_sendfile(out_fd, in_fd, in_offset, length, pri, fiber_eio_cb,
-			&e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
+	FBR_URING_PREP_WTO;
+	uring_prep_recv(sqe, sockfd, buf, len, flags);
+	uring_link_timeout(FBR_A_ &ev, sqe, timeout);
+	return uring_wait_wto(FBR_A_ &ev);
 }
 
-int fbr_eio_readahead(FBR_P_ int fd, off_t offset, size_t length, int pri)
+ssize_t fbr_uring_send_wto(FBR_P_ int sockfd, const void *buf, size_t len,
+		int flags, ev_tstamp timeout)
 {
-	FBR_EIO_PREP;
-	req = eio_readahead(fd, offset, length, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
+	FBR_URING_PREP_WTO;
+	uring_prep_send(sqe, sockfd, buf, len, flags);
+	uring_link_timeout(FBR_A_ &ev, sqe, timeout);
+	return uring_wait_wto(FBR_A_ &ev);
 }
 
-int fbr_eio_syncfs(FBR_P_ int fd, int pri)
+int fbr_uring_connect_wto(FBR_P_ int sockfd, const struct sockaddr *addr,
+		socklen_t addrlen, ev_tstamp timeout)
 {
-	FBR_EIO_PREP;
-	req = eio_syncfs(fd, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
+	FBR_URING_PREP_WTO;
+	uring_prep_connect(sqe, sockfd, addr, addrlen);
+	uring_link_timeout(FBR_A_ &ev, sqe, timeout);
+	return uring_wait_wto(FBR_A_ &ev);
 }
 
-int fbr_eio_sync_file_range(FBR_P_ int fd, off_t offset, size_t nbytes,
-			unsigned int flags, int pri)
+#ifdef FBR_HAVE_URING_MULTISHOT
+
+int fbr_uring_accept_multishot(FBR_P_ struct fbr_ev_uring *ev, int sockfd)
 {
-	FBR_EIO_PREP;
-	req = eio_sync_file_range(fd, offset, nbytes, flags, pri, fiber_eio_cb,
-			&e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
+	struct io_uring_sqe *sqe;
+
+	sqe = fbr_uring_get_sqe(FBR_A_ ev);
+	if (NULL == sqe)
+		return -1;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = sockfd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	return_success(0);
 }
 
-int fbr_eio_fallocate(FBR_P_ int fd, int mode, off_t offset, off_t len, int pri)
+int fbr_uring_buf_ring_init(FBR_P_ struct fbr_uring_buf_ring *ring,
+		unsigned short bgid, unsigned entries, size_t buf_size)
 {
-	FBR_EIO_PREP;
-	req = eio_fallocate(fd, mode, offset, len, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
+	struct io_uring_buf_reg reg;
+	unsigned i;
+
+	if (NULL == fctx->__p->uring || 0 == entries || entries > 32768 ||
+			(entries & (entries - 1)) || 0 == buf_size ||
+			buf_size > UINT32_MAX)
+		return_error(-1, FBR_EINVAL);
+
+	/* The kernel wants the ring page aligned */
+	ring->ring_size = entries * sizeof(struct io_uring_buf);
+	ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | FBR_MAP_ANON_FLAG, -1, 0);
+	if (MAP_FAILED == ring->ring)
+		return_error(-1, FBR_ESYSTEM);
+	ring->bufs = malloc(entries * buf_size);
+	if (NULL == ring->bufs) {
+		munmap(ring->ring, ring->ring_size);
+		return_error(-1, FBR_ESYSTEM);
+	}
+	ring->buf_size = buf_size;
+	ring->entries = entries;
+	ring->tail = 0;
+	ring->bgid = bgid;
+
+	memset(&reg, 0x00, sizeof(reg));
+	reg.ring_addr = (uintptr_t)ring->ring;
+	reg.ring_entries = entries;
+	reg.bgid = bgid;
+	if (-1 == sys_io_uring_register(fctx->__p->uring->fd,
+				IORING_REGISTER_PBUF_RING, &reg, 1)) {
+		free(ring->bufs);
+		munmap(ring->ring, ring->ring_size);
+		return_error(-1, FBR_ESYSTEM);
+	}
+	for (i = 0; i < entries; i++)
+		fbr_uring_buf_put(FBR_A_ ring, (char *)ring->bufs +
+				i * buf_size);
+	return_success(0);
 }
 
-static void custom_execute_cb(eio_req *req)
+void fbr_uring_buf_ring_destroy(FBR_P_ struct fbr_uring_buf_ring *ring)
 {
-	struct fbr_ev_eio *ev = req->data;
-	req->result = ev->custom_func(ev->custom_arg);
+	struct io_uring_buf_reg reg;
+
+	memset(&reg, 0x00, sizeof(reg));
+	reg.bgid = ring->bgid;
+	sys_io_uring_register(fctx->__p->uring->fd,
+			IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	free(ring->bufs);
+	munmap(ring->ring, ring->ring_size);
 }
 
-eio_ssize_t fbr_eio_custom(FBR_P_ fbr_eio_custom_func_t func, void *data,
-		int pri)
+void fbr_uring_buf_put(_unused_ FBR_P_ struct fbr_uring_buf_ring *ring,
+		void *buf)
 {
-	FBR_EIO_PREP;
-	e_eio.custom_func = func;
-	e_eio.custom_arg = data;
-	req = eio_custom(custom_execute_cb, pri, fiber_eio_cb, &e_eio);
-	FBR_EIO_WAIT;
-	FBR_EIO_RESULT_RET;
-}
+	struct io_uring_buf_ring *br = ring->ring;
+	struct io_uring_buf *slot;
+	size_t bid = ((char *)buf - (char *)ring->bufs) / ring->buf_size;
 
-#else
+	slot = &br->bufs[ring->tail & (ring->entries - 1)];
+	slot->addr = (uintptr_t)buf;
+	slot->len = ring->buf_size;
+	slot->bid = bid;
+	__atomic_store_n(&br->tail, ++ring->tail, __ATOMIC_RELEASE);
+}
 
-void fbr_eio_init(FBR_PU)
+ssize_t fbr_uring_recv_buf(FBR_P_ int sockfd,
+		struct fbr_uring_buf_ring *ring, void **buf, int flags)
 {
-	fbr_log_e(FBR_A_ "libevfibers: libeio support is not compiled");
-	abort();
+	void *selected;
+	ssize_t retval;
+	FBR_URING_PREP;
+	((struct fbr_uring_req *)ev.req)->buf_ring = ring;
+	uring_prep_recv(sqe, sockfd, NULL, ring->buf_size, flags);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = ring->bgid;
+	*buf = NULL;
+	retval = fbr_uring_wait(FBR_A_ &ev);
+	if (0 == (ev.flags & IORING_CQE_F_BUFFER))
+		return retval;
+	selected = (char *)ring->bufs +
+		(ev.flags >> IORING_CQE_BUFFER_SHIFT) * ring->buf_size;
+	if (retval > 0)
+		*buf = selected;
+	else
+		fbr_uring_buf_put(FBR_A_ ring, selected);
+	return retval;
 }
 
 #endif
+
+#endif
@@ -21,6 +21,8 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <ev.h>
 #include <check.h>
 #include <evfibers_private/fiber.h>
@@ -173,11 +175,255 @@ START_TEST(test_buffer_basic)
 }
 END_TEST
 
+START_TEST(test_buffer_pool)
+{
+	struct fbr_context context;
+	struct fbr_buffer buffer;
+	void *mem_ptr;
+	char *ptr;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	retval = fbr_buffer_init(&context, &buffer, 0);
+	fail_unless(0 == retval, NULL);
+	ptr = fbr_buffer_alloc_prepare(&context, &buffer, 5);
+	fail_unless(NULL != ptr, NULL);
+	memcpy(ptr, "stale", 5);
+	fbr_buffer_alloc_commit(&context, &buffer);
+	mem_ptr = buffer.vrb.mem_ptr;
+	fbr_buffer_destroy(&context, &buffer);
+
+	/* Released mapping is handed out again, emptied */
+	retval = fbr_buffer_init(&context, &buffer, 0);
+	fail_unless(0 == retval, NULL);
+	fail_unless(mem_ptr == buffer.vrb.mem_ptr, NULL);
+	fail_unless(0 == fbr_buffer_bytes(&context, &buffer), NULL);
+	fbr_buffer_destroy(&context, &buffer);
+
+	/* Disabled cache unmaps released buffers */
+	fbr_set_buffer_cache_size(&context, 0);
+	retval = fbr_buffer_init(&context, &buffer, 0);
+	fail_unless(0 == retval, NULL);
+	fbr_buffer_destroy(&context, &buffer);
+
+	fbr_destroy(&context);
+}
+END_TEST
+
+/* Fills the vrb so that data wraps around the end of the ring */
+static void vrb_fill_wrapped(struct fbr_vrb *vrb, size_t skip, size_t len)
+{
+	size_t i;
+	unsigned char *ptr;
+
+	fail_unless(0 == fbr_vrb_give(vrb, skip), NULL);
+	fail_unless(0 == fbr_vrb_take(vrb, skip), NULL);
+	ptr = fbr_vrb_space_ptr(vrb);
+	for (i = 0; i < len; i++)
+		ptr[i] = i % 251;
+	fail_unless(0 == fbr_vrb_give(vrb, len), NULL);
+}
+
+static void vrb_check(struct fbr_vrb *vrb, size_t len)
+{
+	size_t i;
+	unsigned char *ptr = fbr_vrb_data_ptr(vrb);
+
+	fail_unless(len == fbr_vrb_data_len(vrb), NULL);
+	for (i = 0; i < len; i++)
+		fail_unless(ptr[i] == i % 251, "mismatch at %zd", i);
+}
+
+START_TEST(test_vrb_resize)
+{
+	struct fbr_vrb vrb;
+	size_t page = sysconf(_SC_PAGESIZE);
+	void *block, *lower;
+	int retval;
+
+	retval = fbr_vrb_init(&vrb, 4 * page, "/tmp/fbr_vrb.XXXXXX");
+	fail_unless(0 == retval, NULL);
+
+	/* Short wrapped part is appended after the old end */
+	vrb_fill_wrapped(&vrb, 3 * page, 2 * page);
+	retval = fbr_vrb_resize(&vrb, 8 * page, NULL);
+	fail_unless(0 == retval, NULL);
+	fail_unless(8 * page == fbr_vrb_capacity(&vrb), NULL);
+	vrb_check(&vrb, 2 * page);
+	fbr_vrb_reset(&vrb);
+
+	/* Short head part is moved to the new end */
+	vrb_fill_wrapped(&vrb, 7 * page, 6 * page);
+	retval = fbr_vrb_resize(&vrb, 10 * page, NULL);
+	fail_unless(0 == retval, NULL);
+	vrb_check(&vrb, 6 * page);
+	fail_unless(4 * page == fbr_vrb_space_len(&vrb), NULL);
+
+	/* Public resize only grows */
+	retval = fbr_vrb_resize(&vrb, page, NULL);
+	fail_unless(0 == retval, NULL);
+	fail_unless(10 * page == fbr_vrb_capacity(&vrb), NULL);
+
+	/* Never shrinks below the data length */
+	retval = fbr_vrb_resize_do(&vrb, page, NULL);
+	fail_unless(0 == retval, NULL);
+	fail_unless(6 * page == fbr_vrb_capacity(&vrb), NULL);
+	vrb_check(&vrb, 6 * page);
+
+	fbr_vrb_take(&vrb, 5 * page);
+	fbr_vrb_reset(&vrb);
+	vrb_fill_wrapped(&vrb, 5 * page, 3 * page);
+	retval = fbr_vrb_resize_do(&vrb, 3 * page, NULL);
+	fail_unless(0 == retval, NULL);
+	fail_unless(3 * page == fbr_vrb_capacity(&vrb), NULL);
+	vrb_check(&vrb, 3 * page);
+
+	/* Ring still wraps correctly at its new size */
+	fbr_vrb_take(&vrb, 3 * page);
+	vrb_fill_wrapped(&vrb, 2 * page, 3 * page);
+	vrb_check(&vrb, 3 * page);
+
+	/* Occupied address space after the reservation forces a move */
+	block = mmap(vrb.mem_ptr + vrb.mem_ptr_size, page, PROT_NONE,
+			MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	fail_if(MAP_FAILED == block, NULL);
+	lower = vrb.lower_ptr;
+	retval = fbr_vrb_resize(&vrb, 12 * page, NULL);
+	fail_unless(0 == retval, NULL);
+	fail_if(lower == vrb.lower_ptr, NULL);
+	vrb_check(&vrb, 3 * page);
+	munmap(block, page);
+
+	fbr_vrb_destroy(&vrb);
+}
+END_TEST
+
+struct fd_arg {
+	struct fbr_buffer *buffer;
+	int fd;
+	size_t count;
+	size_t done;
+};
+
+static void fd_source_fiber(FBR_P_ void *_arg)
+{
+	struct fd_arg *arg = _arg;
+	unsigned char chunk[1000];
+	size_t i, len;
+	ssize_t r;
+
+	while (arg->done < arg->count) {
+		len = arg->count - arg->done;
+		if (len > sizeof(chunk))
+			len = sizeof(chunk);
+		for (i = 0; i < len; i++)
+			chunk[i] = (arg->done + i) % 251;
+		r = fbr_write_all(FBR_A_ arg->fd, chunk, len);
+		fail_unless((ssize_t)len == r, NULL);
+		arg->done += len;
+	}
+	close(arg->fd);
+}
+
+static void fd_fill_fiber(FBR_P_ void *_arg)
+{
+	struct fd_arg *arg = _arg;
+	ssize_t r;
+
+	/* Odd sized reads make the data wrap at arbitrary offsets */
+	while ((r = fbr_buffer_fill_from_fd(FBR_A_ arg->buffer, arg->fd,
+					1777)) > 0)
+		arg->done += r;
+	fail_unless(0 == r, NULL);
+}
+
+static void fd_drain_fiber(FBR_P_ void *_arg)
+{
+	struct fd_arg *arg = _arg;
+	ssize_t r;
+
+	while (arg->done < arg->count) {
+		r = fbr_buffer_drain_to_fd(FBR_A_ arg->buffer, arg->fd, 0);
+		fail_unless(r > 0, NULL);
+		arg->done += r;
+	}
+	close(arg->fd);
+}
+
+static void fd_sink_fiber(FBR_P_ void *_arg)
+{
+	struct fd_arg *arg = _arg;
+	unsigned char chunk[4096];
+	ssize_t r, i;
+
+	while ((r = fbr_read(FBR_A_ arg->fd, chunk, sizeof(chunk))) > 0) {
+		for (i = 0; i < r; i++)
+			fail_unless(chunk[i] == (arg->done + i) % 251,
+					"mismatch at %zd", arg->done + i);
+		arg->done += r;
+	}
+	fail_unless(0 == r, NULL);
+}
+
+START_TEST(test_buffer_fd)
+{
+	struct fbr_context context;
+	struct fbr_buffer buffer;
+	int in[2], out[2];
+	const size_t count = 1 << 20;
+	struct fd_arg source, fill, drain, sink;
+	fbr_id_t fibers[4];
+	int retval;
+	int i;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	retval = fbr_buffer_init(&context, &buffer, 0);
+	fail_unless(0 == retval, NULL);
+	fail_unless(0 == pipe(in), NULL);
+	fail_unless(0 == pipe(out), NULL);
+	for (i = 0; i < 2; i++) {
+		fbr_fd_nonblock(&context, in[i]);
+		fbr_fd_nonblock(&context, out[i]);
+	}
+
+	source = (struct fd_arg){ &buffer, in[1], count, 0 };
+	fill = (struct fd_arg){ &buffer, in[0], count, 0 };
+	drain = (struct fd_arg){ &buffer, out[1], count, 0 };
+	sink = (struct fd_arg){ &buffer, out[0], count, 0 };
+	fibers[0] = fbr_create(&context, "source", fd_source_fiber, &source, 0);
+	fibers[1] = fbr_create(&context, "fill", fd_fill_fiber, &fill, 0);
+	fibers[2] = fbr_create(&context, "drain", fd_drain_fiber, &drain, 0);
+	fibers[3] = fbr_create(&context, "sink", fd_sink_fiber, &sink, 0);
+	for (i = 0; i < 4; i++) {
+		fail_if(fbr_id_isnull(fibers[i]), NULL);
+		retval = fbr_transfer(&context, fibers[i]);
+		fail_unless(0 == retval, NULL);
+	}
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(count == fill.done, NULL);
+	fail_unless(count == drain.done, NULL);
+	fail_unless(count == sink.done, NULL);
+	for (i = 0; i < 4; i++)
+		fail_unless(fbr_is_reclaimed(&context, fibers[i]), NULL);
+
+	close(in[0]);
+	close(out[0]);
+	fbr_buffer_destroy(&context, &buffer);
+	fbr_destroy(&context);
+}
+END_TEST
 
 TCase * buffer_tcase(void)
 {
 	TCase *tc_buffer = tcase_create ("Buffer");
 	tcase_add_test(tc_buffer, test_buffer_basic);
 	tcase_add_test(tc_buffer, test_buffer);
+	tcase_add_test(tc_buffer, test_buffer_pool);
+	tcase_add_test(tc_buffer, test_vrb_resize);
+	tcase_add_test(tc_buffer, test_buffer_fd);
 	return tc_buffer;
 }
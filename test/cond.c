@@ -305,6 +305,178 @@ START_TEST(test_premature_cond)
 }
 END_TEST
 
+#define HANDOFF_BUDGET 8
+
+struct fiber_arg4 {
+	struct fbr_cond_var cond;
+	int woken;
+	int done;
+};
+
+static void cond_handoff_waiter(FBR_P_ void *_arg)
+{
+	struct fiber_arg4 *arg = _arg;
+	int retval;
+
+	while (!arg->done) {
+		retval = fbr_cond_wait(FBR_A_ &arg->cond, NULL);
+		fail_unless(0 == retval, NULL);
+		arg->woken++;
+	}
+}
+
+static void cond_handoff_signaller(FBR_P_ void *_arg)
+{
+	struct fiber_arg4 *arg = _arg;
+	int i;
+
+	/* The waiter runs before fbr_cond_signal returns */
+	for (i = 0; i < HANDOFF_BUDGET; i++) {
+		fbr_cond_signal(FBR_A_ &arg->cond);
+		fail_unless(i + 1 == arg->woken, NULL);
+	}
+	/* Until the budget for this loop iteration runs out */
+	fbr_cond_signal(FBR_A_ &arg->cond);
+	fail_unless(HANDOFF_BUDGET == arg->woken, NULL);
+	fbr_sleep(FBR_A_ 0.001);
+	fail_unless(HANDOFF_BUDGET + 1 == arg->woken, NULL);
+
+	arg->done = 1;
+	fbr_cond_signal(FBR_A_ &arg->cond);
+	fail_unless(HANDOFF_BUDGET + 2 == arg->woken, NULL);
+}
+
+START_TEST(test_cond_handoff)
+{
+	struct fbr_context context;
+	struct fiber_arg4 arg;
+	fbr_id_t waiter, signaller;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	fbr_set_handoff_budget(&context, HANDOFF_BUDGET);
+	fbr_cond_init(&context, &arg.cond);
+	arg.woken = 0;
+	arg.done = 0;
+
+	waiter = fbr_create(&context, "handoff_waiter", cond_handoff_waiter,
+			&arg, 0);
+	fail_if(fbr_id_isnull(waiter), NULL);
+	retval = fbr_transfer(&context, waiter);
+	fail_unless(0 == retval, NULL);
+
+	/* Signals from the root are always deferred */
+	fbr_cond_signal(&context, &arg.cond);
+	fail_unless(0 == arg.woken, NULL);
+	ev_run(EV_DEFAULT, EVRUN_NOWAIT);
+	fail_unless(1 == arg.woken, NULL);
+	arg.woken = 0;
+
+	signaller = fbr_create(&context, "handoff_signaller",
+			cond_handoff_signaller, &arg, 0);
+	fail_if(fbr_id_isnull(signaller), NULL);
+	retval = fbr_transfer(&context, signaller);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(fbr_is_reclaimed(&context, waiter), NULL);
+	fail_unless(fbr_is_reclaimed(&context, signaller), NULL);
+	fbr_cond_destroy(&context, &arg.cond);
+	fbr_destroy(&context);
+}
+END_TEST
+#undef HANDOFF_BUDGET
+
+struct fiber_arg5 {
+	struct fbr_mutex mutex;
+	struct fbr_cond_var cond;
+	int signalled;
+	int woken;
+};
+
+/* A fiber is never transferred to while it is still on the call stack */
+static int call_stack_unique(FBR_P)
+{
+	struct fbr_stack_item *i, *j;
+
+	for (i = fctx->__p->stack; i <= fctx->__p->sp; i++)
+		for (j = i + 1; j <= fctx->__p->sp; j++)
+			if (i->fiber == j->fiber)
+				return 0;
+	return 1;
+}
+
+static void cond_settling_waiter(FBR_P_ void *_arg)
+{
+	struct fiber_arg5 *arg = _arg;
+	int retval;
+
+	retval = fbr_mutex_lock(FBR_A_ &arg->mutex);
+	fail_unless(0 == retval, NULL);
+	/* Let the signaller block on the mutex */
+	fbr_sleep(FBR_A_ 0.001);
+	/* The unlock within the wait must not hand off to the signaller, as
+	 * it would transfer back to this fiber with the signal */
+	retval = fbr_cond_wait(FBR_A_ &arg->cond, &arg->mutex);
+	fail_unless(0 == retval, NULL);
+	fail_unless(call_stack_unique(FBR_A), NULL);
+	fail_unless(arg->signalled, NULL);
+	fail_unless(fbr_id_eq(fbr_self(FBR_A), arg->mutex.locked_by), NULL);
+	arg->woken = 1;
+	fbr_mutex_unlock(FBR_A_ &arg->mutex);
+}
+
+static void cond_settling_signaller(FBR_P_ void *_arg)
+{
+	struct fiber_arg5 *arg = _arg;
+	int retval;
+
+	retval = fbr_mutex_lock(FBR_A_ &arg->mutex);
+	fail_unless(0 == retval, NULL);
+	fail_unless(call_stack_unique(FBR_A), NULL);
+	arg->signalled = 1;
+	fbr_cond_signal(FBR_A_ &arg->cond);
+	fail_unless(call_stack_unique(FBR_A), NULL);
+	fbr_mutex_unlock(FBR_A_ &arg->mutex);
+}
+
+START_TEST(test_cond_handoff_in_wait)
+{
+	struct fbr_context context;
+	struct fiber_arg5 arg;
+	fbr_id_t waiter, signaller;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	fbr_set_handoff_budget(&context, 64);
+	fbr_mutex_init(&context, &arg.mutex);
+	fbr_cond_init(&context, &arg.cond);
+	arg.signalled = 0;
+	arg.woken = 0;
+
+	waiter = fbr_create(&context, "settling_waiter", cond_settling_waiter,
+			&arg, 0);
+	fail_if(fbr_id_isnull(waiter), NULL);
+	signaller = fbr_create(&context, "settling_signaller",
+			cond_settling_signaller, &arg, 0);
+	fail_if(fbr_id_isnull(signaller), NULL);
+	retval = fbr_transfer(&context, waiter);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_transfer(&context, signaller);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(arg.woken, NULL);
+	fail_unless(fbr_is_reclaimed(&context, waiter), NULL);
+	fail_unless(fbr_is_reclaimed(&context, signaller), NULL);
+	fbr_cond_destroy(&context, &arg.cond);
+	fbr_mutex_destroy(&context, &arg.mutex);
+	fbr_destroy(&context);
+}
+END_TEST
+
 TCase * cond_tcase(void)
 {
 	TCase *tc_cond = tcase_create ("Cond");
@@ -313,6 +485,8 @@ TCase * cond_tcase(void)
 	tcase_add_test(tc_cond, test_cond_bad_mutex);
 	tcase_add_test(tc_cond, test_two_conds);
 	tcase_add_test(tc_cond, test_premature_cond);
+	tcase_add_test(tc_cond, test_cond_handoff);
+	tcase_add_test(tc_cond, test_cond_handoff_in_wait);
 	return tc_cond;
 }
 
@@ -0,0 +1,138 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "cooperate.h"
+
+struct fiber_arg {
+	char *trace;
+	size_t *trace_len;
+	char letter;
+	int iterations;
+};
+
+static void cooperate_fiber(FBR_P_ void *_arg)
+{
+	struct fiber_arg *arg = _arg;
+	int i;
+	for (i = 0; i < arg->iterations; i++) {
+		arg->trace[(*arg->trace_len)++] = arg->letter;
+		fbr_cooperate(FBR_A);
+	}
+}
+
+static void run_two(struct fbr_context *fctx, char *trace, int iterations)
+{
+	size_t trace_len = 0;
+	fbr_id_t fiber;
+	int retval;
+	struct fiber_arg arg_a = {
+		.trace = trace,
+		.trace_len = &trace_len,
+		.letter = 'a',
+		.iterations = iterations,
+	};
+	struct fiber_arg arg_b = {
+		.trace = trace,
+		.trace_len = &trace_len,
+		.letter = 'b',
+		.iterations = iterations,
+	};
+
+	fiber = fbr_create(FBR_A_ "cooperate_a", cooperate_fiber, &arg_a, 0);
+	fail_if(fbr_id_isnull(fiber), NULL);
+	retval = fbr_transfer(FBR_A_ fiber);
+	fail_unless(0 == retval, NULL);
+
+	fiber = fbr_create(FBR_A_ "cooperate_b", cooperate_fiber, &arg_b, 0);
+	fail_if(fbr_id_isnull(fiber), NULL);
+	retval = fbr_transfer(FBR_A_ fiber);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+	trace[trace_len] = '\0';
+}
+
+START_TEST(test_cooperate)
+{
+	struct fbr_context context;
+	char trace[32];
+
+	fbr_init(&context, EV_DEFAULT);
+	run_two(&context, trace, 4);
+	fail_unless(0 == strcmp(trace, "abababab"), "trace: %s", trace);
+	fbr_destroy(&context);
+}
+END_TEST
+
+START_TEST(test_cooperate_iterations)
+{
+	struct fbr_context context;
+	char trace[32];
+
+	fbr_init(&context, EV_DEFAULT);
+	fbr_set_cooperate_budget(&context, 0., 3);
+	run_two(&context, trace, 9);
+	fail_unless(0 == strcmp(trace, "aaabbbaaabbbaaabbb"), "trace: %s",
+			trace);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void busy_fiber(FBR_P_ void *_arg)
+{
+	int *yields = _arg;
+	ev_tstamp start = ev_time();
+	while (ev_time() - start < 0.2) {
+		fbr_cooperate(FBR_A);
+		/* A yield resets the slice, so it is unset only after one */
+		if (0. == CURRENT_FIBER->slice.started)
+			(*yields)++;
+	}
+}
+
+START_TEST(test_cooperate_quantum)
+{
+	struct fbr_context context;
+	fbr_id_t fiber;
+	int yields = 0;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	fbr_set_cooperate_budget(&context, 0.05, 0);
+	fiber = fbr_create(&context, "busy", busy_fiber, &yields, 0);
+	fail_if(fbr_id_isnull(fiber), NULL);
+	retval = fbr_transfer(&context, fiber);
+	fail_unless(0 == retval, NULL);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(yields >= 2 && yields <= 5, "yields: %d", yields);
+	fbr_destroy(&context);
+}
+END_TEST
+
+TCase * cooperate_tcase(void)
+{
+	TCase *tc_cooperate = tcase_create ("Cooperate");
+	tcase_add_test(tc_cooperate, test_cooperate);
+	tcase_add_test(tc_cooperate, test_cooperate_iterations);
+	tcase_add_test(tc_cooperate, test_cooperate_quantum);
+	return tc_cooperate;
+}
@@ -0,0 +1,198 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "deadline.h"
+
+static struct fbr_mutex held_mutex;
+static int child_done;
+
+static void holder_fiber(FBR_P_ _unused_ void *_arg)
+{
+	fbr_mutex_lock(FBR_A_ &held_mutex);
+	fbr_sleep(FBR_A_ 0.1);
+	fbr_mutex_unlock(FBR_A_ &held_mutex);
+}
+
+static void deadline_child_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	ev_tstamp start = ev_now(fctx->__p->loop);
+	ssize_t retval;
+	char c;
+
+	fail_unless(fbr_get_deadline(FBR_A) > start, NULL);
+	/* Nothing is ever written, the inherited deadline ends the read */
+	retval = fbr_read(FBR_A_ fd, &c, 1);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(ETIMEDOUT == errno, NULL);
+	fail_unless(FBR_ETIMEDOUT == fctx->f_errno, NULL);
+	fail_unless(ev_now(fctx->__p->loop) - start >= 0.04, NULL);
+	child_done = 1;
+}
+
+static void deadline_parent_fiber(FBR_P_ void *_arg)
+{
+	fbr_id_t child;
+	ev_tstamp left;
+	int retval;
+
+	fbr_set_deadline(FBR_A_ ev_now(fctx->__p->loop) + 0.05);
+	child = fbr_create(FBR_A_ "deadline_child", deadline_child_fiber,
+			_arg, 0);
+	fail_if(fbr_id_isnull(child), NULL);
+	retval = fbr_transfer(FBR_A_ child);
+	fail_unless(0 == retval, NULL);
+
+	/* Nested waits share the budget */
+	left = fbr_sleep(FBR_A_ 1.0);
+	fail_unless(left > 0.5, NULL);
+	fail_unless(FBR_ETIMEDOUT == fctx->f_errno, NULL);
+	fail_unless(child_done, NULL);
+
+	/* Once passed, any wait that would block fails straight away */
+	retval = fbr_mutex_lock(FBR_A_ &held_mutex);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_ETIMEDOUT == fctx->f_errno, NULL);
+	fail_if(fbr_id_eq(held_mutex.locked_by, fbr_self(FBR_A)), NULL);
+
+	fbr_set_deadline(FBR_A_ 0.);
+	fail_unless(0. == fbr_get_deadline(FBR_A), NULL);
+	retval = fbr_mutex_lock(FBR_A_ &held_mutex);
+	fail_unless(0 == retval, NULL);
+	fbr_mutex_unlock(FBR_A_ &held_mutex);
+}
+
+START_TEST(test_deadline)
+{
+	struct fbr_context context;
+	fbr_id_t holder, parent;
+	int fds[2];
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	fbr_mutex_init(&context, &held_mutex);
+	child_done = 0;
+
+	retval = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_fd_nonblock(&context, fds[0]);
+	fail_unless(0 == retval, NULL);
+
+	holder = fbr_create(&context, "holder", holder_fiber, NULL, 0);
+	fail_if(fbr_id_isnull(holder), NULL);
+	parent = fbr_create(&context, "deadline_parent", deadline_parent_fiber,
+			fds, 0);
+	fail_if(fbr_id_isnull(parent), NULL);
+	retval = fbr_transfer(&context, holder);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_transfer(&context, parent);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(fbr_is_reclaimed(&context, parent), NULL);
+	fail_unless(fbr_is_reclaimed(&context, holder), NULL);
+	fbr_mutex_destroy(&context, &held_mutex);
+	close(fds[0]);
+	close(fds[1]);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void cancelled_child_fiber(FBR_P_ _unused_ void *_arg)
+{
+	fail_unless(1 == fbr_is_cancelled(FBR_A_ fbr_self(FBR_A)), NULL);
+	child_done = 1;
+}
+
+static void cancelled_fiber(FBR_P_ _unused_ void *_arg)
+{
+	struct fbr_mutex mutex;
+	struct fbr_cond_var cond;
+	fbr_id_t child;
+	int retval;
+
+	fbr_mutex_init(FBR_A_ &mutex);
+	fbr_cond_init(FBR_A_ &cond);
+	fbr_mutex_lock(FBR_A_ &mutex);
+	retval = fbr_cond_wait(FBR_A_ &cond, &mutex);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_ECANCELED == fctx->f_errno, NULL);
+	/* The mutex is held again, as after a successful wait */
+	fail_unless(fbr_id_eq(mutex.locked_by, fbr_self(FBR_A)), NULL);
+	fail_unless(TAILQ_EMPTY(&cond.waiting), NULL);
+	fbr_mutex_unlock(FBR_A_ &mutex);
+
+	fail_unless(1.0 == fbr_sleep(FBR_A_ 1.0), NULL);
+	fail_unless(FBR_ECANCELED == fctx->f_errno, NULL);
+	/* Waits that do not block still succeed */
+	retval = fbr_mutex_lock(FBR_A_ &mutex);
+	fail_unless(0 == retval, NULL);
+	fbr_mutex_unlock(FBR_A_ &mutex);
+
+	child = fbr_create(FBR_A_ "cancelled_child", cancelled_child_fiber,
+			NULL, 0);
+	fail_if(fbr_id_isnull(child), NULL);
+	retval = fbr_transfer(FBR_A_ child);
+	fail_unless(0 == retval, NULL);
+
+	fbr_cond_destroy(FBR_A_ &cond);
+	fbr_mutex_destroy(FBR_A_ &mutex);
+}
+
+START_TEST(test_cancel)
+{
+	struct fbr_context context;
+	fbr_id_t fiber;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	child_done = 0;
+
+	fiber = fbr_create(&context, "cancelled", cancelled_fiber, NULL, 0);
+	fail_if(fbr_id_isnull(fiber), NULL);
+	retval = fbr_transfer(&context, fiber);
+	fail_unless(0 == retval, NULL);
+	fail_unless(0 == fbr_is_cancelled(&context, fiber), NULL);
+
+	retval = fbr_cancel(&context, fiber);
+	fail_unless(0 == retval, NULL);
+
+	fail_unless(child_done, NULL);
+	fail_unless(fbr_is_reclaimed(&context, fiber), NULL);
+	retval = fbr_cancel(&context, fiber);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_ENOFIBER == context.f_errno, NULL);
+	fbr_destroy(&context);
+}
+END_TEST
+
+TCase * deadline_tcase(void)
+{
+	TCase *tc_deadline = tcase_create ("Deadline");
+	tcase_add_test(tc_deadline, test_deadline);
+	tcase_add_test(tc_deadline, test_cancel);
+	return tc_deadline;
+}
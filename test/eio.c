@@ -282,7 +282,7 @@ START_TEST(test_eio)
 	fbr_id_t fiber = FBR_ID_NULL;
 	struct fbr_context context;
 	fbr_init(&context, EV_DEFAULT);
-	fbr_eio_init();
+	fbr_eio_init(&context);
 	signal(SIGPIPE, SIG_IGN);
 
 	fiber = fbr_create(&context, "io_fiber", io_fiber, NULL, 0);
@@ -16,11 +16,13 @@
 
  ********************************************************************/
 
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <limits.h>
 #include <ev.h>
 #include <check.h>
 #include <evfibers_private/fiber.h>
@@ -488,6 +490,657 @@ START_TEST(test_tcp)
 }
 END_TEST
 
+static int root_resumed;
+
+static void optimistic_reader_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	char buf[4];
+	ssize_t retval;
+
+	retval = fbr_read(FBR_A_ fd, buf, sizeof(buf));
+	fail_unless(4 == retval, NULL);
+	/* Optimistic read must not have yielded as the data was there */
+	fail_unless((fctx->__p->optimistic_io ? 0 : 1) == root_resumed,
+			NULL);
+}
+
+static void run_optimistic_read(int optimistic)
+{
+	struct fbr_context context;
+	fbr_id_t reader = FBR_ID_NULL;
+	int fds[2];
+	int retval;
+
+	retval = pipe(fds);
+	fail_unless(0 == retval);
+	fbr_init(&context, EV_DEFAULT);
+	fbr_enable_optimistic_io(&context, optimistic);
+	fbr_assume_nonblocking_fds(&context, 1);
+	retval = fbr_fd_nonblock(&context, fds[0]);
+	fail_unless(0 == retval);
+	retval = write(fds[1], "data", 4);
+	fail_unless(4 == retval);
+
+	root_resumed = 0;
+	reader = fbr_create(&context, "reader", optimistic_reader_fiber,
+			fds + 0, 0);
+	fail_if(fbr_id_isnull(reader), NULL);
+	retval = fbr_transfer(&context, reader);
+	fail_unless(0 == retval, NULL);
+	root_resumed = 1;
+
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(fbr_is_reclaimed(&context, reader));
+
+	close(fds[0]);
+	close(fds[1]);
+	fbr_destroy(&context);
+}
+
+START_TEST(test_optimistic_read)
+{
+	run_optimistic_read(1);
+	run_optimistic_read(0);
+}
+END_TEST
+
+static void blocking_reader_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	char buf[4];
+	ssize_t retval;
+
+	retval = fbr_read(FBR_A_ fd, buf, sizeof(buf));
+	fail_unless(4 == retval, NULL);
+	fail_unless(1 == root_resumed, NULL);
+}
+
+START_TEST(test_optimistic_blocking_fd)
+{
+	struct fbr_context context;
+	fbr_id_t reader;
+	int fds[2];
+	int retval;
+
+	retval = pipe(fds);
+	fail_unless(0 == retval);
+	fbr_init(&context, EV_DEFAULT);
+	fbr_enable_optimistic_io(&context, 1);
+
+	/* Descriptors are waited for first unless declared non-blocking, so
+	 * the read does not block the thread and the root gets to write the
+	 * data */
+	root_resumed = 0;
+	reader = fbr_create(&context, "reader", blocking_reader_fiber,
+			fds + 0, 0);
+	fail_if(fbr_id_isnull(reader), NULL);
+	retval = fbr_transfer(&context, reader);
+	fail_unless(0 == retval, NULL);
+	root_resumed = 1;
+	retval = write(fds[1], "data", 4);
+	fail_unless(4 == retval);
+
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(fbr_is_reclaimed(&context, reader));
+
+	close(fds[0]);
+	close(fds[1]);
+	fbr_destroy(&context);
+}
+END_TEST
+
+#define buf_size (1 * 1024 * 1024)
+static void fd_reader_fiber(FBR_P_ void *_arg)
+{
+	struct fbr_fd *fdh = _arg;
+	char *buf = malloc(buf_size);
+	ssize_t retval;
+	size_t i;
+
+	retval = fbr_fd_read_all(FBR_A_ fdh, buf, buf_size);
+	fail_unless(buf_size == retval, NULL);
+	for (i = 0; i < buf_size; i++)
+		fail_unless((char)i == buf[i], NULL);
+	free(buf);
+
+	/* Nothing else is coming, the wait ends with detaching */
+	retval = fbr_fd_read(FBR_A_ fdh, &i, sizeof(i));
+	fail_unless(-1 == retval, NULL);
+	fail_unless(EBADF == errno, NULL);
+}
+
+static void fd_writer_fiber(FBR_P_ void *_arg)
+{
+	struct fbr_fd *fdh = _arg;
+	struct fbr_fd *rfdh = fdh + 1;
+	char *buf = malloc(buf_size);
+	ssize_t retval;
+	size_t i;
+
+	for (i = 0; i < buf_size; i++)
+		buf[i] = i;
+	retval = fbr_fd_write_all(FBR_A_ fdh, buf, buf_size);
+	fail_unless(buf_size == retval, NULL);
+	free(buf);
+
+	fbr_sleep(FBR_A_ 0.01);
+	/* The read watcher has to stay registered while the reader waits */
+	fail_unless(ev_is_active(&rfdh->r_io), NULL);
+	fbr_fd_detach(FBR_A_ rfdh);
+	fbr_fd_detach(FBR_A_ fdh);
+	fail_unless(-1 == rfdh->fd, NULL);
+}
+#undef buf_size
+
+START_TEST(test_fd_handle)
+{
+	struct fbr_context context;
+	struct fbr_fd handles[2];
+	fbr_id_t reader, writer;
+	int fds[2];
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	retval = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_fd_attach(&context, &handles[1], fds[0]);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_fd_attach(&context, &handles[0], fds[1]);
+	fail_unless(0 == retval, NULL);
+
+	reader = fbr_create(&context, "fd_reader", fd_reader_fiber,
+			&handles[1], 0);
+	fail_if(fbr_id_isnull(reader), NULL);
+	writer = fbr_create(&context, "fd_writer", fd_writer_fiber,
+			&handles[0], 0);
+	fail_if(fbr_id_isnull(writer), NULL);
+
+	retval = fbr_transfer(&context, reader);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_transfer(&context, writer);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(fbr_is_reclaimed(&context, reader), NULL);
+	fail_unless(fbr_is_reclaimed(&context, writer), NULL);
+
+	close(fds[0]);
+	close(fds[1]);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void fd_idle_reader_fiber(FBR_P_ void *_arg)
+{
+	struct fbr_fd *fdh = _arg;
+	ev_tstamp start;
+	ssize_t retval;
+	char c;
+	int i;
+
+	fbr_fd_set_idle_timeout(FBR_A_ fdh, 0.05);
+	/* Activity keeps pushing the deadline away */
+	for (i = 0; i < 5; i++) {
+		retval = fbr_fd_read(FBR_A_ fdh, &c, 1);
+		fail_unless(1 == retval, NULL);
+		fail_unless('0' + i == c, NULL);
+	}
+
+	start = ev_now(fctx->__p->loop);
+	retval = fbr_fd_read(FBR_A_ fdh, &c, 1);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(ETIMEDOUT == errno, NULL);
+	fail_unless(ev_now(fctx->__p->loop) - start >= 0.04, NULL);
+	fail_if(ev_is_active(&fdh->idle_timer), NULL);
+
+	/* The handle stays expired until there is activity */
+	retval = fbr_fd_read(FBR_A_ fdh, &c, 1);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(ETIMEDOUT == errno, NULL);
+
+	fbr_fd_set_idle_timeout(FBR_A_ fdh, 0.);
+	retval = fbr_fd_read(FBR_A_ fdh, &c, 1);
+	fail_unless(1 == retval, NULL);
+	fail_unless('x' == c, NULL);
+	fbr_fd_detach(FBR_A_ fdh);
+}
+
+static void fd_idle_writer_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	ssize_t retval;
+	char c;
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		fbr_sleep(FBR_A_ 0.03);
+		c = '0' + i;
+		retval = write(fd, &c, 1);
+		fail_unless(1 == retval, NULL);
+	}
+	fbr_sleep(FBR_A_ 0.1);
+	retval = write(fd, "x", 1);
+	fail_unless(1 == retval, NULL);
+}
+
+START_TEST(test_fd_idle_timeout)
+{
+	struct fbr_context context;
+	struct fbr_fd fdh;
+	fbr_id_t reader, writer;
+	int fds[2];
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	retval = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_fd_attach(&context, &fdh, fds[0]);
+	fail_unless(0 == retval, NULL);
+
+	reader = fbr_create(&context, "idle_reader", fd_idle_reader_fiber,
+			&fdh, 0);
+	fail_if(fbr_id_isnull(reader), NULL);
+	writer = fbr_create(&context, "idle_writer", fd_idle_writer_fiber,
+			fds + 1, 0);
+	fail_if(fbr_id_isnull(writer), NULL);
+
+	retval = fbr_transfer(&context, reader);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_transfer(&context, writer);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(fbr_is_reclaimed(&context, reader), NULL);
+	fail_unless(fbr_is_reclaimed(&context, writer), NULL);
+
+	close(fds[0]);
+	close(fds[1]);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void fd_idle_shorten_reader_fiber(FBR_P_ void *_arg)
+{
+	struct fbr_fd *fdh = _arg;
+	ev_tstamp start;
+	ssize_t retval;
+	char c;
+
+	fbr_fd_set_idle_timeout(FBR_A_ fdh, 60.);
+	start = ev_now(fctx->__p->loop);
+	retval = fbr_fd_read(FBR_A_ fdh, &c, 1);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(ETIMEDOUT == errno, NULL);
+	fail_unless(ev_now(fctx->__p->loop) - start < 1., NULL);
+	fbr_fd_detach(FBR_A_ fdh);
+}
+
+static void fd_idle_shorten_fiber(FBR_P_ void *_arg)
+{
+	struct fbr_fd *fdh = _arg;
+
+	fbr_sleep(FBR_A_ 0.01);
+	/* The waiting reader is woken up by the new, earlier deadline */
+	fbr_fd_set_idle_timeout(FBR_A_ fdh, 0.02);
+}
+
+START_TEST(test_fd_idle_timeout_shorten)
+{
+	struct fbr_context context;
+	struct fbr_fd fdh;
+	fbr_id_t reader, shortener;
+	int fds[2];
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	retval = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_fd_attach(&context, &fdh, fds[0]);
+	fail_unless(0 == retval, NULL);
+
+	reader = fbr_create(&context, "idle_reader",
+			fd_idle_shorten_reader_fiber, &fdh, 0);
+	fail_if(fbr_id_isnull(reader), NULL);
+	shortener = fbr_create(&context, "idle_shortener",
+			fd_idle_shorten_fiber, &fdh, 0);
+	fail_if(fbr_id_isnull(shortener), NULL);
+
+	retval = fbr_transfer(&context, reader);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_transfer(&context, shortener);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(fbr_is_reclaimed(&context, reader), NULL);
+	fail_unless(fbr_is_reclaimed(&context, shortener), NULL);
+
+	close(fds[0]);
+	close(fds[1]);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void reader_fiber_buffered(FBR_P_ void *_arg)
+{
+	struct fbr_fd *fdh = _arg;
+	struct fbr_reader reader;
+	void *ptr;
+	ssize_t retval;
+
+	retval = fbr_reader_init(FBR_A_ &reader, fdh, 0);
+	fail_unless(0 == retval, NULL);
+
+	retval = fbr_reader_readline(FBR_A_ &reader, &ptr);
+	fail_unless(6 == retval, NULL);
+	fail_unless(!memcmp(ptr, "hello\n", 6), NULL);
+	retval = fbr_reader_read_exact(FBR_A_ &reader, 4, &ptr);
+	fail_unless(4 == retval, NULL);
+	fail_unless(!memcmp(ptr, "\0\1\2\3", 4), NULL);
+	retval = fbr_reader_read_until(FBR_A_ &reader, ';', &ptr);
+	fail_unless(7 == retval, NULL);
+	fail_unless(!memcmp(ptr, "split ;", 7), NULL);
+	retval = fbr_reader_read_exact(FBR_A_ &reader,
+			fbr_vrb_capacity(&reader.vrb) + 1, &ptr);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_EINVAL == fctx->f_errno, NULL);
+	retval = fbr_reader_readline(FBR_A_ &reader, &ptr);
+	fail_unless(4 == retval, NULL);
+	fail_unless(!memcmp(ptr, "tail", 4), NULL);
+	retval = fbr_reader_readline(FBR_A_ &reader, &ptr);
+	fail_unless(0 == retval, NULL);
+
+	fbr_reader_destroy(FBR_A_ &reader);
+	fbr_fd_detach(FBR_A_ fdh);
+}
+
+static void reader_writer_fiber(FBR_P_ void *_arg)
+{
+	struct fbr_fd *fdh = _arg;
+	static const char * const pieces[] = {
+		"hel", "lo\n\0\1", "\2\3spl", "it ;tail", NULL
+	};
+	static const size_t lengths[] = { 3, 5, 5, 8 };
+	ssize_t retval;
+	int i;
+
+	for (i = 0; pieces[i]; i++) {
+		retval = fbr_fd_write_all(FBR_A_ fdh, pieces[i], lengths[i]);
+		fail_unless((ssize_t)lengths[i] == retval, NULL);
+		fbr_sleep(FBR_A_ 0.001);
+	}
+	shutdown(fdh->fd, SHUT_WR);
+	fbr_fd_detach(FBR_A_ fdh);
+}
+
+START_TEST(test_reader)
+{
+	struct fbr_context context;
+	struct fbr_fd rfd, wfd;
+	fbr_id_t reader, writer;
+	int fds[2];
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	retval = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_fd_attach(&context, &rfd, fds[0]);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_fd_attach(&context, &wfd, fds[1]);
+	fail_unless(0 == retval, NULL);
+
+	reader = fbr_create(&context, "reader", reader_fiber_buffered, &rfd,
+			0);
+	fail_if(fbr_id_isnull(reader), NULL);
+	writer = fbr_create(&context, "writer", reader_writer_fiber, &wfd, 0);
+	fail_if(fbr_id_isnull(writer), NULL);
+
+	retval = fbr_transfer(&context, reader);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_transfer(&context, writer);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(fbr_is_reclaimed(&context, reader), NULL);
+	fail_unless(fbr_is_reclaimed(&context, writer), NULL);
+
+	close(fds[0]);
+	close(fds[1]);
+	fbr_destroy(&context);
+}
+END_TEST
+
+#define buf_size (256 * 1024)
+static void vec_reader_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	char *buf = malloc(2 * buf_size);
+	char header[16];
+	struct iovec iov[2];
+	size_t total = 0;
+	ssize_t retval;
+	size_t i;
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = 2 * buf_size;
+	retval = fbr_readv(FBR_A_ fd, iov, 2);
+	fail_unless(retval > (ssize_t)sizeof(header), NULL);
+	fail_unless(!memcmp(header, "header-0123456-\n", sizeof(header)),
+			NULL);
+	total = retval - sizeof(header);
+	while (total < buf_size) {
+		retval = fbr_read(FBR_A_ fd, buf + total, 2 * buf_size - total);
+		fail_unless(retval > 0, NULL);
+		total += retval;
+	}
+	fail_unless(buf_size == total, NULL);
+	for (i = 0; i < buf_size; i++)
+		fail_unless((char)i == buf[i], NULL);
+	free(buf);
+
+	/* Nothing more is coming */
+	retval = fbr_readv_wto(FBR_A_ fd, iov, 2, 0.01);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(ETIMEDOUT == errno, NULL);
+}
+
+static void vec_writer_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	char *buf = malloc(buf_size);
+	struct iovec iov[4];
+	ssize_t retval;
+	size_t i;
+
+	for (i = 0; i < buf_size; i++)
+		buf[i] = i;
+	iov[0].iov_base = "header-";
+	iov[0].iov_len = 7;
+	iov[1].iov_base = "0123456-\n";
+	iov[1].iov_len = 9;
+	iov[2].iov_base = NULL;
+	iov[2].iov_len = 0;
+	iov[3].iov_base = buf;
+	iov[3].iov_len = buf_size;
+	retval = fbr_writev_all(FBR_A_ fd, iov, -1);
+	fail_unless(-1 == retval && EINVAL == errno, NULL);
+	retval = fbr_writev_all(FBR_A_ fd, iov, INT_MAX);
+	fail_unless(-1 == retval && EINVAL == errno, NULL);
+	retval = fbr_writev_all(FBR_A_ fd, iov, 4);
+	fail_unless(16 + buf_size == retval, NULL);
+	fail_unless(buf == iov[3].iov_base, NULL);
+	free(buf);
+}
+#undef buf_size
+
+START_TEST(test_vectored)
+{
+	struct fbr_context context;
+	fbr_id_t reader, writer;
+	int fds[2];
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	retval = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_fd_nonblock(&context, fds[0]);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_fd_nonblock(&context, fds[1]);
+	fail_unless(0 == retval, NULL);
+
+	reader = fbr_create(&context, "vec_reader", vec_reader_fiber, fds + 0,
+			0);
+	fail_if(fbr_id_isnull(reader), NULL);
+	writer = fbr_create(&context, "vec_writer", vec_writer_fiber, fds + 1,
+			0);
+	fail_if(fbr_id_isnull(writer), NULL);
+
+	retval = fbr_transfer(&context, reader);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_transfer(&context, writer);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(fbr_is_reclaimed(&context, reader), NULL);
+	fail_unless(fbr_is_reclaimed(&context, writer), NULL);
+
+	close(fds[0]);
+	close(fds[1]);
+	fbr_destroy(&context);
+}
+END_TEST
+
+#define n_msgs 8
+static void msg_reader_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	int values[n_msgs];
+	struct iovec iov[n_msgs];
+	ssize_t retval;
+	int i;
+#ifdef FBR_HAVE_MMSG
+	struct mmsghdr msgs[n_msgs];
+
+	memset(msgs, 0x00, sizeof(msgs));
+	for (i = 0; i < n_msgs; i++) {
+		iov[i].iov_base = values + i;
+		iov[i].iov_len = sizeof(int);
+		msgs[i].msg_hdr.msg_iov = iov + i;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	/* All the datagrams are queued by the time the reader wakes up */
+	retval = fbr_recvmmsg(FBR_A_ fd, msgs, n_msgs, 0);
+	fail_unless(n_msgs == retval, NULL);
+	for (i = 0; i < n_msgs; i++) {
+		fail_unless(sizeof(int) == msgs[i].msg_len, NULL);
+		fail_unless(i == values[i], NULL);
+	}
+	retval = fbr_recvmmsg_wto(FBR_A_ fd, msgs, n_msgs, 0, 0.01);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(ETIMEDOUT == errno, NULL);
+#else
+	struct msghdr msg;
+
+	memset(&msg, 0x00, sizeof(msg));
+	for (i = 0; i < n_msgs; i++) {
+		iov[0].iov_base = values + i;
+		iov[0].iov_len = sizeof(int);
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 1;
+		retval = fbr_recvmsg(FBR_A_ fd, &msg, 0);
+		fail_unless(sizeof(int) == retval, NULL);
+		fail_unless(i == values[i], NULL);
+	}
+#endif
+	retval = fbr_recvmsg_wto(FBR_A_ fd, &(struct msghdr){
+			.msg_iov = iov, .msg_iovlen = 1 }, 0, 0.01);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(ETIMEDOUT == errno, NULL);
+}
+
+static void msg_writer_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+	int values[n_msgs];
+	struct iovec iov[n_msgs];
+	ssize_t retval;
+	int i;
+#ifdef FBR_HAVE_MMSG
+	struct mmsghdr msgs[n_msgs];
+
+	memset(msgs, 0x00, sizeof(msgs));
+	for (i = 0; i < n_msgs; i++) {
+		values[i] = i;
+		iov[i].iov_base = values + i;
+		iov[i].iov_len = sizeof(int);
+		msgs[i].msg_hdr.msg_iov = iov + i;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	retval = fbr_sendmmsg(FBR_A_ fd, msgs, n_msgs, 0);
+	fail_unless(n_msgs == retval, NULL);
+#else
+	struct msghdr msg;
+
+	memset(&msg, 0x00, sizeof(msg));
+	for (i = 0; i < n_msgs; i++) {
+		values[i] = i;
+		iov[0].iov_base = values + i;
+		iov[0].iov_len = sizeof(int);
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 1;
+		retval = fbr_sendmsg(FBR_A_ fd, &msg, 0);
+		fail_unless(sizeof(int) == retval, NULL);
+	}
+#endif
+}
+#undef n_msgs
+
+START_TEST(test_msg_batch)
+{
+	struct fbr_context context;
+	fbr_id_t reader, writer;
+	int fds[2];
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	retval = socketpair(AF_UNIX, SOCK_DGRAM, 0, fds);
+	fail_unless(0 == retval, NULL);
+
+	reader = fbr_create(&context, "msg_reader", msg_reader_fiber, fds + 0,
+			0);
+	fail_if(fbr_id_isnull(reader), NULL);
+	writer = fbr_create(&context, "msg_writer", msg_writer_fiber, fds + 1,
+			0);
+	fail_if(fbr_id_isnull(writer), NULL);
+
+	retval = fbr_transfer(&context, reader);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_transfer(&context, writer);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(fbr_is_reclaimed(&context, reader), NULL);
+	fail_unless(fbr_is_reclaimed(&context, writer), NULL);
+
+	close(fds[0]);
+	close(fds[1]);
+	fbr_destroy(&context);
+}
+END_TEST
 
 TCase * io_tcase(void)
 {
@@ -498,5 +1151,13 @@ TCase * io_tcase(void)
 	tcase_add_test(tc_io, test_udp);
 	tcase_add_test(tc_io, test_tcp);
 	tcase_add_test(tc_io, test_read_write_premature);
+	tcase_add_test(tc_io, test_optimistic_read);
+	tcase_add_test(tc_io, test_optimistic_blocking_fd);
+	tcase_add_test(tc_io, test_fd_handle);
+	tcase_add_test(tc_io, test_fd_idle_timeout);
+	tcase_add_test(tc_io, test_fd_idle_timeout_shorten);
+	tcase_add_test(tc_io, test_reader);
+	tcase_add_test(tc_io, test_vectored);
+	tcase_add_test(tc_io, test_msg_batch);
 	return tc_io;
 }
@@ -30,14 +30,27 @@
 #include "buffer.h"
 #include "key.h"
 #include "eio.h"
+#include "uring.h"
 #include "async-wait.h"
 #include "popen3.h"
+#include "cooperate.h"
+#include "remote.h"
+#include "steal.h"
+#include "timer.h"
+#include "deadline.h"
+#include "rwlock.h"
+#include "sem.h"
+#include "mq.h"
+#include "pq.h"
 
 Suite *evfibers_suite(void)
 {
 	Suite *s;
 	TCase *tc_init, *tc_mutex, *tc_cond, *tc_reclaim, *tc_io, *tc_logger,
-	      *tc_buffer, *tc_key, *tc_eio, *tc_async_wait, *tc_popen3;
+	      *tc_buffer, *tc_key, *tc_eio, *tc_uring, *tc_async_wait,
+	      *tc_popen3, *tc_cooperate, *tc_remote, *tc_steal, *tc_timer,
+	      *tc_deadline, *tc_rwlock, *tc_sem, *tc_mq,
+	      *tc_pq;
 
 	s = suite_create ("evfibers");
 	tc_init = init_tcase();
@@ -49,8 +62,18 @@ Suite *evfibers_suite(void)
 	tc_buffer = buffer_tcase();
 	tc_key = key_tcase();
 	tc_eio = eio_tcase();
+	tc_uring = uring_tcase();
 	tc_async_wait = async_wait_tcase();
 	tc_popen3 = popen3_tcase();
+	tc_cooperate = cooperate_tcase();
+	tc_remote = remote_tcase();
+	tc_steal = steal_tcase();
+	tc_timer = timer_tcase();
+	tc_deadline = deadline_tcase();
+	tc_rwlock = rwlock_tcase();
+	tc_sem = sem_tcase();
+	tc_mq = mq_tcase();
+	tc_pq = pq_tcase();
 	suite_add_tcase(s, tc_init);
 	suite_add_tcase(s, tc_mutex);
 	suite_add_tcase(s, tc_cond);
@@ -60,8 +83,18 @@ Suite *evfibers_suite(void)
 	suite_add_tcase(s, tc_buffer);
 	suite_add_tcase(s, tc_key);
 	suite_add_tcase(s, tc_eio);
+	suite_add_tcase(s, tc_uring);
 	suite_add_tcase(s, tc_async_wait);
 	suite_add_tcase(s, tc_popen3);
+	suite_add_tcase(s, tc_cooperate);
+	suite_add_tcase(s, tc_remote);
+	suite_add_tcase(s, tc_steal);
+	suite_add_tcase(s, tc_timer);
+	suite_add_tcase(s, tc_deadline);
+	suite_add_tcase(s, tc_rwlock);
+	suite_add_tcase(s, tc_sem);
+	suite_add_tcase(s, tc_mq);
+	suite_add_tcase(s, tc_pq);
 
 	return s;
 }
@@ -0,0 +1,386 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <stdint.h>
+#include <string.h>
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "mq.h"
+
+#define N_MESSAGES 5
+
+struct mq_arg {
+	struct fbr_mq *mq1;
+	struct fbr_mq *mq2;
+	long received[2 * N_MESSAGES];
+	int n_received;
+	int timed_out;
+};
+
+static void producer1_fiber(FBR_P_ void *_arg)
+{
+	struct mq_arg *arg = _arg;
+	long i;
+	int retval;
+
+	for (i = 1; i <= N_MESSAGES; i++) {
+		retval = fbr_mq_push(arg->mq1, (void *)i);
+		fail_unless(0 == retval, NULL);
+		fbr_sleep(FBR_A_ 0.001);
+	}
+}
+
+static void producer2_fiber(FBR_P_ void *_arg)
+{
+	struct mq_arg *arg = _arg;
+	long i;
+	int retval;
+
+	for (i = 1; i <= N_MESSAGES; i++) {
+		fbr_sleep(FBR_A_ 0.0015);
+		retval = fbr_mq_push(arg->mq2, (void *)-i);
+		fail_unless(0 == retval, NULL);
+	}
+}
+
+static void select_fiber(FBR_P_ void *_arg)
+{
+	struct mq_arg *arg = _arg;
+	struct fbr_ev_mq_pop pop1, pop2;
+	struct fbr_ev_base *events[] = {&pop1.ev_base, &pop2.ev_base, NULL};
+	int n_events;
+
+	for (;;) {
+		fbr_ev_mq_pop_init(FBR_A_ &pop1, arg->mq1);
+		fbr_ev_mq_pop_init(FBR_A_ &pop2, arg->mq2);
+		n_events = fbr_ev_wait_to(FBR_A_ events, 0.05);
+		fail_if(n_events < 0, NULL);
+		if (0 == n_events) {
+			arg->timed_out = 1;
+			return;
+		}
+		/* Every arrived event carries a message off its queue */
+		if (pop1.ev_base.arrived)
+			arg->received[arg->n_received++] = (long)pop1.obj;
+		if (pop2.ev_base.arrived)
+			arg->received[arg->n_received++] = (long)pop2.obj;
+		fail_unless(arg->n_received <= 2 * N_MESSAGES, NULL);
+	}
+}
+
+START_TEST(test_mq_select)
+{
+	struct fbr_context context;
+	struct mq_arg arg;
+	fbr_id_t selector, producer1, producer2;
+	long last1 = 0, last2 = 0;
+	int retval;
+	int i;
+
+	fbr_init(&context, EV_DEFAULT);
+	arg.mq1 = fbr_mq_create(&context, 2, 0);
+	arg.mq2 = fbr_mq_create(&context, 2, 0);
+	arg.n_received = 0;
+	arg.timed_out = 0;
+
+	selector = fbr_create(&context, "select", select_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(selector), NULL);
+	retval = fbr_transfer(&context, selector);
+	fail_unless(0 == retval, NULL);
+	producer1 = fbr_create(&context, "producer1", producer1_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(producer1), NULL);
+	retval = fbr_transfer(&context, producer1);
+	fail_unless(0 == retval, NULL);
+	producer2 = fbr_create(&context, "producer2", producer2_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(producer2), NULL);
+	retval = fbr_transfer(&context, producer2);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(arg.timed_out, NULL);
+	fail_unless(2 * N_MESSAGES == arg.n_received, NULL);
+	for (i = 0; i < arg.n_received; i++) {
+		if (arg.received[i] > 0) {
+			fail_unless(last1 + 1 == arg.received[i], NULL);
+			last1 = arg.received[i];
+		} else {
+			fail_unless(last2 - 1 == arg.received[i], NULL);
+			last2 = arg.received[i];
+		}
+	}
+	fbr_mq_destroy(arg.mq1);
+	fbr_mq_destroy(arg.mq2);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void push_fiber(FBR_P_ void *_arg)
+{
+	struct mq_arg *arg = _arg;
+	struct fbr_ev_mq_push push;
+	struct fbr_ev_base *events[] = {&push.ev_base, NULL};
+	int n_events;
+
+	/* Nobody pops in time, the queue does not take the message */
+	fbr_ev_mq_push_init(FBR_A_ &push, arg->mq1, (void *)2);
+	n_events = fbr_ev_wait_to(FBR_A_ events, 0.001);
+	fail_unless(0 == n_events, NULL);
+	fail_if(push.ev_base.arrived, NULL);
+	arg->n_received++;
+
+	fbr_ev_mq_push_init(FBR_A_ &push, arg->mq1, (void *)3);
+	n_events = fbr_ev_wait_to(FBR_A_ events, 1.0);
+	fail_unless(1 == n_events, NULL);
+	fail_unless(push.ev_base.arrived, NULL);
+
+	/* Unbuffered queue: the push completes once it is popped */
+	fail_unless(0 == fbr_mq_push(arg->mq2, (void *)4), NULL);
+	arg->n_received++;
+}
+
+static void pop_fiber(FBR_P_ void *_arg)
+{
+	struct mq_arg *arg = _arg;
+
+	fbr_sleep(FBR_A_ 0.01);
+	fail_unless(1 == arg->n_received, NULL);
+	fail_unless((void *)1 == fbr_mq_pop(arg->mq1), NULL);
+	fail_unless((void *)3 == fbr_mq_pop(arg->mq1), NULL);
+	fail_unless((void *)4 == fbr_mq_pop(arg->mq2), NULL);
+}
+
+START_TEST(test_mq_push)
+{
+	struct fbr_context context;
+	struct mq_arg arg;
+	fbr_id_t pusher, popper;
+	void *obj;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	arg.mq1 = fbr_mq_create(&context, 1, 0);
+	arg.mq2 = fbr_mq_create(&context, 0, 0);
+	arg.n_received = 0;
+
+	retval = fbr_mq_try_push(arg.mq1, (void *)1);
+	fail_unless(0 == retval, NULL);
+	retval = fbr_mq_try_push(arg.mq1, (void *)1);
+	fail_unless(-1 == retval, NULL);
+	retval = fbr_mq_try_pop(arg.mq2, &obj);
+	fail_unless(-1 == retval, NULL);
+
+	pusher = fbr_create(&context, "push", push_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(pusher), NULL);
+	retval = fbr_transfer(&context, pusher);
+	fail_unless(0 == retval, NULL);
+	popper = fbr_create(&context, "pop", pop_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(popper), NULL);
+	retval = fbr_transfer(&context, popper);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(2 == arg.n_received, NULL);
+	fail_unless(fbr_is_reclaimed(&context, pusher), NULL);
+	fail_unless(fbr_is_reclaimed(&context, popper), NULL);
+	fbr_mq_destroy(arg.mq1);
+	fbr_mq_destroy(arg.mq2);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void many_consumer_fiber(_unused_ FBR_P_ void *_arg)
+{
+	struct mq_arg *arg = _arg;
+	void *objs[N_MESSAGES];
+	ssize_t n;
+	long next = 0;
+	int i;
+
+	while (next < 1000) {
+		n = fbr_mq_pop_many(arg->mq1, objs, N_MESSAGES);
+		fail_unless(n > 0, NULL);
+		for (i = 0; i < n; i++)
+			fail_unless(next++ == (long)objs[i], NULL);
+		arg->n_received++;
+	}
+}
+
+START_TEST(test_mq_many)
+{
+	struct fbr_context context;
+	struct mq_arg arg;
+	fbr_id_t consumer;
+	void *objs[8];
+	long next = 0;
+	ssize_t n;
+	int retval;
+	int i;
+
+	fbr_init(&context, EV_DEFAULT);
+	/* Not a power of two, the ring is rounded up but the limit stays */
+	arg.mq1 = fbr_mq_create(&context, 5, 0);
+	arg.n_received = 0;
+
+	for (i = 0; i < 8; i++)
+		objs[i] = (void *)(long)i;
+	n = fbr_mq_push_many(arg.mq1, objs, 8);
+	fail_unless(5 == n, NULL);
+	n = fbr_mq_pop_many(arg.mq1, objs, 3);
+	fail_unless(3 == n, NULL);
+	fail_unless((void *)0 == objs[0] && (void *)2 == objs[2], NULL);
+	n = fbr_mq_pop_many(arg.mq1, objs, 8);
+	fail_unless(2 == n, NULL);
+	fail_unless((void *)4 == objs[1], NULL);
+
+	consumer = fbr_create(&context, "many_consumer", many_consumer_fiber,
+			&arg, 0);
+	fail_if(fbr_id_isnull(consumer), NULL);
+	retval = fbr_transfer(&context, consumer);
+	fail_unless(0 == retval, NULL);
+
+	/* The consumer gets the first message directly, the rest are queued
+	 * with it woken up only once */
+	while (next < 1000) {
+		for (i = 0; i < 8; i++)
+			objs[i] = (void *)(next + i);
+		n = fbr_mq_push_many(arg.mq1, objs, 8);
+		fail_unless(n > 0, NULL);
+		next += n;
+		ev_run(EV_DEFAULT, EVRUN_NOWAIT);
+	}
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(fbr_is_reclaimed(&context, consumer), NULL);
+	fail_unless(arg.n_received < 1000, NULL);
+	fbr_mq_destroy(arg.mq1);
+	fbr_destroy(&context);
+}
+END_TEST
+
+struct record {
+	long seq;
+	char payload[40];
+};
+
+static void inline_producer_fiber(_unused_ FBR_P_ void *_arg)
+{
+	struct mq_arg *arg = _arg;
+	struct record *rec;
+	struct record copy;
+	long i;
+
+	for (i = 0; i < 100; i++) {
+		if (i % 2) {
+			memset(&copy, 0, sizeof(copy));
+			copy.seq = i;
+			fail_unless(0 == fbr_mq_push_data(arg->mq1, &copy), NULL);
+			continue;
+		}
+		rec = fbr_mq_reserve(arg->mq1);
+		fail_if(NULL == rec, NULL);
+		fail_unless(0 == (uintptr_t)rec % 16, NULL);
+		rec->seq = i;
+		fbr_mq_commit(arg->mq1);
+	}
+}
+
+static void inline_consumer_fiber(_unused_ FBR_P_ void *_arg)
+{
+	struct mq_arg *arg = _arg;
+	struct record *rec;
+	struct record copy;
+	long i;
+
+	for (i = 0; i < 100; i++) {
+		if (i % 3) {
+			fail_unless(0 == fbr_mq_pop_data(arg->mq1, &copy), NULL);
+			fail_unless(i == copy.seq, NULL);
+		} else {
+			rec = fbr_mq_peek(arg->mq1);
+			fail_if(NULL == rec, NULL);
+			fail_unless(i == rec->seq, NULL);
+			fbr_mq_release(arg->mq1);
+		}
+		arg->n_received++;
+	}
+}
+
+START_TEST(test_mq_inline)
+{
+	struct fbr_context context;
+	struct mq_arg arg;
+	fbr_id_t producer, consumer;
+	struct record *rec;
+	int retval;
+	int i;
+
+	fbr_init(&context, EV_DEFAULT);
+	fail_unless(NULL == fbr_mq_create_inline(&context, 0, 8, 0), NULL);
+	fail_unless(FBR_EINVAL == context.f_errno, NULL);
+	arg.mq1 = fbr_mq_create_inline(&context, 3, sizeof(struct record), 0);
+	fail_if(NULL == arg.mq1, NULL);
+	arg.n_received = 0;
+
+	fail_unless(NULL == fbr_mq_try_peek(arg.mq1), NULL);
+	for (i = 0; i < 3; i++) {
+		rec = fbr_mq_try_reserve(arg.mq1);
+		fail_if(NULL == rec, NULL);
+		if (0 == i)
+			fail_unless(0 == (uintptr_t)rec % 64, NULL);
+		fbr_mq_commit(arg.mq1);
+	}
+	fail_unless(NULL == fbr_mq_try_reserve(arg.mq1), NULL);
+	for (i = 0; i < 3; i++) {
+		fail_if(NULL == fbr_mq_try_peek(arg.mq1), NULL);
+		fbr_mq_release(arg.mq1);
+	}
+
+	consumer = fbr_create(&context, "inline_consumer",
+			inline_consumer_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(consumer), NULL);
+	retval = fbr_transfer(&context, consumer);
+	fail_unless(0 == retval, NULL);
+	producer = fbr_create(&context, "inline_producer",
+			inline_producer_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(producer), NULL);
+	retval = fbr_transfer(&context, producer);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(100 == arg.n_received, NULL);
+	fail_unless(fbr_is_reclaimed(&context, producer), NULL);
+	fail_unless(fbr_is_reclaimed(&context, consumer), NULL);
+	fbr_mq_destroy(arg.mq1);
+	fbr_destroy(&context);
+}
+END_TEST
+
+TCase * mq_tcase(void)
+{
+	TCase *tc_mq = tcase_create ("Mq");
+	tcase_add_test(tc_mq, test_mq_select);
+	tcase_add_test(tc_mq, test_mq_push);
+	tcase_add_test(tc_mq, test_mq_many);
+	tcase_add_test(tc_mq, test_mq_inline);
+	return tc_mq;
+}
@@ -0,0 +1,173 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "pq.h"
+
+#define N_ITEMS 1000
+
+struct pq_arg {
+	struct fbr_pq *pq;
+	struct fbr_delayq *dq;
+	long popped[N_ITEMS];
+	ev_tstamp popped_at[N_ITEMS];
+	int n_popped;
+};
+
+static void pq_consumer_fiber(_unused_ FBR_P_ void *_arg)
+{
+	struct pq_arg *arg = _arg;
+	int i;
+
+	for (i = 0; i < N_ITEMS; i++)
+		arg->popped[arg->n_popped++] = (long)fbr_pq_pop(arg->pq);
+}
+
+START_TEST(test_pq)
+{
+	struct fbr_context context;
+	struct pq_arg arg;
+	fbr_id_t consumer;
+	void *obj;
+	long i;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	arg.pq = fbr_pq_create(&context, 4);
+	fail_if(NULL == arg.pq, NULL);
+	arg.n_popped = 0;
+
+	/* Lower values first, ties in the order of pushing */
+	fail_unless(0 == fbr_pq_try_push(arg.pq, (void *)1, 5), NULL);
+	fail_unless(0 == fbr_pq_try_push(arg.pq, (void *)2, -3), NULL);
+	fail_unless(0 == fbr_pq_try_push(arg.pq, (void *)3, 5), NULL);
+	fail_unless(0 == fbr_pq_try_push(arg.pq, (void *)4, 0), NULL);
+	fail_unless(-1 == fbr_pq_try_push(arg.pq, (void *)5, -10), NULL);
+	fail_unless(4 == fbr_pq_count(arg.pq), NULL);
+	fail_unless(0 == fbr_pq_try_pop(arg.pq, &obj) && (void *)2 == obj,
+			NULL);
+	fail_unless(0 == fbr_pq_try_pop(arg.pq, &obj) && (void *)4 == obj,
+			NULL);
+	fail_unless(0 == fbr_pq_try_pop(arg.pq, &obj) && (void *)1 == obj,
+			NULL);
+	fail_unless(0 == fbr_pq_try_pop(arg.pq, &obj) && (void *)3 == obj,
+			NULL);
+	fail_unless(-1 == fbr_pq_try_pop(arg.pq, &obj), NULL);
+
+	consumer = fbr_create(&context, "pq_consumer", pq_consumer_fiber,
+			&arg, 0);
+	fail_if(fbr_id_isnull(consumer), NULL);
+	retval = fbr_transfer(&context, consumer);
+	fail_unless(0 == retval, NULL);
+
+	/* The consumer gets to run after every four pushes */
+	for (i = 0; i < N_ITEMS; i++) {
+		retval = fbr_pq_try_push(arg.pq, (void *)i,
+				(i % 4) ? N_ITEMS - i : 0);
+		fail_unless(0 == retval, NULL);
+		if (3 == i % 4)
+			ev_run(EV_DEFAULT, EVRUN_NOWAIT);
+	}
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(N_ITEMS == arg.n_popped, NULL);
+	for (i = 0; i < N_ITEMS; i += 4) {
+		fail_unless(i == arg.popped[i], NULL);
+		fail_unless(i + 3 == arg.popped[i + 1], NULL);
+		fail_unless(i + 2 == arg.popped[i + 2], NULL);
+		fail_unless(i + 1 == arg.popped[i + 3], NULL);
+	}
+	fbr_pq_destroy(arg.pq);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void dq_consumer_fiber(FBR_P_ void *_arg)
+{
+	struct pq_arg *arg = _arg;
+	void *obj;
+
+	while (arg->n_popped < 4) {
+		obj = fbr_delayq_pop(arg->dq);
+		arg->popped_at[arg->n_popped] = ev_now(fctx->__p->loop);
+		arg->popped[arg->n_popped++] = (long)obj;
+	}
+}
+
+START_TEST(test_delayq)
+{
+	struct fbr_context context;
+	struct pq_arg arg;
+	fbr_id_t consumer1, consumer2;
+	ev_tstamp start;
+	void *obj;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	arg.dq = fbr_delayq_create(&context, 0);
+	fail_if(NULL == arg.dq, NULL);
+	arg.n_popped = 0;
+	start = ev_now(EV_DEFAULT);
+
+	fail_unless(0 == fbr_delayq_try_push(arg.dq, (void *)3, 0.03), NULL);
+	fail_unless(0 == fbr_delayq_try_push(arg.dq, (void *)1, 0.01), NULL);
+	fail_unless(0 == fbr_delayq_try_push(arg.dq, (void *)2, 0.02), NULL);
+	fail_unless(-1 == fbr_delayq_try_pop(arg.dq, &obj), NULL);
+	fail_unless(3 == fbr_delayq_count(arg.dq), NULL);
+
+	/* Both consumers share the single timer */
+	consumer1 = fbr_create(&context, "dq_consumer1", dq_consumer_fiber,
+			&arg, 0);
+	fail_if(fbr_id_isnull(consumer1), NULL);
+	retval = fbr_transfer(&context, consumer1);
+	fail_unless(0 == retval, NULL);
+	consumer2 = fbr_create(&context, "dq_consumer2", dq_consumer_fiber,
+			&arg, 0);
+	fail_if(fbr_id_isnull(consumer2), NULL);
+	retval = fbr_transfer(&context, consumer2);
+	fail_unless(0 == retval, NULL);
+
+	/* Due straight away, jumps ahead of everything */
+	fail_unless(0 == fbr_delayq_try_push(arg.dq, (void *)0, 0.), NULL);
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(4 == arg.n_popped, NULL);
+	fail_unless(0 == arg.popped[0], NULL);
+	fail_unless(1 == arg.popped[1], NULL);
+	fail_unless(2 == arg.popped[2], NULL);
+	fail_unless(3 == arg.popped[3], NULL);
+	fail_unless(arg.popped_at[1] - start >= 0.01, NULL);
+	fail_unless(arg.popped_at[2] - start >= 0.02, NULL);
+	fail_unless(arg.popped_at[3] - start >= 0.03, NULL);
+	fail_unless(arg.popped_at[3] - start < 0.5, NULL);
+	fail_unless(0 == fbr_delayq_count(arg.dq), NULL);
+	fbr_delayq_destroy(arg.dq);
+	fbr_destroy(&context);
+}
+END_TEST
+
+TCase * pq_tcase(void)
+{
+	TCase *tc_pq = tcase_create ("Pq");
+	tcase_add_test(tc_pq, test_pq);
+	tcase_add_test(tc_pq, test_delayq);
+	return tc_pq;
+}
@@ -194,6 +194,103 @@ START_TEST(test_user_data)
 }
 END_TEST
 
+static void stack_size_fiber(FBR_P_ void *_arg)
+{
+	size_t *stack_size = _arg;
+	char buf[768 * 1024];
+
+	*stack_size = CURRENT_FIBER->stack->size;
+	/* Would hit the guard page with a 64 KB stack */
+	memset(buf, 0xAA, sizeof(buf));
+	fail_unless((char)0xAA == ((volatile char *)buf)[0]);
+}
+
+START_TEST(test_stack_size)
+{
+	struct fbr_context context;
+	fbr_id_t fiber = FBR_ID_NULL;
+	fbr_id_t new_fiber = FBR_ID_NULL;
+	size_t stack_size = 0;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	fiber = fbr_create(&context, "small", reclaim_fiber1, NULL, 0);
+	fail_if(fbr_id_isnull(fiber), NULL);
+	retval = fbr_transfer(&context, fiber);
+	fail_unless(0 == retval, NULL);
+
+	/* Reclaimed fiber with a small stack must not be served as is */
+	new_fiber = fbr_create(&context, "large", stack_size_fiber,
+			&stack_size, 1024 * 1024);
+	fail_if(fbr_id_isnull(new_fiber), NULL);
+	fail_unless(fiber.p == new_fiber.p);
+	retval = fbr_transfer(&context, new_fiber);
+	fail_unless(0 == retval, NULL);
+	fail_unless(stack_size >= 1024 * 1024, "stack size: %zd", stack_size);
+
+	/* ...and the reverse */
+	fiber = fbr_create(&context, "small", stack_size_fiber, &stack_size,
+			0);
+	fail_if(fbr_id_isnull(fiber), NULL);
+	fail_unless(FBR_STACK_SIZE ==
+			((struct fbr_fiber *)fiber.p)->stack->size);
+
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void stack_user_fiber(_unused_ FBR_P_ _unused_ void *_arg)
+{
+	char buf[8 * 1024];
+	memset(buf, 0x00, sizeof(buf));
+	fail_unless(0 == ((volatile char *)buf)[0]);
+}
+
+START_TEST(test_stack_profiling)
+{
+	struct fbr_context context;
+	struct fbr_stack_stats stats[2];
+	fbr_id_t fiber = FBR_ID_NULL;
+	size_t stack_size;
+	size_t n;
+	int i;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	fbr_enable_stack_profiling(&context, 1, 1);
+
+	for (i = 0; i < FBR_STACK_AUTOTUNE_SAMPLES; i++) {
+		fiber = fbr_create(&context, "stack_user", stack_user_fiber,
+				NULL, 0);
+		fail_if(fbr_id_isnull(fiber), NULL);
+		fail_unless(FBR_STACK_SIZE ==
+				((struct fbr_fiber *)fiber.p)->stack->size);
+		retval = fbr_transfer(&context, fiber);
+		fail_unless(0 == retval, NULL);
+	}
+
+	n = fbr_get_stack_stats(&context, stats, 2);
+	fail_unless(1 == n, NULL);
+	fail_unless(0 == strcmp(stats[0].name, "stack_user"), NULL);
+	fail_unless(FBR_STACK_AUTOTUNE_SAMPLES == stats[0].samples, NULL);
+	fail_unless(stats[0].max_used >= 8 * 1024, NULL);
+	fail_unless(stats[0].max_used < FBR_STACK_SIZE / 2, NULL);
+	fail_unless(FBR_STACK_AUTOTUNE_SAMPLES == stats[0].hist[5] +
+			stats[0].hist[6], NULL);
+
+	/* Enough samples collected, learned size should be used now */
+	fiber = fbr_create(&context, "stack_user", stack_user_fiber, NULL, 0);
+	fail_if(fbr_id_isnull(fiber), NULL);
+	stack_size = ((struct fbr_fiber *)fiber.p)->stack->size;
+	fail_unless(stack_size >= 2 * stats[0].max_used, NULL);
+	fail_unless(stack_size < FBR_STACK_SIZE, NULL);
+	retval = fbr_transfer(&context, fiber);
+	fail_unless(0 == retval, NULL);
+
+	fbr_destroy(&context);
+}
+END_TEST
 
 TCase * reclaim_tcase(void)
 {
@@ -202,5 +299,7 @@ TCase * reclaim_tcase(void)
 	tcase_add_test(tc_reclaim, test_no_reclaim);
 	tcase_add_test(tc_reclaim, test_disown);
 	tcase_add_test(tc_reclaim, test_user_data);
+	tcase_add_test(tc_reclaim, test_stack_size);
+	tcase_add_test(tc_reclaim, test_stack_profiling);
 	return tc_reclaim;
 }
@@ -0,0 +1,163 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <pthread.h>
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "remote.h"
+
+#define PING_PONG_ROUNDS 1000
+
+struct worker {
+	struct fbr_context fctx;
+	struct ev_loop *loop;
+	fbr_id_t fiber;
+	struct worker *peer;
+	pthread_barrier_t *barrier;
+	int initiator;
+	int rounds;
+};
+
+static void ping_pong_fiber(FBR_P_ void *_arg)
+{
+	struct worker *w = _arg;
+	int retval;
+	int i;
+
+	for (i = 0; i < PING_PONG_ROUNDS; i++) {
+		if (w->initiator) {
+			retval = fbr_wake_remote(&w->peer->fctx,
+					w->peer->fiber);
+			fail_unless(0 == retval, NULL);
+			fbr_wait_remote(FBR_A);
+		} else {
+			fbr_wait_remote(FBR_A);
+			retval = fbr_wake_remote(&w->peer->fctx,
+					w->peer->fiber);
+			fail_unless(0 == retval, NULL);
+		}
+		w->rounds++;
+	}
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	int retval;
+
+	w->loop = ev_loop_new(EVFLAG_AUTO);
+	fbr_init(&w->fctx, w->loop);
+	w->fiber = fbr_create(&w->fctx, "ping_pong", ping_pong_fiber, w, 0);
+	fail_if(fbr_id_isnull(w->fiber), NULL);
+
+	/* Both fiber ids have to be known before any of them starts */
+	pthread_barrier_wait(w->barrier);
+
+	retval = fbr_transfer(&w->fctx, w->fiber);
+	fail_unless(0 == retval, NULL);
+	ev_run(w->loop, 0);
+
+	fbr_destroy(&w->fctx);
+	ev_loop_destroy(w->loop);
+	return NULL;
+}
+
+START_TEST(test_wake_remote)
+{
+	struct worker workers[2];
+	pthread_t threads[2];
+	pthread_barrier_t barrier;
+	int retval;
+	int i;
+
+	memset(workers, 0x00, sizeof(workers));
+	pthread_barrier_init(&barrier, NULL, 2);
+	for (i = 0; i < 2; i++) {
+		workers[i].peer = &workers[1 - i];
+		workers[i].barrier = &barrier;
+		workers[i].initiator = (0 == i);
+	}
+	for (i = 0; i < 2; i++) {
+		retval = pthread_create(&threads[i], NULL, worker_thread,
+				&workers[i]);
+		fail_unless(0 == retval, NULL);
+	}
+	for (i = 0; i < 2; i++)
+		pthread_join(threads[i], NULL);
+	pthread_barrier_destroy(&barrier);
+
+	for (i = 0; i < 2; i++)
+		fail_unless(PING_PONG_ROUNDS == workers[i].rounds, NULL);
+}
+END_TEST
+
+static void sticky_fiber(FBR_P_ void *_arg)
+{
+	int *woken = _arg;
+	/* Wakeups were posted before we got to wait, still no blocking */
+	fbr_wait_remote(FBR_A);
+	(*woken)++;
+	fbr_wait_remote(FBR_A);
+	(*woken)++;
+}
+
+START_TEST(test_wake_remote_pending)
+{
+	struct fbr_context context;
+	fbr_id_t fiber, dead;
+	int woken = 0;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+
+	dead = fbr_create(&context, "dead", NULL, NULL, 0);
+	fail_if(fbr_id_isnull(dead), NULL);
+	retval = fbr_reclaim(&context, dead);
+	fail_unless(0 == retval, NULL);
+
+	fiber = fbr_create(&context, "sticky", sticky_fiber, &woken, 0);
+	fail_if(fbr_id_isnull(fiber), NULL);
+
+	/* Wakeups are not counted */
+	fail_unless(0 == fbr_wake_remote(&context, fiber), NULL);
+	fail_unless(0 == fbr_wake_remote(&context, fiber), NULL);
+	/* Reclaimed fibers are skipped */
+	fail_unless(0 == fbr_wake_remote(&context, dead), NULL);
+	ev_run(EV_DEFAULT, EVRUN_NOWAIT);
+
+	retval = fbr_transfer(&context, fiber);
+	fail_unless(0 == retval, NULL);
+	fail_unless(1 == woken, NULL);
+
+	fail_unless(0 == fbr_wake_remote(&context, fiber), NULL);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(2 == woken, NULL);
+
+	fbr_destroy(&context);
+}
+END_TEST
+
+TCase * remote_tcase(void)
+{
+	TCase *tc_remote = tcase_create ("Remote");
+	tcase_add_test(tc_remote, test_wake_remote);
+	tcase_add_test(tc_remote, test_wake_remote_pending);
+	return tc_remote;
+}
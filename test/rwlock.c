@@ -0,0 +1,218 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <errno.h>
+#include <string.h>
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "rwlock.h"
+
+#define N_READERS 10
+
+struct rwlock_arg {
+	struct fbr_rwlock rwlock;
+	int inside;
+	int max_inside;
+	char order[16];
+	int n_order;
+};
+
+static void shared_reader_fiber(FBR_P_ void *_arg)
+{
+	struct rwlock_arg *arg = _arg;
+	int retval;
+
+	retval = fbr_rwlock_rdlock(FBR_A_ &arg->rwlock);
+	fail_unless(0 == retval, NULL);
+	if (++arg->inside > arg->max_inside)
+		arg->max_inside = arg->inside;
+	fail_if(fbr_rwlock_trywrlock(FBR_A_ &arg->rwlock), NULL);
+	/* Readers keep the lock across the yield */
+	fbr_sleep(FBR_A_ 0.01);
+	arg->inside--;
+	fbr_rwlock_unlock(FBR_A_ &arg->rwlock);
+}
+
+START_TEST(test_rwlock_shared)
+{
+	struct fbr_context context;
+	struct rwlock_arg arg;
+	fbr_id_t fibers[N_READERS];
+	int retval;
+	int i;
+
+	fbr_init(&context, EV_DEFAULT);
+	fbr_rwlock_init(&context, &arg.rwlock);
+	arg.inside = 0;
+	arg.max_inside = 0;
+
+	for (i = 0; i < N_READERS; i++) {
+		fibers[i] = fbr_create(&context, "shared_reader",
+				shared_reader_fiber, &arg, 0);
+		fail_if(fbr_id_isnull(fibers[i]), NULL);
+		retval = fbr_transfer(&context, fibers[i]);
+		fail_unless(0 == retval, NULL);
+	}
+	fail_unless(N_READERS == arg.rwlock.readers, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(N_READERS == arg.max_inside, NULL);
+	fail_unless(0 == arg.rwlock.readers, NULL);
+	for (i = 0; i < N_READERS; i++)
+		fail_unless(fbr_is_reclaimed(&context, fibers[i]), NULL);
+	fbr_rwlock_destroy(&context, &arg.rwlock);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void order_fiber(FBR_P_ void *_arg)
+{
+	struct rwlock_arg *arg = _arg;
+	const char *name = fbr_get_name(FBR_A_ fbr_self(FBR_A));
+	int retval;
+
+	if ('w' == name[0])
+		retval = fbr_rwlock_wrlock(FBR_A_ &arg->rwlock);
+	else
+		retval = fbr_rwlock_rdlock(FBR_A_ &arg->rwlock);
+	fail_unless(0 == retval, NULL);
+	arg->order[arg->n_order++] = name[0];
+	fbr_sleep(FBR_A_ 0.005);
+	fbr_rwlock_unlock(FBR_A_ &arg->rwlock);
+}
+
+START_TEST(test_rwlock_writer_preference)
+{
+	struct fbr_context context;
+	struct rwlock_arg arg;
+	static const char * const names[] = {
+		"r", "w", "r", "r", "w", NULL
+	};
+	fbr_id_t fiber;
+	int retval;
+	int i;
+
+	fbr_init(&context, EV_DEFAULT);
+	fbr_rwlock_init(&context, &arg.rwlock);
+	arg.n_order = 0;
+
+	for (i = 0; names[i]; i++) {
+		fiber = fbr_create(&context, names[i], order_fiber, &arg, 0);
+		fail_if(fbr_id_isnull(fiber), NULL);
+		retval = fbr_transfer(&context, fiber);
+		fail_unless(0 == retval, NULL);
+	}
+	/* Readers coming after a waiting writer do not get in */
+	fail_unless(1 == arg.rwlock.readers, NULL);
+	fail_unless(2 == arg.rwlock.pending_writers, NULL);
+	fail_if(fbr_rwlock_tryrdlock(&context, &arg.rwlock), NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	arg.order[arg.n_order] = '\0';
+	fail_unless(!strcmp("rwwrr", arg.order), "order is %s", arg.order);
+	fbr_rwlock_destroy(&context, &arg.rwlock);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void timeout_writer_fiber(FBR_P_ void *_arg)
+{
+	struct rwlock_arg *arg = _arg;
+	int retval;
+
+	retval = fbr_rwlock_wrlock_wto(FBR_A_ &arg->rwlock, 0.01);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_ETIMEDOUT == fctx->f_errno, NULL);
+	fail_unless(ETIMEDOUT == errno, NULL);
+	arg->order[arg->n_order++] = 'w';
+}
+
+static void timeout_reader_fiber(FBR_P_ void *_arg)
+{
+	struct rwlock_arg *arg = _arg;
+	struct fbr_ev_rwlock ev_rwlock;
+	struct fbr_ev_timer timer;
+	struct fbr_ev_base *events[] = {NULL, NULL, NULL};
+	int retval;
+
+	/* Queued up behind the writer, let in once it gives up */
+	fbr_ev_rwlock_init(FBR_A_ &ev_rwlock, &arg->rwlock, 0);
+	fbr_ev_timer_init(FBR_A_ &timer);
+	fbr_ev_timer_start(FBR_A_ &timer, 1.0);
+	events[0] = &ev_rwlock.ev_base;
+	events[1] = &timer.ev_base;
+	retval = fbr_ev_wait(FBR_A_ events);
+	fail_unless(1 == retval, NULL);
+	fail_unless(ev_rwlock.ev_base.arrived, NULL);
+	fbr_ev_timer_stop(FBR_A_ &timer);
+	arg->order[arg->n_order++] = 'r';
+	fbr_rwlock_unlock(FBR_A_ &arg->rwlock);
+}
+
+START_TEST(test_rwlock_timeout)
+{
+	struct fbr_context context;
+	struct rwlock_arg arg;
+	fbr_id_t writer, reader;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	fbr_rwlock_init(&context, &arg.rwlock);
+	arg.n_order = 0;
+
+	/* The root holds the lock for reading throughout */
+	retval = fbr_rwlock_tryrdlock(&context, &arg.rwlock);
+	fail_unless(1 == retval, NULL);
+
+	writer = fbr_create(&context, "timeout_writer", timeout_writer_fiber,
+			&arg, 0);
+	fail_if(fbr_id_isnull(writer), NULL);
+	retval = fbr_transfer(&context, writer);
+	fail_unless(0 == retval, NULL);
+	reader = fbr_create(&context, "timeout_reader", timeout_reader_fiber,
+			&arg, 0);
+	fail_if(fbr_id_isnull(reader), NULL);
+	retval = fbr_transfer(&context, reader);
+	fail_unless(0 == retval, NULL);
+	fail_unless(1 == arg.rwlock.readers, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(2 == arg.n_order, NULL);
+	fail_unless('w' == arg.order[0] && 'r' == arg.order[1], NULL);
+	fail_unless(0 == arg.rwlock.pending_writers, NULL);
+	fail_unless(TAILQ_EMPTY(&arg.rwlock.pending), NULL);
+	fbr_rwlock_unlock(&context, &arg.rwlock);
+	fail_unless(0 == arg.rwlock.readers, NULL);
+	fbr_rwlock_destroy(&context, &arg.rwlock);
+	fbr_destroy(&context);
+}
+END_TEST
+
+TCase * rwlock_tcase(void)
+{
+	TCase *tc_rwlock = tcase_create ("Rwlock");
+	tcase_add_test(tc_rwlock, test_rwlock_shared);
+	tcase_add_test(tc_rwlock, test_rwlock_writer_preference);
+	tcase_add_test(tc_rwlock, test_rwlock_timeout);
+	return tc_rwlock;
+}
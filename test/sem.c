@@ -0,0 +1,220 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <errno.h>
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "sem.h"
+
+#define N_WORKERS 10
+#define N_PERMITS 3
+
+struct sem_arg {
+	struct fbr_sem sem;
+	struct fbr_waitgroup wg;
+	int inside;
+	int max_inside;
+	int done;
+};
+
+static size_t pending_count(struct fbr_id_tailq *tailq)
+{
+	struct fbr_id_tailq_i *item;
+	size_t count = 0;
+
+	TAILQ_FOREACH(item, tailq, entries)
+		count++;
+	return count;
+}
+
+static void sem_worker_fiber(FBR_P_ void *_arg)
+{
+	struct sem_arg *arg = _arg;
+	int retval;
+
+	retval = fbr_sem_acquire(FBR_A_ &arg->sem, 1);
+	fail_unless(0 == retval, NULL);
+	if (++arg->inside > arg->max_inside)
+		arg->max_inside = arg->inside;
+	fbr_sleep(FBR_A_ 0.005);
+	arg->inside--;
+	arg->done++;
+	fbr_sem_release(FBR_A_ &arg->sem, 1);
+	fbr_waitgroup_done(FBR_A_ &arg->wg);
+}
+
+static void sem_parent_fiber(FBR_P_ void *_arg)
+{
+	struct sem_arg *arg = _arg;
+	fbr_id_t fiber;
+	int retval;
+	int i;
+
+	fbr_waitgroup_add(FBR_A_ &arg->wg, N_WORKERS);
+	for (i = 0; i < N_WORKERS; i++) {
+		fiber = fbr_create(FBR_A_ "sem_worker", sem_worker_fiber,
+				arg, 0);
+		fail_if(fbr_id_isnull(fiber), NULL);
+		retval = fbr_transfer(FBR_A_ fiber);
+		fail_unless(0 == retval, NULL);
+	}
+	fail_unless(N_PERMITS == arg->inside, NULL);
+	fail_unless(N_WORKERS - N_PERMITS ==
+			pending_count(&arg->sem.pending), NULL);
+
+	retval = fbr_waitgroup_wait(FBR_A_ &arg->wg);
+	fail_unless(0 == retval, NULL);
+	fail_unless(N_WORKERS == arg->done, NULL);
+	fail_unless(0 == arg->wg.count, NULL);
+	/* Nothing outstanding, does not block */
+	retval = fbr_waitgroup_wait(FBR_A_ &arg->wg);
+	fail_unless(0 == retval, NULL);
+}
+
+START_TEST(test_sem_waitgroup)
+{
+	struct fbr_context context;
+	struct sem_arg arg;
+	fbr_id_t parent;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	fbr_sem_init(&context, &arg.sem, N_PERMITS);
+	fbr_waitgroup_init(&context, &arg.wg);
+	arg.inside = 0;
+	arg.max_inside = 0;
+	arg.done = 0;
+
+	parent = fbr_create(&context, "sem_parent", sem_parent_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(parent), NULL);
+	retval = fbr_transfer(&context, parent);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(fbr_is_reclaimed(&context, parent), NULL);
+	fail_unless(N_PERMITS == arg.max_inside, NULL);
+	fail_unless(N_PERMITS == arg.sem.value, NULL);
+	fbr_waitgroup_destroy(&context, &arg.wg);
+	fbr_sem_destroy(&context, &arg.sem);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static void big_acquire_fiber(FBR_P_ void *_arg)
+{
+	struct sem_arg *arg = _arg;
+	int retval;
+
+	retval = fbr_sem_acquire_wto(FBR_A_ &arg->sem, 3, 0.01);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_ETIMEDOUT == fctx->f_errno, NULL);
+	fail_unless(ETIMEDOUT == errno, NULL);
+	arg->done++;
+}
+
+static void small_acquire_fiber(FBR_P_ void *_arg)
+{
+	struct sem_arg *arg = _arg;
+	struct fbr_ev_sem ev_sem;
+	struct fbr_ev_waitgroup ev_wg;
+	struct fbr_ev_base *events[] = {NULL, NULL, NULL};
+	int retval;
+
+	fbr_ev_sem_init(FBR_A_ &ev_sem, &arg->sem, 1);
+	fbr_ev_waitgroup_init(FBR_A_ &ev_wg, &arg->wg);
+	events[0] = &ev_sem.ev_base;
+	events[1] = &ev_wg.ev_base;
+	retval = fbr_ev_wait(FBR_A_ events);
+	fail_unless(1 == retval, NULL);
+	fail_unless(ev_sem.ev_base.arrived, NULL);
+	/* The big request must have given up first */
+	fail_unless(1 == arg->done, NULL);
+	arg->done++;
+	fbr_waitgroup_done(FBR_A_ &arg->wg);
+}
+
+static void wg_timeout_fiber(FBR_P_ void *_arg)
+{
+	struct sem_arg *arg = _arg;
+	int retval;
+
+	retval = fbr_waitgroup_wait_wto(FBR_A_ &arg->wg, 0.001);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_ETIMEDOUT == fctx->f_errno, NULL);
+}
+
+START_TEST(test_sem_order)
+{
+	struct fbr_context context;
+	struct sem_arg arg;
+	fbr_id_t big, small, wg_timeout;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	fbr_sem_init(&context, &arg.sem, 0);
+	fbr_waitgroup_init(&context, &arg.wg);
+	fbr_waitgroup_add(&context, &arg.wg, 1);
+	arg.done = 0;
+
+	big = fbr_create(&context, "big_acquire", big_acquire_fiber, &arg, 0);
+	fail_if(fbr_id_isnull(big), NULL);
+	retval = fbr_transfer(&context, big);
+	fail_unless(0 == retval, NULL);
+	small = fbr_create(&context, "small_acquire", small_acquire_fiber,
+			&arg, 0);
+	fail_if(fbr_id_isnull(small), NULL);
+	retval = fbr_transfer(&context, small);
+	fail_unless(0 == retval, NULL);
+
+	/* The first waiter needs more, so nobody is woken */
+	fbr_sem_release(&context, &arg.sem, 2);
+	fail_unless(2 == pending_count(&arg.sem.pending), NULL);
+	fail_unless(2 == arg.sem.value, NULL);
+	fail_if(fbr_sem_tryacquire(&context, &arg.sem, 1), NULL);
+
+	wg_timeout = fbr_create(&context, "wg_timeout", wg_timeout_fiber,
+			&arg, 0);
+	fail_if(fbr_id_isnull(wg_timeout), NULL);
+	retval = fbr_transfer(&context, wg_timeout);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+
+	fail_unless(fbr_is_reclaimed(&context, wg_timeout), NULL);
+
+	fail_unless(2 == arg.done, NULL);
+	fail_unless(1 == arg.sem.value, NULL);
+	fail_unless(TAILQ_EMPTY(&arg.sem.pending), NULL);
+	fail_unless(fbr_sem_tryacquire(&context, &arg.sem, 1), NULL);
+	fail_unless(0 == arg.sem.value, NULL);
+	fbr_waitgroup_destroy(&context, &arg.wg);
+	fbr_sem_destroy(&context, &arg.sem);
+	fbr_destroy(&context);
+}
+END_TEST
+
+TCase * sem_tcase(void)
+{
+	TCase *tc_sem = tcase_create ("Sem");
+	tcase_add_test(tc_sem, test_sem_waitgroup);
+	tcase_add_test(tc_sem, test_sem_order);
+	return tc_sem;
+}
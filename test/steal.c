@@ -0,0 +1,194 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <pthread.h>
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "steal.h"
+
+#define STEAL_WORKERS 4
+#define STEAL_TASKS 200
+
+struct worker {
+	struct fbr_context fctx;
+	struct ev_loop *loop;
+	fbr_id_t stopper;
+	int index;
+	int tasks_run;
+};
+
+static struct fbr_sched *sched;
+static struct worker workers[STEAL_WORKERS];
+static pthread_barrier_t barrier;
+static int tasks_done;
+
+static void task_fiber(FBR_P_ _unused_ void *_arg)
+{
+	ev_tstamp start = ev_time();
+	int i;
+
+	for (i = 0; i < STEAL_WORKERS; i++)
+		if (&workers[i].fctx == fctx)
+			workers[i].tasks_run++;
+	/* Keep the worker busy for a while */
+	while (ev_time() - start < 0.001)
+		;
+	if (STEAL_TASKS == __atomic_add_fetch(&tasks_done, 1,
+				__ATOMIC_SEQ_CST)) {
+		for (i = 0; i < STEAL_WORKERS; i++)
+			fbr_wake_remote(&workers[i].fctx, workers[i].stopper);
+	}
+}
+
+static void stopper_fiber(FBR_P_ void *_arg)
+{
+	struct worker *w = _arg;
+	fbr_wait_remote(FBR_A);
+	fbr_sched_detach(FBR_A);
+	ev_break(w->loop, EVBREAK_ALL);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	int retval;
+	int i;
+
+	w->loop = ev_loop_new(EVFLAG_AUTO);
+	fbr_init(&w->fctx, w->loop);
+	retval = fbr_sched_attach(&w->fctx, sched);
+	fail_unless(0 == retval, NULL);
+	w->stopper = fbr_create(&w->fctx, "stopper", stopper_fiber, w, 0);
+	fail_if(fbr_id_isnull(w->stopper), NULL);
+	retval = fbr_transfer(&w->fctx, w->stopper);
+	fail_unless(0 == retval, NULL);
+
+	pthread_barrier_wait(&barrier);
+
+	/* All of the load lands on the first worker */
+	if (0 == w->index) {
+		for (i = 0; i < STEAL_TASKS; i++) {
+			retval = fbr_spawn(&w->fctx, "task", task_fiber, NULL,
+					0);
+			fail_unless(0 == retval, NULL);
+		}
+	}
+	ev_run(w->loop, 0);
+
+	/* Loops must stay around until nobody can send a wakeup */
+	pthread_barrier_wait(&barrier);
+	fbr_destroy(&w->fctx);
+	ev_loop_destroy(w->loop);
+	return NULL;
+}
+
+START_TEST(test_steal)
+{
+	pthread_t threads[STEAL_WORKERS];
+	int stolen = 0;
+	int retval;
+	int i;
+
+	sched = fbr_sched_create(STEAL_WORKERS);
+	fail_if(NULL == sched, NULL);
+	memset(workers, 0x00, sizeof(workers));
+	pthread_barrier_init(&barrier, NULL, STEAL_WORKERS);
+	for (i = 0; i < STEAL_WORKERS; i++) {
+		workers[i].index = i;
+		retval = pthread_create(&threads[i], NULL, worker_thread,
+				&workers[i]);
+		fail_unless(0 == retval, NULL);
+	}
+	for (i = 0; i < STEAL_WORKERS; i++)
+		pthread_join(threads[i], NULL);
+	pthread_barrier_destroy(&barrier);
+	fbr_sched_destroy(sched);
+
+	fail_unless(STEAL_TASKS == tasks_done, NULL);
+	for (i = 1; i < STEAL_WORKERS; i++)
+		stolen += workers[i].tasks_run;
+	fail_unless(STEAL_TASKS == workers[0].tasks_run + stolen, NULL);
+	fail_unless(stolen > 0, NULL);
+}
+END_TEST
+
+START_TEST(test_spawn_unattached)
+{
+	struct fbr_context context;
+	int retval;
+
+	fbr_init(&context, EV_DEFAULT);
+	retval = fbr_spawn(&context, "task", task_fiber, NULL, 0);
+	fail_unless(-1 == retval, NULL);
+	fail_unless(FBR_EINVAL == context.f_errno, NULL);
+	fbr_destroy(&context);
+}
+END_TEST
+
+START_TEST(test_sched_reattach)
+{
+	struct fbr_context contexts[3];
+	struct ev_loop *loops[3];
+	struct fbr_sched *sched;
+	int retval;
+	int i;
+
+	sched = fbr_sched_create(2);
+	fail_if(NULL == sched, NULL);
+	for (i = 0; i < 3; i++) {
+		loops[i] = ev_loop_new(EVFLAG_AUTO);
+		fbr_init(&contexts[i], loops[i]);
+	}
+
+	fail_unless(0 == fbr_sched_attach(&contexts[0], sched), NULL);
+	fail_unless(0 == fbr_sched_attach(&contexts[1], sched), NULL);
+	/* A failed attach does not use up a slot */
+	for (i = 0; i < 3; i++) {
+		retval = fbr_sched_attach(&contexts[2], sched);
+		fail_unless(-1 == retval, NULL);
+		fail_unless(FBR_EINVAL == contexts[2].f_errno, NULL);
+	}
+	/* Slots of detached workers are taken over */
+	for (i = 0; i < 10; i++) {
+		fbr_sched_detach(&contexts[i % 2]);
+		retval = fbr_sched_attach(&contexts[2], sched);
+		fail_unless(0 == retval, NULL);
+		fbr_sched_detach(&contexts[2]);
+		retval = fbr_sched_attach(&contexts[i % 2], sched);
+		fail_unless(0 == retval, NULL);
+	}
+	fail_unless(2 == sched->n_workers, NULL);
+
+	for (i = 0; i < 3; i++) {
+		fbr_destroy(&contexts[i]);
+		ev_loop_destroy(loops[i]);
+	}
+	fbr_sched_destroy(sched);
+}
+END_TEST
+
+TCase * steal_tcase(void)
+{
+	TCase *tc_steal = tcase_create ("Steal");
+	tcase_add_test(tc_steal, test_steal);
+	tcase_add_test(tc_steal, test_spawn_unattached);
+	tcase_add_test(tc_steal, test_sched_reattach);
+	return tc_steal;
+}
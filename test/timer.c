@@ -0,0 +1,152 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <ev.h>
+#include <check.h>
+#include <evfibers_private/fiber.h>
+
+#include "timer.h"
+
+#define N_SLEEPERS 6
+
+static const ev_tstamp sleep_times[N_SLEEPERS] = {
+	0.07, 0.0, 0.01, 0.15, 0.003, 0.07
+};
+static int wake_order[N_SLEEPERS];
+static int n_woken;
+
+static void sleeper_fiber(FBR_P_ void *_arg)
+{
+	int i = (intptr_t)_arg;
+	ev_tstamp start = ev_now(fctx->__p->loop);
+
+	fail_unless(0. == fbr_sleep(FBR_A_ sleep_times[i]));
+	fail_unless(ev_now(fctx->__p->loop) - start >= sleep_times[i]);
+	wake_order[n_woken++] = i;
+}
+
+START_TEST(test_timer_sleep)
+{
+	struct fbr_context context;
+	fbr_id_t id;
+	int i;
+
+	fbr_init(&context, EV_DEFAULT);
+	n_woken = 0;
+	for (i = 0; i < N_SLEEPERS; i++) {
+		id = fbr_create(&context, "sleeper", sleeper_fiber,
+				(void *)(intptr_t)i, 0);
+		fail_if(fbr_id_isnull(id));
+		fail_unless(0 == fbr_transfer(&context, id));
+	}
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(N_SLEEPERS == n_woken);
+	for (i = 1; i < N_SLEEPERS; i++)
+		fail_unless(sleep_times[wake_order[i - 1]] <=
+				sleep_times[wake_order[i]]);
+	fail_unless(0 == context.__p->wheel.count);
+	fbr_destroy(&context);
+}
+END_TEST
+
+static int parked;
+
+static void timer_fiber(FBR_P_ _unused_ void *_arg)
+{
+	struct fbr_ev_timer timer, far, beyond;
+	struct fbr_cond_var cond;
+	struct fbr_mutex mutex;
+	struct fbr_ev_cond_var ev_cond;
+	struct fbr_ev_base *events[] = {NULL, NULL};
+	int retval;
+
+	fbr_ev_timer_init(FBR_A_ &timer);
+	fbr_ev_timer_init(FBR_A_ &far);
+	fbr_ev_timer_init(FBR_A_ &beyond);
+
+	/* Never started */
+	retval = fbr_ev_wait_one(FBR_A_ &timer.ev_base);
+	fail_unless(-1 == retval);
+	fail_unless(FBR_EINVAL == fctx->f_errno);
+
+	/* Upper levels and the overflow slot */
+	fbr_ev_timer_start(FBR_A_ &far, 3600.);
+	fbr_ev_timer_start(FBR_A_ &beyond, 1e7);
+	fail_unless(1 < far.level);
+	fail_unless(FBR_WHEEL_LEVELS - 1 == beyond.level);
+	fail_unless(2 == fctx->__p->wheel.count);
+
+	/* Expired timer keeps arriving until restarted */
+	fbr_ev_timer_start(FBR_A_ &timer, 0.01);
+	fail_unless(0. == fbr_sleep(FBR_A_ 0.02));
+	fail_unless(timer.fired);
+	fail_unless(0 == fbr_ev_wait_one(FBR_A_ &timer.ev_base));
+	fail_unless(0 == fbr_ev_wait_one(FBR_A_ &timer.ev_base));
+	fbr_ev_timer_start(FBR_A_ &timer, 0.01);
+	fail_unless(!timer.fired);
+	fail_unless(0 == fbr_ev_wait_one(FBR_A_ &timer.ev_base));
+	fbr_ev_timer_stop(FBR_A_ &timer);
+	retval = fbr_ev_wait_one(FBR_A_ &timer.ev_base);
+	fail_unless(-1 == retval);
+
+	/* Timeout along with other events */
+	fbr_mutex_init(FBR_A_ &mutex);
+	fbr_cond_init(FBR_A_ &cond);
+	fbr_ev_cond_var_init(FBR_A_ &ev_cond, &cond, NULL);
+	events[0] = &ev_cond.ev_base;
+	fail_unless(0 == fbr_ev_wait_to(FBR_A_ events, 0.01));
+	fbr_cond_destroy(FBR_A_ &cond);
+	fbr_mutex_destroy(FBR_A_ &mutex);
+
+	fbr_ev_timer_stop(FBR_A_ &far);
+	fail_unless(1 == fctx->__p->wheel.count);
+	/* The other one is stopped by reclaim */
+	parked = 1;
+	fbr_sleep(FBR_A_ 3600.);
+	fail("Reclaimed fiber has been resumed");
+}
+
+START_TEST(test_timer_event)
+{
+	struct fbr_context context;
+	fbr_id_t id;
+
+	fbr_init(&context, EV_DEFAULT);
+	id = fbr_create(&context, "timer", timer_fiber, NULL, 0);
+	fail_if(fbr_id_isnull(id));
+	fail_unless(0 == fbr_transfer(&context, id));
+	parked = 0;
+	while (!parked)
+		ev_run(EV_DEFAULT, EVRUN_ONCE);
+	fail_unless(2 == context.__p->wheel.count);
+	fail_unless(0 == fbr_reclaim(&context, id));
+	fail_unless(0 == context.__p->wheel.count);
+	fail_unless(!ev_is_active(&context.__p->wheel.timer));
+	/* Nothing keeps the loop running any more */
+	ev_run(EV_DEFAULT, 0);
+	fbr_destroy(&context);
+}
+END_TEST
+
+TCase * timer_tcase(void)
+{
+	TCase *tc_timer = tcase_create("Timer");
+	tcase_add_test(tc_timer, test_timer_sleep);
+	tcase_add_test(tc_timer, test_timer_event);
+	return tc_timer;
+}
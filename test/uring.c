@@ -0,0 +1,485 @@
+/********************************************************************
+
+   Copyright 2013 Konstantin Olkhovskiy <lupus@oxnull.net>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ ********************************************************************/
+
+#include <check.h>
+#include <evfibers/config.h>
+#ifdef FBR_URING_ENABLED
+
+#include <errno.h>
+#include <ev.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <evfibers/uring.h>
+#include <evfibers_private/fiber.h>
+
+static char msg[] = "Small test line\n";
+
+static void io_fiber(FBR_P_ _unused_ void *_arg)
+{
+	ssize_t retval;
+	int fd;
+	char buf[sizeof(msg)];
+	struct stat st;
+
+	fd = fbr_uring_open(FBR_A_ "./uring.test", O_RDWR | O_CREAT | O_TRUNC,
+			0644);
+	fail_unless(0 <= fd);
+
+	retval = fbr_uring_write(FBR_A_ fd, msg, sizeof(msg), -1);
+	fail_unless(sizeof(msg) == retval);
+	retval = fbr_uring_write(FBR_A_ fd, msg, sizeof(msg), sizeof(msg));
+	fail_unless(sizeof(msg) == retval);
+
+	retval = fbr_uring_fsync(FBR_A_ fd, 0);
+	fail_unless(0 == retval);
+	retval = fbr_uring_fsync(FBR_A_ fd, 1);
+	fail_unless(0 == retval);
+
+	memset(&st, 0x00, sizeof(st));
+	retval = fbr_uring_fstat(FBR_A_ fd, &st);
+	fail_unless(0 == retval);
+	fail_unless(2 * sizeof(msg) == st.st_size);
+	fail_unless(S_ISREG(st.st_mode));
+
+	memset(buf, 0x00, sizeof(buf));
+	retval = fbr_uring_read(FBR_A_ fd, buf, sizeof(buf), sizeof(msg));
+	fail_unless(sizeof(msg) == retval);
+	fail_unless(!memcmp(msg, buf, sizeof(msg)));
+
+	/* Current position is right past the first write */
+	retval = fbr_uring_read(FBR_A_ fd, buf, sizeof(buf), -1);
+	fail_unless(sizeof(msg) == retval);
+	retval = fbr_uring_read(FBR_A_ fd, buf, sizeof(buf), -1);
+	fail_unless(0 == retval);
+
+	retval = fbr_uring_close(FBR_A_ fd);
+	fail_unless(0 == retval);
+	retval = fbr_uring_close(FBR_A_ fd);
+	fail_unless(-1 == retval);
+	fail_unless(FBR_ESYSTEM == fctx->f_errno);
+	fail_unless(EBADF == errno);
+
+	memset(&st, 0x00, sizeof(st));
+	retval = fbr_uring_stat(FBR_A_ "./uring.test", &st);
+	fail_unless(0 == retval);
+	fail_unless(2 * sizeof(msg) == st.st_size);
+
+	retval = unlink("./uring.test");
+	fail_unless(0 == retval);
+
+	retval = fbr_uring_stat(FBR_A_ "./uring.test", &st);
+	fail_unless(-1 == retval);
+	fail_unless(ENOENT == errno);
+
+	fd = fbr_uring_open(FBR_A_ "./uring.test", O_RDONLY, 0);
+	fail_unless(-1 == fd);
+	fail_unless(ENOENT == errno);
+}
+
+static void sleep_fiber(FBR_P_ _unused_ void *_arg)
+{
+	struct fbr_ev_uring ev;
+	struct io_uring_sqe *sqe;
+	static struct __kernel_timespec ts = { .tv_sec = 3600 };
+
+	fbr_ev_uring_init(FBR_A_ &ev);
+	sqe = fbr_uring_get_sqe(FBR_A_ &ev);
+	fail_unless(NULL != sqe);
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)&ts;
+	sqe->len = 1;
+	fbr_ev_wait_one(FBR_A_ &ev.ev_base);
+	fail("Reclaimed fiber has been resumed");
+}
+
+static void stat_fiber(FBR_P_ _unused_ void *_arg)
+{
+	char path[] = "./uring.test";
+	struct stat st;
+
+	fbr_uring_stat(FBR_A_ path, &st);
+	fail("Reclaimed fiber has been resumed");
+}
+
+static void pipe_timeout_fiber(FBR_P_ _unused_ void *_arg)
+{
+	ssize_t retval;
+	int fds[2];
+	char buf[sizeof(msg)];
+	char pristine[sizeof(msg)];
+
+	retval = pipe(fds);
+	fail_unless(0 == retval);
+
+	memset(buf, 'x', sizeof(buf));
+	memset(pristine, 'x', sizeof(pristine));
+	fbr_set_deadline(FBR_A_ ev_now(fctx->__p->loop) + 0.05);
+	retval = fbr_uring_read(FBR_A_ fds[0], buf, sizeof(buf), -1);
+	fail_unless(-1 == retval);
+	fail_unless(FBR_ETIMEDOUT == fctx->f_errno);
+	fail_unless(ETIMEDOUT == errno);
+	/* The read is over by now, not merely asked to stop */
+	fail_unless(0 == fctx->__p->uring->in_flight);
+	fbr_set_deadline(FBR_A_ 0.);
+
+	/* Data written afterwards is neither consumed by the timed out read
+	 * nor placed into its buffer */
+	retval = write(fds[1], msg, sizeof(msg));
+	fail_unless(sizeof(msg) == retval);
+	retval = fbr_uring_read(FBR_A_ fds[0], pristine, sizeof(pristine), -1);
+	fail_unless(sizeof(msg) == retval);
+	fail_unless(!memcmp(msg, pristine, sizeof(msg)));
+	memset(pristine, 'x', sizeof(pristine));
+	fail_unless(!memcmp(pristine, buf, sizeof(buf)));
+
+	close(fds[0]);
+	close(fds[1]);
+}
+
+#ifdef FBR_HAVE_URING_MULTISHOT
+
+#define N_CLIENTS 2
+
+static struct sockaddr_in listen_addr;
+static struct fbr_uring_buf_ring buf_ring;
+
+static void echo_fiber(FBR_P_ void *_arg)
+{
+	int fd = (intptr_t)_arg;
+	ssize_t retval;
+	void *buf;
+
+	/* Outlives the acceptor */
+	fail_unless(0 == fbr_disown(FBR_A_ FBR_ID_NULL));
+	for (;;) {
+		retval = fbr_uring_recv_buf(FBR_A_ fd, &buf_ring, &buf, 0);
+		fail_unless(0 <= retval);
+		if (0 == retval)
+			break;
+		fail_unless(NULL != buf);
+		fail_unless(retval == fbr_uring_send(FBR_A_ fd, buf, retval,
+					0));
+		fbr_uring_buf_put(FBR_A_ &buf_ring, buf);
+	}
+	fail_unless(NULL == buf);
+	fail_unless(0 == fbr_uring_close(FBR_A_ fd));
+}
+
+static void acceptor_fiber(FBR_P_ void *_arg)
+{
+	int sockfd = (intptr_t)_arg;
+	struct fbr_ev_uring ev;
+	fbr_id_t fiber;
+	int retval;
+	int i;
+
+	fbr_ev_uring_init(FBR_A_ &ev);
+	retval = fbr_uring_accept_multishot(FBR_A_ &ev, sockfd);
+	fail_unless(0 == retval);
+	for (i = 0; i < N_CLIENTS; i++) {
+		retval = fbr_uring_wait(FBR_A_ &ev);
+		fail_unless(0 <= retval);
+		fail_unless(ev.flags & IORING_CQE_F_MORE);
+		fiber = fbr_create(FBR_A_ "echo", echo_fiber,
+				(void *)(intptr_t)retval, 0);
+		fail_if(fbr_id_isnull(fiber));
+		fail_unless(0 == fbr_transfer(FBR_A_ fiber));
+	}
+	fbr_uring_cancel(FBR_A_ &ev);
+	fail_unless(NULL == ev.req);
+	fbr_uring_cancel(FBR_A_ &ev);
+	retval = fbr_uring_wait(FBR_A_ &ev);
+	fail_unless(-1 == retval);
+	fail_unless(FBR_EINVAL == fctx->f_errno);
+	close(sockfd);
+}
+
+static void client_fiber(FBR_P_ _unused_ void *_arg)
+{
+	char buf[sizeof(msg)];
+	ssize_t retval;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	fail_unless(0 <= fd);
+	retval = fbr_uring_connect_wto(FBR_A_ fd,
+			(struct sockaddr *)&listen_addr, sizeof(listen_addr),
+			5.0);
+	fail_unless(0 == retval);
+
+	retval = fbr_uring_send_wto(FBR_A_ fd, msg, sizeof(msg), 0, 5.0);
+	fail_unless(sizeof(msg) == retval);
+	retval = fbr_uring_recv_wto(FBR_A_ fd, buf, sizeof(buf), MSG_WAITALL,
+			5.0);
+	fail_unless(sizeof(msg) == retval);
+	fail_unless(!memcmp(msg, buf, sizeof(msg)));
+
+	/* Nothing is going to be echoed back */
+	retval = fbr_uring_recv_wto(FBR_A_ fd, buf, sizeof(buf), 0, 0.05);
+	fail_unless(-1 == retval);
+	fail_unless(ETIMEDOUT == errno);
+
+	close(fd);
+}
+
+static void stuck_sender_fiber(FBR_P_ _unused_ void *_arg)
+{
+	static char buf[65536];
+	ssize_t retval;
+	int fds[2];
+	int size = 4096;
+
+	fail_unless(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	/* Nobody reads on the other end, so sending stalls eventually */
+	do {
+		retval = fbr_uring_send_wto(FBR_A_ fds[1], buf, sizeof(buf),
+				0, 0.05);
+	} while (0 < retval);
+	fail_unless(-1 == retval);
+	fail_unless(ETIMEDOUT == errno);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static struct fbr_uring_buf_ring small_ring;
+
+static void deadline_sender_fiber(FBR_P_ void *_arg)
+{
+	int fd = *(int *)_arg;
+
+	/* Wakes up in the same loop iteration as the deadline of the
+	 * receiver expires */
+	fbr_sleep(FBR_A_ 0.05);
+	fail_unless(sizeof(msg) == write(fd, msg, sizeof(msg)));
+}
+
+static void deadline_receiver_fiber(FBR_P_ void *_arg)
+{
+	int *fds = _arg;
+	void *first, *second, *buf;
+	ssize_t retval;
+
+	fbr_set_deadline(FBR_A_ ev_now(fctx->__p->loop) + 0.05);
+	retval = fbr_uring_recv_buf(FBR_A_ fds[0], &small_ring, &buf, 0);
+	fail_unless(-1 == retval);
+	fail_unless(ETIMEDOUT == errno);
+	fail_unless(NULL == buf);
+	fbr_set_deadline(FBR_A_ 0.);
+
+	/* Whatever buffer the interrupted receive has taken is back in the
+	 * ring exactly once */
+	fail_unless(sizeof(msg) == write(fds[1], msg, sizeof(msg)));
+	retval = fbr_uring_recv_buf(FBR_A_ fds[0], &small_ring, &first, 0);
+	fail_unless(sizeof(msg) == retval);
+	fail_unless(sizeof(msg) == write(fds[1], msg, sizeof(msg)));
+	retval = fbr_uring_recv_buf(FBR_A_ fds[0], &small_ring, &second, 0);
+	fail_unless(sizeof(msg) == retval);
+	fail_if(first == second);
+	fail_unless(sizeof(msg) == write(fds[1], msg, sizeof(msg)));
+	retval = fbr_uring_recv_buf(FBR_A_ fds[0], &small_ring, &buf, 0);
+	fail_unless(-1 == retval);
+	fail_unless(ENOBUFS == errno);
+	fbr_uring_buf_put(FBR_A_ &small_ring, first);
+	fbr_uring_buf_put(FBR_A_ &small_ring, second);
+}
+
+START_TEST(test_uring_recv_buf_deadline)
+{
+	int retval;
+	int fds[2];
+	fbr_id_t fiber = FBR_ID_NULL;
+	struct fbr_context context;
+	fbr_init(&context, EV_DEFAULT);
+	retval = fbr_uring_init(&context, 0);
+	if (-1 == retval) {
+		fbr_destroy(&context);
+		return;
+	}
+	retval = fbr_uring_buf_ring_init(&context, &small_ring, 2, 2, 64);
+	if (-1 == retval) {
+		fbr_destroy(&context);
+		return;
+	}
+	fail_unless(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+	fiber = fbr_create(&context, "deadline_receiver",
+			deadline_receiver_fiber, fds, 0);
+	fail_if(fbr_id_isnull(fiber));
+	fail_unless(0 == fbr_transfer(&context, fiber));
+	fiber = fbr_create(&context, "deadline_sender",
+			deadline_sender_fiber, fds + 1, 0);
+	fail_if(fbr_id_isnull(fiber));
+	fail_unless(0 == fbr_transfer(&context, fiber));
+
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(0 == context.__p->uring->in_flight);
+
+	close(fds[0]);
+	close(fds[1]);
+	fbr_uring_buf_ring_destroy(&context, &small_ring);
+	fbr_destroy(&context);
+}
+END_TEST
+
+START_TEST(test_uring_net)
+{
+	int retval;
+	int i, sockfd;
+	socklen_t addrlen = sizeof(listen_addr);
+	fbr_id_t fiber = FBR_ID_NULL;
+	struct fbr_context context;
+	fbr_init(&context, EV_DEFAULT);
+	retval = fbr_uring_init(&context, 0);
+	if (-1 == retval) {
+		fbr_destroy(&context);
+		return;
+	}
+	retval = fbr_uring_buf_ring_init(&context, &buf_ring, 1, 3, 64);
+	fail_unless(-1 == retval);
+	fail_unless(FBR_EINVAL == context.f_errno);
+	retval = fbr_uring_buf_ring_init(&context, &buf_ring, 1, 4, 64);
+	if (-1 == retval) {
+		/* Kernel older than 5.19 */
+		fbr_destroy(&context);
+		return;
+	}
+
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	fail_unless(0 <= sockfd);
+	memset(&listen_addr, 0x00, sizeof(listen_addr));
+	listen_addr.sin_family = AF_INET;
+	listen_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fail_unless(0 == bind(sockfd, (struct sockaddr *)&listen_addr,
+				sizeof(listen_addr)));
+	fail_unless(0 == getsockname(sockfd, (struct sockaddr *)&listen_addr,
+				&addrlen));
+	fail_unless(0 == listen(sockfd, 16));
+
+	fiber = fbr_create(&context, "acceptor", acceptor_fiber,
+			(void *)(intptr_t)sockfd, 0);
+	fail_if(fbr_id_isnull(fiber));
+	fail_unless(0 == fbr_transfer(&context, fiber));
+	for (i = 0; i < N_CLIENTS; i++) {
+		fiber = fbr_create(&context, "client", client_fiber, NULL, 0);
+		fail_if(fbr_id_isnull(fiber));
+		fail_unless(0 == fbr_transfer(&context, fiber));
+	}
+	fiber = fbr_create(&context, "stuck_sender", stuck_sender_fiber,
+			NULL, 0);
+	fail_if(fbr_id_isnull(fiber));
+	fail_unless(0 == fbr_transfer(&context, fiber));
+
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(0 == context.__p->uring->in_flight);
+
+	fbr_uring_buf_ring_destroy(&context, &buf_ring);
+	fbr_destroy(&context);
+}
+END_TEST
+
+#endif
+
+START_TEST(test_uring)
+{
+	int retval;
+	fbr_id_t fiber = FBR_ID_NULL;
+	struct fbr_context context;
+	fbr_init(&context, EV_DEFAULT);
+	retval = fbr_uring_init(&context, 0);
+	if (-1 == retval) {
+		/* Kernel without io_uring or with io_uring disabled */
+		fail_unless(FBR_ESYSTEM == context.f_errno);
+		fbr_destroy(&context);
+		return;
+	}
+	retval = fbr_uring_init(&context, 0);
+	fail_unless(-1 == retval);
+	fail_unless(FBR_EINVAL == context.f_errno);
+
+	fiber = fbr_create(&context, "io_fiber", io_fiber, NULL, 0);
+	fail_if(fbr_id_isnull(fiber));
+	retval = fbr_transfer(&context, fiber);
+	fail_unless(0 == retval, NULL);
+
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(0 == context.__p->uring->in_flight);
+
+	fiber = fbr_create(&context, "pipe_timeout_fiber", pipe_timeout_fiber,
+			NULL, 0);
+	fail_if(fbr_id_isnull(fiber));
+	retval = fbr_transfer(&context, fiber);
+	fail_unless(0 == retval, NULL);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(0 == context.__p->uring->in_flight);
+
+	/* Path and statx buffer outlive the stack of a reclaimed fiber */
+	fiber = fbr_create(&context, "stat_fiber", stat_fiber, NULL, 0);
+	fail_if(fbr_id_isnull(fiber));
+	retval = fbr_transfer(&context, fiber);
+	fail_unless(0 == retval, NULL);
+	fail_unless(1 == context.__p->uring->in_flight);
+	retval = fbr_reclaim(&context, fiber);
+	fail_unless(0 == retval, NULL);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(0 == context.__p->uring->in_flight);
+
+	/* Reclaiming a waiting fiber cancels its operation, which then no
+	 * longer keeps the loop alive */
+	fiber = fbr_create(&context, "sleep_fiber", sleep_fiber, NULL, 0);
+	fail_if(fbr_id_isnull(fiber));
+	retval = fbr_transfer(&context, fiber);
+	fail_unless(0 == retval, NULL);
+	ev_run(EV_DEFAULT, EVRUN_NOWAIT);
+	fail_unless(1 == context.__p->uring->in_flight);
+	retval = fbr_reclaim(&context, fiber);
+	fail_unless(0 == retval, NULL);
+	ev_run(EV_DEFAULT, 0);
+	fail_unless(0 == context.__p->uring->in_flight);
+
+	fbr_destroy(&context);
+}
+END_TEST
+
+TCase * uring_tcase(void)
+{
+	TCase *tc_uring = tcase_create("URING");
+	tcase_add_test(tc_uring, test_uring);
+#ifdef FBR_HAVE_URING_MULTISHOT
+	tcase_add_test(tc_uring, test_uring_net);
+	tcase_add_test(tc_uring, test_uring_recv_buf_deadline);
+#endif
+	return tc_uring;
+}
+
+#else
+
+TCase * uring_tcase(void)
+{
+	TCase *tc_uring = tcase_create("URING_DISABLED");
+	return tc_uring;
+}
+
+#endif